@@ -0,0 +1,348 @@
+/*
+ * bench-gen.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "bench-gen.h"
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-packed-log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#define GEN_DEVICE_NAME "SynPS/2 Synaptics TouchPad"
+#define GEN_HEADER \
+    "# Kernel Info: Linux version 4.2.0 (ps2emu-gen-log)\n" \
+    "# Device listing:\n" \
+    "#    \"AT Translated Set 2 keyboard\" on i8042 KBD port\n" \
+    "#    \"" GEN_DEVICE_NAME "\" on i8042 AUX port\n" \
+    "#\n"
+#define GEN_NOTE "second half"
+
+/* Reset, set defaults, identify, set the sample rate and enable */
+static const struct {
+    time_t delay;
+    PS2EventType type;
+    guchar data;
+} init_sequence[] = {
+    { 0,      PS2_EVENT_TYPE_PARAMETER, 0xff },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_INTERRUPT, 0xaa },
+    { 500000, PS2_EVENT_TYPE_INTERRUPT, 0x00 },
+    { 1000,   PS2_EVENT_TYPE_PARAMETER, 0xf6 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xe6 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xe6 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xe6 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xe6 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xe9 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xf3 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xc8 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+    { 3000,   PS2_EVENT_TYPE_PARAMETER, 0xf4 },
+    { 1500,   PS2_EVENT_TYPE_INTERRUPT, 0xfa },
+};
+
+gboolean gen_format_from_string(const gchar *str,
+                                GenFormat *format) {
+    if (g_ascii_strcasecmp(str, "v0") == 0)
+        *format = GEN_FORMAT_V0;
+    else if (g_ascii_strcasecmp(str, "v1") == 0)
+        *format = GEN_FORMAT_V1;
+    else if (g_ascii_strcasecmp(str, "packed") == 0)
+        *format = GEN_FORMAT_PACKED;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+/* We use our own PRNG (xorshift32) instead of GRand so that the same seed
+ * always gives the same log, no matter what version of glib we're using */
+static guint32 gen_random(LogGenerator *gen) {
+    guint32 x = gen->rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return gen->rand_state = x;
+}
+
+static gint gen_random_range(LogGenerator *gen,
+                             gint min,
+                             gint max) {
+    return min + (gint)(gen_random(gen) % (guint32)(max - min + 1));
+}
+
+void log_generator_init(LogGenerator *gen,
+                        guint64 events,
+                        guint32 seed) {
+    *gen = (LogGenerator) {
+        .rand_state = seed * 2654435761u + 1,
+        .remaining = events,
+        .note_at = events / 2,
+        .x = 2000,
+        .y = 3000,
+        .packet_pos = G_N_ELEMENTS(gen->packet),
+    };
+
+    /* xorshift gets stuck on 0 */
+    if (!gen->rand_state)
+        gen->rand_state = 1;
+}
+
+gboolean log_generator_next_init(LogGenerator *gen,
+                                 PS2Event *event) {
+    if (gen->init_pos >= G_N_ELEMENTS(init_sequence))
+        return FALSE;
+
+    gen->time += init_sequence[gen->init_pos].delay;
+
+    *event = (PS2Event) {
+        .time = gen->time,
+        .type = init_sequence[gen->init_pos].type,
+        .data = init_sequence[gen->init_pos].data,
+        .origin = PS2_PORT_AUX,
+    };
+
+    if (++gen->init_pos == G_N_ELEMENTS(init_sequence))
+        gen->time = 0;
+
+    return TRUE;
+}
+
+gboolean log_generator_next_main(LogGenerator *gen,
+                                 PS2Event *event,
+                                 gboolean *note) {
+    *note = FALSE;
+
+    if (!gen->remaining)
+        return FALSE;
+
+    if (gen->packet_pos == G_N_ELEMENTS(gen->packet)) {
+        if (gen->remaining <= gen->note_at) {
+            *note = TRUE;
+            gen->note_at = 0;
+        }
+
+        gen->x += gen_random_range(gen, -5, 5);
+        gen->y += gen_random_range(gen, -5, 5);
+
+        gen->packet[0] = 0x80 | (((gen->y >> 8) & 0xf0) >> 4);
+        gen->packet[1] = 0x40;
+        gen->packet[2] = gen->x & 0xff;
+        gen->packet[3] = 0xc0 | (((gen->x >> 12) & 1) << 4);
+        gen->packet[4] = gen->y & 0xff;
+        gen->packet[5] = 0x00;
+        gen->packet_pos = 0;
+
+        /* Time between the last byte of a packet and the next packet */
+        if (gen->time)
+            gen->time += 6000 + gen_random_range(gen, -100, 100);
+    } else {
+        gen->time += gen_random_range(gen, 1150, 1250);
+    }
+
+    *event = (PS2Event) {
+        .time = gen->time,
+        .type = PS2_EVENT_TYPE_INTERRUPT,
+        .data = gen->packet[gen->packet_pos++],
+        .origin = PS2_PORT_AUX,
+    };
+
+    gen->remaining--;
+
+    return TRUE;
+}
+
+static inline const gchar *event_comment(const PS2Event *event) {
+    return event->type == PS2_EVENT_TYPE_INTERRUPT ? "(interrupt, 1, 12)" :
+                                                     "(parameter)";
+}
+
+static inline gchar event_direction(const PS2Event *event) {
+    return event->type == PS2_EVENT_TYPE_INTERRUPT ? 'R' : 'S';
+}
+
+void gen_write_text_log(FILE *output,
+                        GenFormat format,
+                        guint64 events,
+                        guint32 seed) {
+    LogGenerator gen;
+    PS2Event event;
+    gboolean note;
+    time_t main_offset = 0;
+
+    log_generator_init(&gen, events, seed);
+
+    if (format == GEN_FORMAT_V0) {
+        /* V0 logs have no sections, and the time of each event is just the
+         * time in dmesg */
+        fprintf(output, "# ps2emu-record V0\n" GEN_HEADER);
+
+        while (log_generator_next_init(&gen, &event)) {
+            fprintf(output, "%-10ld A %c %.2hhx # %s\n",
+                    event.time + G_USEC_PER_SEC, event_direction(&event),
+                    event.data, event_comment(&event));
+            main_offset = event.time + 2 * G_USEC_PER_SEC;
+        }
+
+        while (log_generator_next_main(&gen, &event, &note)) {
+            fprintf(output, "%-10ld A %c %.2hhx # %s\n",
+                    event.time + main_offset, event_direction(&event),
+                    event.data, event_comment(&event));
+        }
+
+        return;
+    }
+
+    fprintf(output,
+            "# ps2emu-record V%d\n"
+            GEN_HEADER
+            "T: A\n"
+            "S: Init\n",
+            PS2EMU_LOG_VERSION);
+
+    while (log_generator_next_init(&gen, &event)) {
+        fprintf(output, "E: %-10ld %c %.2hhx # %s\n",
+                event.time, event_direction(&event), event.data,
+                event_comment(&event));
+    }
+
+    fprintf(output, "S: Main\n");
+
+    while (log_generator_next_main(&gen, &event, &note)) {
+        if (note)
+            fprintf(output, "N: " GEN_NOTE "\n");
+
+        fprintf(output, "E: %-10ld %c %.2hhx # %s\n",
+                event.time, event_direction(&event), event.data,
+                event_comment(&event));
+    }
+}
+
+static GList *prepend_event(GList *section,
+                            const PS2Event *event) {
+    LogLine *log_line = g_slice_alloc(sizeof(LogLine));
+
+    *log_line = (LogLine) {
+        .type = LINE_TYPE_EVENT,
+        .ps2_event = g_slice_dup(PS2Event, event),
+    };
+
+    return g_list_prepend(section, log_line);
+}
+
+static GList *prepend_note(GList *section,
+                           const gchar *note) {
+    LogLine *log_line = g_slice_alloc(sizeof(LogLine));
+
+    *log_line = (LogLine) {
+        .type = LINE_TYPE_NOTE,
+        .note = g_strdup(note),
+    };
+
+    return g_list_prepend(section, log_line);
+}
+
+ParsedLog *gen_parsed_log(GenFormat format,
+                          guint64 events,
+                          guint32 seed) {
+    ParsedLog *parsed_log = g_new0(ParsedLog, 1);
+    LogGenerator gen;
+    PS2Event event;
+    gboolean note;
+    GList **init_dest;
+    time_t main_offset = 0;
+
+    parsed_log->port = PS2_PORT_AUX;
+    parsed_log->header = g_strdup(GEN_HEADER);
+    parsed_log->device_name = g_strdup(GEN_DEVICE_NAME);
+
+    /* V0 logs keep everything in the main section */
+    if (format == GEN_FORMAT_V0)
+        init_dest = &parsed_log->main_section;
+    else
+        init_dest = &parsed_log->init_section;
+
+    log_generator_init(&gen, events, seed);
+
+    while (log_generator_next_init(&gen, &event)) {
+        if (format == GEN_FORMAT_V0) {
+            event.time += G_USEC_PER_SEC;
+            main_offset = event.time + G_USEC_PER_SEC;
+        }
+
+        *init_dest = prepend_event(*init_dest, &event);
+    }
+
+    while (log_generator_next_main(&gen, &event, &note)) {
+        if (note && format != GEN_FORMAT_V0)
+            parsed_log->main_section = prepend_note(parsed_log->main_section,
+                                                    GEN_NOTE);
+
+        event.time += main_offset;
+        parsed_log->main_section = prepend_event(parsed_log->main_section,
+                                                 &event);
+    }
+
+    parsed_log->init_section = g_list_reverse(parsed_log->init_section);
+    parsed_log->main_section = g_list_reverse(parsed_log->main_section);
+
+    return parsed_log;
+}
+
+gboolean gen_write_log_file(const gchar *path,
+                            GenFormat format,
+                            guint64 events,
+                            guint32 seed,
+                            GError **error) {
+    FILE *output;
+
+    output = path ? fopen(path, "w") : stdout;
+    if (!output) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    if (format == GEN_FORMAT_PACKED) {
+        ParsedLog *parsed_log = gen_parsed_log(GEN_FORMAT_V1, events, seed);
+        GByteArray *packed = packed_log_encode(parsed_log, PS2EMU_LOG_VERSION);
+
+        log_free(parsed_log);
+        fwrite(packed->data, 1, packed->len, output);
+        g_byte_array_unref(packed);
+    } else {
+        gen_write_text_log(output, format, events, seed);
+    }
+
+    if (output != stdout ? fclose(output) != 0 : fflush(output) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s", path ? path : "stdout",
+                    strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,82 @@
+/*
+ * bench-gen.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __BENCH_GEN_H__
+#define __BENCH_GEN_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "ps2emu-log.h"
+
+typedef enum {
+    GEN_FORMAT_V0,
+    GEN_FORMAT_V1,
+    GEN_FORMAT_PACKED
+} GenFormat;
+
+/* Generates the same touchpad recording for the same seed and event count: a
+ * Synaptics style initialization sequence, followed by 6 byte absolute packets
+ * at ~80Hz with a user note halfway through */
+typedef struct {
+    guint32 rand_state;
+    guint64 remaining;
+    guint64 note_at;
+
+    guint init_pos;
+    time_t time;
+    gint x;
+    gint y;
+    guchar packet[6];
+    guint packet_pos;
+} LogGenerator;
+
+gboolean gen_format_from_string(const gchar *str,
+                                GenFormat *format);
+
+void log_generator_init(LogGenerator *gen,
+                        guint64 events,
+                        guint32 seed);
+
+/* Returns the next event of the initialization sequence, FALSE once it's over.
+ * Times start from 0 */
+gboolean log_generator_next_init(LogGenerator *gen,
+                                 PS2Event *event);
+
+/* Returns the next event of the main section, FALSE once we've generated
+ * enough. Times start from 0. *note is set right before the event that follows
+ * the note */
+gboolean log_generator_next_main(LogGenerator *gen,
+                                 PS2Event *event,
+                                 gboolean *note);
+
+/* Write a text log, V0 or V1 */
+void gen_write_text_log(FILE *output,
+                        GenFormat format,
+                        guint64 events,
+                        guint32 seed);
+
+/* Build the log in memory, the way log_parse() would have */
+ParsedLog *gen_parsed_log(GenFormat format,
+                          guint64 events,
+                          guint32 seed);
+
+gboolean gen_write_log_file(const gchar *path,
+                            GenFormat format,
+                            guint64 events,
+                            guint32 seed,
+                            GError **error);
+
+#endif /* !__BENCH_GEN_H__ */
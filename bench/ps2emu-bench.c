@@ -0,0 +1,540 @@
+/*
+ * ps2emu-bench.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "bench-gen.h"
+#include "ps2emu.h"
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-kmsg.h"
+#include "ps2emu-packed-log.h"
+#include "ps2emu-profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+/* The benchmarks that work on single lines cycle through this many different
+ * ones, so that they don't need memory proportional to the number of events */
+#define BENCH_LINE_COUNT 4096
+
+typedef struct {
+    guint64 events;
+    guint32 seed;
+
+    gchar *tmp_dir;
+    gchar *v0_path;
+    gchar *v1_path;
+    gsize v0_size;
+    gsize v1_size;
+    gchar *packed;
+    gsize packed_size;
+
+    /* Event lines from a V1 log, without the "E: " */
+    gchar *event_lines[BENCH_LINE_COUNT];
+    PS2Event line_events[BENCH_LINE_COUNT];
+    gchar *kmsg_lines[BENCH_LINE_COUNT];
+
+    PS2EmuLog *log;
+    GByteArray *host_bytes;
+} BenchData;
+
+/* What a single run of a benchmark went through */
+typedef struct {
+    guint64 events;
+    guint64 bytes;
+} BenchRun;
+
+typedef struct {
+    const gchar *name;
+    const gchar *description;
+    gboolean (*run)(BenchData *data,
+                    BenchRun *run,
+                    GError **error);
+} Bench;
+
+static gboolean parse_text_log(const gchar *path,
+                               gsize size,
+                               BenchRun *run,
+                               GError **error) {
+    GIOChannel *input_channel;
+    ParsedLog *parsed_log;
+    gint log_version;
+
+    input_channel = g_io_channel_new_file(path, "r", error);
+    if (!input_channel)
+        return FALSE;
+
+    log_version = log_parse_version(input_channel, error);
+    if (log_version < 0)
+        goto error;
+
+    parsed_log = log_parse(input_channel, log_version, error);
+    if (!parsed_log)
+        goto error;
+
+    run->events = g_list_length(parsed_log->init_section) +
+        g_list_length(parsed_log->main_section);
+    run->bytes = size;
+
+    log_free(parsed_log);
+    g_io_channel_unref(input_channel);
+
+    return TRUE;
+
+error:
+    g_io_channel_unref(input_channel);
+    return FALSE;
+}
+
+static gboolean bench_parse_v0(BenchData *data,
+                               BenchRun *run,
+                               GError **error) {
+    return parse_text_log(data->v0_path, data->v0_size, run, error);
+}
+
+static gboolean bench_parse_v1(BenchData *data,
+                               BenchRun *run,
+                               GError **error) {
+    return parse_text_log(data->v1_path, data->v1_size, run, error);
+}
+
+static gboolean bench_packed_decode(BenchData *data,
+                                    BenchRun *run,
+                                    GError **error) {
+    ParsedLog *parsed_log;
+    gint log_version;
+
+    parsed_log = packed_log_decode((const guint8*)data->packed,
+                                   data->packed_size, &log_version, error);
+    if (!parsed_log)
+        return FALSE;
+
+    run->events = g_list_length(parsed_log->init_section) +
+        g_list_length(parsed_log->main_section);
+    run->bytes = data->packed_size;
+
+    log_free(parsed_log);
+
+    return TRUE;
+}
+
+static gboolean bench_event_from_line(BenchData *data,
+                                      BenchRun *run,
+                                      GError **error) {
+    for (guint64 i = 0; i < data->events; i++) {
+        const gchar *line = data->event_lines[i % BENCH_LINE_COUNT];
+        PS2Event *event;
+
+        event = ps2_event_from_line(line, PS2EMU_LOG_VERSION, error);
+        if (!event)
+            return FALSE;
+
+        ps2_event_free(event);
+        run->bytes += strlen(line);
+    }
+
+    run->events = data->events;
+
+    return TRUE;
+}
+
+static gboolean bench_event_to_string(BenchData *data,
+                                      BenchRun *run,
+                                      GError **error) {
+    for (guint64 i = 0; i < data->events; i++) {
+        PS2Event *event = &data->line_events[i % BENCH_LINE_COUNT];
+        gchar *str;
+
+        str = ps2_event_to_string(event, event->time);
+        run->bytes += strlen(str);
+        g_free(str);
+    }
+
+    run->events = data->events;
+
+    return TRUE;
+}
+
+static gboolean bench_kmsg_parse(BenchData *data,
+                                 BenchRun *run,
+                                 GError **error) {
+    for (guint64 i = 0; i < data->events; i++) {
+        const gchar *line = data->kmsg_lines[i % BENCH_LINE_COUNT];
+        KmsgMessage msg;
+
+        if (!kmsg_parse_line(line, &msg, error)) {
+            if (!*error)
+                g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Failed to parse '%s'", line);
+            return FALSE;
+        }
+
+        run->bytes += strlen(line);
+    }
+
+    run->events = data->events;
+
+    return TRUE;
+}
+
+/* A clock that doesn't wait for anything, and a device that answers every
+ * byte the host should send with exactly that byte. This leaves nothing but
+ * the replay scheduler itself */
+typedef struct {
+    gint64 now;
+    GByteArray *host_bytes;
+    guint host_pos;
+} MockBackend;
+
+static gint64 mock_get_time(gpointer user_data) {
+    MockBackend *mock = user_data;
+
+    return mock->now;
+}
+
+static void mock_sleep(gint64 duration,
+                       gpointer user_data) {
+    MockBackend *mock = user_data;
+
+    mock->now += duration;
+}
+
+static gboolean mock_open(PS2Port port,
+                          gpointer user_data,
+                          GError **error) {
+    return TRUE;
+}
+
+static gboolean mock_send(guchar data,
+                          gpointer user_data,
+                          GError **error) {
+    return TRUE;
+}
+
+static gboolean mock_receive(guchar *data,
+                             gpointer user_data,
+                             GError **error) {
+    MockBackend *mock = user_data;
+
+    *data = mock->host_bytes->data[mock->host_pos++ % mock->host_bytes->len];
+
+    return TRUE;
+}
+
+static const PS2EmuClock mock_clock = {
+    .get_time = mock_get_time,
+    .sleep = mock_sleep,
+};
+
+static const PS2EmuDevice mock_device = {
+    .open = mock_open,
+    .send = mock_send,
+    .receive = mock_receive,
+};
+
+static gboolean bench_replay(BenchData *data,
+                             BenchRun *run,
+                             GError **error) {
+    MockBackend mock = {
+        .host_bytes = data->host_bytes,
+    };
+    PS2EmuReplay *replay = ps2emu_replay_new(data->log);
+    gboolean ret;
+
+    ps2emu_replay_set_clock(replay, &mock_clock, &mock);
+    ps2emu_replay_set_device(replay, &mock_device, &mock, NULL);
+
+    ret = ps2emu_replay_init(replay, error) &&
+          ps2emu_replay_run(replay, error);
+
+    if (ret && ps2emu_replay_get_mismatch_count(replay)) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                            "The mock device went out of sync");
+        ret = FALSE;
+    }
+
+    ps2emu_replay_free(replay);
+
+    run->events = ps2emu_log_get_event_count(data->log, PS2EMU_SECTION_INIT) +
+        ps2emu_log_get_event_count(data->log, PS2EMU_SECTION_MAIN);
+
+    return ret;
+}
+
+static const Bench benches[] = {
+    { "parse-v0", "log_parse() on a V0 log", bench_parse_v0 },
+    { "parse-v1", "log_parse() on a V1 log", bench_parse_v1 },
+    { "packed-decode", "packed_log_decode() on a packed log",
+      bench_packed_decode },
+    { "event-from-line", "ps2_event_from_line() on V1 event lines",
+      bench_event_from_line },
+    { "event-to-string", "ps2_event_to_string() on events from dmesg",
+      bench_event_to_string },
+    { "kmsg-parse", "kmsg_parse_line() on i8042 debugging output",
+      bench_kmsg_parse },
+    { "replay", "Replay scheduler against a mock device and clock",
+      bench_replay },
+};
+
+static void collect_host_byte(PS2EmuSection section,
+                              const PS2Event *event,
+                              const gchar *note,
+                              gpointer user_data) {
+    GByteArray *host_bytes = user_data;
+
+    if (event && event->type != PS2_EVENT_TYPE_INTERRUPT)
+        g_byte_array_append(host_bytes, &event->data, 1);
+}
+
+static gboolean bench_data_init(BenchData *data,
+                                GError **error) {
+    LogGenerator gen;
+    PS2Event event;
+    ParsedLog *parsed_log;
+    GByteArray *packed;
+    gboolean note;
+    GStatBuf statbuf;
+
+    data->tmp_dir = g_dir_make_tmp("ps2emu-bench-XXXXXX", error);
+    if (!data->tmp_dir)
+        return FALSE;
+
+    data->v0_path = g_build_filename(data->tmp_dir, "v0.log", NULL);
+    data->v1_path = g_build_filename(data->tmp_dir, "v1.log", NULL);
+
+    if (!gen_write_log_file(data->v0_path, GEN_FORMAT_V0, data->events,
+                            data->seed, error) ||
+        !gen_write_log_file(data->v1_path, GEN_FORMAT_V1, data->events,
+                            data->seed, error))
+        return FALSE;
+
+    if (g_stat(data->v0_path, &statbuf) == 0)
+        data->v0_size = statbuf.st_size;
+    if (g_stat(data->v1_path, &statbuf) == 0)
+        data->v1_size = statbuf.st_size;
+
+    parsed_log = gen_parsed_log(GEN_FORMAT_V1, data->events, data->seed);
+    packed = packed_log_encode(parsed_log, PS2EMU_LOG_VERSION);
+    log_free(parsed_log);
+
+    data->packed_size = packed->len;
+    data->packed = (gchar*)g_byte_array_free(packed, FALSE);
+
+    log_generator_init(&gen, BENCH_LINE_COUNT, data->seed);
+    for (guint i = 0; i < BENCH_LINE_COUNT; i++) {
+        if (!log_generator_next_init(&gen, &event))
+            log_generator_next_main(&gen, &event, &note);
+
+        data->event_lines[i] =
+            g_strdup_printf("%-10ld %c %.2hhx # (interrupt, 1, 12)\n",
+                            event.time,
+                            event.type == PS2_EVENT_TYPE_INTERRUPT ? 'R' : 'S',
+                            event.data);
+        data->kmsg_lines[i] =
+            g_strdup_printf("6,%u,%ld,-;i8042: [%ld] %.2hhx <- i8042 "
+                            "(interrupt, 1, 12)\n",
+                            i, event.time, event.time / 1000, event.data);
+
+        data->line_events[i] = event;
+        data->line_events[i].original_line = data->kmsg_lines[i];
+    }
+
+    data->log = ps2emu_log_load(data->v1_path, error);
+    if (!data->log)
+        return FALSE;
+
+    data->host_bytes = g_byte_array_new();
+    ps2emu_log_foreach(data->log, collect_host_byte, data->host_bytes);
+
+    return TRUE;
+}
+
+static void bench_data_clear(BenchData *data) {
+    if (data->v0_path)
+        g_unlink(data->v0_path);
+    if (data->v1_path)
+        g_unlink(data->v1_path);
+    if (data->tmp_dir)
+        g_rmdir(data->tmp_dir);
+
+    g_free(data->tmp_dir);
+    g_free(data->v0_path);
+    g_free(data->v1_path);
+    g_free(data->packed);
+
+    for (guint i = 0; i < BENCH_LINE_COUNT; i++) {
+        g_free(data->event_lines[i]);
+        g_free(data->kmsg_lines[i]);
+    }
+
+    if (data->log)
+        ps2emu_log_unref(data->log);
+    if (data->host_bytes)
+        g_byte_array_unref(data->host_bytes);
+}
+
+/* Keep running the benchmark until at least min_time has passed, and print a
+ * line with the averages */
+static gboolean run_bench(const Bench *bench,
+                          BenchData *data,
+                          gint64 min_time,
+                          GError **error) {
+    guint64 iterations = 0,
+            events = 0,
+            bytes = 0,
+            allocs;
+    gint64 start_time,
+           elapsed;
+    const guint64 start_allocs = profile_get_alloc_count();
+
+    start_time = g_get_monotonic_time();
+    do {
+        BenchRun run = { 0 };
+
+        if (!bench->run(data, &run, error)) {
+            g_prefix_error(error, "While running %s: ", bench->name);
+            return FALSE;
+        }
+
+        iterations++;
+        events += run.events;
+        bytes += run.bytes;
+        elapsed = g_get_monotonic_time() - start_time;
+    } while (elapsed < min_time);
+
+    allocs = profile_get_alloc_count() - start_allocs;
+
+    printf("%s\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%.2f\t%.2f\t%.3f\n",
+           bench->name, events / iterations, iterations,
+           elapsed * 1000.0 / events,
+           bytes / (gdouble)elapsed,
+           allocs / (gdouble)events);
+    fflush(stdout);
+
+    return TRUE;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("[benchmark...] - benchmark ps2emu");
+    GError *error = NULL;
+    BenchData data = { 0 };
+    gint64 events = 100000;
+    gint seed = 1;
+    gdouble min_time = 1.0;
+    gboolean list = FALSE;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "events", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT64,
+          &events, "Use logs with n events (default 100000)", "n" },
+        { "seed", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &seed, "Seed for the log generator (default 1)", "n" },
+        { "min-time", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_DOUBLE,
+          &min_time, "Run each benchmark for at least n seconds (default 1)",
+          "n" },
+        { "list", 'l', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &list, "List the available benchmarks", NULL },
+        { 0 }
+    };
+
+    /* Make the slice allocator go through malloc, so we can count what it
+     * allocates. glib reads this before main() even starts, so we have to
+     * restart ourselves with it set */
+    if (g_strcmp0(g_getenv("G_SLICE"), "always-malloc") != 0) {
+        g_setenv("G_SLICE", "always-malloc", TRUE);
+        execv("/proc/self/exe", argv);
+
+        fprintf(stderr,
+                "Warning: Couldn't restart with G_SLICE=always-malloc, slice "
+                "allocations won't be counted\n");
+    }
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Runs microbenchmarks of the hot paths in ps2emu on synthetic logs,\n"
+        "all of them unless some are named on the command line. Results are\n"
+        "written as tab separated values with the columns:\n"
+        "\n"
+        "  benchmark events iterations ns_per_event mb_per_s allocs_per_event\n"
+        "\n"
+        "where events is the number of events processed per iteration.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (list) {
+        for (guint i = 0; i < G_N_ELEMENTS(benches); i++)
+            printf("%-16s %s\n", benches[i].name, benches[i].description);
+
+        return 0;
+    }
+
+    if (events < 1)
+        exit_on_bad_argument(main_context, FALSE,
+                             "We need at least one event to benchmark");
+
+    for (gint i = 1; i < argc; i++) {
+        gboolean found = FALSE;
+
+        for (guint j = 0; j < G_N_ELEMENTS(benches) && !found; j++)
+            found = strcmp(argv[i], benches[j].name) == 0;
+
+        if (!found)
+            exit_on_bad_argument(main_context, FALSE,
+                                 "Unknown benchmark '%s', use --list to see "
+                                 "them all", argv[i]);
+    }
+
+    data.events = events;
+    data.seed = seed;
+
+    if (!bench_data_init(&data, &error))
+        goto error;
+
+    profile_start();
+
+    printf("# benchmark\tevents\titerations\tns_per_event\tmb_per_s\t"
+           "allocs_per_event\n");
+
+    for (guint i = 0; i < G_N_ELEMENTS(benches); i++) {
+        gboolean selected = argc < 2;
+
+        for (gint j = 1; j < argc && !selected; j++)
+            selected = strcmp(argv[j], benches[i].name) == 0;
+
+        if (!selected)
+            continue;
+
+        if (!run_bench(&benches[i], &data, min_time * G_USEC_PER_SEC, &error))
+            goto error;
+    }
+
+    bench_data_clear(&data);
+
+    return 0;
+
+error:
+    fprintf(stderr, "Error: %s\n", error->message);
+    bench_data_clear(&data);
+
+    return 1;
+}
@@ -0,0 +1,75 @@
+/*
+ * ps2emu-gen-log.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "bench-gen.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("- generate synthetic PS/2 logs");
+    GError *error = NULL;
+    gchar *format_str = NULL,
+          *output_path = NULL;
+    gint64 events = 1000;
+    gint seed = 1;
+    GenFormat format = GEN_FORMAT_V1;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "events", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT64,
+          &events, "Generate n events in the main section (default 1000)",
+          "n" },
+        { "format", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &format_str, "Write a log in the given format (default v1)",
+          "<v0|v1|packed>" },
+        { "seed", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &seed, "Seed for the random number generator (default 1)", "n" },
+        { "output", 'o', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &output_path, "Write the log to file instead of stdout", "file" },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Generates a synthetic touchpad recording for benchmarking. The same\n"
+        "seed and event count always produce the same log. Packed logs are\n"
+        "built in memory before being written, so very large ones need a lot\n"
+        "of memory.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (events < 0)
+        exit_on_bad_argument(main_context, FALSE,
+                             "The number of events can't be negative");
+
+    if (format_str && !gen_format_from_string(format_str, &format))
+        exit_on_bad_argument(main_context, TRUE, "Invalid format '%s'",
+                             format_str);
+
+    if (!gen_write_log_file(output_path, format, events, seed, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        return 1;
+    }
+
+    return 0;
+}
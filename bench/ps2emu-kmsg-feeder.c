@@ -0,0 +1,631 @@
+/*
+ * ps2emu-kmsg-feeder.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "bench-gen.h"
+#include "ps2emu.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define FEEDER_KBD_NAME   "AT Translated Set 2 keyboard"
+#define FEEDER_MOUSE_NAME "PS/2 Generic Mouse"
+
+/* A little longer than the recorder waits for the initialization sequence to
+ * end */
+#define FEEDER_DEFAULT_QUIET_SECS 6
+
+/* The i8042 command that sends the next byte to the AUX port */
+#define I8042_CMD_AUX_SEND 0xd4
+
+typedef struct {
+    PS2Port port;
+    GArray *init_events;
+    GArray *main_events;
+    gchar *device_name;
+} FeederLog;
+
+typedef struct {
+    FILE *kmsg;
+    guint64 seq;
+    PS2Port port;
+    gboolean noise;
+    guint64 event_count;
+} Feeder;
+
+static void append_event(PS2EmuSection section,
+                         const PS2Event *event,
+                         const gchar *note,
+                         gpointer user_data) {
+    FeederLog *log = user_data;
+    PS2Event copy;
+
+    /* Notes only exist in the log, the kernel never saw them */
+    if (!event)
+        return;
+
+    copy = *event;
+    copy.original_line = NULL;
+
+    g_array_append_val(section == PS2EMU_SECTION_INIT ? log->init_events :
+                                                        log->main_events,
+                       copy);
+}
+
+static void feeder_log_init(FeederLog *log) {
+    *log = (FeederLog) {
+        .port = PS2_PORT_AUX,
+        .init_events = g_array_new(FALSE, FALSE, sizeof(PS2Event)),
+        .main_events = g_array_new(FALSE, FALSE, sizeof(PS2Event)),
+    };
+}
+
+static void feeder_log_free(FeederLog *log) {
+    g_array_free(log->init_events, TRUE);
+    g_array_free(log->main_events, TRUE);
+    g_free(log->device_name);
+}
+
+static gboolean feeder_log_load(FeederLog *log,
+                                const gchar *path,
+                                GError **error) {
+    PS2EmuLog *ps2emu_log;
+
+    ps2emu_log = ps2emu_log_load(path, error);
+    if (!ps2emu_log)
+        return FALSE;
+
+    log->port = ps2emu_log_get_port(ps2emu_log);
+    log->device_name = g_strdup(ps2emu_log_get_device_name(ps2emu_log));
+    ps2emu_log_foreach(ps2emu_log, append_event, log);
+
+    ps2emu_log_unref(ps2emu_log);
+
+    return TRUE;
+}
+
+static void feeder_log_generate(FeederLog *log,
+                                guint64 events,
+                                guint32 seed) {
+    LogGenerator gen;
+    PS2Event event;
+    gboolean note;
+
+    log_generator_init(&gen, events, seed);
+
+    while (log_generator_next_init(&gen, &event))
+        g_array_append_val(log->init_events, event);
+
+    while (log_generator_next_main(&gen, &event, &note))
+        g_array_append_val(log->main_events, event);
+}
+
+static gboolean write_tree_file(const gchar *root,
+                                const gchar *path,
+                                const gchar *contents,
+                                GError **error) {
+    gchar *file_path = g_build_filename(root, path, NULL),
+          *dir_path = g_path_get_dirname(file_path);
+    gboolean ret = FALSE;
+
+    if (g_mkdir_with_parents(dir_path, 0755) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating %s: %s", dir_path, strerror(errno));
+        goto out;
+    }
+
+    ret = g_file_set_contents(file_path, contents, -1, error);
+
+out:
+    g_free(file_path);
+    g_free(dir_path);
+
+    return ret;
+}
+
+/* Just enough of /proc and /sys for ps2emu-record to find the controller, the
+ * devices on it and the debugging parameters */
+static gboolean create_fake_tree(const gchar *root,
+                                 const FeederLog *log,
+                                 GError **error) {
+    const gchar *kbd_name = FEEDER_KBD_NAME,
+                *aux_name = FEEDER_MOUSE_NAME;
+
+    if (log->device_name) {
+        if (log->port == PS2_PORT_KBD)
+            kbd_name = log->device_name;
+        else
+            aux_name = log->device_name;
+    }
+
+    if (!write_tree_file(root, "proc/ioports",
+                         "0060-0060 : keyboard\n"
+                         "0064-0064 : keyboard\n", error) ||
+        !write_tree_file(root, "proc/version",
+                         "Linux version 4.2.0 (ps2emu-kmsg-feeder)\n",
+                         error) ||
+        !write_tree_file(root, "sys/module/i8042/parameters/debug", "0\n",
+                         error) ||
+        !write_tree_file(root, "sys/module/i8042/parameters/unmask_kbd_data",
+                         "0\n", error) ||
+        !write_tree_file(root, "sys/class/dmi/id/sys_vendor", "ps2emu\n",
+                         error) ||
+        !write_tree_file(root, "sys/class/dmi/id/product_name",
+                         "Fake i8042\n", error) ||
+        !write_tree_file(root, "sys/class/dmi/id/product_version", "1.0\n",
+                         error) ||
+        !write_tree_file(root, "sys/class/dmi/id/bios_vendor", "ps2emu\n",
+                         error) ||
+        !write_tree_file(root, "sys/class/dmi/id/bios_date", "01/01/2015\n",
+                         error) ||
+        !write_tree_file(root, "sys/class/dmi/id/bios_version", "1.0\n",
+                         error))
+        return FALSE;
+
+    for (gint i = 0; i < 2; i++) {
+        const gchar *description = i == 0 ? "i8042 KBD port\n" :
+                                             "i8042 AUX port\n";
+        gchar *serio = g_strdup_printf("sys/devices/platform/i8042/serio%d", i),
+              *description_path = g_build_filename(serio, "description", NULL),
+              *drvctl_path = g_build_filename(serio, "drvctl", NULL),
+              *name_path = g_strdup_printf("%s/input/input%d/name", serio,
+                                           i + 3),
+              *name = g_strdup_printf("%s\n", i == 0 ? kbd_name : aux_name);
+        gboolean rc;
+
+        rc = write_tree_file(root, description_path, description, error) &&
+             write_tree_file(root, drvctl_path, "", error) &&
+             write_tree_file(root, name_path, name, error);
+
+        g_free(serio);
+        g_free(description_path);
+        g_free(drvctl_path);
+        g_free(name_path);
+        g_free(name);
+
+        if (!rc)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean create_fake_kmsg(const gchar *kmsg_path,
+                                 GError **error) {
+    gchar *dir_path = g_path_get_dirname(kmsg_path);
+    gint rc;
+
+    rc = g_mkdir_with_parents(dir_path, 0755);
+    g_free(dir_path);
+    if (rc != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating %s: %s", kmsg_path, strerror(errno));
+        return FALSE;
+    }
+
+    if (g_unlink(kmsg_path) != 0 && errno != ENOENT) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While removing %s: %s", kmsg_path, strerror(errno));
+        return FALSE;
+    }
+
+    if (mkfifo(kmsg_path, 0644) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating %s: %s", kmsg_path, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean recorder_exited(GPid *recorder_pid,
+                                GError **error) {
+    gint status;
+
+    if (!*recorder_pid || waitpid(*recorder_pid, &status, WNOHANG) == 0)
+        return FALSE;
+
+    g_spawn_close_pid(*recorder_pid);
+    *recorder_pid = 0;
+
+    g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                        "The recorder exited before it started recording");
+    return TRUE;
+}
+
+/* Wait for the recorder to write its start marker to the fake kmsg, and give
+ * back the marker. The recorder only opens the pipe for reading once we open
+ * it for writing, so it can't read the marker back before we do, and nothing
+ * we write gets lost before it's there to read it */
+static FILE *wait_for_start_marker(const gchar *kmsg_path,
+                                   GPid *recorder_pid,
+                                   gchar **marker,
+                                   GError **error) {
+    GString *line = g_string_new(NULL);
+    gint read_fd,
+         write_fd = -1;
+    FILE *kmsg = NULL;
+
+    read_fd = open(kmsg_path, O_RDONLY | O_NONBLOCK);
+    if (read_fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", kmsg_path, strerror(errno));
+        goto out;
+    }
+
+    while (!strchr(line->str, '\n')) {
+        struct pollfd pfd = { .fd = read_fd, .events = POLLIN };
+        gchar buf[256];
+        gssize len;
+
+        if (recorder_exited(recorder_pid, error))
+            goto out;
+
+        if (poll(&pfd, 1, 100) <= 0 || !(pfd.revents & POLLIN))
+            continue;
+
+        len = read(read_fd, buf, sizeof(buf) - 1);
+        if (len < 0 && errno != EAGAIN) {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While reading %s: %s", kmsg_path, strerror(errno));
+            goto out;
+        }
+        if (len > 0)
+            g_string_append_len(line, buf, len);
+    }
+
+    close(read_fd);
+    read_fd = -1;
+
+    /* Without a reader, this fails with ENXIO instead of blocking */
+    while ((write_fd = open(kmsg_path, O_WRONLY | O_NONBLOCK)) < 0) {
+        if (errno != ENXIO) {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While opening %s: %s", kmsg_path, strerror(errno));
+            goto out;
+        }
+
+        if (recorder_exited(recorder_pid, error))
+            goto out;
+
+        g_usleep(10000);
+    }
+
+    fcntl(write_fd, F_SETFL, fcntl(write_fd, F_GETFL) & ~O_NONBLOCK);
+
+    kmsg = fdopen(write_fd, "w");
+    *marker = g_strndup(line->str, strcspn(line->str, "\n"));
+
+out:
+    if (read_fd >= 0)
+        close(read_fd);
+
+    g_string_free(line, TRUE);
+
+    return kmsg;
+}
+
+static void write_record(Feeder *feeder,
+                         gint priority,
+                         const gchar *format,
+                         ...) G_GNUC_PRINTF(3, 4);
+
+static void write_record(Feeder *feeder,
+                         gint priority,
+                         const gchar *format,
+                         ...) {
+    va_list args;
+
+    fprintf(feeder->kmsg, "%d,%lu,%ld,-;", priority, feeder->seq++,
+            g_get_monotonic_time());
+
+    va_start(args, format);
+    vfprintf(feeder->kmsg, format, args);
+    va_end(args);
+
+    fputc('\n', feeder->kmsg);
+}
+
+static void write_i8042_record(Feeder *feeder,
+                               guchar data,
+                               gboolean sent,
+                               const gchar *type) {
+    write_record(feeder, 7, "i8042: [%ld] %.2hhx %s i8042 (%s)",
+                 g_get_monotonic_time() / 1000, data, sent ? "->" : "<-",
+                 type);
+}
+
+/* Write an event the way i8042 logs it with debugging enabled */
+static void write_event(Feeder *feeder,
+                        const PS2Event *event) {
+    gboolean kbd = feeder->port == PS2_PORT_KBD;
+
+    if (event->type == PS2_EVENT_TYPE_INTERRUPT) {
+        write_i8042_record(feeder, event->data, FALSE,
+                           kbd ? "interrupt, 0, 1" : "interrupt, 1, 12");
+    } else if (kbd) {
+        write_i8042_record(feeder, event->data, TRUE, "kbd-data");
+    } else {
+        write_i8042_record(feeder, I8042_CMD_AUX_SEND, TRUE, "command");
+        write_i8042_record(feeder, event->data, TRUE, "parameter");
+    }
+
+    /* Traffic from the other port, which the recorder has to filter out */
+    if (feeder->noise && ++feeder->event_count % 8 == 0) {
+        write_i8042_record(feeder, 0x1c, FALSE,
+                           kbd ? "interrupt, 1, 12" : "interrupt, 0, 1");
+    }
+}
+
+static void sleep_until(Feeder *feeder,
+                        gint64 time) {
+    gint64 now = g_get_monotonic_time();
+
+    if (time <= now)
+        return;
+
+    fflush(feeder->kmsg);
+    g_usleep(time - now);
+}
+
+static void feed_init(Feeder *feeder,
+                      GArray *events) {
+    const gint64 start_time = g_get_monotonic_time();
+
+    /* Reattaching the ports makes i8042 write the controller's config, which
+     * the recorder ignores since it goes to one of the controller's ports,
+     * until the next command that doesn't. Keyboard traffic has no commands of
+     * its own, so enable the KBD interface to end it */
+    write_i8042_record(feeder, 0x60, TRUE, "command");
+    write_i8042_record(feeder, 0x47, TRUE, "parameter");
+    write_i8042_record(feeder, 0xae, TRUE, "command");
+
+    for (guint i = 0; i < events->len; i++) {
+        const PS2Event *event = &g_array_index(events, PS2Event, i);
+
+        sleep_until(feeder, start_time + event->time);
+        write_event(feeder, event);
+    }
+
+    fflush(feeder->kmsg);
+}
+
+/* A rate of 0 means as fast as we can, a negative rate means following the
+ * timing in the log */
+static void feed_main(Feeder *feeder,
+                      GArray *events,
+                      gdouble rate,
+                      gint repeat) {
+    const gint64 start_time = g_get_monotonic_time();
+    gint64 offset = 0,
+           last_time = 0;
+    guint64 count = 0;
+
+    for (gint r = 0; r < repeat; r++) {
+        for (guint i = 0; i < events->len; i++) {
+            const PS2Event *event = &g_array_index(events, PS2Event, i);
+
+            if (rate < 0)
+                sleep_until(feeder, start_time + offset + event->time);
+            else if (rate > 0)
+                sleep_until(feeder, start_time + count / rate * G_USEC_PER_SEC);
+
+            write_event(feeder, event);
+            last_time = event->time;
+            count++;
+        }
+
+        /* Leave a gap like the one between two packets before starting
+         * over */
+        offset += last_time + 10000;
+    }
+
+    fflush(feeder->kmsg);
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("[-- COMMAND...] - feed a fake kernel log to "
+                             "ps2emu-record");
+    GError *error = NULL;
+    gchar **command,
+          *root = NULL,
+          *log_path = NULL,
+          *kmsg_path = NULL,
+          *marker = NULL;
+    gint64 events = 1000;
+    gint seed = 1,
+         repeat = 1,
+         quiet_time = FEEDER_DEFAULT_QUIET_SECS,
+         status = 0;
+    gdouble rate = -1;
+    gboolean noise = FALSE;
+    FeederLog log;
+    Feeder feeder = { 0 };
+    GPid recorder_pid = 0;
+    gint stdin_fd;
+    gint64 main_start_time;
+    gint ret = 1;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "root", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &root, "Create the fake /dev, /proc and /sys in dir", "dir" },
+        { "log", 'l', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &log_path, "Feed the events from a recording instead of generating "
+          "them", "file" },
+        { "events", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT64,
+          &events, "Generate n events in the main section (default 1000)",
+          "n" },
+        { "seed", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &seed, "Seed for the generated log (default 1)", "n" },
+        { "rate", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_DOUBLE,
+          &rate, "Feed the main section at n events per second instead of "
+          "following the log's timing, 0 for as fast as possible", "n" },
+        { "repeat", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &repeat, "Feed the main section n times (default 1)", "n" },
+        { "quiet-time", 'q', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &quiet_time, "Seconds to wait between the initialization sequence "
+          "and the main section (default 6)", "secs" },
+        { "noise", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &noise, "Mix in traffic from the port that isn't being recorded",
+          NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Creates a fake /proc and /sys for an i8042 controller in the given\n"
+        "directory, with a pipe in place of /dev/kmsg, and plays a recording\n"
+        "into it the way the kernel logs it with i8042 debugging enabled. This\n"
+        "allows running ps2emu-record --root=dir without root or real\n"
+        "hardware.\n"
+        "\n"
+        "If a command is given, it's started once the fake tree is ready with\n"
+        "its input closed, and the feeder exits with its exit status once the\n"
+        "log has been fed and the command has finished. Closing the fake\n"
+        "kmsg ends the recording, and the rate the recorder kept up with is\n"
+        "printed to stderr. For example:\n"
+        "\n"
+        "  ps2emu-kmsg-feeder --root=/tmp/fake -n 1000000 --rate=0 --\n"
+        "    ps2emu-record --root=/tmp/fake > /tmp/fake.txt\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (!root)
+        exit_on_bad_argument(main_context, TRUE, "No root directory given");
+
+    if (events < 0 || repeat < 1 || quiet_time < 0)
+        exit_on_bad_argument(main_context, FALSE,
+                             "Event counts and times can't be negative");
+
+    feeder_log_init(&log);
+    if (log_path) {
+        if (!feeder_log_load(&log, log_path, &error))
+            goto out;
+    } else {
+        feeder_log_generate(&log, events, seed);
+    }
+
+    if (!create_fake_tree(root, &log, &error))
+        goto out;
+
+    kmsg_path = g_build_filename(root, "dev", "kmsg", NULL);
+    if (!create_fake_kmsg(kmsg_path, &error))
+        goto out;
+
+    /* If the recorder dies, we want an error instead of being killed */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* glib leaves the -- separating our options from the command */
+    command = &argv[1];
+    if (*command && strcmp(*command, "--") == 0)
+        command++;
+
+    if (*command) {
+        if (!g_spawn_async_with_pipes(NULL, command, NULL,
+                                      G_SPAWN_SEARCH_PATH |
+                                      G_SPAWN_DO_NOT_REAP_CHILD,
+                                      NULL, NULL, &recorder_pid, &stdin_fd,
+                                      NULL, NULL, &error)) {
+            g_prefix_error(&error, "While starting %s: ", *command);
+            goto out;
+        }
+
+        /* ps2emu-record waits for enter before it starts */
+        close(stdin_fd);
+    } else {
+        fprintf(stderr, "Waiting for ps2emu-record --root=%s...\n", root);
+    }
+
+    feeder.kmsg = wait_for_start_marker(kmsg_path, &recorder_pid, &marker,
+                                        &error);
+    if (!feeder.kmsg)
+        goto out;
+
+    feeder.port = log.port;
+    feeder.noise = noise;
+
+    write_record(&feeder, 12, "%s", marker);
+    feed_init(&feeder, log.init_events);
+
+    sleep_until(&feeder, g_get_monotonic_time() + quiet_time * G_USEC_PER_SEC);
+
+    main_start_time = g_get_monotonic_time();
+    feed_main(&feeder, log.main_events, rate, repeat);
+
+    if (fclose(feeder.kmsg) != 0) {
+        feeder.kmsg = NULL;
+        g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s", kmsg_path, strerror(errno));
+        goto out;
+    }
+    feeder.kmsg = NULL;
+
+    ret = 0;
+
+    if (recorder_pid) {
+        gdouble elapsed;
+
+        waitpid(recorder_pid, &status, 0);
+        g_spawn_close_pid(recorder_pid);
+        recorder_pid = 0;
+
+        elapsed = (gdouble)(g_get_monotonic_time() - main_start_time) /
+                  G_USEC_PER_SEC;
+        fprintf(stderr, "Fed %" G_GUINT64_FORMAT " events in %.3fs, %.0f "
+                "events/s\n",
+                (guint64)log.main_events->len * repeat, elapsed,
+                log.main_events->len * repeat / elapsed);
+
+        ret = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+
+out:
+    if (error)
+        fprintf(stderr, "Error: %s\n", error->message);
+
+    if (feeder.kmsg)
+        fclose(feeder.kmsg);
+
+    if (recorder_pid) {
+        kill(recorder_pid, SIGTERM);
+        waitpid(recorder_pid, &status, 0);
+        g_spawn_close_pid(recorder_pid);
+    }
+
+    feeder_log_free(&log);
+    g_option_context_free(main_context);
+    g_free(root);
+    g_free(log_path);
+    g_free(kmsg_path);
+    g_free(marker);
+
+    return ret;
+}
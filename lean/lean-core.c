@@ -0,0 +1,444 @@
+/*
+ * lean-core.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "lean-core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How far the option names get indented in --help */
+#define HELP_INDENT 2
+#define HELP_MIN_COLUMN 30
+
+void lean_set_error(LeanError *error,
+                    const char *format,
+                    ...) {
+    va_list args;
+
+    if (!error || error->set)
+        return;
+
+    va_start(args, format);
+    vsnprintf(error->message, sizeof(error->message), format, args);
+    va_end(args);
+
+    error->set = true;
+}
+
+void lean_prefix_error(LeanError *error,
+                       const char *format,
+                       ...) {
+    char message[sizeof(error->message)];
+    size_t prefix_len;
+    va_list args;
+
+    if (!error || !error->set)
+        return;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    prefix_len = strlen(message);
+    snprintf(message + prefix_len, sizeof(message) - prefix_len, "%s",
+             error->message);
+    memcpy(error->message, message, sizeof(message));
+}
+
+static const LeanOption *find_long_option(const LeanOption *options,
+                                          const char *name,
+                                          size_t name_len) {
+    for (const LeanOption *option = options; option->long_name; option++) {
+        if (strlen(option->long_name) == name_len &&
+            strncmp(option->long_name, name, name_len) == 0)
+            return option;
+    }
+
+    return NULL;
+}
+
+static const LeanOption *find_short_option(const LeanOption *options,
+                                           char name) {
+    for (const LeanOption *option = options; option->long_name; option++) {
+        if (option->short_name && option->short_name == name)
+            return option;
+    }
+
+    return NULL;
+}
+
+static bool apply_option(const LeanOption *option,
+                         const char *display_name,
+                         const char *value,
+                         LeanError *error) {
+    char *end;
+    long parsed;
+
+    switch (option->type) {
+    case LEAN_OPTION_FLAG:
+        *(bool*)option->arg = true;
+        break;
+    case LEAN_OPTION_INT:
+        errno = 0;
+        parsed = strtol(value, &end, 0);
+        if (errno != 0 || end == value || *end != '\0') {
+            lean_set_error(error, "Cannot parse integer value '%s' for %s",
+                           value, display_name);
+            return false;
+        }
+
+        *(long*)option->arg = parsed;
+        break;
+    case LEAN_OPTION_CALLBACK:
+        ((LeanOptionFunc)option->arg)();
+        break;
+    }
+
+    return true;
+}
+
+static void print_help_and_exit(const LeanOptionContext *context,
+                                const char *prgname) {
+    lean_option_context_print_help(context, prgname, stdout);
+    exit(0);
+}
+
+bool lean_option_context_parse(const LeanOptionContext *context,
+                               int *argc,
+                               char ***argv,
+                               LeanError *error) {
+    char **args = *argv;
+    char display_name[64];
+    const LeanOption *option;
+    const char *value;
+    int remaining = 1;
+    bool options_done = false;
+
+    for (int i = 1; i < *argc; i++) {
+        char *arg = args[i];
+
+        if (options_done || arg[0] != '-' || arg[1] == '\0') {
+            args[remaining++] = arg;
+            continue;
+        }
+
+        if (strcmp(arg, "--") == 0) {
+            options_done = true;
+            continue;
+        }
+
+        if (arg[1] == '-') {
+            const char *name = arg + 2,
+                       *equals = strchr(name, '=');
+            size_t name_len = equals ? (size_t)(equals - name) : strlen(name);
+
+            if (name_len == 4 && strncmp(name, "help", 4) == 0)
+                print_help_and_exit(context, args[0]);
+
+            option = find_long_option(context->options, name, name_len);
+            if (!option) {
+                lean_set_error(error, "Unknown option %.*s",
+                               (int)name_len + 2, arg);
+                return false;
+            }
+
+            snprintf(display_name, sizeof(display_name), "--%s",
+                     option->long_name);
+
+            if (option->type != LEAN_OPTION_INT) {
+                if (equals) {
+                    lean_set_error(error, "Unexpected argument to %s",
+                                   display_name);
+                    return false;
+                }
+
+                value = NULL;
+            } else if (equals) {
+                value = equals + 1;
+            } else if (i + 1 < *argc) {
+                value = args[++i];
+            } else {
+                lean_set_error(error, "Missing argument for %s",
+                               display_name);
+                return false;
+            }
+
+            if (!apply_option(option, display_name, value, error))
+                return false;
+
+            continue;
+        }
+
+        /* A group of short options, the last of which can take a value */
+        for (const char *c = arg + 1; *c; c++) {
+            if (*c == 'h' || *c == '?')
+                print_help_and_exit(context, args[0]);
+
+            option = find_short_option(context->options, *c);
+            if (!option) {
+                lean_set_error(error, "Unknown option -%c", *c);
+                return false;
+            }
+
+            snprintf(display_name, sizeof(display_name), "-%c", *c);
+
+            if (option->type != LEAN_OPTION_INT) {
+                if (!apply_option(option, display_name, NULL, error))
+                    return false;
+
+                continue;
+            }
+
+            if (c[1])
+                value = c + 1;
+            else if (i + 1 < *argc)
+                value = args[++i];
+            else {
+                lean_set_error(error, "Missing argument for %s",
+                               display_name);
+                return false;
+            }
+
+            if (!apply_option(option, display_name, value, error))
+                return false;
+
+            break;
+        }
+    }
+
+    args[remaining] = NULL;
+    *argc = remaining;
+
+    return true;
+}
+
+static int format_option_name(char *buf,
+                              size_t len,
+                              const LeanOption *option) {
+    const char *arg_description = option->type == LEAN_OPTION_INT ?
+                                  option->arg_description : NULL;
+
+    if (option->short_name) {
+        return snprintf(buf, len, "-%c, --%s%s%s", option->short_name,
+                        option->long_name, arg_description ? "=" : "",
+                        arg_description ? arg_description : "");
+    }
+
+    return snprintf(buf, len, "--%s%s%s", option->long_name,
+                    arg_description ? "=" : "",
+                    arg_description ? arg_description : "");
+}
+
+void lean_option_context_print_help(const LeanOptionContext *context,
+                                    const char *prgname,
+                                    FILE *file) {
+    char name[128];
+    int column = HELP_MIN_COLUMN,
+        name_len;
+
+    for (const LeanOption *option = context->options; option->long_name;
+         option++) {
+        name_len = format_option_name(name, sizeof(name), option);
+        if (HELP_INDENT + name_len + 2 > column)
+            column = HELP_INDENT + name_len + 2;
+    }
+
+    fprintf(file,
+            "Usage:\n"
+            "  %s [OPTION...] %s\n"
+            "\n"
+            "Help Options:\n"
+            "  %-*s%s\n"
+            "\n"
+            "Application Options:\n",
+            prgname, context->parameter_string,
+            column - HELP_INDENT, "-h, --help", "Show help options");
+
+    for (const LeanOption *option = context->options; option->long_name;
+         option++) {
+        format_option_name(name, sizeof(name), option);
+        fprintf(file, "  %-*s%s\n", column - HELP_INDENT, name,
+                option->description);
+    }
+
+    if (context->description)
+        fprintf(file, "\n%s", context->description);
+}
+
+char *lean_read_file(const char *path,
+                     size_t *len,
+                     LeanError *error) {
+    char *data = NULL,
+         *new_data;
+    size_t alloc = 4096,
+           data_len = 0;
+    ssize_t count;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        lean_set_error(error, "%s", strerror(errno));
+        return NULL;
+    }
+
+    /* Not every file we get is a regular one (e.g. a pipe), so just keep
+     * reading until we hit EOF */
+    while (true) {
+        if (!data || data_len + 1 == alloc) {
+            if (data)
+                alloc *= 2;
+
+            new_data = realloc(data, alloc);
+            if (!new_data) {
+                lean_set_error(error, "Out of memory");
+                goto error;
+            }
+
+            data = new_data;
+        }
+
+        count = read(fd, data + data_len, alloc - data_len - 1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            lean_set_error(error, "%s", strerror(errno));
+            goto error;
+        }
+
+        if (count == 0)
+            break;
+
+        data_len += count;
+    }
+
+    close(fd);
+
+    data[data_len] = '\0';
+    if (len)
+        *len = data_len;
+
+    return data;
+
+error:
+    close(fd);
+    free(data);
+
+    return NULL;
+}
+
+bool lean_write_all(int fd,
+                    const void *data,
+                    size_t len,
+                    LeanError *error) {
+    const char *pos = data;
+    ssize_t count;
+
+    while (len) {
+        count = write(fd, pos, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            lean_set_error(error, "%s", strerror(errno));
+            return false;
+        }
+
+        pos += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+bool lean_read_all(int fd,
+                   void *data,
+                   size_t len,
+                   LeanError *error) {
+    char *pos = data;
+    ssize_t count;
+
+    while (len) {
+        count = read(fd, pos, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            lean_set_error(error, "%s", strerror(errno));
+            return false;
+        }
+
+        if (count == 0)
+            return false;
+
+        pos += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+void *lean_array_append(LeanArray *array) {
+    void *element;
+
+    if (array->len == array->alloc) {
+        array->alloc = array->alloc ? array->alloc * 2 : 64;
+        array->data = realloc(array->data,
+                              array->alloc * array->element_size);
+        if (!array->data) {
+            fprintf(stderr, "Out of memory\n");
+            abort();
+        }
+    }
+
+    element = (char*)array->data + array->len++ * array->element_size;
+    memset(element, 0, array->element_size);
+
+    return element;
+}
+
+void lean_array_clear(LeanArray *array) {
+    free(array->data);
+
+    array->data = NULL;
+    array->len = array->alloc = 0;
+}
+
+int64_t lean_get_monotonic_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * LEAN_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+void lean_usleep(int64_t usec) {
+    struct timespec ts = {
+        .tv_sec = usec / LEAN_USEC_PER_SEC,
+        .tv_nsec = (usec % LEAN_USEC_PER_SEC) * 1000,
+    };
+
+    if (usec <= 0)
+        return;
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,155 @@
+/*
+ * lean-core.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * The small core the lean build uses in place of glib: errors, an option
+ * parser, file I/O, a growable array and the clock. It only depends on libc,
+ * so the tools built on it can be linked statically and stay small enough for
+ * an initramfs.
+ */
+
+#ifndef __LEAN_CORE_H__
+#define __LEAN_CORE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LEAN_USEC_PER_SEC 1000000
+
+#define LEAN_N_ELEMENTS(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define LEAN_PRINTF(format_idx, arg_idx) \
+    __attribute__((format(printf, format_idx, arg_idx)))
+
+/*
+ * Errors
+ *
+ * The message lives in a fixed buffer, so reporting an error never allocates.
+ * Like a GError, the first error set is the one that sticks.
+ */
+typedef struct {
+    bool set;
+    char message[256];
+} LeanError;
+
+void lean_set_error(LeanError *error,
+                    const char *format,
+                    ...)
+LEAN_PRINTF(2, 3);
+
+void lean_prefix_error(LeanError *error,
+                       const char *format,
+                       ...)
+LEAN_PRINTF(2, 3);
+
+/*
+ * Options
+ *
+ * Parses the same syntax as GOptionContext: --name=value, --name value,
+ * -n value, -nvalue, grouped short flags and -- to end the options. --help and
+ * -h are handled automatically.
+ */
+typedef enum {
+    LEAN_OPTION_FLAG,
+    LEAN_OPTION_INT,
+    /* Takes no value, arg is a void (*)(void) that's called right away */
+    LEAN_OPTION_CALLBACK
+} LeanOptionType;
+
+typedef struct {
+    const char *long_name;
+    char short_name;
+    LeanOptionType type;
+    void *arg;
+    const char *description;
+    const char *arg_description;
+} LeanOption;
+
+typedef struct {
+    /* Shown after the program name in the usage line */
+    const char *parameter_string;
+    const char *description;
+    /* Terminated by an entry with no long_name */
+    const LeanOption *options;
+} LeanOptionContext;
+
+typedef void (*LeanOptionFunc)(void);
+
+/* Removes the options it parsed from argv, leaving argv[0] and the remaining
+ * arguments in order */
+bool lean_option_context_parse(const LeanOptionContext *context,
+                               int *argc,
+                               char ***argv,
+                               LeanError *error);
+
+void lean_option_context_print_help(const LeanOptionContext *context,
+                                    const char *prgname,
+                                    FILE *file);
+
+/*
+ * Files
+ */
+
+/* Reads the whole file into a NUL terminated buffer, which the caller frees */
+char *lean_read_file(const char *path,
+                     size_t *len,
+                     LeanError *error);
+
+/* Writes or reads all of len, retrying on EINTR. Reading returns false with
+ * no error set at EOF */
+bool lean_write_all(int fd,
+                    const void *data,
+                    size_t len,
+                    LeanError *error);
+
+bool lean_read_all(int fd,
+                   void *data,
+                   size_t len,
+                   LeanError *error);
+
+/*
+ * Arrays
+ *
+ * A growable array of fixed size elements. Zero initialize it with the element
+ * size set before use.
+ */
+typedef struct {
+    void *data;
+    size_t len;
+    size_t alloc;
+    size_t element_size;
+} LeanArray;
+
+#define LEAN_ARRAY_INIT(type) { .element_size = sizeof(type) }
+
+#define lean_array_index(array, type, i) (((type *)(array)->data)[i])
+
+/* Adds a zeroed element to the end of the array, and returns it */
+void *lean_array_append(LeanArray *array);
+
+void lean_array_clear(LeanArray *array);
+
+/*
+ * Time
+ */
+
+/* The monotonic clock in microseconds */
+int64_t lean_get_monotonic_time(void);
+
+void lean_usleep(int64_t usec);
+
+#endif /* !__LEAN_CORE_H__ */
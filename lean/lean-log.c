@@ -0,0 +1,283 @@
+/*
+ * lean-log.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * A port of log_parse() from src/ps2emu-log.c that parses the log in place
+ * instead of allocating every line and event. Both have to accept the same
+ * logs, so keep them in sync.
+ */
+
+#include "lean-log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define PACKED_LOG_MAGIC "PS2EMUPK"
+#define LOG_IMAGE_MAGIC  "PS2EMUIM"
+
+/* Where the message starts in a line like "E: ..." */
+#define LINE_TYPE_LENGTH sizeof("X:")
+
+static char *strip(char *line) {
+    char *end;
+
+    while (isspace((unsigned char)*line))
+        line++;
+
+    end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return line;
+}
+
+/* Returns false without setting error for lines that are just a comment */
+static bool parse_event(const char *str,
+                        int version,
+                        LeanLine *line,
+                        LeanError *error) {
+    const char *start = str + strspn(str, " \t");
+    char origin_char,
+         direction_char = '\0';
+    char *end;
+    long time;
+
+    if (*start == '#')
+        return false;
+
+    if (version == 0) {
+        if (sscanf(start, "%ld %c %c %hhx", &time, &origin_char,
+                   &direction_char, &line->data) != 4) {
+            lean_set_error(error, "Invalid event line '%s'", str);
+            return false;
+        }
+
+        if (origin_char != 'K' && origin_char != 'A') {
+            lean_set_error(error, "Invalid event origin '%c' from '%s'",
+                           origin_char, str);
+            return false;
+        }
+    } else {
+        errno = 0;
+        time = strtol(start, &end, 10);
+        if (end == start)
+            goto invalid;
+
+        start = end + strspn(end, " \t");
+        if (*start == '\0')
+            goto invalid;
+        direction_char = *start++;
+
+        line->data = strtoul(start, &end, 16);
+        if (end == start || errno != 0)
+            goto invalid;
+    }
+
+    line->time = time;
+
+    if (direction_char == 'S')
+        line->type = LEAN_LINE_PARAMETER;
+    else if (direction_char == 'R')
+        line->type = LEAN_LINE_INTERRUPT;
+    else {
+        lean_set_error(error, "Invalid event direction '%c' from '%s'",
+                       direction_char, str);
+        return false;
+    }
+
+    return true;
+
+invalid:
+    lean_set_error(error, "Invalid event line '%s'", str);
+    return false;
+}
+
+static bool parse_section(const char *str,
+                          LeanArray **section_dest,
+                          LeanLog *log,
+                          LeanError *error) {
+    size_t len;
+
+    str += strspn(str, " \t");
+    len = strcspn(str, " \t");
+
+    if (len == 0) {
+        lean_set_error(error, "Invalid section line");
+        return false;
+    }
+
+    if (len == 4 && strncmp(str, "Init", 4) == 0)
+        *section_dest = &log->sections[LEAN_SECTION_INIT];
+    else if (len == 4 && strncmp(str, "Main", 4) == 0)
+        *section_dest = &log->sections[LEAN_SECTION_MAIN];
+    else {
+        lean_set_error(error, "Invalid section type `%.*s`", (int)len, str);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_line(char *line,
+                       LeanArray **section_dest,
+                       LeanLog *log,
+                       LeanError *error) {
+    LeanLine event = { 0 },
+             *new_line;
+    char *msg_start;
+
+    if (log->version < 1) {
+        if (!parse_event(line, log->version, &event, error))
+            return !error->set;
+
+        *(LeanLine*)lean_array_append(*section_dest) = event;
+        return true;
+    }
+
+    msg_start = strlen(line) >= LINE_TYPE_LENGTH ?
+                line + LINE_TYPE_LENGTH : line + strlen(line);
+
+    switch (line[0]) {
+    case 'T':
+        if (msg_start[0] == 'K')
+            log->port = LEAN_PORT_KBD;
+        else if (msg_start[0] == 'A')
+            log->port = LEAN_PORT_AUX;
+        else {
+            lean_set_error(error, "Invalid device type '%c'", msg_start[0]);
+            return false;
+        }
+        break;
+    case 'E':
+        if (!parse_event(msg_start, log->version, &event, error))
+            return !error->set;
+
+        *(LeanLine*)lean_array_append(*section_dest) = event;
+        break;
+    case 'S':
+        return parse_section(msg_start, section_dest, log, error);
+    case 'N':
+        if (*msg_start == '\0') {
+            lean_set_error(error, "Note is empty");
+            return false;
+        }
+
+        new_line = lean_array_append(*section_dest);
+        new_line->type = LEAN_LINE_NOTE;
+        new_line->note = msg_start;
+        break;
+    default:
+        lean_set_error(error, "Invalid line type `%c`", line[0]);
+        return false;
+    }
+
+    return true;
+}
+
+bool lean_log_load(const char *path,
+                   LeanLog *log,
+                   LeanError *error) {
+    LeanArray *section_dest;
+    char *pos,
+         *line,
+         *next;
+
+    *log = (LeanLog) {
+        .sections = {
+            LEAN_ARRAY_INIT(LeanLine),
+            LEAN_ARRAY_INIT(LeanLine),
+        },
+    };
+
+    log->buffer = lean_read_file(path, NULL, error);
+    if (!log->buffer) {
+        lean_prefix_error(error, "While opening %s: ", path);
+        return false;
+    }
+
+    if (strncmp(log->buffer, PACKED_LOG_MAGIC,
+                sizeof(PACKED_LOG_MAGIC) - 1) == 0) {
+        lean_set_error(error,
+                       "%s is a packed log, which this build of "
+                       "ps2emu-replay can't read. Unpack it with "
+                       "ps2emu-pack --unpack first", path);
+        goto error;
+    }
+
+    if (strncmp(log->buffer, LOG_IMAGE_MAGIC,
+                sizeof(LOG_IMAGE_MAGIC) - 1) == 0) {
+        lean_set_error(error,
+                       "%s is a log image, which this build of "
+                       "ps2emu-replay can't read. Replay the log it was "
+                       "made from instead", path);
+        goto error;
+    }
+
+    if (log->buffer[0] == '\0') {
+        lean_set_error(error, "Reached unexpected EOF");
+        goto error;
+    }
+
+    if (sscanf(log->buffer, "# ps2emu-record V%d", &log->version) != 1) {
+        lean_set_error(error, "Invalid log file version");
+        goto error;
+    }
+
+    if (log->version > LEAN_LOG_VERSION) {
+        lean_set_error(error,
+                       "Log version is too new (found %d, we only support up "
+                       "to %d)", log->version, LEAN_LOG_VERSION);
+        goto error;
+    }
+
+    /* We can't reliably play anything back from older logs except for
+     * touchpads, so just automatically set the port type to AUX */
+    if (log->version < 1)
+        log->port = LEAN_PORT_AUX;
+
+    section_dest = &log->sections[LEAN_SECTION_MAIN];
+
+    /* Skip the version line, then cut the rest of the buffer into lines */
+    pos = strchr(log->buffer, '\n');
+    for (; pos; pos = next) {
+        next = strchr(++pos, '\n');
+        if (next)
+            *next = '\0';
+
+        line = strip(pos);
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        if (!parse_line(line, &section_dest, log, error))
+            goto error;
+    }
+
+    return true;
+
+error:
+    lean_log_clear(log);
+    return false;
+}
+
+void lean_log_clear(LeanLog *log) {
+    lean_array_clear(&log->sections[LEAN_SECTION_INIT]);
+    lean_array_clear(&log->sections[LEAN_SECTION_MAIN]);
+
+    free(log->buffer);
+    log->buffer = NULL;
+}
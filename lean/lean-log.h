@@ -0,0 +1,66 @@
+/*
+ * lean-log.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __LEAN_LOG_H__
+#define __LEAN_LOG_H__
+
+#include "lean-core.h"
+
+/* The newest log version we understand, the same as PS2EMU_LOG_VERSION */
+#define LEAN_LOG_VERSION 1
+
+typedef enum {
+    LEAN_PORT_KBD,
+    LEAN_PORT_AUX
+} LeanPort;
+
+typedef enum {
+    LEAN_SECTION_INIT,
+    LEAN_SECTION_MAIN
+} LeanSection;
+
+typedef enum {
+    /* A byte from the device to the host */
+    LEAN_LINE_INTERRUPT,
+    /* A byte from the host to the device */
+    LEAN_LINE_PARAMETER,
+    LEAN_LINE_NOTE
+} LeanLineType;
+
+typedef struct {
+    int64_t time;
+    /* Points into the buffer of the log */
+    const char *note;
+    LeanLineType type;
+    uint8_t data;
+} LeanLine;
+
+/* A text log (any version), with each section in one flat array. Packed logs
+ * aren't supported, since decoding them needs glib */
+typedef struct {
+    int version;
+    LeanPort port;
+    LeanArray sections[2];
+
+    char *buffer;
+} LeanLog;
+
+bool lean_log_load(const char *path,
+                   LeanLog *log,
+                   LeanError *error);
+
+void lean_log_clear(LeanLog *log);
+
+#endif /* !__LEAN_LOG_H__ */
@@ -0,0 +1,292 @@
+/*
+ * lean-replay.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * ps2emu-replay for the lean build. This follows src/ps2emu-replay.c and the
+ * replay session in src/ps2emu-replay-session.c, and has to behave the same
+ * way, minus --profile, --trace and the metrics options.
+ */
+
+#include "lean-core.h"
+#include "lean-log.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/serio.h>
+#include <userio.h>
+
+#define PS2EMU_USERIO_PATH     "/dev/userio"
+#define PS2EMU_MIN_EVENT_DELAY (LEAN_USEC_PER_SEC / 2)
+
+typedef struct {
+    int userio_fd;
+    bool verbose;
+    unsigned int mismatch_count;
+} Replay;
+
+static void print_version(void) {
+    printf("ps2emu userspace tools v" VERSION "\n");
+    exit(0);
+}
+
+static bool send_userio_cmd(Replay *replay,
+                            uint8_t type,
+                            uint8_t data,
+                            LeanError *error) {
+    struct userio_cmd cmd = {
+        .type = type,
+        .data = data,
+    };
+
+    return lean_write_all(replay->userio_fd, &cmd, sizeof(cmd), error);
+}
+
+static bool open_device(Replay *replay,
+                        LeanPort port,
+                        LeanError *error) {
+    replay->userio_fd = open(PS2EMU_USERIO_PATH, O_RDWR);
+    if (replay->userio_fd < 0) {
+        lean_set_error(error, "While opening %s: %s", PS2EMU_USERIO_PATH,
+                       strerror(errno));
+        return false;
+    }
+
+    if (!send_userio_cmd(replay, USERIO_CMD_SET_PORT_TYPE,
+                         port == LEAN_PORT_KBD ? SERIO_8042_XL : SERIO_8042,
+                         error)) {
+        lean_prefix_error(error, "While setting port type on %s: ",
+                          PS2EMU_USERIO_PATH);
+        return false;
+    }
+
+    if (!send_userio_cmd(replay, USERIO_CMD_REGISTER, 0, error)) {
+        lean_prefix_error(error, "While starting device on %s: ",
+                          PS2EMU_USERIO_PATH);
+        return false;
+    }
+
+    return true;
+}
+
+/* Output goes out while we're waiting for the next event, instead of right
+ * before sending it */
+static void replay_sleep(int64_t duration) {
+    fflush(stdout);
+    lean_usleep(duration);
+}
+
+static bool simulate_interrupt(Replay *replay,
+                               int64_t start_time,
+                               int64_t offset,
+                               const LeanLine *line,
+                               LeanError *error) {
+    const int64_t deadline = start_time - offset + line->time;
+    int64_t current_time = lean_get_monotonic_time();
+
+    if (current_time < deadline)
+        replay_sleep(deadline - current_time);
+
+    if (!send_userio_cmd(replay, USERIO_CMD_SEND_INTERRUPT, line->data,
+                         error))
+        return false;
+
+    if (replay->verbose)
+        printf("Send\t-> %.2hhx\n", line->data);
+
+    return true;
+}
+
+static bool simulate_receive(Replay *replay,
+                             const LeanLine *line,
+                             LeanError *error) {
+    uint8_t data;
+
+    if (!lean_read_all(replay->userio_fd, &data, sizeof(data), error)) {
+        lean_set_error(error, "Unexpected EOF from %s", PS2EMU_USERIO_PATH);
+        return false;
+    }
+
+    if (line->data == data) {
+        if (replay->verbose)
+            printf("Receive\t<- %.2hhx\n", line->data);
+
+        return true;
+    }
+
+    fprintf(stderr, "Expected %.2hhx, received %.2hhx\n", line->data, data);
+
+    if (++replay->mismatch_count == 1) {
+        fprintf(stderr,
+                "The device has gone out of sync with the recording, "
+                "playback from this point forward will probably fail.\n");
+    }
+
+    return true;
+}
+
+static bool replay_section(Replay *replay,
+                           const LeanArray *section,
+                           int64_t max_wait,
+                           int64_t note_delay,
+                           LeanError *error) {
+    const int64_t start_time = lean_get_monotonic_time();
+    const LeanLine *last_event = NULL;
+    int64_t offset = 0;
+
+    for (size_t i = 0; i < section->len; i++) {
+        const LeanLine *line = &lean_array_index(section, LeanLine, i);
+
+        if (line->type == LEAN_LINE_NOTE) {
+            printf("User note: %s\n", line->note);
+
+            replay_sleep(note_delay);
+            offset -= note_delay;
+
+            continue;
+        }
+
+        if (max_wait && last_event) {
+            int64_t wait_time = line->time - last_event->time;
+
+            /* If necessary, time-travel to the future */
+            if (wait_time > max_wait)
+                offset += wait_time - max_wait;
+        }
+        last_event = line;
+
+        if (line->type == LEAN_LINE_INTERRUPT) {
+            if (!simulate_interrupt(replay, start_time, offset, line, error))
+                return false;
+        } else {
+            if (!simulate_receive(replay, line, error))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc,
+         char *argv[]) {
+    long max_wait = 0,
+         event_delay = 0,
+         note_delay = 0;
+    bool no_events = false,
+         keep_running = false,
+         verbose = false;
+    LeanError error = { 0 };
+    LeanLog log = { 0 };
+    Replay replay = { .userio_fd = -1 };
+    int ret = 1;
+
+    const LeanOption options[] = {
+        { "version", 'V', LEAN_OPTION_CALLBACK, print_version,
+          "Show the version of the application", NULL },
+        { "verbose", 'v', LEAN_OPTION_FLAG, &verbose,
+          "Be more verbose when replaying events", NULL },
+        { "no-events", 'n', LEAN_OPTION_FLAG, &no_events,
+          "Don't replay events, just initialize the device", NULL },
+        { "keep-running", 'r', LEAN_OPTION_FLAG, &keep_running,
+          "Don't exit immediately after replay finishes", NULL },
+        { "max-wait", 'w', LEAN_OPTION_INT, &max_wait,
+          "Don't wait for longer then n seconds between events", "n" },
+        { "event-delay", 'd', LEAN_OPTION_INT, &event_delay,
+          "Wait n seconds after init before playing events", "n" },
+        { "note-delay", 'D', LEAN_OPTION_INT, &note_delay,
+          "Wait n seconds after printing a user note", "n" },
+        { 0 }
+    };
+    const LeanOptionContext context = {
+        .parameter_string = "<event_log> - replay PS/2 devices",
+        .description =
+            "Replays a PS/2 device using any log created with "
+            "ps2emu-record\n",
+        .options = options,
+    };
+
+    if (!lean_option_context_parse(&context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error.message);
+        lean_option_context_print_help(&context, argv[0], stderr);
+        return 1;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "No filename specified! Use --help for more "
+                        "information\n");
+        return 1;
+    }
+
+    /* Batch up output and write it out while we sleep */
+    setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+
+    if (!lean_log_load(argv[1], &log, &error))
+        goto out;
+
+    replay.verbose = verbose;
+
+    if (!open_device(&replay, log.port, &error))
+        goto out;
+
+    if (log.version == 0) {
+        if (!replay_section(&replay, &log.sections[LEAN_SECTION_MAIN], 0, 0,
+                            &error))
+            goto out;
+    } else {
+        printf("Replaying initialization sequence...\n");
+        if (!replay_section(&replay, &log.sections[LEAN_SECTION_INIT], 0, 0,
+                            &error))
+            goto out;
+
+        printf("Device initialized\n");
+
+        if (!no_events) {
+            /* Always wait at least a little so we don't throw the driver out
+             * of sync */
+            replay_sleep(event_delay * LEAN_USEC_PER_SEC +
+                         PS2EMU_MIN_EVENT_DELAY);
+
+            printf("Replaying event sequence...\n");
+            if (!replay_section(&replay, &log.sections[LEAN_SECTION_MAIN],
+                                max_wait * LEAN_USEC_PER_SEC,
+                                note_delay * LEAN_USEC_PER_SEC, &error))
+                goto out;
+        }
+
+        if (keep_running) {
+            fflush(stdout);
+            pause();
+        }
+    }
+
+    ret = 0;
+
+out:
+    fflush(stdout);
+
+    if (error.set)
+        fprintf(stderr, "Error: %s\n", error.message);
+
+    if (replay.userio_fd >= 0)
+        close(replay.userio_fd);
+
+    lean_log_clear(&log);
+
+    return ret;
+}
@@ -0,0 +1,687 @@
+/*
+ * ps2emu-analyze.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * Works out where the time in the initialization sequence of a recording
+ * went. The sequence is split into steps, each made of a command from the
+ * host, its parameter if it takes one, and everything the device sent back
+ * before the host's next command. A step costs the time from its command to
+ * the last byte of the exchange, plus however long the host stayed idle
+ * afterwards: the driver thinking, or the host waiting out a timeout for a
+ * response that never came. Idle times that match one of the timeouts in
+ * libps2 get flagged, as do waits within an exchange for the device to answer
+ * that match one, and so does every step of a probe round (everything from
+ * one reset to the next) that repeats an earlier round exactly.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-packed-log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#define PS2_CMD_RESET     0xff
+#define PS2_RET_NAK       0xfe
+#define PS2_RET_ERROR     0xfc
+
+#define MAX_RESPONSE_LEN  PS2_MAX_PACKET_LEN
+
+/* How many steps of each family to print by default */
+#define DEFAULT_TOP_STEPS 10
+
+typedef struct {
+    gint64 time;
+    const gchar *name;
+} KnownTimeout;
+
+/* From drivers/input/serio/libps2.c. The kernel waits at least this long, and
+ * a little more depending on HZ and scheduling */
+static const KnownTimeout known_timeouts[] = {
+    { 200 * 1000,  "libps2 ACK timeout" },
+    { 500 * 1000,  "libps2 command timeout" },
+    { 4000 * 1000, "libps2 reset timeout" },
+};
+
+#define ACK_TIMEOUT     (&known_timeouts[0])
+#define COMMAND_TIMEOUT (&known_timeouts[1])
+#define RESET_TIMEOUT   (&known_timeouts[2])
+
+#define KNOWN_TIMEOUT_SLACK_BEFORE 1000
+#define KNOWN_TIMEOUT_SLACK_AFTER  (20 * 1000)
+
+typedef struct {
+    guchar command;
+    const gchar *name;
+    gboolean has_param;
+} CommandInfo;
+
+static const CommandInfo aux_commands[] = {
+    { 0xff, "reset",          FALSE },
+    { 0xfe, "resend",         FALSE },
+    { 0xf6, "set defaults",   FALSE },
+    { 0xf5, "disable",        FALSE },
+    { 0xf4, "enable",         FALSE },
+    { 0xf3, "set rate",       TRUE  },
+    { 0xf2, "get id",         FALSE },
+    { 0xf0, "remote mode",    FALSE },
+    { 0xee, "wrap mode",      FALSE },
+    { 0xec, "reset wrap",     FALSE },
+    { 0xeb, "read data",      FALSE },
+    { 0xea, "stream mode",    FALSE },
+    { 0xe9, "get info",       FALSE },
+    { 0xe8, "set resolution", TRUE  },
+    { 0xe7, "scaling 2:1",    FALSE },
+    { 0xe6, "scaling 1:1",    FALSE },
+};
+
+static const CommandInfo kbd_commands[] = {
+    { 0xff, "reset",          FALSE },
+    { 0xfe, "resend",         FALSE },
+    { 0xfa, "all typematic",  FALSE },
+    { 0xf6, "set defaults",   FALSE },
+    { 0xf5, "disable",        FALSE },
+    { 0xf4, "enable",         FALSE },
+    { 0xf3, "set typematic",  TRUE  },
+    { 0xf2, "get id",         FALSE },
+    { 0xf0, "scancode set",   TRUE  },
+    { 0xee, "echo",           FALSE },
+    { 0xed, "set leds",       TRUE  },
+};
+
+typedef struct {
+    guchar command;
+    gint param;
+    const CommandInfo *info;
+
+    guchar response[MAX_RESPONSE_LEN];
+    guint response_len;
+    gboolean response_truncated;
+
+    time_t start;
+    time_t end;
+    gint64 exchange;
+    gint64 idle;
+    /* Whether the last byte of the exchange came from the host, so the
+     * device's next one is an ACK */
+    gboolean ack_due;
+    /* How long the host waited within the exchange for the device's next
+     * byte, if that matched the timeout for it */
+    gint64 response_wait;
+
+    const KnownTimeout *timeout;
+    const KnownTimeout *response_timeout;
+    gboolean retry;
+    gboolean redundant;
+} ProbeStep;
+
+typedef struct {
+    guint count;
+    gint64 cost;
+    gint64 timeout_cost;
+    gint64 redundant_cost;
+} StepStats;
+
+typedef struct {
+    guint logs;
+    gint64 init_time;
+    gint64 timeout_time;
+    gint64 redundant_time;
+
+    /* Keyed by the command and parameter of each step */
+    GHashTable *steps;
+} FamilyStats;
+
+static gboolean verbose = FALSE;
+static gint top_steps = DEFAULT_TOP_STEPS;
+
+static const CommandInfo *lookup_command(PS2Port port,
+                                         guchar command) {
+    const CommandInfo *commands;
+    gsize count;
+
+    if (port == PS2_PORT_KBD) {
+        commands = kbd_commands;
+        count = G_N_ELEMENTS(kbd_commands);
+    } else {
+        commands = aux_commands;
+        count = G_N_ELEMENTS(aux_commands);
+    }
+
+    for (gsize i = 0; i < count; i++) {
+        if (commands[i].command == command)
+            return &commands[i];
+    }
+
+    return NULL;
+}
+
+static gboolean known_timeout_matches(const KnownTimeout *timeout,
+                                      gint64 wait) {
+    return wait >= timeout->time - KNOWN_TIMEOUT_SLACK_BEFORE &&
+           wait <= timeout->time + timeout->time / 10 +
+                   KNOWN_TIMEOUT_SLACK_AFTER;
+}
+
+static const KnownTimeout *match_known_timeout(gint64 idle) {
+    for (gsize i = 0; i < G_N_ELEMENTS(known_timeouts); i++) {
+        if (known_timeout_matches(&known_timeouts[i], idle))
+            return &known_timeouts[i];
+    }
+
+    return NULL;
+}
+
+static gboolean step_failed(const ProbeStep *step) {
+    return step->response_len == 0 ||
+           step->response[0] == PS2_RET_NAK ||
+           step->response[0] == PS2_RET_ERROR ||
+           step->timeout != NULL ||
+           step->response_timeout != NULL;
+}
+
+static gboolean steps_equal(const ProbeStep *a,
+                            const ProbeStep *b) {
+    return a->command == b->command &&
+           a->param == b->param &&
+           a->response_len == b->response_len &&
+           memcmp(a->response, b->response, a->response_len) == 0;
+}
+
+static gchar *step_key(const ProbeStep *step) {
+    if (step->param >= 0)
+        return g_strdup_printf("%.2hhx %.2x", step->command, step->param);
+
+    return g_strdup_printf("%.2hhx", step->command);
+}
+
+/* Whether a host byte is the parameter of the command before it, rather than
+ * a new command. The device acknowledges the command before the host sends
+ * its parameter */
+static gboolean takes_param(const ProbeStep *step) {
+    return step->info && step->info->has_param && step->param < 0 &&
+           step->response_len == 1 && step->response[0] == PS2_RET_ACK;
+}
+
+static void step_add_byte(ProbeStep *step,
+                          const PS2Event *event) {
+    const gint64 wait = event->time - step->end;
+    const KnownTimeout *timeout;
+
+    /* libps2 gives the device a while to ACK each byte, and then a while
+     * longer for the rest of its answer */
+    if (step->ack_due)
+        timeout = ACK_TIMEOUT;
+    else if (step->command == PS2_CMD_RESET)
+        timeout = RESET_TIMEOUT;
+    else
+        timeout = COMMAND_TIMEOUT;
+
+    if (wait > step->response_wait && known_timeout_matches(timeout, wait)) {
+        step->response_wait = wait;
+        step->response_timeout = timeout;
+    }
+    step->ack_due = FALSE;
+
+    if (step->response_len < MAX_RESPONSE_LEN)
+        step->response[step->response_len++] = event->data;
+    else
+        step->response_truncated = TRUE;
+
+    step->end = event->time;
+}
+
+/* Splits the initialization sequence into steps. first_time is set to the
+ * time of the first event in it, which may come from the device before the
+ * host has sent anything */
+static GArray *find_steps(ParsedLog *log,
+                          time_t *first_time) {
+    GArray *steps = g_array_new(FALSE, FALSE, sizeof(ProbeStep));
+    ProbeStep *step = NULL;
+    gboolean have_first_time = FALSE;
+
+    *first_time = 0;
+
+    for (GList *l = log->init_section; l != NULL; l = l->next) {
+        LogLine *log_line = l->data;
+        PS2Event *event;
+
+        if (log_line->type != LINE_TYPE_EVENT)
+            continue;
+
+        event = log_line->ps2_event;
+        if (!have_first_time) {
+            *first_time = event->time;
+            have_first_time = TRUE;
+        }
+
+        if (event->type == PS2_EVENT_TYPE_INTERRUPT) {
+            /* Anything the device sends before the first command doesn't
+             * belong to a step */
+            if (step)
+                step_add_byte(step, event);
+
+            continue;
+        }
+
+        if (step && takes_param(step)) {
+            step->param = event->data;
+            step->end = event->time;
+            step->ack_due = TRUE;
+            continue;
+        }
+
+        g_array_append_val(steps, ((ProbeStep) {
+            .command = event->data,
+            .param = -1,
+            .info = lookup_command(log->port, event->data),
+            .start = event->time,
+            .end = event->time,
+            .ack_due = TRUE,
+        }));
+        step = &g_array_index(steps, ProbeStep, steps->len - 1);
+    }
+
+    return steps;
+}
+
+/* Every step of a round (from one reset up to the next) that repeats an
+ * earlier round exactly didn't tell the driver anything new */
+static void find_redundant_rounds(GArray *steps) {
+    GArray *rounds = g_array_new(FALSE, FALSE, sizeof(guint));
+    guint start = 0;
+
+    for (guint i = 0; i <= steps->len; i++) {
+        guint len;
+
+        if (i < steps->len &&
+            (i == 0 ||
+             g_array_index(steps, ProbeStep, i).command != PS2_CMD_RESET))
+            continue;
+
+        len = i - start;
+        for (guint r = 0; r + 1 < rounds->len && len; r += 2) {
+            guint other = g_array_index(rounds, guint, r);
+            guint j;
+
+            if (g_array_index(rounds, guint, r + 1) != len)
+                continue;
+
+            for (j = 0; j < len; j++) {
+                if (!steps_equal(&g_array_index(steps, ProbeStep, other + j),
+                                 &g_array_index(steps, ProbeStep, start + j)))
+                    break;
+            }
+
+            if (j == len) {
+                for (j = 0; j < len; j++)
+                    g_array_index(steps, ProbeStep, start + j).redundant = TRUE;
+                break;
+            }
+        }
+
+        g_array_append_val(rounds, start);
+        g_array_append_val(rounds, len);
+        start = i;
+    }
+
+    g_array_free(rounds, TRUE);
+}
+
+static void analyze_steps(GArray *steps) {
+    for (guint i = 0; i < steps->len; i++) {
+        ProbeStep *step = &g_array_index(steps, ProbeStep, i);
+
+        step->exchange = step->end - step->start;
+        if (i + 1 < steps->len) {
+            step->idle = g_array_index(steps, ProbeStep, i + 1).start -
+                         step->end;
+            step->timeout = match_known_timeout(step->idle);
+        }
+
+        if (i > 0) {
+            const ProbeStep *last = &g_array_index(steps, ProbeStep, i - 1);
+
+            step->retry = step->command == last->command &&
+                          step->param == last->param &&
+                          step_failed(last);
+        }
+    }
+
+    find_redundant_rounds(steps);
+}
+
+static void print_step(const ProbeStep *step,
+                       time_t first_time) {
+    GString *command = g_string_new(NULL),
+            *response = g_string_new(NULL),
+            *notes = g_string_new(NULL);
+
+    g_string_printf(command, "%.2hhx", step->command);
+    if (step->param >= 0)
+        g_string_append_printf(command, " %.2x", step->param);
+
+    for (guint i = 0; i < step->response_len; i++)
+        g_string_append_printf(response, "%s%.2hhx", i ? " " : "",
+                               step->response[i]);
+    if (step->response_truncated)
+        g_string_append(response, " ...");
+    if (!step->response_len)
+        g_string_append(response, "-");
+
+    if (step->response_timeout)
+        g_string_append_printf(notes, "%s before the response",
+                               step->response_timeout->name);
+    if (step->timeout)
+        g_string_append_printf(notes, "%s%s", notes->len ? ", " : "",
+                               step->timeout->name);
+    if (step->retry)
+        g_string_append_printf(notes, "%sretry", notes->len ? ", " : "");
+    if (step->redundant)
+        g_string_append_printf(notes, "%sre-probe", notes->len ? ", " : "");
+
+    printf("%11.3f  %-6s %-15s %-12s %10.3f %10.3f%s%s\n",
+           (step->start - first_time) / 1000.0, command->str,
+           step->info ? step->info->name : "?", response->str,
+           step->exchange / 1000.0, step->idle / 1000.0,
+           notes->len ? "  " : "", notes->str);
+
+    g_string_free(command, TRUE);
+    g_string_free(response, TRUE);
+    g_string_free(notes, TRUE);
+}
+
+static void family_stats_free(FamilyStats *stats) {
+    g_hash_table_destroy(stats->steps);
+    g_free(stats);
+}
+
+static void add_to_family(GHashTable *families,
+                          ParsedLog *log,
+                          GArray *steps,
+                          gint64 init_time) {
+    const gchar *family = log_get_device_family(log);
+    FamilyStats *stats;
+
+    stats = g_hash_table_lookup(families, family);
+    if (!stats) {
+        stats = g_new0(FamilyStats, 1);
+        stats->steps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             g_free);
+        g_hash_table_insert(families, g_strdup(family), stats);
+    }
+
+    stats->logs++;
+    stats->init_time += init_time;
+
+    for (guint i = 0; i < steps->len; i++) {
+        const ProbeStep *step = &g_array_index(steps, ProbeStep, i);
+        const gint64 cost = step->exchange + step->idle;
+        gchar *key = step_key(step);
+        StepStats *step_stats;
+
+        step_stats = g_hash_table_lookup(stats->steps, key);
+        if (!step_stats) {
+            step_stats = g_new0(StepStats, 1);
+            g_hash_table_insert(stats->steps, key, step_stats);
+        } else {
+            g_free(key);
+        }
+
+        step_stats->count++;
+        step_stats->cost += cost;
+
+        if (step->timeout) {
+            step_stats->timeout_cost += step->idle;
+            stats->timeout_time += step->idle;
+        }
+
+        if (step->response_timeout) {
+            step_stats->timeout_cost += step->response_wait;
+            stats->timeout_time += step->response_wait;
+        }
+
+        if (step->redundant) {
+            step_stats->redundant_cost += cost;
+            stats->redundant_time += cost;
+        }
+    }
+}
+
+static gboolean analyze_log(const gchar *path,
+                            GHashTable *families,
+                            gboolean print,
+                            GError **error) {
+    GIOChannel *input_channel = NULL;
+    ParsedLog *log = NULL;
+    GArray *steps = NULL;
+    time_t first_time;
+    gint64 init_time = 0;
+    int log_version;
+    gboolean ret = FALSE;
+
+    if (packed_log_file_test(path)) {
+        log = packed_log_load(path, &log_version, error);
+    } else {
+        input_channel = g_io_channel_new_file(path, "r", error);
+        if (!input_channel) {
+            g_prefix_error(error, "While opening %s: ", path);
+            goto out;
+        }
+
+        log_version = log_parse_version(input_channel, error);
+        if (log_version < 0)
+            goto out;
+
+        log = log_parse(input_channel, log_version, error);
+    }
+
+    if (!log)
+        goto out;
+
+    if (log_version == 0) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "%s is a V0 log, which doesn't have an initialization "
+                    "section. Convert it with ps2emu-convert first", path);
+        goto out;
+    }
+
+    steps = find_steps(log, &first_time);
+    analyze_steps(steps);
+
+    if (steps->len) {
+        const ProbeStep *last = &g_array_index(steps, ProbeStep,
+                                               steps->len - 1);
+
+        init_time = last->end - first_time;
+    }
+
+    if (print) {
+        gint64 timeout_time = 0,
+               redundant_time = 0;
+
+        printf("%s: %s, initialization took %.3f ms\n",
+               path, log_get_device_family(log), init_time / 1000.0);
+        printf("%11s  %-6s %-15s %-12s %10s %10s  %s\n",
+               "at (ms)", "cmd", "", "response", "exch (ms)", "idle (ms)",
+               "notes");
+
+        for (guint i = 0; i < steps->len; i++) {
+            const ProbeStep *step = &g_array_index(steps, ProbeStep, i);
+
+            print_step(step, first_time);
+
+            if (step->timeout)
+                timeout_time += step->idle;
+            if (step->response_timeout)
+                timeout_time += step->response_wait;
+            if (step->redundant)
+                redundant_time += step->exchange + step->idle;
+        }
+
+        printf("Waiting out timeouts: %.3f ms, redundant re-probes: "
+               "%.3f ms\n\n", timeout_time / 1000.0, redundant_time / 1000.0);
+    }
+
+    add_to_family(families, log, steps, init_time);
+    ret = TRUE;
+
+out:
+    if (steps)
+        g_array_free(steps, TRUE);
+    if (log)
+        log_free(log);
+    if (input_channel)
+        g_io_channel_unref(input_channel);
+
+    return ret;
+}
+
+static gint compare_step_cost(gconstpointer a,
+                              gconstpointer b,
+                              gpointer user_data) {
+    GHashTable *steps = user_data;
+    const StepStats *stats_a = g_hash_table_lookup(steps, *(gchar**)a),
+                    *stats_b = g_hash_table_lookup(steps, *(gchar**)b);
+
+    if (stats_a->cost != stats_b->cost)
+        return stats_a->cost < stats_b->cost ? 1 : -1;
+
+    return strcmp(*(gchar**)a, *(gchar**)b);
+}
+
+static void print_family(const gchar *family,
+                         FamilyStats *stats) {
+    GPtrArray *keys = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key;
+
+    printf("%s: %u logs\n"
+           "  Initialization took %.3f ms on average, %.3f ms of it waiting "
+           "out timeouts\n"
+           "  and %.3f ms in redundant re-probes\n",
+           family, stats->logs,
+           stats->init_time / 1000.0 / stats->logs,
+           stats->timeout_time / 1000.0 / stats->logs,
+           stats->redundant_time / 1000.0 / stats->logs);
+
+    g_hash_table_iter_init(&iter, stats->steps);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        g_ptr_array_add(keys, key);
+    g_ptr_array_sort_with_data(keys, compare_step_cost, stats->steps);
+
+    printf("  %-6s %8s %15s %15s %15s\n",
+           "step", "count", "per log (ms)", "timeouts (ms)",
+           "re-probes (ms)");
+    for (guint i = 0; i < keys->len && i < (guint)top_steps; i++) {
+        const StepStats *step = g_hash_table_lookup(stats->steps,
+                                                    keys->pdata[i]);
+
+        printf("  %-6s %8u %15.3f %15.3f %15.3f\n",
+               (const gchar*)keys->pdata[i], step->count,
+               step->cost / 1000.0 / stats->logs,
+               step->timeout_cost / 1000.0 / stats->logs,
+               step->redundant_cost / 1000.0 / stats->logs);
+    }
+    printf("\n");
+
+    g_ptr_array_free(keys, TRUE);
+}
+
+static gint compare_family_names(gconstpointer a,
+                                 gconstpointer b) {
+    return strcmp(*(const gchar**)a, *(const gchar**)b);
+}
+
+static void print_families(GHashTable *families) {
+    GPtrArray *names = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer name;
+
+    g_hash_table_iter_init(&iter, families);
+    while (g_hash_table_iter_next(&iter, &name, NULL))
+        g_ptr_array_add(names, name);
+    g_ptr_array_sort(names, compare_family_names);
+
+    for (guint i = 0; i < names->len; i++)
+        print_family(names->pdata[i],
+                     g_hash_table_lookup(families, names->pdata[i]));
+
+    g_ptr_array_free(names, TRUE);
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<recording>... - analyze device initialization");
+    GHashTable *families;
+    GError *error = NULL;
+    gboolean single,
+             ret = TRUE;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "verbose", 'v', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &verbose, "Print the steps of every log, not just the summary of "
+          "each device family", NULL },
+        { "top", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &top_steps, "Print the n most expensive steps of each device family "
+          "(default 10)", "n" },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Breaks down where the time in the initialization sequence of logs\n"
+        "created with ps2emu-record went. Given more than one log, it sums up\n"
+        "which steps cost the most for each device family.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (argc < 2)
+        exit_on_bad_argument(main_context, FALSE,
+                             "No filenames specified! Use --help for more "
+                             "information");
+
+    if (top_steps < 1)
+        exit_on_bad_argument(main_context, FALSE,
+                             "--top needs to be at least 1");
+
+    families = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify)family_stats_free);
+
+    /* There's nothing to sum up with just one log */
+    single = argc == 2;
+
+    for (gint i = 1; i < argc; i++) {
+        if (!analyze_log(argv[i], families, single || verbose, &error)) {
+            fprintf(stderr, "Skipping %s: %s\n", argv[i], error->message);
+            g_clear_error(&error);
+            ret = FALSE;
+        }
+    }
+
+    if (!single)
+        print_families(families);
+
+    g_hash_table_destroy(families);
+
+    return ret ? 0 : 1;
+}
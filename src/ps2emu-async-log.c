@@ -0,0 +1,201 @@
+/*
+ * ps2emu-async-log.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-async-log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+/* Long enough for every message we print while replaying, and most notes,
+ * while keeping a record at 256 bytes. Anything longer gets cut short */
+#define ASYNC_LOG_TEXT_SIZE 244
+
+#define ASYNC_LOG_TRUNCATED "...\n"
+
+typedef struct {
+    FILE *stream;
+    /* How many messages were dropped right before this one */
+    guint dropped_before;
+    gchar text[ASYNC_LOG_TEXT_SIZE];
+} AsyncLogRecord;
+
+struct _AsyncLog {
+    AsyncLogRecord *ring;
+    guint slots;
+
+    /* Both only ever count up, the slot is the count masked by slots - 1.
+     * head is only written by the printing thread, and tail only by the drain
+     * thread */
+    guint head;
+    guint tail;
+
+    /* Only touched by the printing thread */
+    guint pending_drops;
+
+    gint stopping;
+
+    /* Set by the drain thread before it goes to sleep on wake_fds[0], and
+     * cleared by whoever wakes it up. Only whoever clears it writes to
+     * wake_fds[1], so printing makes a syscall at most once per sleep */
+    gint asleep;
+    gint wake_fds[2];
+
+    GThread *thread;
+};
+
+static void write_record(AsyncLogRecord *record) {
+    if (record->dropped_before) {
+        fprintf(record->stream, "... %u messages dropped ...\n",
+                record->dropped_before);
+    }
+
+    fputs(record->text, record->stream);
+}
+
+static void wake_up(AsyncLog *log) {
+    if (!g_atomic_int_compare_and_exchange(&log->asleep, TRUE, FALSE))
+        return;
+
+    g_warn_if_fail(write(log->wake_fds[1], "", 1) == 1);
+}
+
+static void go_to_sleep(AsyncLog *log,
+                        guint tail) {
+    gchar byte;
+
+    g_atomic_int_set(&log->asleep, TRUE);
+
+    /* Anything printed before asleep was set didn't wake us up */
+    if (tail != g_atomic_int_get(&log->head) ||
+        g_atomic_int_get(&log->stopping)) {
+        if (g_atomic_int_compare_and_exchange(&log->asleep, TRUE, FALSE))
+            return;
+
+        /* Someone else cleared it first, and their byte is on its way */
+    }
+
+    while (read(log->wake_fds[0], &byte, 1) < 0 && errno == EINTR);
+}
+
+static gpointer drain_thread(gpointer data) {
+    AsyncLog *log = data;
+    guint tail = log->tail,
+          head;
+
+    while (TRUE) {
+        head = g_atomic_int_get(&log->head);
+
+        if (tail == head) {
+            /* stopping is set after the last message is added, so if it's set
+             * and there's still nothing new we've printed everything */
+            if (g_atomic_int_get(&log->stopping) &&
+                tail == g_atomic_int_get(&log->head))
+                break;
+
+            fflush(stdout);
+            fflush(stderr);
+
+            go_to_sleep(log, tail);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            write_record(&log->ring[tail & (log->slots - 1)]);
+            g_atomic_int_set(&log->tail, tail + 1);
+        }
+    }
+
+    return NULL;
+}
+
+AsyncLog *async_log_new(guint slots,
+                        GError **error) {
+    AsyncLog *log = g_new0(AsyncLog, 1);
+
+    g_assert((slots & (slots - 1)) == 0);
+
+    if (pipe(log->wake_fds) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating a pipe: %s", strerror(errno));
+        g_free(log);
+        return NULL;
+    }
+
+    log->slots = slots;
+
+    /* Touch the ring now, so printing doesn't take page faults */
+    log->ring = g_new(AsyncLogRecord, slots);
+    memset(log->ring, 0, slots * sizeof(AsyncLogRecord));
+
+    log->thread = g_thread_new("async-log", drain_thread, log);
+
+    return log;
+}
+
+void async_log_printf(AsyncLog *log,
+                      FILE *stream,
+                      const gchar *format,
+                      ...) {
+    guint head = log->head;
+    AsyncLogRecord *record;
+    va_list args;
+    gint len;
+
+    if (head - g_atomic_int_get(&log->tail) == log->slots) {
+        log->pending_drops++;
+        return;
+    }
+
+    record = &log->ring[head & (log->slots - 1)];
+
+    va_start(args, format);
+    len = g_vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+
+    if (len >= (gint)sizeof(record->text)) {
+        memcpy(record->text + sizeof(record->text) -
+               sizeof(ASYNC_LOG_TRUNCATED),
+               ASYNC_LOG_TRUNCATED, sizeof(ASYNC_LOG_TRUNCATED));
+    }
+
+    record->stream = stream;
+    record->dropped_before = log->pending_drops;
+    log->pending_drops = 0;
+
+    /* Published before we check whether the drain thread is asleep, which it
+     * sets before checking head, so one of us always sees the other */
+    g_atomic_int_set(&log->head, head + 1);
+    wake_up(log);
+}
+
+void async_log_free(AsyncLog *log) {
+    g_atomic_int_set(&log->stopping, TRUE);
+    wake_up(log);
+    g_thread_join(log->thread);
+
+    if (log->pending_drops)
+        fprintf(stderr, "... %u messages dropped ...\n", log->pending_drops);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    close(log->wake_fds[0]);
+    close(log->wake_fds[1]);
+    g_free(log->ring);
+    g_free(log);
+}
@@ -0,0 +1,46 @@
+/*
+ * ps2emu-async-log.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_ASYNC_LOG_H__
+#define __PS2EMU_ASYNC_LOG_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+/* Diagnostic output that never blocks the thread printing it. Messages are
+ * formatted into a ring buffer and written out by a background thread, so a
+ * slow terminal or pipe can't hold up the replay. The background thread
+ * sleeps while there's nothing to write, and printing only makes a syscall to
+ * wake it up. Only one thread may print to an AsyncLog. If the ring fills up,
+ * messages are dropped, and a line saying how many were lost is printed in
+ * their place. Messages that don't fit in a slot are cut short */
+typedef struct _AsyncLog AsyncLog;
+
+#define ASYNC_LOG_DEFAULT_SLOTS 4096
+
+/* slots must be a power of two */
+AsyncLog *async_log_new(guint slots,
+                        GError **error);
+
+void async_log_printf(AsyncLog *log,
+                      FILE *stream,
+                      const gchar *format,
+                      ...)
+G_GNUC_PRINTF(3, 4);
+
+/* Writes out everything left in the ring and stops the background thread */
+void async_log_free(AsyncLog *log);
+
+#endif /* !__PS2EMU_ASYNC_LOG_H__ */
@@ -0,0 +1,148 @@
+/*
+ * ps2emu-checkpoint.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * Checkpoints are small key files, so they can be looked at (or fixed up) by
+ * hand:
+ *
+ *   [Checkpoint]
+ *   Port=A
+ *   MainLines=120000
+ *   Position=45000
+ *   ...
+ */
+
+#include "ps2emu.h"
+
+#include <glib.h>
+
+#define CHECKPOINT_GROUP "Checkpoint"
+
+gboolean ps2emu_checkpoint_save(const PS2EmuCheckpoint *checkpoint,
+                                const gchar *path,
+                                GError **error) {
+    GKeyFile *key_file = g_key_file_new();
+    gchar *data;
+    gsize len;
+    gboolean ret;
+
+    g_key_file_set_string(key_file, CHECKPOINT_GROUP, "Port",
+                          checkpoint->port == PS2_PORT_KBD ? "K" : "A");
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "MainLines",
+                         checkpoint->main_lines);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "Position",
+                         checkpoint->position);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "Elapsed",
+                         checkpoint->elapsed);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "Offset",
+                         checkpoint->offset);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "LastEventTime",
+                         checkpoint->last_event_time);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "Notes",
+                         checkpoint->notes);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "NoteDelayTotal",
+                         checkpoint->note_delay_total);
+    g_key_file_set_int64(key_file, CHECKPOINT_GROUP, "Mismatches",
+                         checkpoint->mismatch_count);
+
+    data = g_key_file_to_data(key_file, &len, NULL);
+    ret = g_file_set_contents(path, data, len, error);
+    if (!ret)
+        g_prefix_error(error, "While writing checkpoint %s: ", path);
+
+    g_free(data);
+    g_key_file_free(key_file);
+
+    return ret;
+}
+
+static gboolean get_int64(GKeyFile *key_file,
+                          const gchar *key,
+                          gint64 *value,
+                          GError **error) {
+    GError *local_error = NULL;
+
+    *value = g_key_file_get_int64(key_file, CHECKPOINT_GROUP, key,
+                                  &local_error);
+    if (local_error) {
+        g_propagate_error(error, local_error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean ps2emu_checkpoint_load(PS2EmuCheckpoint *checkpoint,
+                                const gchar *path,
+                                GError **error) {
+    GKeyFile *key_file = g_key_file_new();
+    gchar *port = NULL;
+    gint64 main_lines,
+           position,
+           notes,
+           mismatches;
+    gboolean ret = FALSE;
+
+    if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, error))
+        goto out;
+
+    port = g_key_file_get_string(key_file, CHECKPOINT_GROUP, "Port", error);
+    if (!port)
+        goto out;
+
+    if (g_str_equal(port, "K")) {
+        checkpoint->port = PS2_PORT_KBD;
+    } else if (g_str_equal(port, "A")) {
+        checkpoint->port = PS2_PORT_AUX;
+    } else {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Invalid port type \"%s\"", port);
+        goto out;
+    }
+
+    if (!get_int64(key_file, "MainLines", &main_lines, error) ||
+        !get_int64(key_file, "Position", &position, error) ||
+        !get_int64(key_file, "Elapsed", &checkpoint->elapsed, error) ||
+        !get_int64(key_file, "Offset", &checkpoint->offset, error) ||
+        !get_int64(key_file, "LastEventTime", &checkpoint->last_event_time,
+                   error) ||
+        !get_int64(key_file, "Notes", &notes, error) ||
+        !get_int64(key_file, "NoteDelayTotal", &checkpoint->note_delay_total,
+                   error) ||
+        !get_int64(key_file, "Mismatches", &mismatches, error))
+        goto out;
+
+    if (main_lines < 0 || position < 0 || notes < 0 || mismatches < 0) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Negative counts");
+        goto out;
+    }
+
+    checkpoint->main_lines = main_lines;
+    checkpoint->position = position;
+    checkpoint->notes = notes;
+    checkpoint->mismatch_count = mismatches;
+
+    ret = TRUE;
+
+out:
+    if (!ret)
+        g_prefix_error(error, "While loading checkpoint %s: ", path);
+
+    g_free(port);
+    g_key_file_free(key_file);
+
+    return ret;
+}
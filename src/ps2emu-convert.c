@@ -0,0 +1,470 @@
+/*
+ * ps2emu-convert.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+typedef enum {
+    CONVERT_OK,
+    CONVERT_SKIPPED,
+    CONVERT_LOW_CONFIDENCE,
+    CONVERT_FAILED
+} ConvertStatus;
+
+typedef struct {
+    gchar *input;
+    gchar *output;
+
+    ConvertStatus status;
+    gchar *message;
+} ConvertJob;
+
+typedef struct {
+    PS2Event event;
+    gchar *rest;
+} BufferedEvent;
+
+typedef struct {
+    FILE *output;
+    GString *header;
+    PS2Port port;
+    gboolean port_known;
+
+    /* Everything we've read before finding the end of initialization */
+    GArray *buffer;
+    InitEndDetector detector;
+    gint candidate;
+    gint last_candidate;
+
+    gboolean in_main;
+    gboolean main_started;
+    time_t main_start_time;
+} Converter;
+
+static gboolean force = FALSE;
+
+static void buffered_event_clear(BufferedEvent *buffered) {
+    g_free(buffered->rest);
+}
+
+/* Parse a V0 event line, which looks like this:
+ *
+ *     5528124    A S f4 # (parameter)
+ *
+ * rest is set to the data and comment, which we carry over unchanged */
+static gboolean parse_v0_event(const gchar *line,
+                               PS2Event *event,
+                               const gchar **rest) {
+    gchar origin,
+          direction;
+    gchar *end;
+
+    event->time = strtol(line, &end, 10);
+    if (end == line)
+        return FALSE;
+
+    line = end + strspn(end, " \t");
+    origin = *line++;
+    if (!g_ascii_isspace(*line))
+        return FALSE;
+
+    line += strspn(line, " \t");
+    direction = *line++;
+    if (!g_ascii_isspace(*line))
+        return FALSE;
+
+    *rest = line + strspn(line, " \t");
+
+    if (origin == 'K')
+        event->origin = PS2_PORT_KBD;
+    else if (origin == 'A')
+        event->origin = PS2_PORT_AUX;
+    else
+        return FALSE;
+
+    if (direction == 'S')
+        event->type = PS2_EVENT_TYPE_PARAMETER;
+    else if (direction == 'R')
+        event->type = PS2_EVENT_TYPE_INTERRUPT;
+    else
+        return FALSE;
+
+    event->data = strtoul(*rest, &end, 16);
+    if (end == *rest)
+        return FALSE;
+
+    event->original_line = NULL;
+
+    return TRUE;
+}
+
+static inline void write_event(FILE *output,
+                               const PS2Event *event,
+                               time_t time,
+                               const gchar *rest) {
+    fprintf(output, "E: %-10ld %c %s", time,
+            event->type == PS2_EVENT_TYPE_INTERRUPT ? 'R' : 'S', rest);
+}
+
+/* Write out everything we've buffered, with the initialization sequence
+ * ending at the event at index init_end */
+static void flush_buffer(Converter *converter,
+                         gint init_end) {
+    GArray *buffer = converter->buffer;
+    time_t init_start_time = 0;
+
+    fprintf(converter->output,
+            "# ps2emu-record V%d\n"
+            "%s"
+            "T: %c\n"
+            "S: Init\n",
+            PS2EMU_LOG_VERSION, converter->header->str,
+            converter->port == PS2_PORT_KBD ? 'K' : 'A');
+
+    if (buffer->len)
+        init_start_time = g_array_index(buffer, BufferedEvent, 0).event.time;
+
+    for (guint i = 0; i < buffer->len; i++) {
+        BufferedEvent *buffered = &g_array_index(buffer, BufferedEvent, i);
+
+        if ((gint)i == init_end + 1) {
+            fprintf(converter->output, "S: Main\n");
+            converter->main_start_time = buffered->event.time;
+            converter->main_started = TRUE;
+        }
+
+        write_event(converter->output, &buffered->event,
+                    buffered->event.time - ((gint)i <= init_end ?
+                                            init_start_time :
+                                            converter->main_start_time),
+                    buffered->rest);
+    }
+
+    if (init_end + 1 >= (gint)buffer->len)
+        fprintf(converter->output, "S: Main\n");
+
+    g_array_set_size(buffer, 0);
+    converter->in_main = TRUE;
+}
+
+static gboolean convert_event(Converter *converter,
+                              const PS2Event *event,
+                              const gchar *rest,
+                              GError **error) {
+    BufferedEvent buffered;
+
+    if (!converter->port_known) {
+        converter->port = event->origin;
+        converter->port_known = TRUE;
+    } else if (event->origin != converter->port) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Log contains events from both the KBD and AUX "
+                            "ports");
+        return FALSE;
+    }
+
+    if (converter->in_main)
+        goto write_main;
+
+    switch (init_end_detector_feed(&converter->detector, event)) {
+        case INIT_END_CONFIRMED:
+            flush_buffer(converter, converter->candidate);
+            goto write_main;
+        case INIT_END_REJECTED:
+            converter->candidate = -1;
+            break;
+        default:
+            break;
+    }
+
+    buffered = (BufferedEvent) {
+        .event = *event,
+        .rest = g_strdup(rest),
+    };
+    g_array_append_val(converter->buffer, buffered);
+
+    if (converter->detector.have_candidate && converter->candidate < 0) {
+        converter->candidate = converter->buffer->len - 1;
+        converter->last_candidate = converter->candidate;
+    }
+
+    return TRUE;
+
+write_main:
+    if (!converter->main_started) {
+        converter->main_start_time = event->time;
+        converter->main_started = TRUE;
+    }
+
+    write_event(converter->output, event,
+                event->time - converter->main_start_time, rest);
+    return TRUE;
+}
+
+static void convert(gpointer data,
+                    gpointer user_data) {
+    ConvertJob *job = data;
+    Converter converter = {
+        .header = g_string_new(NULL),
+        .buffer = g_array_new(FALSE, FALSE, sizeof(BufferedEvent)),
+        .candidate = -1,
+        .last_candidate = -1,
+    };
+    GIOChannel *input_channel;
+    GError *error = NULL;
+    gchar *line = NULL,
+          *tmp_path = g_strdup_printf("%s.tmp", job->output);
+    int log_version;
+    GIOStatus rc;
+
+    job->status = CONVERT_FAILED;
+    g_array_set_clear_func(converter.buffer,
+                           (GDestroyNotify)buffered_event_clear);
+
+    input_channel = g_io_channel_new_file(job->input, "r", &error);
+    if (!input_channel)
+        goto out;
+
+    log_version = log_parse_version(input_channel, &error);
+    if (log_version < 0)
+        goto out;
+
+    if (log_version > 0) {
+        job->status = CONVERT_SKIPPED;
+        job->message = g_strdup_printf("already a V%d log", log_version);
+        goto out;
+    }
+
+    converter.output = fopen(tmp_path, "w");
+    if (!converter.output) {
+        g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", tmp_path, strerror(errno));
+        goto out;
+    }
+
+    while ((rc = g_io_channel_read_line(input_channel, &line, NULL, NULL,
+                                        &error)) == G_IO_STATUS_NORMAL) {
+        PS2Event event;
+        const gchar *rest;
+
+        g_strchug(line);
+
+        if (line[0] == '#') {
+            if (!converter.port_known)
+                g_string_append(converter.header, line);
+        } else if (line[0] != '\0') {
+            if (!parse_v0_event(line, &event, &rest)) {
+                g_set_error(&error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Invalid event line '%s'", line);
+                goto out;
+            }
+
+            if (!convert_event(&converter, &event, rest, &error))
+                goto out;
+        }
+
+        g_clear_pointer(&line, g_free);
+    }
+    if (rc != G_IO_STATUS_EOF)
+        goto out;
+
+    if (!converter.in_main) {
+        if (converter.candidate >= 0) {
+            /* The log ended while the host was still quiet */
+            flush_buffer(&converter, converter.candidate);
+        } else if (converter.last_candidate >= 0) {
+            job->status = CONVERT_LOW_CONFIDENCE;
+            job->message = g_strdup(
+                "the host kept sending commands after every time it enabled "
+                "the device, used the last time");
+
+            if (!force)
+                goto out;
+
+            flush_buffer(&converter, converter.last_candidate);
+        } else {
+            job->status = CONVERT_LOW_CONFIDENCE;
+            job->message = g_strdup(
+                "couldn't find where initialization ends, put everything in "
+                "the main section");
+
+            if (!force)
+                goto out;
+
+            flush_buffer(&converter, -1);
+        }
+    }
+
+    if (fclose(converter.output) != 0) {
+        converter.output = NULL;
+        g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s", tmp_path, strerror(errno));
+        goto out;
+    }
+    converter.output = NULL;
+
+    if (rename(tmp_path, job->output) != 0) {
+        g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While renaming %s: %s", tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (job->status == CONVERT_FAILED)
+        job->status = CONVERT_OK;
+
+out:
+    if (error) {
+        job->status = CONVERT_FAILED;
+        job->message = g_strdup(error->message);
+        g_error_free(error);
+    }
+
+    if (converter.output) {
+        fclose(converter.output);
+        unlink(tmp_path);
+    }
+
+    if (input_channel)
+        g_io_channel_unref(input_channel);
+
+    g_free(line);
+    g_free(tmp_path);
+    g_string_free(converter.header, TRUE);
+    g_array_free(converter.buffer, TRUE);
+}
+
+static gchar *get_output_path(const gchar *input,
+                              const gchar *output_dir) {
+    gchar *basename,
+          *path;
+
+    if (output_dir) {
+        basename = g_path_get_basename(input);
+        path = g_build_filename(output_dir, basename, NULL);
+        g_free(basename);
+
+        return path;
+    }
+
+    if (g_str_has_suffix(input, ".log"))
+        return g_strdup_printf("%.*s-v1.log",
+                               (int)(strlen(input) - strlen(".log")), input);
+
+    return g_strdup_printf("%s.v1", input);
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<event_log>... - convert V0 PS/2 logs to V1");
+    GThreadPool *pool;
+    GError *error = NULL;
+    ConvertJob *jobs;
+    gchar *output_dir = NULL;
+    gint jobs_count = 0,
+         failures = 0;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "output-dir", 'o', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &output_dir, "Write converted logs into dir", "dir" },
+        { "jobs", 'j', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &jobs_count, "Convert n logs at once (default: number of CPUs)",
+          "n" },
+        { "force", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &force, "Write out conversions we're not confident in", NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Converts V0 logs to V1 logs, detecting where the initialization\n"
+        "sequence of the device ends.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (argc < 2)
+        exit_on_bad_argument(main_context, FALSE,
+                             "No filenames specified! Use --help for more "
+                             "information");
+
+    if (output_dir && g_mkdir_with_parents(output_dir, 0755) != 0) {
+        fprintf(stderr, "Error: While creating %s: %s\n", output_dir,
+                strerror(errno));
+        return 1;
+    }
+
+    if (jobs_count <= 0)
+        jobs_count = g_get_num_processors();
+
+    pool = g_thread_pool_new(convert, NULL, jobs_count, TRUE, &error);
+    if (!pool) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        return 1;
+    }
+
+    jobs = g_new0(ConvertJob, argc - 1);
+    for (int i = 1; i < argc; i++) {
+        ConvertJob *job = &jobs[i - 1];
+
+        job->input = argv[i];
+        job->output = get_output_path(argv[i], output_dir);
+
+        g_thread_pool_push(pool, job, NULL);
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for (int i = 0; i < argc - 1; i++) {
+        ConvertJob *job = &jobs[i];
+
+        switch (job->status) {
+            case CONVERT_OK:
+                printf("Converted %s -> %s\n", job->input, job->output);
+                break;
+            case CONVERT_SKIPPED:
+                printf("Skipped %s: %s\n", job->input, job->message);
+                break;
+            case CONVERT_LOW_CONFIDENCE:
+                fprintf(stderr, "%s %s: %s\n",
+                        force ? "Converted with low confidence" :
+                                "Not converting",
+                        job->input, job->message);
+                failures++;
+                break;
+            case CONVERT_FAILED:
+                fprintf(stderr, "Failed to convert %s: %s\n",
+                        job->input, job->message);
+                failures++;
+                break;
+        }
+    }
+
+    if (failures)
+        fprintf(stderr, "%d of %d logs could not be converted confidently\n",
+                failures, argc - 1);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,474 @@
+/*
+ * ps2emu-device-ready.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * Once the initialization sequence has been replayed, the kernel still has to
+ * finish probing the device: a driver gets bound to the serio port, it
+ * registers an input device, and it may send the device a few more commands.
+ * Interrupts sent before then get lost or confuse the driver.
+ *
+ * userio doesn't tell us which serio port it created, so we take a list of the
+ * ports before registering ours and look for the new one afterwards. If more
+ * than one shows up (another replay registered a port at the same time), we
+ * can't tell which one is ours and the caller has to fall back to waiting a
+ * fixed amount of time. Otherwise we watch the port in sysfs until it has an
+ * evdev node, waking up on kernel uevents when we can get them and polling
+ * otherwise, and then give the driver a moment to send anything else it wants
+ * to.
+ */
+
+#include "ps2emu-device-ready.h"
+#include "ps2emu.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <glib.h>
+
+/* How often to look at sysfs, in case we can't get uevents or they're for a
+ * different tree than the one we're watching */
+#define DEVICE_READY_POLL_INTERVAL (10 * 1000)
+
+/* Not every driver creates an input device (serio_raw doesn't, for one), so
+ * once a driver is bound and nothing shows up, give it as long as we always
+ * used to */
+#define DEVICE_READY_NO_INPUT_TIME (G_USEC_PER_SEC / 2)
+
+/* When timing a probe, how often to look at sysfs, and how long to wait for
+ * the uevent of an evdev node we've already seen in sysfs */
+#define DEVICE_READY_PROBE_POLL_INTERVAL 1000
+#define DEVICE_READY_UEVENT_GRACE        (10 * 1000)
+
+/* An add uevent for an evdev node, we don't know which port it's on until
+ * we've found ours */
+typedef struct {
+    gchar *devpath;
+    gint64 time;
+} EvdevUevent;
+
+struct _DeviceReady {
+    gchar *serio_dir;
+    GHashTable *ports_before;
+    gchar *port_path;
+    gint64 register_time;
+
+    /* -1 if we couldn't open it */
+    int uevent_fd;
+};
+
+static GHashTable *list_serio_ports(const gchar *serio_dir) {
+    GHashTable *ports;
+    GDir *dir;
+
+    dir = g_dir_open(serio_dir, 0, NULL);
+    if (!dir)
+        return NULL;
+
+    ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (const gchar *name = g_dir_read_name(dir);
+         name != NULL;
+         name = g_dir_read_name(dir)) {
+        if (g_str_has_prefix(name, "serio"))
+            g_hash_table_add(ports, g_strdup(name));
+    }
+
+    g_dir_close(dir);
+
+    return ports;
+}
+
+static int open_uevent_socket(void) {
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1,
+    };
+    int fd,
+        on = 1;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    /* So we know when each uevent was sent, not when we got around to it */
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+DeviceReady *device_ready_new(const gchar *sysfs_dir) {
+    DeviceReady *ready = g_new0(DeviceReady, 1);
+
+    ready->serio_dir = g_build_filename(sysfs_dir, "bus", "serio", "devices",
+                                        NULL);
+    ready->ports_before = list_serio_ports(ready->serio_dir);
+
+    /* Subscribe before the port is registered, so we can't miss anything */
+    ready->uevent_fd = ready->ports_before ? open_uevent_socket() : -1;
+
+    ready->register_time = g_get_monotonic_time();
+
+    return ready;
+}
+
+gint64 device_ready_get_register_time(DeviceReady *ready) {
+    return ready->register_time;
+}
+
+void device_ready_free(DeviceReady *ready) {
+    if (ready->uevent_fd >= 0)
+        close(ready->uevent_fd);
+
+    if (ready->ports_before)
+        g_hash_table_destroy(ready->ports_before);
+
+    g_free(ready->serio_dir);
+    g_free(ready->port_path);
+    g_free(ready);
+}
+
+/* Returns FALSE if there's more than one new port */
+static gboolean find_port(DeviceReady *ready) {
+    GHashTable *ports = list_serio_ports(ready->serio_dir);
+    GHashTableIter iter;
+    const gchar *name,
+                *new_name = NULL;
+    guint new_ports = 0;
+
+    if (!ports)
+        return FALSE;
+
+    g_hash_table_iter_init(&iter, ports);
+    while (g_hash_table_iter_next(&iter, (gpointer*)&name, NULL)) {
+        if (g_hash_table_contains(ready->ports_before, name))
+            continue;
+
+        new_name = name;
+        new_ports++;
+    }
+
+    if (new_ports == 1)
+        ready->port_path = g_build_filename(ready->serio_dir, new_name, NULL);
+
+    g_hash_table_destroy(ports);
+
+    return new_ports <= 1;
+}
+
+static gboolean port_has_driver(const gchar *port_path) {
+    gchar *path = g_build_filename(port_path, "driver", NULL);
+    gboolean ret = g_file_test(path, G_FILE_TEST_EXISTS);
+
+    g_free(path);
+
+    return ret;
+}
+
+/* Looks for <port>/input/input<n>/event<n> */
+static gboolean port_has_evdev(const gchar *port_path) {
+    gchar *input_dir_path = g_build_filename(port_path, "input", NULL);
+    gboolean ret = FALSE;
+    GDir *input_dir;
+
+    input_dir = g_dir_open(input_dir_path, 0, NULL);
+    g_free(input_dir_path);
+    if (!input_dir)
+        return FALSE;
+
+    for (const gchar *name = g_dir_read_name(input_dir);
+         name != NULL && !ret;
+         name = g_dir_read_name(input_dir)) {
+        gchar *device_dir_path;
+        GDir *device_dir;
+
+        if (!g_str_has_prefix(name, "input"))
+            continue;
+
+        device_dir_path = g_build_filename(port_path, "input", name, NULL);
+        device_dir = g_dir_open(device_dir_path, 0, NULL);
+        g_free(device_dir_path);
+        if (!device_dir)
+            continue;
+
+        for (const gchar *child = g_dir_read_name(device_dir);
+             child != NULL && !ret;
+             child = g_dir_read_name(device_dir)) {
+            ret = g_str_has_prefix(child, "event");
+        }
+
+        g_dir_close(device_dir);
+    }
+
+    g_dir_close(input_dir);
+
+    return ret;
+}
+
+static void drain_uevents(int fd) {
+    gchar buf[4096];
+
+    /* We only use uevents to wake up, sysfs tells us what changed */
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+}
+
+DeviceReadyResult device_ready_wait(DeviceReady *ready,
+                                    int device_fd,
+                                    gint64 find_timeout) {
+    const gint64 start_time = g_get_monotonic_time();
+    gint64 bound_time = -1,
+           evdev_time = -1;
+
+    if (!ready->ports_before)
+        return DEVICE_READY_UNKNOWN;
+
+    while (TRUE) {
+        struct pollfd fds[] = {
+            { .fd = device_fd, .events = POLLIN },
+            { .fd = ready->uevent_fd, .events = POLLIN },
+        };
+        gint64 now = g_get_monotonic_time(),
+               deadline,
+               timeout;
+
+        if (!ready->port_path && !find_port(ready))
+            return DEVICE_READY_UNKNOWN;
+
+        if (ready->port_path) {
+            if (bound_time < 0 && port_has_driver(ready->port_path))
+                bound_time = now;
+            if (bound_time >= 0 && evdev_time < 0 &&
+                port_has_evdev(ready->port_path))
+                evdev_time = now;
+
+            if (evdev_time >= 0)
+                deadline = evdev_time + DEVICE_READY_QUIET_TIME;
+            else if (bound_time >= 0)
+                deadline = bound_time + DEVICE_READY_NO_INPUT_TIME;
+            else
+                deadline = G_MAXINT64;
+
+            if (now >= deadline)
+                return DEVICE_READY;
+
+            deadline = MIN(deadline, start_time + DEVICE_READY_TIMEOUT);
+            if (now >= deadline)
+                return DEVICE_READY_TIMEOUT_EXPIRED;
+        } else {
+            deadline = start_time + find_timeout;
+            if (now >= deadline)
+                return DEVICE_READY_UNKNOWN;
+        }
+
+        timeout = MIN(deadline - now, DEVICE_READY_POLL_INTERVAL);
+        if (poll(fds, ready->uevent_fd >= 0 ? 2 : 1,
+                 (timeout + 999) / 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return DEVICE_READY_UNKNOWN;
+        }
+
+        if (fds[0].revents & POLLIN)
+            return DEVICE_READY_HOST_BUSY;
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            return DEVICE_READY_UNKNOWN;
+
+        if (ready->uevent_fd >= 0 && fds[1].revents & POLLIN)
+            drain_uevents(ready->uevent_fd);
+    }
+}
+
+/* Returns the length of the uevent, or 0 if there aren't any left. time is
+ * when the kernel sent it, on the monotonic clock */
+static gssize read_uevent(int fd,
+                          gchar *buf,
+                          gsize len,
+                          gint64 *time) {
+    union {
+        struct cmsghdr header;
+        gchar buf[CMSG_SPACE(sizeof(struct timespec))];
+    } control;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = len - 1,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = &control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    gssize ret;
+
+    ret = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (ret <= 0)
+        return 0;
+
+    buf[ret] = '\0';
+    *time = g_get_monotonic_time();
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        const struct timespec *ts;
+
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+
+        /* The timestamp is on the realtime clock */
+        ts = (const struct timespec*)CMSG_DATA(cmsg);
+        *time -= g_get_real_time() -
+                 ((gint64)ts->tv_sec * G_USEC_PER_SEC + ts->tv_nsec / 1000);
+    }
+
+    return ret;
+}
+
+/* Kernel uevents start with "<action>@<devpath>" */
+static void collect_evdev_uevents(DeviceReady *ready,
+                                  GArray *uevents) {
+    gchar buf[8192];
+    gint64 time;
+
+    while (read_uevent(ready->uevent_fd, buf, sizeof(buf), &time)) {
+        const gchar *devpath,
+                    *name;
+        EvdevUevent uevent;
+
+        if (!g_str_has_prefix(buf, "add@"))
+            continue;
+
+        devpath = buf + strlen("add@");
+        name = strrchr(devpath, '/');
+        if (!name || !g_str_has_prefix(name, "/event") ||
+            !strstr(devpath, "/input/"))
+            continue;
+
+        uevent = (EvdevUevent) {
+            .devpath = g_strdup(devpath),
+            .time = time,
+        };
+        g_array_append_val(uevents, uevent);
+    }
+}
+
+static void evdev_uevent_clear(EvdevUevent *uevent) {
+    g_free(uevent->devpath);
+}
+
+gboolean device_ready_wait_for_evdev(DeviceReady *ready,
+                                     gint64 timeout,
+                                     gint64 *time,
+                                     GError **error) {
+    const gint64 deadline = g_get_monotonic_time() + timeout;
+    GArray *uevents = g_array_new(FALSE, FALSE, sizeof(EvdevUevent));
+    gchar *pattern = NULL;
+    gint64 sysfs_time = -1;
+    gboolean ret = FALSE;
+
+    g_array_set_clear_func(uevents, (GDestroyNotify)evdev_uevent_clear);
+
+    if (!ready->ports_before) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                    "Can't look for the serio port of the device in %s",
+                    ready->serio_dir);
+        goto out;
+    }
+
+    while (TRUE) {
+        struct pollfd fd = {
+            .fd = ready->uevent_fd,
+            .events = POLLIN,
+        };
+        gint64 now = g_get_monotonic_time();
+
+        if (ready->uevent_fd >= 0)
+            collect_evdev_uevents(ready, uevents);
+
+        if (!ready->port_path && !find_port(ready)) {
+            g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                                "Can't tell which serio port is the device's, "
+                                "another one was registered at the same "
+                                "time");
+            goto out;
+        }
+
+        if (ready->port_path) {
+            if (!pattern) {
+                gchar *name = g_path_get_basename(ready->port_path);
+
+                pattern = g_strdup_printf("/%s/input/", name);
+                g_free(name);
+            }
+
+            for (guint i = 0; i < uevents->len; i++) {
+                EvdevUevent *uevent = &g_array_index(uevents, EvdevUevent, i);
+
+                if (strstr(uevent->devpath, pattern)) {
+                    *time = uevent->time;
+                    ret = TRUE;
+                    goto out;
+                }
+            }
+
+            if (sysfs_time < 0 && port_has_evdev(ready->port_path))
+                sysfs_time = now;
+
+            /* The uevent comes right after the node shows up in sysfs, so
+             * give it a moment before settling for when we saw the node */
+            if (sysfs_time >= 0 &&
+                (ready->uevent_fd < 0 ||
+                 now >= sysfs_time + DEVICE_READY_UEVENT_GRACE)) {
+                *time = sysfs_time;
+                ret = TRUE;
+                goto out;
+            }
+        }
+
+        if (now >= deadline) {
+            g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                                ready->port_path ?
+                                "The device never got an evdev node" :
+                                "The serio port of the device never showed "
+                                "up");
+            goto out;
+        }
+
+        if (poll(&fd, ready->uevent_fd >= 0 ? 1 : 0,
+                 MAX(DEVICE_READY_PROBE_POLL_INTERVAL / 1000, 1)) < 0 &&
+            errno != EINTR) {
+            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                        "While waiting for the device: %s",
+                        g_strerror(errno));
+            goto out;
+        }
+    }
+
+out:
+    g_array_free(uevents, TRUE);
+    g_free(pattern);
+
+    return ret;
+}
@@ -0,0 +1,66 @@
+/*
+ * ps2emu-device-ready.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_DEVICE_READY_H__
+#define __PS2EMU_DEVICE_READY_H__
+
+#include <glib.h>
+
+/* How long the host has to leave the device alone once its input device shows
+ * up, before we consider the driver done with it */
+#define DEVICE_READY_QUIET_TIME (100 * 1000)
+
+/* Don't wait for longer than this for the driver, once we know which serio
+ * port is ours */
+#define DEVICE_READY_TIMEOUT (5 * G_USEC_PER_SEC)
+
+typedef enum {
+    /* The driver created an input device, and stopped talking to us */
+    DEVICE_READY,
+    /* The host sent something, so it's waiting on the main section */
+    DEVICE_READY_HOST_BUSY,
+    /* We found our serio port, but the driver never finished with it */
+    DEVICE_READY_TIMEOUT_EXPIRED,
+    /* We couldn't tell which serio port is ours */
+    DEVICE_READY_UNKNOWN
+} DeviceReadyResult;
+
+typedef struct _DeviceReady DeviceReady;
+
+/* Remembers which serio ports exist under sysfs_dir, so the one userio creates
+ * for us can be found later. Call right before registering the port */
+DeviceReady *device_ready_new(const gchar *sysfs_dir);
+
+/* Waits until the driver bound to our serio port is ready for events, while
+ * watching device_fd for anything from the host. If the port doesn't show up
+ * within find_timeout, gives up and returns DEVICE_READY_UNKNOWN */
+DeviceReadyResult device_ready_wait(DeviceReady *ready,
+                                    int device_fd,
+                                    gint64 find_timeout);
+
+/* When we were about to register the port */
+gint64 device_ready_get_register_time(DeviceReady *ready);
+
+/* Waits for up to timeout for the evdev node of our serio port to show up,
+ * and returns when it was created. That's when its uevent was received if we
+ * got one, otherwise when we first saw it in sysfs */
+gboolean device_ready_wait_for_evdev(DeviceReady *ready,
+                                     gint64 timeout,
+                                     gint64 *time,
+                                     GError **error);
+
+void device_ready_free(DeviceReady *ready);
+
+#endif /* !__PS2EMU_DEVICE_READY_H__ */
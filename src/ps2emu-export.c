@@ -0,0 +1,531 @@
+/*
+ * ps2emu-export.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-packed-log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+/* How many rows we buffer for each column before writing them out. This is
+ * the only thing that grows with the size of the input, so it bounds the
+ * memory we use no matter how large the corpus is */
+#define EXPORT_BATCH_ROWS 65536
+
+typedef enum {
+    COLUMN_LOG,
+    COLUMN_SECTION,
+    COLUMN_TIME,
+    COLUMN_DIRECTION,
+    COLUMN_DATA,
+    COLUMN_PACKET,
+    COLUMN_PACKET_BYTE,
+    /* Only written with --decode */
+    COLUMN_DECODED,
+    COLUMN_BUTTONS,
+    COLUMN_DX,
+    COLUMN_DY,
+    COLUMN_WHEEL,
+    COLUMN_COUNT
+} ExportColumnId;
+
+#define COLUMN_FIRST_DECODED COLUMN_DECODED
+
+/* Besides PS2_CMD_ENABLE, the commands that change whether a mouse reports */
+#define PS2_CMD_DISABLE      0xf5
+#define PS2_CMD_SET_DEFAULTS 0xf6
+#define PS2_CMD_RESET        0xff
+
+typedef struct {
+    const gchar *name;
+    const gchar *type;
+    gsize width;
+
+    FILE *file;
+    guint8 *buffer;
+    guint count;
+} ExportColumn;
+
+typedef struct {
+    ExportColumn columns[COLUMN_COUNT];
+    guint column_count;
+
+    guint64 rows;
+    guint32 packets;
+
+    /* The packet we're in the middle of reading. We hold onto it until it's
+     * complete, so that we can decode it before writing out any of its rows */
+    PS2Event packet[PS2_MAX_PACKET_LEN];
+    guint packet_len;
+    LogSectionType packet_section;
+    guint32 log_id;
+
+    /* Whether the device acknowledged the host enabling data reporting, so
+     * what it sends on its own are packets */
+    gboolean reporting;
+    /* The last byte from the host, and whether the device has yet to answer
+     * it */
+    guchar host_byte;
+    gboolean answer_due;
+} Exporter;
+
+static const ExportColumn column_templates[COLUMN_COUNT] = {
+    [COLUMN_LOG]         = { "log",         "uint32", 4 },
+    [COLUMN_SECTION]     = { "section",     "uint8",  1 },
+    [COLUMN_TIME]        = { "time",        "int64",  8 },
+    [COLUMN_DIRECTION]   = { "direction",   "uint8",  1 },
+    [COLUMN_DATA]        = { "data",        "uint8",  1 },
+    [COLUMN_PACKET]      = { "packet",      "uint32", 4 },
+    [COLUMN_PACKET_BYTE] = { "packet_byte", "uint8",  1 },
+    [COLUMN_DECODED]     = { "decoded",     "uint8",  1 },
+    [COLUMN_BUTTONS]     = { "buttons",     "uint8",  1 },
+    [COLUMN_DX]          = { "dx",          "int16",  2 },
+    [COLUMN_DY]          = { "dy",          "int16",  2 },
+    [COLUMN_WHEEL]       = { "wheel",       "int8",   1 },
+};
+
+static gboolean flush_column(ExportColumn *column,
+                             GError **error) {
+    if (!column->count)
+        return TRUE;
+
+    if (fwrite(column->buffer, column->width, column->count, column->file) !=
+        column->count) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing column %s: %s", column->name,
+                    strerror(errno));
+        return FALSE;
+    }
+
+    column->count = 0;
+    return TRUE;
+}
+
+static inline void append_value(ExportColumn *column,
+                                const void *value) {
+    memcpy(&column->buffer[column->count * column->width], value,
+           column->width);
+    column->count++;
+}
+
+static gboolean exporter_open(Exporter *exporter,
+                              const gchar *output_dir,
+                              gboolean decode,
+                              GError **error) {
+    if (g_mkdir_with_parents(output_dir, 0755) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating %s: %s", output_dir, strerror(errno));
+        return FALSE;
+    }
+
+    exporter->column_count = decode ? COLUMN_COUNT : COLUMN_FIRST_DECODED;
+
+    for (guint i = 0; i < exporter->column_count; i++) {
+        ExportColumn *column = &exporter->columns[i];
+        gchar *file_name,
+              *path;
+
+        *column = column_templates[i];
+
+        file_name = g_strdup_printf("%s.%s", column->name, column->type);
+        path = g_build_filename(output_dir, file_name, NULL);
+        g_free(file_name);
+
+        column->file = fopen(path, "w");
+        if (!column->file) {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While opening %s: %s", path, strerror(errno));
+            g_free(path);
+            return FALSE;
+        }
+        g_free(path);
+
+        column->buffer = g_malloc(column->width * EXPORT_BATCH_ROWS);
+    }
+
+    return TRUE;
+}
+
+/* Works out whether packet is data the device reported, rather than something
+ * from the host or the device answering it. Only the first packet from the
+ * device after the host sends something counts as the answer */
+static gboolean track_reporting(Exporter *exporter,
+                                const PS2Event *packet,
+                                guint len) {
+    if (packet[0].type != PS2_EVENT_TYPE_INTERRUPT) {
+        exporter->host_byte = packet[len - 1].data;
+        exporter->answer_due = TRUE;
+        return FALSE;
+    }
+
+    if (!exporter->answer_due)
+        return exporter->reporting;
+
+    exporter->answer_due = FALSE;
+    if (packet[0].data == PS2_RET_ACK) {
+        switch (exporter->host_byte) {
+            case PS2_CMD_ENABLE:
+                exporter->reporting = TRUE;
+                break;
+            case PS2_CMD_DISABLE:
+            case PS2_CMD_SET_DEFAULTS:
+            case PS2_CMD_RESET:
+                exporter->reporting = FALSE;
+                break;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Decode standard PS/2 mouse packets (and their IntelliMouse extension), the
+ * only packet format every PS/2 pointing device speaks */
+static gboolean decode_mouse_packet(const PS2Event *packet,
+                                    guint len,
+                                    guint8 *buttons,
+                                    gint16 *dx,
+                                    gint16 *dy,
+                                    gint8 *wheel) {
+    guint8 flags = packet[0].data;
+
+    if (packet[0].type != PS2_EVENT_TYPE_INTERRUPT ||
+        (len != 3 && len != 4) || !(flags & 0x08))
+        return FALSE;
+
+    *buttons = flags & 0x07;
+    *dx = packet[1].data - ((flags << 4) & 0x100);
+    *dy = packet[2].data - ((flags << 3) & 0x100);
+    *wheel = len == 4 ? (gint8)packet[3].data : 0;
+
+    return TRUE;
+}
+
+static gboolean flush_packet(Exporter *exporter,
+                             GError **error) {
+    ExportColumn *columns = exporter->columns;
+    guint8 section = exporter->packet_section,
+           decoded = FALSE,
+           buttons = 0;
+    gint16 dx = 0,
+           dy = 0;
+    gint8 wheel = 0;
+
+    if (!exporter->packet_len)
+        return TRUE;
+
+    if (exporter->column_count > COLUMN_FIRST_DECODED &&
+        track_reporting(exporter, exporter->packet, exporter->packet_len))
+        decoded = decode_mouse_packet(exporter->packet, exporter->packet_len,
+                                      &buttons, &dx, &dy, &wheel);
+
+    for (guint8 i = 0; i < exporter->packet_len; i++) {
+        PS2Event *event = &exporter->packet[i];
+        gint64 time = event->time;
+        guint8 direction = event->type == PS2_EVENT_TYPE_INTERRUPT;
+
+        append_value(&columns[COLUMN_LOG], &exporter->log_id);
+        append_value(&columns[COLUMN_SECTION], &section);
+        append_value(&columns[COLUMN_TIME], &time);
+        append_value(&columns[COLUMN_DIRECTION], &direction);
+        append_value(&columns[COLUMN_DATA], &event->data);
+        append_value(&columns[COLUMN_PACKET], &exporter->packets);
+        append_value(&columns[COLUMN_PACKET_BYTE], &i);
+
+        /* Decoded fields only go on the first byte of the packet */
+        if (exporter->column_count > COLUMN_FIRST_DECODED) {
+            guint8 first = decoded && i == 0;
+            guint8 zero8 = 0;
+            gint16 zero16 = 0;
+
+            append_value(&columns[COLUMN_DECODED], &first);
+            append_value(&columns[COLUMN_BUTTONS], first ? &buttons : &zero8);
+            append_value(&columns[COLUMN_DX], first ? &dx : &zero16);
+            append_value(&columns[COLUMN_DY], first ? &dy : &zero16);
+            append_value(&columns[COLUMN_WHEEL],
+                         first ? (guint8*)&wheel : &zero8);
+        }
+
+        if (columns[0].count == EXPORT_BATCH_ROWS) {
+            for (guint c = 0; c < exporter->column_count; c++) {
+                if (!flush_column(&columns[c], error))
+                    return FALSE;
+            }
+        }
+    }
+
+    exporter->rows += exporter->packet_len;
+    exporter->packets++;
+    exporter->packet_len = 0;
+
+    return TRUE;
+}
+
+static gboolean export_event(Exporter *exporter,
+                             LogSectionType section,
+                             const PS2Event *event,
+                             GError **error) {
+    if (exporter->packet_len &&
+        (section != exporter->packet_section ||
+         !ps2_event_continues_packet(
+             &exporter->packet[exporter->packet_len - 1],
+             exporter->packet_len, event))) {
+        if (!flush_packet(exporter, error))
+            return FALSE;
+    }
+
+    exporter->packet_section = section;
+    exporter->packet[exporter->packet_len++] = *event;
+
+    return TRUE;
+}
+
+static gboolean export_text_log(Exporter *exporter,
+                                const gchar *path,
+                                GError **error) {
+    GIOChannel *input_channel;
+    GString *line = g_string_sized_new(128);
+    LogSectionType section = SECTION_TYPE_MAIN;
+    int log_version;
+    GIOStatus rc;
+    gboolean ret = FALSE;
+
+    input_channel = g_io_channel_new_file(path, "r", error);
+    if (!input_channel) {
+        g_prefix_error(error, "While opening %s: ", path);
+        goto out;
+    }
+    /* Skip UTF-8 validation, logs are plain ASCII */
+    if (g_io_channel_set_encoding(input_channel, NULL, error) !=
+        G_IO_STATUS_NORMAL)
+        goto out;
+
+    log_version = log_parse_version(input_channel, error);
+    if (log_version < 0)
+        goto out;
+
+    while ((rc = g_io_channel_read_line_string(input_channel, line, NULL,
+                                               error)) == G_IO_STATUS_NORMAL) {
+        gchar *msg_start = line->str;
+        LogLineType line_type;
+        PS2Event *event;
+        gboolean exported;
+
+        g_strchug(line->str);
+        if (line->str[0] == '#' || line->str[0] == '\0')
+            continue;
+
+        if (log_version < 1)
+            line_type = LINE_TYPE_EVENT;
+        else
+            line_type = log_get_line_type(line->str, &msg_start, error);
+
+        switch (line_type) {
+            case LINE_TYPE_EVENT:
+                event = ps2_event_from_line(msg_start, log_version, error);
+                if (!event) {
+                    if (*error)
+                        goto out;
+
+                    continue;
+                }
+
+                exported = export_event(exporter, section, event, error);
+                ps2_event_free(event);
+                if (!exported)
+                    goto out;
+                break;
+            case LINE_TYPE_SECTION:
+                section = log_get_section_type_from_line(msg_start, error);
+                if (section == SECTION_TYPE_ERROR)
+                    goto out;
+                break;
+            case LINE_TYPE_INVALID:
+                goto out;
+            default:
+                break;
+        }
+    }
+    if (rc != G_IO_STATUS_EOF)
+        goto out;
+
+    ret = flush_packet(exporter, error);
+
+out:
+    if (input_channel)
+        g_io_channel_unref(input_channel);
+    g_string_free(line, TRUE);
+
+    return ret;
+}
+
+static gboolean export_section(Exporter *exporter,
+                               LogSectionType section,
+                               GList *lines,
+                               GError **error) {
+    for (GList *l = lines; l != NULL; l = l->next) {
+        LogLine *log_line = l->data;
+
+        if (log_line->type != LINE_TYPE_EVENT)
+            continue;
+
+        if (!export_event(exporter, section, log_line->ps2_event, error))
+            return FALSE;
+    }
+
+    return flush_packet(exporter, error);
+}
+
+static gboolean export_packed_log(Exporter *exporter,
+                                  const gchar *path,
+                                  GError **error) {
+    ParsedLog *log;
+    int log_version;
+    gboolean ret;
+
+    log = packed_log_load(path, &log_version, error);
+    if (!log)
+        return FALSE;
+
+    ret = export_section(exporter, SECTION_TYPE_INIT, log->init_section,
+                         error) &&
+          export_section(exporter, SECTION_TYPE_MAIN, log->main_section,
+                         error);
+
+    log_free(log);
+
+    return ret;
+}
+
+static gboolean exporter_close(Exporter *exporter,
+                               const gchar *output_dir,
+                               gchar **paths,
+                               GError **error) {
+    GString *schema = g_string_new(NULL);
+    gchar *schema_path;
+    gboolean ret = TRUE;
+
+    for (guint i = 0; i < exporter->column_count; i++) {
+        ExportColumn *column = &exporter->columns[i];
+
+        if (ret && !flush_column(column, error))
+            ret = FALSE;
+
+        if (fclose(column->file) != 0 && ret) {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While closing column %s: %s", column->name,
+                        strerror(errno));
+            ret = FALSE;
+        }
+        g_free(column->buffer);
+    }
+    if (!ret)
+        goto out;
+
+    g_string_append_printf(schema,
+                           "# ps2emu-export columns, %s endian\n"
+                           "rows %" G_GUINT64_FORMAT "\n",
+                           G_BYTE_ORDER == G_LITTLE_ENDIAN ? "little" : "big",
+                           exporter->rows);
+    for (guint i = 0; i < exporter->column_count; i++) {
+        g_string_append_printf(schema, "column %s %s\n",
+                               exporter->columns[i].name,
+                               exporter->columns[i].type);
+    }
+    for (guint i = 0; paths[i] != NULL; i++)
+        g_string_append_printf(schema, "log %u %s\n", i, paths[i]);
+
+    schema_path = g_build_filename(output_dir, "schema.txt", NULL);
+    ret = g_file_set_contents(schema_path, schema->str, schema->len, error);
+    g_free(schema_path);
+
+out:
+    g_string_free(schema, TRUE);
+
+    return ret;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<log>... - export PS/2 logs as columns");
+    Exporter *exporter = g_new0(Exporter, 1);
+    GError *error = NULL;
+    gchar *output_dir = NULL;
+    gboolean decode = FALSE;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "output", 'o', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &output_dir, "Write the columns into directory dir", "dir" },
+        { "decode", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &decode, "Also export decoded fields of standard mouse packets",
+          NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Exports one or more logs into a directory of fixed-width binary\n"
+        "columns, one file per column, for loading into analysis tools.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (!output_dir)
+        exit_on_bad_argument(main_context, TRUE,
+                             "No output directory specified!");
+
+    if (argc < 2)
+        exit_on_bad_argument(main_context, FALSE,
+                             "No filenames specified! Use --help for more "
+                             "information");
+
+    if (!exporter_open(exporter, output_dir, decode, &error))
+        goto error;
+
+    for (int i = 1; i < argc; i++) {
+        gboolean rc;
+
+        exporter->log_id = i - 1;
+        exporter->reporting = FALSE;
+        exporter->answer_due = FALSE;
+
+        if (packed_log_file_test(argv[i]))
+            rc = export_packed_log(exporter, argv[i], &error);
+        else
+            rc = export_text_log(exporter, argv[i], &error);
+
+        if (!rc) {
+            g_prefix_error(&error, "While exporting %s: ", argv[i]);
+            goto error;
+        }
+    }
+
+    if (!exporter_close(exporter, output_dir, &argv[1], &error))
+        goto error;
+
+    return 0;
+
+error:
+    fprintf(stderr, "Error: %s\n", error->message);
+
+    return 1;
+}
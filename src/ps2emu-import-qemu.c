@@ -0,0 +1,792 @@
+/*
+ * ps2emu-import-qemu.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+#define IMPORT_IO_BUFFER_SIZE (1 << 20)
+
+/* What a trace event tells us. Bytes from the devices are taken off their
+ * queue by ps2_read_data() when the controller raises its interrupt, but the
+ * value only shows up once the guest reads the data port */
+typedef enum {
+    TRACE_EVENT_OTHER,
+    /* A byte was taken off the queue of the device at opaque */
+    TRACE_EVENT_FETCH,
+    /* The guest read a byte from the data port */
+    TRACE_EVENT_READ,
+    /* The host sent a byte to the device */
+    TRACE_EVENT_WRITE,
+    /* Anything else that tells us which device is at opaque */
+    TRACE_EVENT_DEVICE
+} TraceEventKind;
+
+typedef struct {
+    const gchar *name;
+    TraceEventKind kind;
+    PS2Port port;
+} TraceEventInfo;
+
+static const TraceEventInfo trace_events[] = {
+    { "ps2_read_data",                TRACE_EVENT_FETCH },
+    { "pckbd_kbd_read_data",          TRACE_EVENT_READ },
+    { "ps2_write_keyboard",           TRACE_EVENT_WRITE,  PS2_PORT_KBD },
+    { "ps2_write_mouse",              TRACE_EVENT_WRITE,  PS2_PORT_AUX },
+    { "ps2_put_keycode",              TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_keyboard_event",           TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_set_ledstate",             TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_reset_keyboard",           TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_keyboard_set_translation", TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_kbd_reset",                TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_kbd_init",                 TRACE_EVENT_DEVICE, PS2_PORT_KBD },
+    { "ps2_mouse_send_packet",        TRACE_EVENT_DEVICE, PS2_PORT_AUX },
+    { "ps2_mouse_fake_event",         TRACE_EVENT_DEVICE, PS2_PORT_AUX },
+    { "ps2_mouse_reset",              TRACE_EVENT_DEVICE, PS2_PORT_AUX },
+    { "ps2_mouse_init",               TRACE_EVENT_DEVICE, PS2_PORT_AUX },
+};
+
+/* One line of the trace, pointing into the line buffer */
+typedef struct {
+    const gchar *name;
+    gsize name_len;
+    /* Everything after the name (and the pid, for simpletrace) */
+    const gchar *args;
+} TraceRecord;
+
+typedef struct {
+    FILE *output;
+    const gchar *input_name;
+    PS2Port port;
+
+    /* Where the simpletrace timestamps are up to, they're deltas from the
+     * record before */
+    guint64 simple_time;
+    guint64 last_time;
+
+    /* The device each pointer belongs to, 0 until we've seen it */
+    guint64 kbd_opaque;
+    guint64 aux_opaque;
+
+    /* The last byte taken off a device queue, until the guest reads it */
+    gboolean fetch_pending;
+    guint64 fetch_opaque;
+    guint64 fetch_time;
+
+    /* Everything we've read before finding the end of initialization */
+    GArray *buffer;
+    InitEndDetector detector;
+    gint candidate;
+    gint last_candidate;
+
+    gboolean in_main;
+    gboolean main_started;
+    time_t main_start_time;
+
+    guint64 lines;
+    guint64 events;
+    guint64 other_port_bytes;
+    guint64 unknown_bytes;
+    guint64 lost_bytes;
+} Importer;
+
+/* Hands out whole lines from big blocks of the input, getline() is a lot
+ * slower on traces with millions of lines */
+typedef struct {
+    FILE *input;
+    gchar *buffer;
+    gsize size;
+    gsize start;
+    gsize end;
+    gboolean eof;
+} LineReader;
+
+static PS2Port import_target = PS2_PORT_AUX;
+static gboolean force = FALSE;
+
+static const TraceEventInfo *lookup_trace_event(const TraceRecord *record) {
+    /* Most of a trace with everything enabled isn't PS/2 at all */
+    if (strncmp(record->name, "ps2_", 4) != 0 &&
+        strncmp(record->name, "pckbd_", 6) != 0)
+        return NULL;
+
+    for (guint i = 0; i < G_N_ELEMENTS(trace_events); i++) {
+        if (strncmp(trace_events[i].name, record->name,
+                    record->name_len) == 0 &&
+            trace_events[i].name[record->name_len] == '\0')
+            return &trace_events[i];
+    }
+
+    return NULL;
+}
+
+/* Arguments are "opaque=0x5581 val=0xf4" in simpletrace's text output, and
+ * whatever the event's format string makes of them with the log backend,
+ * which for the events we care about is "0x5581 val 244". Either way, the
+ * device is the first one and the value the last one */
+static gboolean parse_arg_value(const gchar *arg,
+                                const gchar *end,
+                                guint64 *value) {
+    const gchar *equals = memchr(arg, '=', end - arg);
+    gchar *parsed_end;
+
+    if (equals)
+        arg = equals + 1;
+
+    errno = 0;
+    *value = strtoull(arg, &parsed_end, 0);
+
+    return parsed_end == end && parsed_end != arg && errno == 0;
+}
+
+static gboolean get_first_arg(const TraceRecord *record,
+                              guint64 *value) {
+    const gchar *arg = record->args + strspn(record->args, " "),
+                *end = arg + strcspn(arg, " \n");
+
+    return parse_arg_value(arg, end, value);
+}
+
+static gboolean get_last_arg(const TraceRecord *record,
+                             guint64 *value) {
+    const gchar *end = record->args + strlen(record->args),
+                *arg;
+
+    while (end > record->args && g_ascii_isspace(end[-1]))
+        end--;
+
+    arg = end;
+    while (arg > record->args && arg[-1] != ' ')
+        arg--;
+
+    return parse_arg_value(arg, end, value);
+}
+
+static inline const gchar *skip_digits(const gchar *str) {
+    while (g_ascii_isdigit(*str))
+        str++;
+
+    return str;
+}
+
+static inline const gchar *parse_digits(const gchar *str,
+                                        guint64 *value) {
+    *value = 0;
+    while (g_ascii_isdigit(*str))
+        *value = *value * 10 + (*str++ - '0');
+
+    return str;
+}
+
+/* Lines from the log backend look like this, the timestamp is only there if
+ * QEMU was started with -msg timestamp=on:
+ *
+ *     4120@1700000000.123456:ps2_write_mouse 0x55d5c0e8 val 244
+ *
+ * and lines from simpletrace.py like this, with the time in microseconds
+ * since the record before:
+ *
+ *     ps2_write_mouse 12.345 pid=4120 opaque=0x55d5c0e8 val=0xf4
+ *
+ * Returns FALSE for lines that aren't trace records, and fails if a record
+ * has no timestamp */
+static gboolean parse_record(Importer *importer,
+                             const gchar *line,
+                             TraceRecord *record,
+                             guint64 *time,
+                             GError **error) {
+    const gchar *pos;
+
+    if (g_ascii_isdigit(line[0])) {
+        guint64 secs,
+                usecs;
+
+        pos = skip_digits(line);
+        if (*pos != '@')
+            return FALSE;
+
+        pos = parse_digits(pos + 1, &secs);
+        if (*pos != '.')
+            return FALSE;
+
+        pos = parse_digits(pos + 1, &usecs);
+        if (*pos != ':')
+            return FALSE;
+
+        *time = (secs * G_USEC_PER_SEC + usecs) * 1000;
+
+        record->name = pos + 1;
+        record->name_len = strcspn(record->name, " \n");
+        record->args = record->name + record->name_len;
+
+        return TRUE;
+    }
+
+    if (!g_ascii_isalpha(line[0]) && line[0] != '_')
+        return FALSE;
+
+    record->name = line;
+    record->name_len = strcspn(line, " \n");
+    pos = line + record->name_len;
+
+    if (*pos == ' ' && g_ascii_isdigit(pos[1])) {
+        const gchar *delta_end = skip_digits(pos + 1);
+        guint64 delta;
+
+        if (*delta_end == '.' && strncmp(skip_digits(delta_end + 1),
+                                         " pid=", 5) == 0) {
+            const gchar *frac = delta_end + 1;
+
+            /* Nanoseconds, from microseconds with three decimals */
+            parse_digits(pos + 1, &delta);
+            delta *= 1000;
+            for (guint i = 0, scale = 100; i < 3 && g_ascii_isdigit(frac[i]);
+                 i++, scale /= 10)
+                delta += (frac[i] - '0') * scale;
+
+            importer->simple_time += delta;
+            *time = importer->simple_time;
+
+            pos = strchr(delta_end, '=');
+            record->args = pos + strcspn(pos, " \n");
+
+            return TRUE;
+        }
+    }
+
+    /* The log backend without timestamps */
+    record->args = pos;
+    if (lookup_trace_event(record)) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "The trace has no timestamps, start QEMU with "
+                            "-msg timestamp=on");
+        return FALSE;
+    }
+
+    return FALSE;
+}
+
+static gchar *line_reader_next(LineReader *reader,
+                               const gchar *input_name,
+                               GError **error) {
+    for (;;) {
+        gchar *line = reader->buffer + reader->start,
+              *newline = memchr(line, '\n', reader->end - reader->start);
+        gsize len,
+              read;
+
+        if (newline) {
+            *newline = '\0';
+            reader->start = newline + 1 - reader->buffer;
+
+            return line;
+        }
+
+        if (reader->eof) {
+            if (reader->start == reader->end)
+                return NULL;
+
+            /* The last line doesn't end with a newline */
+            reader->buffer[reader->end] = '\0';
+            reader->start = reader->end;
+
+            return line;
+        }
+
+        /* Keep the start of the next line, and fill up the rest */
+        len = reader->end - reader->start;
+        memmove(reader->buffer, line, len);
+        reader->start = 0;
+        reader->end = len;
+
+        if (reader->end == reader->size - 1) {
+            reader->size *= 2;
+            reader->buffer = g_realloc(reader->buffer, reader->size);
+        }
+
+        read = fread(reader->buffer + reader->end, 1,
+                     reader->size - 1 - reader->end, reader->input);
+        reader->end += read;
+
+        if (read == 0) {
+            if (ferror(reader->input)) {
+                g_set_error(error, G_FILE_ERROR,
+                            g_file_error_from_errno(errno),
+                            "While reading %s: %s", input_name,
+                            strerror(errno));
+                return NULL;
+            }
+
+            reader->eof = TRUE;
+        }
+    }
+}
+
+/* The same as "E: %-10ld %c %.2hhx\n", which is most of the time spent on a
+ * big trace when done with fprintf() */
+static inline void write_event(FILE *output,
+                               const PS2Event *event,
+                               time_t time) {
+    static const gchar hex[] = "0123456789abcdef";
+    gchar line[64],
+          digits[24];
+    guint len = 0,
+          digits_len = 0;
+
+    line[len++] = 'E';
+    line[len++] = ':';
+    line[len++] = ' ';
+
+    if (time < 0) {
+        line[len++] = '-';
+        time = -time;
+    }
+
+    do {
+        digits[digits_len++] = '0' + time % 10;
+        time /= 10;
+    } while (time);
+
+    while (digits_len)
+        line[len++] = digits[--digits_len];
+
+    while (len < 3 + 10)
+        line[len++] = ' ';
+
+    line[len++] = ' ';
+    line[len++] = event->type == PS2_EVENT_TYPE_INTERRUPT ? 'R' : 'S';
+    line[len++] = ' ';
+    line[len++] = hex[event->data >> 4];
+    line[len++] = hex[event->data & 0xf];
+    line[len++] = '\n';
+
+    fwrite(line, 1, len, output);
+}
+
+/* Write out everything we've buffered, with the initialization sequence
+ * ending at the event at index init_end */
+static void flush_buffer(Importer *importer,
+                         gint init_end) {
+    GArray *buffer = importer->buffer;
+    time_t init_start_time = 0;
+
+    fprintf(importer->output,
+            "# ps2emu-record V%d\n"
+            "# Imported from the QEMU trace %s by ps2emu-import-qemu\n"
+            "#\n"
+            "T: %c\n"
+            "S: Init\n",
+            PS2EMU_LOG_VERSION, importer->input_name,
+            importer->port == PS2_PORT_KBD ? 'K' : 'A');
+
+    if (buffer->len)
+        init_start_time = g_array_index(buffer, PS2Event, 0).time;
+
+    for (guint i = 0; i < buffer->len; i++) {
+        PS2Event *event = &g_array_index(buffer, PS2Event, i);
+
+        if ((gint)i == init_end + 1) {
+            fprintf(importer->output, "S: Main\n");
+            importer->main_start_time = event->time;
+            importer->main_started = TRUE;
+        }
+
+        write_event(importer->output, event,
+                    event->time - ((gint)i <= init_end ?
+                                   init_start_time :
+                                   importer->main_start_time));
+    }
+
+    if (init_end + 1 >= (gint)buffer->len)
+        fprintf(importer->output, "S: Main\n");
+
+    g_array_set_size(buffer, 0);
+    importer->in_main = TRUE;
+}
+
+static void import_event(Importer *importer,
+                         PS2EventType type,
+                         guchar data,
+                         guint64 time) {
+    PS2Event event = {
+        .type = type,
+        .data = data,
+        .origin = importer->port,
+    };
+
+    /* The log backend's timestamps are from the wall clock */
+    time = MAX(time, importer->last_time);
+    importer->last_time = time;
+    event.time = time / 1000;
+
+    importer->events++;
+
+    if (importer->in_main)
+        goto write_main;
+
+    switch (init_end_detector_feed(&importer->detector, &event)) {
+        case INIT_END_CONFIRMED:
+            flush_buffer(importer, importer->candidate);
+            goto write_main;
+        case INIT_END_REJECTED:
+            importer->candidate = -1;
+            break;
+        default:
+            break;
+    }
+
+    g_array_append_val(importer->buffer, event);
+
+    if (importer->detector.have_candidate && importer->candidate < 0) {
+        importer->candidate = importer->buffer->len - 1;
+        importer->last_candidate = importer->candidate;
+    }
+
+    return;
+
+write_main:
+    if (!importer->main_started) {
+        importer->main_start_time = event.time;
+        importer->main_started = TRUE;
+    }
+
+    write_event(importer->output, &event,
+                event.time - importer->main_start_time);
+}
+
+static void learn_device(Importer *importer,
+                         PS2Port port,
+                         guint64 opaque) {
+    if (port == PS2_PORT_KBD)
+        importer->kbd_opaque = opaque;
+    else
+        importer->aux_opaque = opaque;
+}
+
+static gboolean import_record(Importer *importer,
+                              const TraceRecord *record,
+                              guint64 time,
+                              GError **error) {
+    const TraceEventInfo *info = lookup_trace_event(record);
+    guint64 opaque,
+            value;
+
+    if (!info)
+        return TRUE;
+
+    switch (info->kind) {
+        case TRACE_EVENT_FETCH:
+            if (!get_first_arg(record, &opaque))
+                goto invalid;
+
+            /* The guest never read the byte before this one */
+            if (importer->fetch_pending)
+                importer->lost_bytes++;
+
+            importer->fetch_pending = TRUE;
+            importer->fetch_opaque = opaque;
+            importer->fetch_time = time;
+            break;
+        case TRACE_EVENT_READ:
+            if (!get_last_arg(record, &value))
+                goto invalid;
+
+            /* Anything else is the controller answering its own commands, or
+             * the guest reading the same byte again */
+            if (!importer->fetch_pending)
+                break;
+            importer->fetch_pending = FALSE;
+
+            if (importer->fetch_opaque == 0 ||
+                (importer->fetch_opaque != importer->kbd_opaque &&
+                 importer->fetch_opaque != importer->aux_opaque)) {
+                importer->unknown_bytes++;
+            } else if (importer->fetch_opaque != (importer->port ==
+                                                  PS2_PORT_KBD ?
+                                                  importer->kbd_opaque :
+                                                  importer->aux_opaque)) {
+                importer->other_port_bytes++;
+            } else {
+                import_event(importer, PS2_EVENT_TYPE_INTERRUPT, value,
+                             importer->fetch_time);
+            }
+            break;
+        case TRACE_EVENT_WRITE:
+            if (!get_first_arg(record, &opaque) ||
+                !get_last_arg(record, &value))
+                goto invalid;
+
+            learn_device(importer, info->port, opaque);
+
+            if (info->port == importer->port)
+                import_event(importer, PS2_EVENT_TYPE_PARAMETER, value, time);
+            else
+                importer->other_port_bytes++;
+            break;
+        case TRACE_EVENT_DEVICE:
+            if (!get_first_arg(record, &opaque))
+                goto invalid;
+
+            learn_device(importer, info->port, opaque);
+            break;
+        case TRACE_EVENT_OTHER:
+            break;
+    }
+
+    return TRUE;
+
+invalid:
+    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                "Invalid arguments for %s on line %" G_GUINT64_FORMAT ": %s",
+                info->name, importer->lines, record->args);
+    return FALSE;
+}
+
+static gboolean import_trace(Importer *importer,
+                             FILE *input,
+                             GError **error) {
+    LineReader reader = {
+        .input = input,
+        .buffer = g_malloc(IMPORT_IO_BUFFER_SIZE),
+        .size = IMPORT_IO_BUFFER_SIZE,
+    };
+    gchar *line;
+    gboolean ret = FALSE;
+
+    while ((line = line_reader_next(&reader, importer->input_name, error))) {
+        TraceRecord record;
+        guint64 time;
+
+        importer->lines++;
+
+        if (!parse_record(importer, line, &record, &time, error)) {
+            if (*error)
+                goto out;
+
+            continue;
+        }
+
+        if (!import_record(importer, &record, time, error))
+            goto out;
+    }
+
+    if (*error)
+        goto out;
+
+    if (!importer->events) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_NO_EVENTS,
+                    "No PS/2 traffic on the %s port in %s, the trace needs "
+                    "the ps2_* and pckbd_* events",
+                    importer->port == PS2_PORT_KBD ? "KBD" : "AUX",
+                    importer->input_name);
+        goto out;
+    }
+
+    if (!importer->in_main) {
+        if (importer->candidate >= 0) {
+            /* The trace ended while the host was still quiet */
+            flush_buffer(importer, importer->candidate);
+        } else if (importer->last_candidate >= 0) {
+            if (!force) {
+                g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                    "The host kept sending commands after "
+                                    "every time it enabled the device, use "
+                                    "--force to end initialization at the "
+                                    "last time");
+                goto out;
+            }
+
+            flush_buffer(importer, importer->last_candidate);
+        } else {
+            if (!force) {
+                g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                    "Couldn't find where initialization "
+                                    "ends, use --force to put everything in "
+                                    "the main section");
+                goto out;
+            }
+
+            flush_buffer(importer, -1);
+        }
+    }
+
+    ret = TRUE;
+
+out:
+    g_free(reader.buffer);
+
+    return ret;
+}
+
+static gboolean process_target_arg(const gchar *option_name,
+                                   const gchar *value,
+                                   gpointer data,
+                                   GError **error) {
+    if (strcasecmp(value, "KBD") == 0)
+        import_target = PS2_PORT_KBD;
+    else if (strcasecmp(value, "AUX") == 0)
+        import_target = PS2_PORT_AUX;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<trace> - convert QEMU PS/2 traces to V1 logs");
+    GError *error = NULL;
+    Importer importer = {
+        .buffer = g_array_new(FALSE, FALSE, sizeof(PS2Event)),
+        .candidate = -1,
+        .last_candidate = -1,
+    };
+    FILE *input = NULL;
+    gchar *output_path = NULL,
+          *tmp_path = NULL;
+    gint ret = 1;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "target", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK,
+          process_target_arg, "The PS/2 port to import (default aux)",
+          "<kbd|aux>" },
+        { "output", 'o', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &output_path, "Write the log to file instead of stdout", "file" },
+        { "force", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &force, "Write out the log even if we aren't sure where "
+          "initialization ends", NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Converts the ps2_* and pckbd_* trace events of QEMU's emulated PS/2\n"
+        "controller into a V1 log, from the log backend with\n"
+        "-msg timestamp=on, or the output of simpletrace.py. Use - to read\n"
+        "the trace from stdin.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (argc != 2)
+        exit_on_bad_argument(main_context, FALSE,
+                             "Exactly one trace needs to be specified! Use "
+                             "--help for more information");
+
+    importer.port = import_target;
+
+    if (strcmp(argv[1], "-") == 0) {
+        input = stdin;
+        importer.input_name = "<stdin>";
+    } else {
+        input = fopen(argv[1], "r");
+        if (!input) {
+            g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While opening %s: %s", argv[1], strerror(errno));
+            goto out;
+        }
+        importer.input_name = argv[1];
+    }
+
+    if (output_path) {
+        tmp_path = g_strdup_printf("%s.tmp", output_path);
+        importer.output = fopen(tmp_path, "w");
+        if (!importer.output) {
+            g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While opening %s: %s", tmp_path, strerror(errno));
+            goto out;
+        }
+    } else {
+        importer.output = stdout;
+    }
+    setvbuf(importer.output, NULL, _IOFBF, IMPORT_IO_BUFFER_SIZE);
+
+    if (!import_trace(&importer, input, &error))
+        goto out;
+
+    if (fflush(importer.output) != 0 ||
+        (output_path && fclose(importer.output) != 0)) {
+        if (output_path)
+            importer.output = NULL;
+
+        g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s",
+                    output_path ? tmp_path : "<stdout>", strerror(errno));
+        goto out;
+    }
+
+    if (output_path) {
+        importer.output = NULL;
+
+        if (rename(tmp_path, output_path) != 0) {
+            g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While renaming %s: %s", tmp_path, strerror(errno));
+            goto out;
+        }
+    }
+
+    fprintf(stderr, "Imported %" G_GUINT64_FORMAT " events from %"
+            G_GUINT64_FORMAT " lines\n", importer.events, importer.lines);
+
+    if (importer.other_port_bytes) {
+        fprintf(stderr, "Left out %" G_GUINT64_FORMAT " bytes to or from the "
+                "%s port\n", importer.other_port_bytes,
+                importer.port == PS2_PORT_KBD ? "AUX" : "KBD");
+    }
+
+    if (importer.unknown_bytes) {
+        fprintf(stderr, "Warning: %" G_GUINT64_FORMAT " bytes came from a "
+                "device that never showed up in any other trace event, and "
+                "were left out\n", importer.unknown_bytes);
+    }
+
+    if (importer.lost_bytes) {
+        fprintf(stderr, "Warning: the guest never read %" G_GUINT64_FORMAT
+                " bytes, or the trace is missing pckbd_kbd_read_data\n",
+                importer.lost_bytes);
+    }
+
+    ret = 0;
+
+out:
+    if (error) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    if (input && input != stdin)
+        fclose(input);
+
+    if (output_path && importer.output) {
+        fclose(importer.output);
+        unlink(tmp_path);
+    }
+
+    g_free(tmp_path);
+    g_array_free(importer.buffer, TRUE);
+
+    return ret;
+}
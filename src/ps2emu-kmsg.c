@@ -0,0 +1,156 @@
+/*
+ * ps2emu-kmsg.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-kmsg.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+static gboolean parse_normal_event(const gchar *start_pos,
+                                   PS2Event *event,
+                                   GError **error) {
+    gchar *type_str = NULL;
+    gchar **type_str_args = NULL;
+    int type_str_argc,
+        parsed_count,
+        port;
+
+    errno = 0;
+    parsed_count = sscanf(start_pos,
+                          "[%*d] %hhx %*1[-<]%*1[->] i8042 (%m[^)])\n",
+                          &event->data, &type_str);
+
+    if (errno != 0 || parsed_count != 2)
+        return FALSE;
+
+    type_str_args = g_strsplit(type_str, ",", 0);
+
+    if (strcmp(type_str_args[0], "interrupt") == 0) {
+        event->type = PS2_EVENT_TYPE_INTERRUPT;
+
+        type_str_argc = g_strv_length(type_str_args);
+        if (type_str_argc < 3) {
+            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                        "Got interrupt event, but had less arguments then "
+                        "expected");
+            goto error;
+        }
+
+        errno = 0;
+        port = strtol(type_str_args[1], NULL, 10);
+        if (errno != 0) {
+            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                        "Failed to parse port number from interrupt event: "
+                        "%s\n",
+                        strerror(errno));
+            goto error;
+        }
+
+        event->origin = port;
+    }
+    else if (strcmp(type_str, "command") == 0)
+        event->type = PS2_EVENT_TYPE_COMMAND;
+    else if (strcmp(type_str, "parameter") == 0)
+        event->type = PS2_EVENT_TYPE_PARAMETER;
+    else if (strcmp(type_str, "return") == 0)
+        event->type = PS2_EVENT_TYPE_RETURN;
+    else if (strcmp(type_str, "kbd-data") == 0)
+        event->type = PS2_EVENT_TYPE_KBD_DATA;
+
+    event->original_line = start_pos;
+
+    g_free(type_str);
+    g_strfreev(type_str_args);
+
+    return TRUE;
+
+error:
+    g_free(type_str);
+    g_strfreev(type_str_args);
+
+    return FALSE;
+}
+
+static gboolean parse_record_start_marker(const gchar *start_pos,
+                                          gint64 *start_time) {
+    gint parsed_count;
+
+    errno = 0;
+    parsed_count = sscanf(start_pos,
+                          "Start recording %ld\n",
+                          start_time);
+
+    if (errno != 0 || parsed_count != 1)
+        return FALSE;
+
+    return TRUE;
+}
+
+gboolean kmsg_parse_line(const gchar *line,
+                         KmsgMessage *msg,
+                         GError **error) {
+    static const gchar *search_strings[] = { "i8042: ", "ps2emu: " };
+    const gchar *start_pos = NULL;
+    gint parsed_count;
+    int index;
+
+    for (index = 0; index < G_N_ELEMENTS(search_strings); index++) {
+        start_pos = strstr(line, search_strings[index]);
+        if (start_pos)
+            break;
+    }
+    if (!start_pos)
+        return FALSE;
+
+    /* Move the start position after the initial 'i8042: ' */
+    start_pos += strlen(search_strings[index]);
+    msg->type = g_quark_from_static_string(search_strings[index]);
+
+    if (msg->type == I8042_OUTPUT) {
+        if (!parse_normal_event(start_pos, &msg->event, error))
+            return FALSE;
+    } else {
+        if (!parse_record_start_marker(start_pos, &msg->start_time))
+            return FALSE;
+    }
+
+    /* Parse the time value at the beginning of the message */
+    errno = 0;
+    parsed_count = sscanf(line, "%*d,%*d,%ld", &msg->dmesg_time);
+    if (parsed_count != 1 || errno != 0) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Invalid/no time value received: %s", strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean kmsg_parse_seq(const gchar *line,
+                        guint64 *seq) {
+    const gchar *start_pos = strchr(line, ',');
+    gchar *end_pos;
+
+    if (!start_pos)
+        return FALSE;
+
+    *seq = g_ascii_strtoull(start_pos + 1, &end_pos, 10);
+
+    return end_pos != start_pos + 1 && *end_pos == ',';
+}
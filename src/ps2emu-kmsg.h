@@ -0,0 +1,52 @@
+/*
+ * ps2emu-kmsg.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_KMSG_H__
+#define __PS2EMU_KMSG_H__
+
+#include <glib.h>
+
+#include "ps2emu.h"
+
+#define I8042_OUTPUT  (g_quark_from_static_string("i8042: "))
+#define PS2EMU_OUTPUT (g_quark_from_static_string("ps2emu: "))
+
+/* A message from i8042's debugging output, or the marker ps2emu-record leaves
+ * in the kernel log when it starts recording */
+typedef struct {
+    GQuark type;
+
+    time_t dmesg_time;
+
+    union {
+        PS2Event event;
+        gint64 start_time;
+    };
+} KmsgMessage;
+
+/* Parses a record from /dev/kmsg. Returns FALSE for records that aren't from
+ * i8042 or ps2emu, and sets error if one of those is malformed. The event's
+ * original_line points into line, so it has to outlive msg */
+gboolean kmsg_parse_line(const gchar *line,
+                         KmsgMessage *msg,
+                         GError **error);
+
+/* Gets the sequence number of any record from /dev/kmsg. The kernel numbers
+ * every record, so a gap in them means records were overwritten before we
+ * read them */
+gboolean kmsg_parse_seq(const gchar *line,
+                        guint64 *seq);
+
+#endif /* !__PS2EMU_KMSG_H__ */
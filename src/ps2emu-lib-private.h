@@ -0,0 +1,241 @@
+/*
+ * ps2emu-lib-private.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_LIB_PRIVATE_H__
+#define __PS2EMU_LIB_PRIVATE_H__
+
+#include <glib.h>
+
+#include "ps2emu.h"
+#include "ps2emu-log.h"
+#include "ps2emu-log-image.h"
+
+/* Only symbols starting with ps2emu_ are exported from libps2emu, so nothing
+ * in here should use that prefix */
+
+struct _PS2EmuLog {
+    gint       ref_count;
+    gint       version;
+
+    /* Exactly one of these is set, depending on whether the log was parsed or
+     * mapped from a log image */
+    ParsedLog *parsed_log;
+    LogImage  *image;
+};
+
+PS2EmuLog *log_handle_new(ParsedLog *parsed_log,
+                          gint log_version);
+
+/* Walks through the lines of one section of a log, whichever way it was
+ * loaded. Events from images are built in event, so the event returned is
+ * only valid until the next call */
+typedef struct {
+    GList *list;
+
+    const LogImage *image;
+    const LogImageLine *image_line;
+    const LogImageLine *image_end;
+    PS2Event event;
+} LogCursor;
+
+void log_handle_cursor_init(PS2EmuLog *log,
+                            PS2EmuSection section,
+                            LogCursor *cursor);
+
+/* Returns FALSE at the end of the section. For notes, event is NULL */
+static inline gboolean log_cursor_next(LogCursor *cursor,
+                                       const PS2Event **event,
+                                       const gchar **note) {
+    const LogImageLine *image_line;
+    LogLine *log_line;
+
+    if (!cursor->image) {
+        if (!cursor->list)
+            return FALSE;
+
+        log_line = cursor->list->data;
+        cursor->list = cursor->list->next;
+
+        if (log_line->type == LINE_TYPE_NOTE) {
+            *event = NULL;
+            *note = log_line->note;
+        } else {
+            *event = log_line->ps2_event;
+            *note = NULL;
+        }
+
+        return TRUE;
+    }
+
+    if (cursor->image_line == cursor->image_end)
+        return FALSE;
+
+    image_line = cursor->image_line++;
+    if (image_line->note) {
+        *event = NULL;
+        *note = log_image_get_string(cursor->image, image_line->note);
+        return TRUE;
+    }
+
+    cursor->event = (PS2Event) {
+        .time = image_line->time,
+        .type = image_line->type,
+        .data = image_line->data,
+        .origin = image_line->origin,
+    };
+    *event = &cursor->event;
+    *note = NULL;
+
+    return TRUE;
+}
+
+typedef enum {
+    TRACE_EVENT_INTERRUPT,
+    TRACE_EVENT_HOST_BYTE,
+    TRACE_EVENT_MISMATCH,
+    TRACE_EVENT_NOTE,
+    TRACE_EVENT_SECTION_START,
+    TRACE_EVENT_SECTION_END,
+    TRACE_EVENT_SLEEP,
+    TRACE_EVENT_FLUSH
+} TraceEventType;
+
+/* Kept small and flat, so that adding one is just a copy into the buffer */
+typedef struct {
+    gint64 time;
+    /* How long we slept for, how late an interrupt was sent, how long after
+     * the kernel logged an event we got to it or how many bytes we flushed */
+    gint64 value;
+    const gchar *note;
+    TraceEventType type;
+    PS2EmuSection section;
+    guchar data;
+    guchar expected;
+} TraceEvent;
+
+struct _PS2EmuTrace {
+    gchar *process_name;
+    TraceEvent *events;
+    gsize len;
+    gsize max_events;
+    guint64 dropped;
+
+    /* Notes are copied in here, so the trace can outlive the log they came
+     * from */
+    GStringChunk *notes;
+
+    /* Set when a recorder is using the trace, rather than a replay */
+    gboolean recording;
+};
+
+static inline void trace_add(PS2EmuTrace *trace,
+                             const TraceEvent *event) {
+    if (G_UNLIKELY(trace->len == trace->max_events)) {
+        trace->dropped++;
+        return;
+    }
+
+    trace->events[trace->len++] = *event;
+}
+
+/* Upper bounds of the histogram buckets in microseconds, there's also an
+ * implicit +Inf bucket at the end */
+#define METRICS_HISTOGRAM_BOUNDS \
+    { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000 }
+#define METRICS_HISTOGRAM_BUCKETS 11
+
+typedef struct {
+    /* Not cumulative, that's worked out when they're printed */
+    guint64 buckets[METRICS_HISTOGRAM_BUCKETS];
+    guint64 sum;
+} MetricsHistogram;
+
+struct _PS2EmuMetrics {
+    /* Set once a replay or recorder is using the metrics */
+    gboolean replaying;
+    gboolean recording;
+
+    guint64 interrupts_sent;
+    guint64 bytes_received;
+    guint64 mismatches;
+    guint64 notes;
+    /* Sleeps to wait for an interrupt in the main section */
+    guint64 wakeups;
+    /* How late each interrupt was sent */
+    MetricsHistogram interrupt_lateness;
+
+    guint64 kmsg_records;
+    /* Records the kernel overwrote before we got to read them */
+    guint64 kmsg_lost_records;
+    guint64 events_recorded;
+    guint64 events_filtered;
+    guint64 output_bytes;
+    /* How long after the kernel logged an event we read it */
+    MetricsHistogram kmsg_lag;
+
+    /* Each counted by the thread on one end of a queue, the difference is
+     * what's waiting in it */
+    guint64 kmsg_records_parsed;
+    guint64 output_lines;
+    guint64 output_lines_written;
+    /* The most that was ever waiting in each queue */
+    guint64 kmsg_queue_max;
+    guint64 output_queue_max;
+    /* How long writing out each batch of the recording took */
+    MetricsHistogram output_stall;
+};
+
+/* There's only ever one writer, so there's no need for a locked add */
+static inline void metrics_add(guint64 *counter,
+                               guint64 value) {
+    guint64 current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+    __atomic_store_n(counter, current + value, __ATOMIC_RELAXED);
+}
+
+static inline guint64 metrics_get(const guint64 *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_max(guint64 *gauge,
+                               guint64 value) {
+    if (value > metrics_get(gauge))
+        __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_observe(MetricsHistogram *histogram,
+                                   gint64 usec) {
+    static const gint64 bounds[] = METRICS_HISTOGRAM_BOUNDS;
+    guint bucket = 0;
+
+    if (usec < 0)
+        usec = 0;
+
+    while (bucket < G_N_ELEMENTS(bounds) && usec > bounds[bucket])
+        bucket++;
+
+    metrics_add(&histogram->buckets[bucket], 1);
+    metrics_add(&histogram->sum, usec);
+}
+
+extern PS2EmuPhaseFunc lib_phase_func;
+extern gpointer lib_phase_data;
+
+static inline void lib_phase(const gchar *phase) {
+    if (G_UNLIKELY(lib_phase_func))
+        lib_phase_func(phase, lib_phase_data);
+}
+
+#endif /* !__PS2EMU_LIB_PRIVATE_H__ */
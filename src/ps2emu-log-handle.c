@@ -0,0 +1,264 @@
+/*
+ * ps2emu-log-handle.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu.h"
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-packed-log.h"
+#include "ps2emu-log-image.h"
+#include "ps2emu-lib-private.h"
+
+#include <glib.h>
+
+PS2EmuLog *log_handle_new(ParsedLog *parsed_log,
+                          gint log_version) {
+    PS2EmuLog *log = g_new0(PS2EmuLog, 1);
+
+    log->ref_count = 1;
+    log->parsed_log = parsed_log;
+    log->version = log_version;
+
+    return log;
+}
+
+static PS2EmuLog *log_handle_new_from_image(LogImage *image,
+                                            GError **error) {
+    PS2EmuLog *log;
+
+    if (image->header->log_version > PS2EMU_LOG_VERSION) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Log version is too new (found %d, we only support up to "
+                    "%d)", image->header->log_version, PS2EMU_LOG_VERSION);
+        log_image_free(image);
+        return NULL;
+    }
+
+    log = g_new0(PS2EmuLog, 1);
+    log->ref_count = 1;
+    log->image = image;
+    log->version = image->header->log_version;
+
+    return log;
+}
+
+PS2EmuLog *ps2emu_log_load_from_channel(GIOChannel *input_channel,
+                                        GError **error) {
+    ParsedLog *parsed_log;
+    gint log_version;
+
+    lib_phase("parse version");
+    log_version = log_parse_version(input_channel, error);
+    if (log_version < 0)
+        return NULL;
+
+    if (log_version > PS2EMU_LOG_VERSION) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Log version is too new (found %d, we only support up to "
+                    "%d)", log_version, PS2EMU_LOG_VERSION);
+        return NULL;
+    }
+
+    lib_phase("parse log");
+    parsed_log = log_parse(input_channel, log_version, error);
+    if (!parsed_log)
+        return NULL;
+
+    return log_handle_new(parsed_log, log_version);
+}
+
+PS2EmuLog *ps2emu_log_load(const gchar *path,
+                           GError **error) {
+    GIOChannel *input_channel;
+    ParsedLog *parsed_log;
+    LogImage *image;
+    PS2EmuLog *log;
+    gint log_version;
+
+    lib_phase("open log");
+
+    if (log_image_file_test(path)) {
+        lib_phase("map log image");
+        image = log_image_load(path, error);
+        if (!image)
+            return NULL;
+
+        return log_handle_new_from_image(image, error);
+    }
+
+    if (packed_log_file_test(path)) {
+        lib_phase("load packed log");
+        parsed_log = packed_log_load(path, &log_version, error);
+        if (!parsed_log)
+            return NULL;
+
+        return log_handle_new(parsed_log, log_version);
+    }
+
+    input_channel = g_io_channel_new_file(path, "r", error);
+    if (!input_channel) {
+        g_prefix_error(error, "While opening %s: ", path);
+        return NULL;
+    }
+
+    log = ps2emu_log_load_from_channel(input_channel, error);
+    g_io_channel_unref(input_channel);
+
+    return log;
+}
+
+PS2EmuLog *ps2emu_log_ref(PS2EmuLog *log) {
+    g_atomic_int_inc(&log->ref_count);
+
+    return log;
+}
+
+void ps2emu_log_unref(PS2EmuLog *log) {
+    if (!g_atomic_int_dec_and_test(&log->ref_count))
+        return;
+
+    if (log->image)
+        log_image_free(log->image);
+    else
+        log_free(log->parsed_log);
+
+    g_free(log);
+}
+
+gint ps2emu_log_get_version(PS2EmuLog *log) {
+    return log->version;
+}
+
+PS2Port ps2emu_log_get_port(PS2EmuLog *log) {
+    if (log->image)
+        return log->image->header->port;
+
+    return log->parsed_log->port;
+}
+
+const gchar *ps2emu_log_get_device_name(PS2EmuLog *log) {
+    if (log->image)
+        return log_image_get_string(log->image,
+                                    log->image->header->device_name);
+
+    return log->parsed_log->device_name;
+}
+
+const gchar *ps2emu_log_get_header(PS2EmuLog *log) {
+    if (log->image)
+        return log_image_get_string(log->image, log->image->header->header);
+
+    return log->parsed_log->header;
+}
+
+void log_handle_cursor_init(PS2EmuLog *log,
+                            PS2EmuSection section,
+                            LogCursor *cursor) {
+    LogSectionType section_type = section == PS2EMU_SECTION_INIT ?
+                                  SECTION_TYPE_INIT : SECTION_TYPE_MAIN;
+    gsize count;
+
+    *cursor = (LogCursor) { 0 };
+
+    if (log->image) {
+        cursor->image = log->image;
+        cursor->image_line = log_image_get_lines(log->image, section_type,
+                                                 &count);
+        cursor->image_end = cursor->image_line + count;
+    } else if (section == PS2EMU_SECTION_INIT) {
+        cursor->list = log->parsed_log->init_section;
+    } else {
+        cursor->list = log->parsed_log->main_section;
+    }
+}
+
+guint ps2emu_log_get_event_count(PS2EmuLog *log,
+                                 PS2EmuSection section) {
+    const PS2Event *event;
+    const gchar *note;
+    LogCursor cursor;
+    guint count = 0;
+
+    log_handle_cursor_init(log, section, &cursor);
+    while (log_cursor_next(&cursor, &event, &note)) {
+        if (event)
+            count++;
+    }
+
+    return count;
+}
+
+void ps2emu_log_foreach(PS2EmuLog *log,
+                        PS2EmuLogForeachFunc func,
+                        gpointer user_data) {
+    const PS2EmuSection sections[] = {
+        PS2EMU_SECTION_INIT,
+        PS2EMU_SECTION_MAIN
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS(sections); i++) {
+        const PS2Event *event;
+        const gchar *note;
+        LogCursor cursor;
+
+        log_handle_cursor_init(log, sections[i], &cursor);
+        while (log_cursor_next(&cursor, &event, &note))
+            func(sections[i], event, note, user_data);
+    }
+}
+
+/* Skips over notes, returns NULL at the end of the section */
+static const PS2Event *cursor_next_event(LogCursor *cursor) {
+    const PS2Event *event;
+    const gchar *note;
+
+    while (log_cursor_next(cursor, &event, &note)) {
+        if (event)
+            return event;
+    }
+
+    return NULL;
+}
+
+gboolean ps2emu_log_init_equal(PS2EmuLog *a,
+                               PS2EmuLog *b) {
+    LogCursor cursor_a,
+              cursor_b;
+
+    if (a == b)
+        return TRUE;
+
+    /* V0 logs replay everything as part of initialization */
+    if (a->version == 0 || b->version == 0)
+        return FALSE;
+
+    if (ps2emu_log_get_port(a) != ps2emu_log_get_port(b) ||
+        g_strcmp0(ps2emu_log_get_device_name(a),
+                  ps2emu_log_get_device_name(b)) != 0)
+        return FALSE;
+
+    log_handle_cursor_init(a, PS2EMU_SECTION_INIT, &cursor_a);
+    log_handle_cursor_init(b, PS2EMU_SECTION_INIT, &cursor_b);
+
+    while (TRUE) {
+        const PS2Event *event_a = cursor_next_event(&cursor_a),
+                       *event_b = cursor_next_event(&cursor_b);
+
+        if (!event_a || !event_b)
+            return !event_a && !event_b;
+
+        if (event_a->type != event_b->type || event_a->data != event_b->data)
+            return FALSE;
+    }
+}
@@ -0,0 +1,246 @@
+/*
+ * ps2emu-log-image.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * A log image is a parsed log laid out so that it can be replayed straight
+ * from a read-only mapping of the file, without building anything on the
+ * heap. Any number of replays of the same image then share one copy of it in
+ * the page cache, instead of each having their own parsed copy of the log.
+ *
+ * The image is a LogImageHeader, followed by an array of LogImageLines for
+ * each section and then the NUL terminated strings (the header of the log,
+ * the device name and the notes). Nothing in it is a pointer, everything
+ * refers to everything else by its offset from the start of the image. Images
+ * are in the byte order of the machine that made them and aren't meant to be
+ * passed around, they're a cache for a text or packed log.
+ */
+
+#include "ps2emu-log-image.h"
+#include "ps2emu-misc.h"
+
+#include <string.h>
+#include <glib.h>
+
+G_STATIC_ASSERT(sizeof(LogImageHeader) % 8 == 0);
+G_STATIC_ASSERT(sizeof(LogImageLine) % 8 == 0);
+
+static guint64 add_string(GByteArray *strings,
+                          guint64 strings_start,
+                          const gchar *str) {
+    guint64 offset = strings_start + strings->len;
+
+    if (!str)
+        return 0;
+
+    g_byte_array_append(strings, (const guint8*)str, strlen(str) + 1);
+
+    return offset;
+}
+
+static void encode_section(GByteArray *out,
+                           GByteArray *strings,
+                           guint64 strings_start,
+                           GList *section,
+                           int log_version,
+                           PS2Port port) {
+    for (GList *l = section; l != NULL; l = l->next) {
+        LogLine *log_line = l->data;
+        LogImageLine image_line = { 0 };
+
+        if (log_line->type == LINE_TYPE_NOTE) {
+            image_line.note = add_string(strings, strings_start,
+                                         log_line->note);
+        } else {
+            image_line.time = log_line->ps2_event->time;
+            image_line.type = log_line->ps2_event->type;
+            image_line.data = log_line->ps2_event->data;
+
+            /* Only V0 logs record where each event came from */
+            image_line.origin = log_version == 0 ?
+                                log_line->ps2_event->origin : port;
+        }
+
+        g_byte_array_append(out, (const guint8*)&image_line,
+                            sizeof(image_line));
+    }
+}
+
+GByteArray *log_image_encode(ParsedLog *parsed_log,
+                             int log_version) {
+    GByteArray *out = g_byte_array_new(),
+               *strings = g_byte_array_new();
+    LogImageHeader header = {
+        .format_version = LOG_IMAGE_FORMAT_VERSION,
+        .byte_order = LOG_IMAGE_BYTE_ORDER,
+        .log_version = log_version,
+        .port = parsed_log->port,
+    };
+    GList *sections[] = {
+        [SECTION_TYPE_INIT] = parsed_log->init_section,
+        [SECTION_TYPE_MAIN] = parsed_log->main_section,
+    };
+    guint64 offset = sizeof(header);
+
+    memcpy(header.magic, LOG_IMAGE_MAGIC, LOG_IMAGE_MAGIC_LEN);
+
+    for (guint i = 0; i < G_N_ELEMENTS(sections); i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].count = g_list_length(sections[i]);
+
+        offset += header.sections[i].count * sizeof(LogImageLine);
+    }
+
+    /* offset is now where the strings start */
+    header.header = add_string(strings, offset, parsed_log->header);
+    header.device_name = add_string(strings, offset,
+                                    parsed_log->device_name);
+
+    g_byte_array_append(out, (const guint8*)&header, sizeof(header));
+    for (guint i = 0; i < G_N_ELEMENTS(sections); i++)
+        encode_section(out, strings, offset, sections[i], log_version,
+                       parsed_log->port);
+
+    g_byte_array_append(out, strings->data, strings->len);
+    g_byte_array_free(strings, TRUE);
+
+    ((LogImageHeader*)out->data)->size = out->len;
+
+    return out;
+}
+
+static gboolean check_string(const LogImage *image,
+                             guint64 offset,
+                             guint64 strings_start) {
+    gsize size = image->header->size;
+
+    return offset == 0 ||
+           (offset >= strings_start && offset < size &&
+            memchr(image->data + offset, '\0', size - offset) != NULL);
+}
+
+static gboolean check_image(const LogImage *image,
+                            gsize len,
+                            GError **error) {
+    const LogImageHeader *header = image->header;
+    guint64 strings_start = sizeof(*header);
+
+    if (header->format_version > LOG_IMAGE_FORMAT_VERSION) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Log image format is too new (found %d, we only support "
+                    "up to %d)", header->format_version,
+                    LOG_IMAGE_FORMAT_VERSION);
+        return FALSE;
+    }
+
+    if (header->byte_order != LOG_IMAGE_BYTE_ORDER) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Log image was made on a machine with a "
+                            "different byte order");
+        return FALSE;
+    }
+
+    if (header->size != len)
+        goto corrupt;
+
+    for (guint i = 0; i < G_N_ELEMENTS(header->sections); i++) {
+        const LogImageSection *section = &header->sections[i];
+
+        if (section->offset != strings_start ||
+            section->count > (len - strings_start) / sizeof(LogImageLine))
+            goto corrupt;
+
+        strings_start += section->count * sizeof(LogImageLine);
+    }
+
+    if (!check_string(image, header->header, strings_start) ||
+        !check_string(image, header->device_name, strings_start))
+        goto corrupt;
+
+    /* Every page of the image is shared, so reading all of it once here
+     * doesn't cost us any memory */
+    for (guint i = 0; i < G_N_ELEMENTS(header->sections); i++) {
+        const LogImageLine *lines;
+        gsize count;
+
+        lines = log_image_get_lines(image, i, &count);
+        for (gsize j = 0; j < count; j++) {
+            if (!check_string(image, lines[j].note, strings_start))
+                goto corrupt;
+        }
+    }
+
+    return TRUE;
+
+corrupt:
+    g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                        "Log image is truncated or corrupt");
+    return FALSE;
+}
+
+gboolean log_image_file_test(const gchar *path) {
+    gchar magic[LOG_IMAGE_MAGIC_LEN];
+    gboolean ret;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file)
+        return FALSE;
+
+    ret = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+          memcmp(magic, LOG_IMAGE_MAGIC, sizeof(magic)) == 0;
+
+    fclose(file);
+    return ret;
+}
+
+LogImage *log_image_load(const gchar *path,
+                         GError **error) {
+    LogImage *image = g_new0(LogImage, 1);
+    gsize len;
+
+    image->file = g_mapped_file_new(path, FALSE, error);
+    if (!image->file) {
+        g_prefix_error(error, "While opening %s: ", path);
+        goto error;
+    }
+
+    image->data = g_mapped_file_get_contents(image->file);
+    image->header = (const LogImageHeader*)image->data;
+    len = g_mapped_file_get_length(image->file);
+
+    if (len < sizeof(LogImageHeader) ||
+        memcmp(image->header->magic, LOG_IMAGE_MAGIC,
+               LOG_IMAGE_MAGIC_LEN) != 0) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "%s is not a log image", path);
+        goto error;
+    }
+
+    if (!check_image(image, len, error))
+        goto error;
+
+    return image;
+
+error:
+    log_image_free(image);
+    return NULL;
+}
+
+void log_image_free(LogImage *image) {
+    if (image->file)
+        g_mapped_file_unref(image->file);
+
+    g_free(image);
+}
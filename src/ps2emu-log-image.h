@@ -0,0 +1,93 @@
+/*
+ * ps2emu-log-image.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_LOG_IMAGE_H__
+#define __PS2EMU_LOG_IMAGE_H__
+
+#include <glib.h>
+
+#include "ps2emu-log.h"
+
+#define LOG_IMAGE_MAGIC "PS2EMUIM"
+#define LOG_IMAGE_MAGIC_LEN (sizeof(LOG_IMAGE_MAGIC) - 1)
+#define LOG_IMAGE_FORMAT_VERSION 1
+
+/* Written in the byte order of the machine that made the image, so we can
+ * tell when an image came from a machine with a different one */
+#define LOG_IMAGE_BYTE_ORDER 0x01020304
+
+/* Offsets are from the start of the image. A string offset of 0 means there
+ * isn't one, since the header is always there */
+typedef struct {
+    guint64 offset;
+    guint64 count;
+} LogImageSection;
+
+typedef struct {
+    gchar magic[LOG_IMAGE_MAGIC_LEN];
+    guint32 format_version;
+    guint32 byte_order;
+    guint32 log_version;
+    guint32 port;
+    guint64 size;
+
+    guint64 header;
+    guint64 device_name;
+    LogImageSection sections[2];
+} LogImageHeader;
+
+typedef struct {
+    gint64 time;
+    /* Where the text of a note is, 0 for events */
+    guint64 note;
+    guint8 type;
+    guint8 data;
+    guint8 origin;
+    guint8 padding[5];
+} LogImageLine;
+
+typedef struct {
+    GMappedFile *file;
+    const gchar *data;
+    const LogImageHeader *header;
+} LogImage;
+
+gboolean log_image_file_test(const gchar *path);
+
+GByteArray *log_image_encode(ParsedLog *parsed_log,
+                             int log_version)
+G_GNUC_WARN_UNUSED_RESULT G_GNUC_MALLOC;
+
+LogImage *log_image_load(const gchar *path,
+                         GError **error)
+G_GNUC_MALLOC;
+
+void log_image_free(LogImage *image);
+
+static inline const gchar *log_image_get_string(const LogImage *image,
+                                                guint64 offset) {
+    return offset ? image->data + offset : NULL;
+}
+
+static inline const LogImageLine *log_image_get_lines(const LogImage *image,
+                                                      LogSectionType section,
+                                                      gsize *count) {
+    const LogImageSection *image_section = &image->header->sections[section];
+
+    *count = image_section->count;
+    return (const LogImageLine*)(image->data + image_section->offset);
+}
+
+#endif /* !__PS2EMU_LOG_IMAGE_H__ */
@@ -17,6 +17,7 @@
 #include "ps2emu-misc.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <glib.h>
@@ -27,7 +28,7 @@ void ps2_event_free(PS2Event *event) {
     g_slice_free(PS2Event, event);
 }
 
-static void log_line_free(LogLine *log_line) {
+void log_line_free(LogLine *log_line) {
     switch (log_line->type) {
         case LINE_TYPE_NOTE:
             g_free(log_line->note);
@@ -42,6 +43,54 @@ static void log_line_free(LogLine *log_line) {
     g_slice_free(LogLine, log_line);
 }
 
+void log_free(ParsedLog *parsed_log) {
+    if (parsed_log->init_section)
+        g_list_free_full(parsed_log->init_section, (GDestroyNotify)log_line_free);
+    if (parsed_log->main_section)
+        g_list_free_full(parsed_log->main_section, (GDestroyNotify)log_line_free);
+
+    g_free(parsed_log->header);
+    g_free(parsed_log->device_name);
+    g_free(parsed_log);
+}
+
+const gchar *log_get_device_family(ParsedLog *parsed_log) {
+    if (parsed_log->device_name)
+        return parsed_log->device_name;
+
+    return parsed_log->port == PS2_PORT_KBD ? "Unknown keyboard" :
+                                              "Unknown AUX device";
+}
+
+/* Entries in the device listing that ps2emu-record writes into the header look
+ * like this:
+ *
+ *  #    "SynPS/2 Synaptics TouchPad" on i8042 AUX port
+ */
+static void parse_device_listing_line(const gchar *line,
+                                      gchar **kbd_name,
+                                      gchar **aux_name) {
+    gchar *name = NULL,
+          *port = NULL;
+    int parsed_count;
+
+    parsed_count = sscanf(line, "# \"%m[^\"]\" on %m[^\n]", &name, &port);
+    if (parsed_count != 2)
+        goto out;
+
+    if (strstr(port, "KBD") && !*kbd_name) {
+        *kbd_name = name;
+        name = NULL;
+    } else if (strstr(port, "AUX") && !*aux_name) {
+        *aux_name = name;
+        name = NULL;
+    }
+
+out:
+    g_free(name);
+    g_free(port);
+}
+
 gchar * ps2_event_to_string(PS2Event *event,
                             time_t time) {
     gchar *event_str,
@@ -54,6 +103,12 @@ gchar * ps2_event_to_string(PS2Event *event,
     else
         direction = 'S'; /* sent */
 
+    /* Events that didn't come from dmesg (e.g. ones decoded from a packed
+     * log) don't have anything to comment with */
+    if (!event->original_line || !strstr(event->original_line, "("))
+        return g_strdup_printf("E: %-10ld %c %.2hhx\n",
+                               time, direction, event->data);
+
     /* Find the first paranthesis in the original message from dmesg, and
      * include that as a comment with the line */
     comment = g_strdup(strstr(event->original_line, "("));
@@ -66,6 +121,30 @@ gchar * ps2_event_to_string(PS2Event *event,
     return event_str;
 }
 
+/* Equivalent to sscanf(str, "%ld %c %hhx", ...), but without the overhead of
+ * going through the format string for every single line in a log */
+static int parse_event_fields(const gchar *str,
+                              time_t *time,
+                              char *direction_char,
+                              guchar *data) {
+    gchar *end;
+
+    *time = strtol(str, &end, 10);
+    if (end == str)
+        return 0;
+
+    str = end + strspn(end, " \t\n");
+    if (*str == '\0')
+        return 1;
+    *direction_char = *str++;
+
+    *data = strtoul(str, &end, 16);
+    if (end == str)
+        return 2;
+
+    return 3;
+}
+
 PS2Event * ps2_event_from_line(const gchar *str,
                                int log_version,
                                GError **error) {
@@ -79,6 +158,7 @@ PS2Event * ps2_event_from_line(const gchar *str,
         return NULL;
 
     new_event = g_slice_alloc(sizeof(PS2Event));
+    new_event->original_line = NULL;
 
     errno = 0;
 
@@ -106,9 +186,8 @@ PS2Event * ps2_event_from_line(const gchar *str,
             goto error;
         }
     } else {
-        parsed_count = sscanf(str_start, "%ld %c %hhx",
-                              &new_event->time, &direction_char,
-                              &new_event->data);
+        parsed_count = parse_event_fields(str_start, &new_event->time,
+                                          &direction_char, &new_event->data);
         if (errno != 0 || parsed_count != 3) {
             g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
                         "Invalid event line '%s'", str);
@@ -142,11 +221,9 @@ LogLineType log_get_line_type(gchar *line,
                               GError **error) {
     LogLineType type;
     gchar type_char;
-    int parse_count;
 
-    errno = 0;
-    parse_count = sscanf(line, "%1c:", &type_char);
-    if (errno || parse_count != 1) {
+    type_char = line[0];
+    if (type_char == '\0') {
         g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
                     "Invalid event line `%s`", line);
         return -1;
@@ -183,9 +260,13 @@ ParsedLog *log_parse(GIOChannel *input_channel,
     gchar *msg_start;
     GList **section_dest;
     ParsedLog *parsed_log;
+    GString *header;
+    gchar *kbd_name = NULL,
+          *aux_name = NULL;
     GIOStatus rc;
 
     parsed_log = g_new0(ParsedLog, 1);
+    header = g_string_new(NULL);
 
     /* We can't reliably play anything back from older logs except for
      * touchpads, so just automatically set the port type to AUX */
@@ -196,8 +277,26 @@ ParsedLog *log_parse(GIOChannel *input_channel,
                                         error)) == G_IO_STATUS_NORMAL) {
         g_strchug(line);
 
-        if (line[0] == '#' || line[0] == '\0')
+        if (line[0] == '#') {
+            /* Comments only belong to the header until the first real line */
+            if (header) {
+                g_string_append(header, line);
+                parse_device_listing_line(line, &kbd_name, &aux_name);
+            }
+
+            g_free(line);
             continue;
+        }
+
+        if (line[0] == '\0') {
+            g_free(line);
+            continue;
+        }
+
+        if (header) {
+            parsed_log->header = g_string_free(header, FALSE);
+            header = NULL;
+        }
 
         if (log_version < 1) {
             line_type = LINE_TYPE_EVENT;
@@ -279,6 +378,17 @@ ParsedLog *log_parse(GIOChannel *input_channel,
     if (rc != G_IO_STATUS_EOF)
         goto error;
 
+    if (header)
+        parsed_log->header = g_string_free(header, FALSE);
+
+    if (parsed_log->port == PS2_PORT_KBD) {
+        parsed_log->device_name = kbd_name;
+        g_free(aux_name);
+    } else {
+        parsed_log->device_name = aux_name;
+        g_free(kbd_name);
+    }
+
     if (log_version >= 1) {
         if (parsed_log->init_section)
             parsed_log->init_section = g_list_reverse(parsed_log->init_section);
@@ -290,12 +400,13 @@ ParsedLog *log_parse(GIOChannel *input_channel,
     return parsed_log;
 
 error:
-    if (parsed_log->init_section)
-        g_list_free_full(parsed_log->init_section, (GDestroyNotify)log_line_free);
-    if (parsed_log->main_section)
-        g_list_free_full(parsed_log->main_section, (GDestroyNotify)log_line_free);
+    if (header)
+        g_string_free(header, TRUE);
 
-    g_free(parsed_log);
+    g_free(kbd_name);
+    g_free(aux_name);
+
+    log_free(parsed_log);
     return NULL;
 }
 
@@ -361,3 +472,160 @@ LogSectionType log_get_section_type_from_line(const gchar *line,
     g_free(section_string);
     return type;
 }
+
+gboolean log_read_prelude(GIOChannel *input_channel,
+                          LogPrelude *prelude,
+                          GError **error) {
+    GString *header = g_string_new(NULL);
+    gboolean in_init = FALSE;
+    gchar *line,
+          *msg_start;
+    GIOStatus rc;
+
+    *prelude = (LogPrelude) {
+        .port = PS2_PORT_AUX,
+        .init_lines = g_ptr_array_new_with_free_func(g_free),
+    };
+
+    while ((rc = g_io_channel_read_line(input_channel, &line, NULL, NULL,
+                                        error)) == G_IO_STATUS_NORMAL) {
+        g_strchug(line);
+
+        if (line[0] == '\0') {
+            g_free(line);
+            continue;
+        }
+
+        if (line[0] == '#') {
+            if (in_init)
+                g_ptr_array_add(prelude->init_lines, line);
+            else {
+                g_string_append(header, line);
+                g_free(line);
+            }
+
+            continue;
+        }
+
+        switch (log_get_line_type(line, &msg_start, error)) {
+            case LINE_TYPE_DEVICE_TYPE:
+                prelude->port = msg_start[0] == 'K' ? PS2_PORT_KBD :
+                                                      PS2_PORT_AUX;
+                g_free(line);
+                break;
+            case LINE_TYPE_SECTION:
+                switch (log_get_section_type_from_line(msg_start, error)) {
+                    case SECTION_TYPE_INIT:
+                        in_init = TRUE;
+                        break;
+                    case SECTION_TYPE_MAIN:
+                        prelude->has_main_section = TRUE;
+                        break;
+                    case SECTION_TYPE_ERROR:
+                        g_free(line);
+                        goto error;
+                }
+                g_free(line);
+
+                if (prelude->has_main_section)
+                    goto out;
+                break;
+            case LINE_TYPE_INVALID:
+                g_free(line);
+                goto error;
+            default:
+                g_ptr_array_add(prelude->init_lines, line);
+                break;
+        }
+    }
+    if (rc != G_IO_STATUS_EOF)
+        goto error;
+
+out:
+    prelude->header = g_string_free(header, FALSE);
+    return TRUE;
+
+error:
+    g_string_free(header, TRUE);
+    log_prelude_clear(prelude);
+    return FALSE;
+}
+
+void log_prelude_write(FILE *file,
+                       LogPrelude *prelude) {
+    fprintf(file, "# ps2emu-record V%d\n", PS2EMU_LOG_VERSION);
+    if (prelude->header)
+        fputs(prelude->header, file);
+
+    fprintf(file, "T: %c\n"
+                  "S: Init\n",
+            prelude->port == PS2_PORT_KBD ? 'K' : 'A');
+
+    for (guint i = 0; i < prelude->init_lines->len; i++)
+        fputs(g_ptr_array_index(prelude->init_lines, i), file);
+
+    fprintf(file, "S: Main\n");
+}
+
+void log_prelude_clear(LogPrelude *prelude) {
+    g_clear_pointer(&prelude->header, g_free);
+    g_clear_pointer(&prelude->init_lines, g_ptr_array_unref);
+}
+
+/* Split the message of an event line into its time, and the rest of the line
+ * following it (direction, data and comment) */
+gboolean log_event_line_split_time(const gchar *msg_start,
+                                   time_t *time,
+                                   const gchar **rest) {
+    gchar *end;
+
+    *time = strtol(msg_start, &end, 10);
+    if (end == msg_start)
+        return FALSE;
+
+    *rest = end + strspn(end, " \t");
+    return TRUE;
+}
+
+/* Feed the next event into the detector. A candidate is the acknowledgement
+ * of an enable command, and marks the last event of the initialization
+ * sequence. It's rejected if the host sends anything else before
+ * PS2_INIT_QUIET_TIME passes, and confirmed by the first event after that
+ * (which belongs to the main section) */
+InitEndResult init_end_detector_feed(InitEndDetector *detector,
+                                     const PS2Event *event) {
+    gboolean sent = event->type != PS2_EVENT_TYPE_INTERRUPT &&
+                    event->type != PS2_EVENT_TYPE_RETURN;
+
+    if (detector->have_candidate) {
+        if (event->time - detector->candidate_time > PS2_INIT_QUIET_TIME) {
+            detector->have_candidate = FALSE;
+            return INIT_END_CONFIRMED;
+        }
+
+        if (sent) {
+            detector->have_candidate = FALSE;
+            detector->enable_sent = event->data == PS2_CMD_ENABLE;
+            return INIT_END_REJECTED;
+        }
+
+        return INIT_END_NONE;
+    }
+
+    if (sent) {
+        detector->enable_sent = event->data == PS2_CMD_ENABLE;
+        return INIT_END_NONE;
+    }
+
+    if (detector->enable_sent && event->data == PS2_RET_ACK) {
+        detector->enable_sent = FALSE;
+        detector->have_candidate = TRUE;
+        detector->candidate_time = event->time;
+        detector->candidates++;
+
+        return INIT_END_CANDIDATE;
+    }
+
+    detector->enable_sent = FALSE;
+    return INIT_END_NONE;
+}
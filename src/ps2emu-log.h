@@ -18,30 +18,25 @@
 
 #include <glib.h>
 
+#include "ps2emu.h"
 #include "ps2emu-misc.h"
 
 #define PS2_KEYBOARD_PORT 0
 
-typedef enum {
-    PS2_EVENT_TYPE_COMMAND,
-    PS2_EVENT_TYPE_PARAMETER,
-    PS2_EVENT_TYPE_RETURN,
-    PS2_EVENT_TYPE_KBD_DATA,
-    PS2_EVENT_TYPE_INTERRUPT
-} PS2EventType;
-
-typedef enum {
-    PS2_PORT_KBD,
-    PS2_PORT_AUX
-} PS2Port;
-
-typedef struct {
-    time_t        time;
-    PS2EventType  type;
-    guchar        data;
-    PS2Port       origin;
-    const gchar  *original_line;
-} PS2Event;
+/* A PS/2 byte takes a little over a millisecond to clock out, so bytes going
+ * in the same direction that are closer together than this are most likely
+ * part of the same packet */
+#define PS2_PACKET_GAP     3000
+#define PS2_MAX_PACKET_LEN 8
+
+static inline gboolean ps2_event_continues_packet(const PS2Event *last,
+                                                  guint packet_len,
+                                                  const PS2Event *event) {
+    return packet_len < PS2_MAX_PACKET_LEN &&
+           last->type == event->type &&
+           event->time >= last->time &&
+           event->time - last->time <= PS2_PACKET_GAP;
+}
 
 typedef enum {
     LINE_TYPE_EVENT       = 'E',
@@ -64,6 +59,12 @@ typedef struct {
     GList   *main_section;
 
     PS2Port  port;
+
+    /* The comment block at the top of the log (kernel, machine and device
+     * info), and the name of the device on the recorded port if we found one
+     * in it */
+    gchar   *header;
+    gchar   *device_name;
 } ParsedLog;
 
 typedef enum {
@@ -72,6 +73,15 @@ typedef enum {
     SECTION_TYPE_ERROR = -1,
 } LogSectionType;
 
+/* Everything in a V1 log up to the start of the main section, for tools that
+ * stream through the main section of a log instead of parsing all of it */
+typedef struct {
+    gchar     *header;
+    PS2Port    port;
+    GPtrArray *init_lines;
+    gboolean   has_main_section;
+} LogPrelude;
+
 LogLineType log_get_line_type(gchar *line,
                               gchar **message_start,
                               GError **error);
@@ -98,4 +108,49 @@ ParsedLog *log_parse(GIOChannel *input_channel,
                      GError **error)
 G_GNUC_MALLOC;
 
+void log_line_free(LogLine *log_line);
+
+void log_free(ParsedLog *parsed_log);
+
+const gchar *log_get_device_family(ParsedLog *parsed_log);
+
+/* Finds where the initialization of a device ends in a stream of events that
+ * doesn't have any sections. For mice, initialization ends once the host has
+ * enabled data reporting (0xf4) and the device has acknowledged it (0xfa). We
+ * only trust this once the host stays quiet for a while afterwards, since
+ * drivers may disable and reenable the device several times while probing */
+#define PS2_CMD_ENABLE       0xf4
+#define PS2_RET_ACK          0xfa
+#define PS2_INIT_QUIET_TIME  (PS2EMU_INIT_TIMEOUT_SECS * G_USEC_PER_SEC)
+
+typedef enum {
+    INIT_END_NONE,
+    INIT_END_CANDIDATE,
+    INIT_END_REJECTED,
+    INIT_END_CONFIRMED
+} InitEndResult;
+
+typedef struct {
+    gboolean enable_sent;
+    gboolean have_candidate;
+    time_t candidate_time;
+    guint candidates;
+} InitEndDetector;
+
+InitEndResult init_end_detector_feed(InitEndDetector *detector,
+                                     const PS2Event *event);
+
+gboolean log_read_prelude(GIOChannel *input_channel,
+                          LogPrelude *prelude,
+                          GError **error);
+
+void log_prelude_write(FILE *file,
+                       LogPrelude *prelude);
+
+void log_prelude_clear(LogPrelude *prelude);
+
+gboolean log_event_line_split_time(const gchar *msg_start,
+                                   time_t *time,
+                                   const gchar **rest);
+
 #endif /* !__PS2EMU_LOG_H__ */
@@ -0,0 +1,290 @@
+/*
+ * ps2emu-merge.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+/* Compare the bytes going back and forth during initialization, ignoring the
+ * timing and comments */
+static gboolean init_sequences_match(LogPrelude *a,
+                                     LogPrelude *b) {
+    guint i = 0,
+          j = 0;
+
+    while (TRUE) {
+        PS2Event *event_a = NULL,
+                 *event_b = NULL;
+        gchar *msg_start;
+        gboolean match;
+
+        for (; i < a->init_lines->len && !event_a; i++) {
+            gchar *line = g_ptr_array_index(a->init_lines, i);
+
+            if (log_get_line_type(line, &msg_start, NULL) == LINE_TYPE_EVENT)
+                event_a = ps2_event_from_line(msg_start, PS2EMU_LOG_VERSION,
+                                              NULL);
+        }
+        for (; j < b->init_lines->len && !event_b; j++) {
+            gchar *line = g_ptr_array_index(b->init_lines, j);
+
+            if (log_get_line_type(line, &msg_start, NULL) == LINE_TYPE_EVENT)
+                event_b = ps2_event_from_line(msg_start, PS2EMU_LOG_VERSION,
+                                              NULL);
+        }
+
+        if (!event_a || !event_b) {
+            match = !event_a && !event_b;
+        } else {
+            match = event_a->type == event_b->type &&
+                    event_a->data == event_b->data;
+        }
+
+        if (event_a)
+            ps2_event_free(event_a);
+        if (event_b)
+            ps2_event_free(event_b);
+
+        if (!match || (!event_a && !event_b))
+            return match;
+    }
+}
+
+static gboolean open_log(const gchar *path,
+                         GIOChannel **input_channel,
+                         LogPrelude *prelude,
+                         GError **error) {
+    int log_version;
+
+    *input_channel = g_io_channel_new_file(path, "r", error);
+    if (!*input_channel)
+        return FALSE;
+
+    log_version = log_parse_version(*input_channel, error);
+    if (log_version < 0)
+        goto error;
+
+    if (log_version != PS2EMU_LOG_VERSION) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Only V%d logs can be merged (found V%d)",
+                    PS2EMU_LOG_VERSION, log_version);
+        goto error;
+    }
+
+    if (!log_read_prelude(*input_channel, prelude, error))
+        goto error;
+
+    return TRUE;
+
+error:
+    g_io_channel_unref(*input_channel);
+    *input_channel = NULL;
+    return FALSE;
+}
+
+/* Copy the main section of a log, shifting its events so that the first one
+ * happens at offset. Returns the time of the last event written */
+static gboolean copy_main_section(FILE *output,
+                                  GIOChannel *input_channel,
+                                  time_t offset,
+                                  time_t *last_time,
+                                  GError **error) {
+    gchar *line = NULL,
+          *msg_start;
+    time_t base_time = 0;
+    gboolean has_base_time = FALSE;
+    GIOStatus rc;
+
+    while ((rc = g_io_channel_read_line(input_channel, &line, NULL, NULL,
+                                        error)) == G_IO_STATUS_NORMAL) {
+        const gchar *rest;
+        time_t time;
+
+        g_strchug(line);
+        if (line[0] == '#' || line[0] == '\0')
+            goto next;
+
+        switch (log_get_line_type(line, &msg_start, error)) {
+            case LINE_TYPE_NOTE:
+                fputs(line, output);
+                break;
+            case LINE_TYPE_EVENT:
+                if (!log_event_line_split_time(msg_start, &time, &rest)) {
+                    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                "Invalid event line '%s'", line);
+                    goto error;
+                }
+
+                if (!has_base_time) {
+                    base_time = time;
+                    has_base_time = TRUE;
+                }
+
+                *last_time = time - base_time + offset;
+                fprintf(output, "E: %-10ld %s", *last_time, rest);
+                break;
+            case LINE_TYPE_INVALID:
+                goto error;
+            default:
+                g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Unexpected line in main section '%s'", line);
+                goto error;
+        }
+
+next:
+        g_clear_pointer(&line, g_free);
+    }
+    if (rc != G_IO_STATUS_EOF)
+        goto error;
+
+    return TRUE;
+
+error:
+    g_free(line);
+    return FALSE;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<event_log>... - merge PS/2 logs");
+    GError *error = NULL;
+    gchar *output_path = NULL;
+    FILE *output = stdout;
+    LogPrelude first_prelude = { 0 };
+    time_t gap = 1,
+           last_time = 0;
+    gboolean force = FALSE,
+             no_notes = FALSE;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "output", 'o', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &output_path, "Write the merged log to file instead of stdout",
+          "file" },
+        { "gap", 'g', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &gap, "Leave n seconds between the end of a log and the start of "
+          "the next one (default 1)", "n" },
+        { "force", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &force, "Merge logs even if their initialization sequences differ",
+          NULL },
+        { "no-notes", 'N', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &no_notes, "Don't add a user note at the start of each log", NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Merges the main sections of several logs recorded from the same\n"
+        "device into one log, behind the initialization sequence of the first\n"
+        "log.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (argc < 2)
+        exit_on_bad_argument(main_context, FALSE,
+                             "No filenames specified! Use --help for more "
+                             "information");
+
+    gap *= G_USEC_PER_SEC;
+
+    if (output_path) {
+        output = fopen(output_path, "w");
+        if (!output) {
+            g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "While opening %s: %s", output_path, strerror(errno));
+            goto error;
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        GIOChannel *input_channel;
+        LogPrelude prelude;
+        gchar *basename;
+        gboolean rc;
+
+        if (!open_log(argv[i], &input_channel, &prelude, &error)) {
+            g_prefix_error(&error, "While opening %s: ", argv[i]);
+            goto error;
+        }
+
+        if (i == 1) {
+            log_prelude_write(output, &prelude);
+            first_prelude = prelude;
+        } else {
+            if (prelude.port != first_prelude.port) {
+                g_set_error(&error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "%s was recorded on a different port than %s",
+                            argv[i], argv[1]);
+                goto error;
+            }
+
+            if (!init_sequences_match(&first_prelude, &prelude)) {
+                if (!force) {
+                    g_set_error(&error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                "%s has a different initialization sequence "
+                                "than %s, use --force to merge anyway",
+                                argv[i], argv[1]);
+                    goto error;
+                }
+
+                fprintf(stderr,
+                        "Warning: %s has a different initialization sequence "
+                        "than %s\n", argv[i], argv[1]);
+            }
+
+            log_prelude_clear(&prelude);
+        }
+
+        if (!no_notes) {
+            basename = g_path_get_basename(argv[i]);
+            fprintf(output, "N: %s\n", basename);
+            g_free(basename);
+        }
+
+        rc = copy_main_section(output, input_channel,
+                               i == 1 ? 0 : last_time + gap, &last_time,
+                               &error);
+        g_io_channel_unref(input_channel);
+
+        if (!rc) {
+            g_prefix_error(&error, "While reading %s: ", argv[i]);
+            goto error;
+        }
+    }
+
+    log_prelude_clear(&first_prelude);
+
+    if (output != stdout && fclose(output) != 0) {
+        g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s", output_path, strerror(errno));
+        goto error;
+    }
+
+    return 0;
+
+error:
+    fprintf(stderr, "Error: %s\n", error->message);
+
+    return 1;
+}
@@ -0,0 +1,259 @@
+/*
+ * ps2emu-metrics-export.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-metrics-export.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib.h>
+
+/* How long we give a client to send its request before answering anyway */
+#define METRICS_REQUEST_TIMEOUT_MSECS 100
+
+#define METRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+struct _MetricsExporter {
+    PS2EmuMetrics *metrics;
+
+    gchar *socket_path;
+    gint listen_fd;
+
+    gchar *textfile_path;
+    gint64 next_write_time;
+
+    /* Written to when it's time for the thread to stop */
+    gint wake_fds[2];
+    GThread *thread;
+};
+
+static void send_all(gint fd,
+                     const gchar *data,
+                     gsize len) {
+    gssize written;
+
+    while (len) {
+        /* Don't die from SIGPIPE when a client hangs up early */
+        written = send(fd, data, len, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        data += written;
+        len -= written;
+    }
+}
+
+static void serve_client(MetricsExporter *exporter,
+                         gint client_fd) {
+    struct pollfd pollfd = { .fd = client_fd, .events = POLLIN };
+    gchar request[512];
+    gssize request_len = 0;
+    gchar *body,
+          *header;
+
+    if (poll(&pollfd, 1, METRICS_REQUEST_TIMEOUT_MSECS) > 0)
+        request_len = recv(client_fd, request, sizeof(request), MSG_DONTWAIT);
+
+    body = ps2emu_metrics_to_string(exporter->metrics);
+
+    if (request_len >= 4 && memcmp(request, "GET ", 4) == 0) {
+        header = g_strdup_printf("HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: " METRICS_CONTENT_TYPE "\r\n"
+                                 "Content-Length: %zu\r\n"
+                                 "\r\n",
+                                 strlen(body));
+        send_all(client_fd, header, strlen(header));
+        g_free(header);
+    }
+
+    send_all(client_fd, body, strlen(body));
+    g_free(body);
+}
+
+static void write_textfile(MetricsExporter *exporter) {
+    GError *error = NULL;
+    gchar *contents = ps2emu_metrics_to_string(exporter->metrics);
+
+    /* This writes to a temporary file and renames it over the old one, so the
+     * collector never sees half of a file */
+    if (!g_file_set_contents(exporter->textfile_path, contents, -1, &error)) {
+        g_warning("Failed to write metrics: %s", error->message);
+        g_error_free(error);
+    }
+
+    g_free(contents);
+}
+
+static gpointer exporter_thread(gpointer data) {
+    MetricsExporter *exporter = data;
+    struct pollfd pollfds[2] = {
+        { .fd = exporter->wake_fds[0], .events = POLLIN },
+        { .fd = exporter->listen_fd,   .events = POLLIN },
+    };
+    gint timeout,
+         client_fd;
+    gint64 now;
+
+    while (TRUE) {
+        if (exporter->textfile_path) {
+            now = g_get_monotonic_time();
+
+            if (now >= exporter->next_write_time) {
+                write_textfile(exporter);
+
+                exporter->next_write_time =
+                    now + METRICS_TEXTFILE_INTERVAL_SECS * G_USEC_PER_SEC;
+            }
+
+            timeout = (exporter->next_write_time - now) / 1000 + 1;
+        } else {
+            timeout = -1;
+        }
+
+        /* A negative fd is skipped by poll(), so this works without a socket
+         * too */
+        if (poll(pollfds, G_N_ELEMENTS(pollfds), timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            g_warning("Failed to wait for metrics clients: %s",
+                      strerror(errno));
+            break;
+        }
+
+        if (pollfds[0].revents)
+            break;
+
+        if (pollfds[1].revents & POLLIN) {
+            client_fd = accept(exporter->listen_fd, NULL, NULL);
+            if (client_fd < 0)
+                continue;
+
+            serve_client(exporter, client_fd);
+            close(client_fd);
+        }
+    }
+
+    /* Leave the final values behind */
+    if (exporter->textfile_path)
+        write_textfile(exporter);
+
+    return NULL;
+}
+
+static gint listen_on_socket(const gchar *path,
+                             GError **error) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat stat_buf;
+    gint fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG,
+                    "Socket path %s is too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* Clean up after an earlier run that didn't exit cleanly, but don't remove
+     * anything that isn't a socket */
+    if (lstat(path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode))
+        unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        goto error;
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 8) < 0)
+        goto error;
+
+    return fd;
+
+error:
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "While listening on %s: %s", path, strerror(errno));
+
+    if (fd >= 0)
+        close(fd);
+
+    return -1;
+}
+
+MetricsExporter *metrics_exporter_new(PS2EmuMetrics *metrics,
+                                      const gchar *socket_path,
+                                      const gchar *textfile_path,
+                                      GError **error) {
+    MetricsExporter *exporter = g_new0(MetricsExporter, 1);
+
+    exporter->metrics = metrics;
+    exporter->listen_fd = -1;
+    exporter->wake_fds[0] = exporter->wake_fds[1] = -1;
+
+    if (socket_path) {
+        exporter->listen_fd = listen_on_socket(socket_path, error);
+        if (exporter->listen_fd < 0)
+            goto error;
+
+        exporter->socket_path = g_strdup(socket_path);
+    }
+
+    exporter->textfile_path = g_strdup(textfile_path);
+
+    if (pipe(exporter->wake_fds) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating a pipe: %s", strerror(errno));
+        goto error;
+    }
+
+    exporter->thread = g_thread_new("metrics", exporter_thread, exporter);
+
+    return exporter;
+
+error:
+    metrics_exporter_free(exporter);
+
+    return NULL;
+}
+
+void metrics_exporter_free(MetricsExporter *exporter) {
+    if (exporter->thread) {
+        g_warn_if_fail(write(exporter->wake_fds[1], "", 1) == 1);
+        g_thread_join(exporter->thread);
+    }
+
+    if (exporter->listen_fd >= 0) {
+        close(exporter->listen_fd);
+        unlink(exporter->socket_path);
+    }
+
+    if (exporter->wake_fds[0] >= 0) {
+        close(exporter->wake_fds[0]);
+        close(exporter->wake_fds[1]);
+    }
+
+    g_free(exporter->socket_path);
+    g_free(exporter->textfile_path);
+    g_free(exporter);
+}
@@ -0,0 +1,42 @@
+/*
+ * ps2emu-metrics-export.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_METRICS_EXPORT_H__
+#define __PS2EMU_METRICS_EXPORT_H__
+
+#include <glib.h>
+
+#include "ps2emu.h"
+
+/* How often the textfile gets rewritten */
+#define METRICS_TEXTFILE_INTERVAL_SECS 10
+
+/* Serves metrics from a background thread, so the replay or recording never
+ * waits on whoever is reading them. Anything connecting to socket_path gets
+ * the current metrics and is disconnected; clients that send an HTTP request
+ * first (such as curl --unix-socket) get an HTTP response. textfile_path is
+ * rewritten atomically every METRICS_TEXTFILE_INTERVAL_SECS, for the textfile
+ * collector of node_exporter. Either path can be NULL */
+typedef struct _MetricsExporter MetricsExporter;
+
+MetricsExporter *metrics_exporter_new(PS2EmuMetrics *metrics,
+                                      const gchar *socket_path,
+                                      const gchar *textfile_path,
+                                      GError **error);
+
+/* Writes the textfile one last time, and removes the socket */
+void metrics_exporter_free(MetricsExporter *exporter);
+
+#endif /* !__PS2EMU_METRICS_EXPORT_H__ */
@@ -0,0 +1,194 @@
+/*
+ * ps2emu-metrics.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu.h"
+#include "ps2emu-lib-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <glib.h>
+
+PS2EmuMetrics *ps2emu_metrics_new(void) {
+    return g_new0(PS2EmuMetrics, 1);
+}
+
+void ps2emu_metrics_free(PS2EmuMetrics *metrics) {
+    g_free(metrics);
+}
+
+static inline guint64 load(const guint64 *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Both counters keep going up while we read them, so read the one that trails
+ * first to make sure the difference doesn't go negative. Counters bumped after
+ * the push could still trail for a moment, so never wrap around either */
+static guint64 queue_length(const guint64 *pushed,
+                            const guint64 *popped) {
+    guint64 popped_count = load(popped),
+            pushed_count = load(pushed);
+
+    return pushed_count > popped_count ? pushed_count - popped_count : 0;
+}
+
+static void append_counter(GString *str,
+                           const gchar *name,
+                           const gchar *help,
+                           const guint64 *counter) {
+    g_string_append_printf(str,
+                           "# TYPE %s counter\n"
+                           "# HELP %s %s\n"
+                           "%s_total %" G_GUINT64_FORMAT "\n",
+                           name, name, help, name, load(counter));
+}
+
+static void append_gauge(GString *str,
+                         const gchar *name,
+                         const gchar *help,
+                         guint64 value) {
+    g_string_append_printf(str,
+                           "# TYPE %s gauge\n"
+                           "# HELP %s %s\n"
+                           "%s %" G_GUINT64_FORMAT "\n",
+                           name, name, help, name, value);
+}
+
+static void append_histogram(GString *str,
+                             const gchar *name,
+                             const gchar *help,
+                             const MetricsHistogram *histogram) {
+    static const gint64 bounds[] = METRICS_HISTOGRAM_BOUNDS;
+    guint64 count = 0;
+
+    g_string_append_printf(str,
+                           "# TYPE %s histogram\n"
+                           "# UNIT %s seconds\n"
+                           "# HELP %s %s\n",
+                           name, name, name, help);
+
+    for (gint i = 0; i < G_N_ELEMENTS(bounds); i++) {
+        count += load(&histogram->buckets[i]);
+        g_string_append_printf(str,
+                               "%s_bucket{le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                               name, (gdouble)bounds[i] / G_USEC_PER_SEC,
+                               count);
+    }
+
+    count += load(&histogram->buckets[G_N_ELEMENTS(bounds)]);
+    g_string_append_printf(str,
+                           "%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT "\n"
+                           "%s_sum %g\n"
+                           "%s_count %" G_GUINT64_FORMAT "\n",
+                           name, count,
+                           name,
+                           (gdouble)load(&histogram->sum) / G_USEC_PER_SEC,
+                           name, count);
+}
+
+static gint64 get_resident_bytes(void) {
+    gchar *statm;
+    long resident = 0;
+
+    if (!g_file_get_contents("/proc/self/statm", &statm, NULL, NULL))
+        return -1;
+
+    sscanf(statm, "%*s %ld", &resident);
+    g_free(statm);
+
+    return (gint64)resident * sysconf(_SC_PAGESIZE);
+}
+
+gchar *ps2emu_metrics_to_string(PS2EmuMetrics *metrics) {
+    GString *str = g_string_new(NULL);
+    gint64 resident_bytes;
+
+    if (metrics->replaying) {
+        append_counter(str, "ps2emu_replay_interrupts_sent",
+                       "Bytes sent to the host by the device",
+                       &metrics->interrupts_sent);
+        append_counter(str, "ps2emu_replay_bytes_received",
+                       "Bytes from the host that matched the log",
+                       &metrics->bytes_received);
+        append_counter(str, "ps2emu_replay_mismatches",
+                       "Bytes from the host that didn't match the log",
+                       &metrics->mismatches);
+        append_counter(str, "ps2emu_replay_notes",
+                       "User notes reached in the log",
+                       &metrics->notes);
+        append_counter(str, "ps2emu_replay_wakeups",
+                       "Times the replay slept until a byte was due",
+                       &metrics->wakeups);
+        append_histogram(str, "ps2emu_replay_interrupt_lateness_seconds",
+                         "How long after its time in the log each byte was "
+                         "sent",
+                         &metrics->interrupt_lateness);
+    }
+
+    if (metrics->recording) {
+        append_counter(str, "ps2emu_record_kmsg_records",
+                       "Records read from the kernel log",
+                       &metrics->kmsg_records);
+        append_counter(str, "ps2emu_record_kmsg_lost_records",
+                       "Records the kernel overwrote before they were read",
+                       &metrics->kmsg_lost_records);
+        append_counter(str, "ps2emu_record_events",
+                       "Events written to the recording",
+                       &metrics->events_recorded);
+        append_counter(str, "ps2emu_record_events_filtered",
+                       "i8042 events left out of the recording",
+                       &metrics->events_filtered);
+        append_counter(str, "ps2emu_record_output_bytes",
+                       "Bytes of events written to the recording",
+                       &metrics->output_bytes);
+        append_histogram(str, "ps2emu_record_kmsg_lag_seconds",
+                         "How long after the kernel logged each event it was "
+                         "read",
+                         &metrics->kmsg_lag);
+        append_gauge(str, "ps2emu_record_kmsg_queue_records",
+                     "Records read from the kernel log waiting to be parsed",
+                     queue_length(&metrics->kmsg_records,
+                                  &metrics->kmsg_records_parsed));
+        append_gauge(str, "ps2emu_record_kmsg_queue_max_records",
+                     "The most records that were ever waiting to be parsed",
+                     load(&metrics->kmsg_queue_max));
+        append_gauge(str, "ps2emu_record_output_queue_lines",
+                     "Lines of the recording waiting to be written",
+                     queue_length(&metrics->output_lines,
+                                  &metrics->output_lines_written));
+        append_gauge(str, "ps2emu_record_output_queue_max_lines",
+                     "The most lines that were ever waiting to be written",
+                     load(&metrics->output_queue_max));
+        append_histogram(str, "ps2emu_record_output_stall_seconds",
+                         "How long writing out each batch of the recording "
+                         "took",
+                         &metrics->output_stall);
+    }
+
+    resident_bytes = get_resident_bytes();
+    if (resident_bytes >= 0) {
+        g_string_append_printf(str,
+                               "# TYPE process_resident_memory_bytes gauge\n"
+                               "# UNIT process_resident_memory_bytes bytes\n"
+                               "# HELP process_resident_memory_bytes "
+                               "Resident memory size\n"
+                               "process_resident_memory_bytes %"
+                               G_GINT64_FORMAT "\n",
+                               resident_bytes);
+    }
+
+    g_string_append(str, "# EOF\n");
+
+    return g_string_free(str, FALSE);
+}
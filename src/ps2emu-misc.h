@@ -20,14 +20,12 @@
 #include <stdlib.h>
 #include <glib.h>
 
-#define PS2EMU_ERROR (g_quark_from_static_string("ps2emu-error"))
+#include "ps2emu.h"
+
 #define PS2EMU_LOG_VERSION 1
 
-typedef enum {
-    PS2EMU_ERROR_INPUT,
-    PS2EMU_ERROR_NO_EVENTS,
-    PS2EMU_ERROR_MISC
-} PS2Error;
+/* How long the device has to be quiet before we consider it initialized */
+#define PS2EMU_INIT_TIMEOUT_SECS 5
 
 gboolean print_version(const gchar *option_name,
                        const gchar *value,
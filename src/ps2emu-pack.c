@@ -0,0 +1,292 @@
+/*
+ * ps2emu-pack.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-packed-log.h"
+#include "ps2emu-log-image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <sys/stat.h>
+
+typedef struct {
+    guint logs;
+    guint64 text_size;
+    guint64 packed_size;
+} FamilyStats;
+
+static ParsedLog *load_text_log(const gchar *path,
+                                int *log_version,
+                                GError **error) {
+    GIOChannel *input_channel;
+    ParsedLog *log;
+
+    input_channel = g_io_channel_new_file(path, "r", error);
+    if (!input_channel) {
+        g_prefix_error(error, "While opening %s: ", path);
+        return NULL;
+    }
+
+    *log_version = log_parse_version(input_channel, error);
+    if (*log_version < 0) {
+        g_io_channel_unref(input_channel);
+        return NULL;
+    }
+
+    log = log_parse(input_channel, *log_version, error);
+    g_io_channel_unref(input_channel);
+
+    return log;
+}
+
+static void append_section(GString *out,
+                           GList *section,
+                           int log_version,
+                           PS2Port port) {
+    for (GList *l = section; l != NULL; l = l->next) {
+        LogLine *log_line = l->data;
+        PS2Event *event;
+        gchar *event_str;
+
+        if (log_line->type == LINE_TYPE_NOTE) {
+            g_string_append_printf(out, "N: %s\n", log_line->note);
+            continue;
+        }
+
+        event = log_line->ps2_event;
+        if (log_version == 0) {
+            g_string_append_printf(
+                out, "%-10ld %c %c %.2hhx\n", event->time,
+                port == PS2_PORT_KBD ? 'K' : 'A',
+                event->type == PS2_EVENT_TYPE_INTERRUPT ? 'R' : 'S',
+                event->data);
+            continue;
+        }
+
+        event_str = ps2_event_to_string(event, event->time);
+        g_string_append(out, event_str);
+        g_free(event_str);
+    }
+}
+
+static gboolean pack(const gchar *input,
+                     const gchar *output,
+                     GError **error) {
+    ParsedLog *log;
+    GByteArray *packed;
+    int log_version;
+    gboolean ret;
+
+    log = load_text_log(input, &log_version, error);
+    if (!log)
+        return FALSE;
+
+    packed = packed_log_encode(log, log_version);
+    ret = g_file_set_contents(output, (const gchar*)packed->data, packed->len,
+                              error);
+
+    g_byte_array_free(packed, TRUE);
+    log_free(log);
+
+    return ret;
+}
+
+/* Images can be made from text or packed logs */
+static gboolean make_image(const gchar *input,
+                           const gchar *output,
+                           GError **error) {
+    ParsedLog *log;
+    GByteArray *image;
+    int log_version;
+    gboolean ret;
+
+    if (packed_log_file_test(input))
+        log = packed_log_load(input, &log_version, error);
+    else
+        log = load_text_log(input, &log_version, error);
+
+    if (!log)
+        return FALSE;
+
+    image = log_image_encode(log, log_version);
+    ret = g_file_set_contents(output, (const gchar*)image->data, image->len,
+                              error);
+
+    g_byte_array_free(image, TRUE);
+    log_free(log);
+
+    return ret;
+}
+
+static gboolean unpack(const gchar *input,
+                       const gchar *output,
+                       GError **error) {
+    ParsedLog *log;
+    GString *out;
+    int log_version;
+    gboolean ret;
+
+    log = packed_log_load(input, &log_version, error);
+    if (!log)
+        return FALSE;
+
+    out = g_string_new(NULL);
+    g_string_append_printf(out, "# ps2emu-record V%d\n", log_version);
+    if (log->header)
+        g_string_append(out, log->header);
+
+    if (log_version >= 1) {
+        g_string_append_printf(out, "T: %c\n",
+                               log->port == PS2_PORT_KBD ? 'K' : 'A');
+        g_string_append(out, "S: Init\n");
+        append_section(out, log->init_section, log_version, log->port);
+        g_string_append(out, "S: Main\n");
+    }
+    append_section(out, log->main_section, log_version, log->port);
+
+    ret = g_file_set_contents(output, out->str, out->len, error);
+
+    g_string_free(out, TRUE);
+    log_free(log);
+
+    return ret;
+}
+
+static void print_family_stats(gpointer key,
+                               gpointer value,
+                               gpointer data) {
+    FamilyStats *stats = value;
+
+    printf("%-40s %6u %12lu %12lu %7.2f\n",
+           (const gchar*)key, stats->logs, stats->text_size,
+           stats->packed_size,
+           (gdouble)stats->text_size / MAX(stats->packed_size, 1));
+}
+
+static gboolean print_stats(gchar **paths,
+                            GError **error) {
+    GHashTable *families = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, g_free);
+    gboolean ret = TRUE;
+
+    for (gchar **path = paths; *path != NULL; path++) {
+        ParsedLog *log;
+        GByteArray *packed;
+        FamilyStats *stats;
+        struct stat st;
+        int log_version;
+
+        log = load_text_log(*path, &log_version, error);
+        if (!log || stat(*path, &st) != 0) {
+            if (log)
+                log_free(log);
+
+            fprintf(stderr, "Skipping %s: %s\n", *path,
+                    *error ? (*error)->message : "stat failed");
+            g_clear_error(error);
+            ret = FALSE;
+            continue;
+        }
+
+        packed = packed_log_encode(log, log_version);
+
+        stats = g_hash_table_lookup(families, log_get_device_family(log));
+        if (!stats) {
+            stats = g_new0(FamilyStats, 1);
+            g_hash_table_insert(families,
+                                g_strdup(log_get_device_family(log)), stats);
+        }
+
+        stats->logs++;
+        stats->text_size += st.st_size;
+        stats->packed_size += packed->len;
+
+        g_byte_array_free(packed, TRUE);
+        log_free(log);
+    }
+
+    printf("%-40s %6s %12s %12s %7s\n",
+           "Device family", "Logs", "Text bytes", "Packed bytes", "Ratio");
+    g_hash_table_foreach(families, print_family_stats, NULL);
+
+    g_hash_table_destroy(families);
+
+    return ret;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<input> <output> - pack PS/2 logs");
+    GError *error = NULL;
+    gboolean do_unpack = FALSE,
+             do_image = FALSE,
+             do_stats = FALSE,
+             rc;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "unpack", 'u', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &do_unpack, "Convert a packed log back into a text log", NULL },
+        { "image", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &do_image, "Convert a text or packed log into a log image, which "
+          "replays can share through a read-only mapping", NULL },
+        { "stats", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &do_stats, "Print the compression ratio of each log given, grouped "
+          "by device family", NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Converts logs created with ps2emu-record into the compact packed log\n"
+        "format, which ps2emu-replay can replay directly.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (do_stats) {
+        if (argc < 2)
+            exit_on_bad_argument(main_context, FALSE,
+                                 "No filenames specified! Use --help for more "
+                                 "information");
+
+        return print_stats(&argv[1], &error) ? 0 : 1;
+    }
+
+    if (argc < 3)
+        exit_on_bad_argument(main_context, FALSE,
+                             "No input or output filename specified! Use "
+                             "--help for more information");
+
+    if (do_unpack)
+        rc = unpack(argv[1], argv[2], &error);
+    else if (do_image)
+        rc = make_image(argv[1], argv[2], &error);
+    else
+        rc = pack(argv[1], argv[2], &error);
+
+    if (!rc) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        return 1;
+    }
+
+    return 0;
+}
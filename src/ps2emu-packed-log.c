@@ -0,0 +1,579 @@
+/*
+ * ps2emu-packed-log.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * The packed log format is a compact binary encoding of a parsed log. After
+ * the file header, the log is stored as a stream of records:
+ *
+ *   0x00                    End of the log
+ *   0x01 <section>          Start of a section (a LogSectionType)
+ *   0x02 <len> <bytes>      A user note
+ *   1d iiiiii ...           A packet of events in direction d
+ *
+ * A packet is a run of bytes going in the same direction, spaced closely
+ * enough together that they're most likely part of the same PS/2 packet. Each
+ * direction keeps an adaptive dictionary of the packets it has seen most
+ * recently. When a packet has the same length as a dictionary entry, it's
+ * stored as the index of the closest entry, a mask of the bytes that changed,
+ * and those bytes XORed against the entry. Otherwise (index 0x3f) the packet
+ * is stored literally. Either way, the packet ends up at the front of the
+ * dictionary.
+ *
+ * The time of the first event in a packet is stored as the difference between
+ * this packet's interval and the last one (delta-of-delta), and the gaps
+ * between the bytes inside the packet are stored relative to the gaps of the
+ * dictionary entry it was matched against. For a touchpad streaming at a
+ * fixed rate, most packets end up taking three or four bytes.
+ *
+ * All integers are stored as LEB128 varints, signed ones zigzag encoded.
+ * Comments on event lines are not preserved.
+ */
+
+#include "ps2emu-packed-log.h"
+#include "ps2emu-misc.h"
+
+#include <string.h>
+#include <glib.h>
+
+#define PACKED_RECORD_END     0x00
+#define PACKED_RECORD_SECTION 0x01
+#define PACKED_RECORD_NOTE    0x02
+#define PACKED_RECORD_PACKET  0x80
+
+#define PACKED_PACKET_DIRECTION_RECEIVED 0x40
+#define PACKED_PACKET_INDEX_MASK         0x3f
+#define PACKED_PACKET_LITERAL            0x3f
+
+#define PACKED_DICT_SIZE       PACKED_PACKET_LITERAL
+#define PACKED_MAX_PACKET_LEN  PS2_MAX_PACKET_LEN
+
+typedef struct {
+    guint8 len;
+    guint8 data[PACKED_MAX_PACKET_LEN];
+    time_t gaps[PACKED_MAX_PACKET_LEN];
+} PackedPacket;
+
+typedef struct {
+    PackedPacket entries[PACKED_DICT_SIZE];
+    guint count;
+} PackedDict;
+
+typedef struct {
+    PackedDict dicts[2];
+    time_t last_time;
+    time_t last_delta;
+} PackedCoder;
+
+static inline guint64 zigzag_encode(gint64 value) {
+    return ((guint64)value << 1) ^ (guint64)(value >> 63);
+}
+
+static inline gint64 zigzag_decode(guint64 value) {
+    return (gint64)(value >> 1) ^ -(gint64)(value & 1);
+}
+
+static void write_varint(GByteArray *out,
+                         guint64 value) {
+    guint8 buf[10];
+    guint len = 0;
+
+    do {
+        buf[len] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            buf[len] |= 0x80;
+        len++;
+    } while (value);
+
+    g_byte_array_append(out, buf, len);
+}
+
+static inline void write_byte(GByteArray *out,
+                              guint8 byte) {
+    g_byte_array_append(out, &byte, 1);
+}
+
+static void write_string(GByteArray *out,
+                         const gchar *str) {
+    gsize len = str ? strlen(str) : 0;
+
+    write_varint(out, len);
+    g_byte_array_append(out, (const guint8*)str, len);
+}
+
+/* Move the entry at index to the front of the dictionary and replace it with
+ * packet. An index past the end of the dictionary inserts a new entry,
+ * evicting the least recently used one if the dictionary is full. Both the
+ * encoder and decoder go through this, so they always agree on the indexes */
+static void packed_dict_use(PackedDict *dict,
+                            guint index,
+                            const PackedPacket *packet) {
+    if (index >= dict->count) {
+        if (dict->count < PACKED_DICT_SIZE)
+            dict->count++;
+
+        index = dict->count - 1;
+    }
+
+    memmove(&dict->entries[1], &dict->entries[0],
+            index * sizeof(PackedPacket));
+    dict->entries[0] = *packet;
+}
+
+static guint packed_dict_find(PackedDict *dict,
+                              const PackedPacket *packet,
+                              guint8 *mask) {
+    guint best_index = PACKED_PACKET_LITERAL,
+          best_changed = G_MAXUINT;
+
+    for (guint i = 0; i < dict->count; i++) {
+        PackedPacket *entry = &dict->entries[i];
+        guint changed = 0;
+        guint8 entry_mask = 0;
+
+        if (entry->len != packet->len)
+            continue;
+
+        for (guint j = 0; j < packet->len; j++) {
+            if (entry->data[j] != packet->data[j]) {
+                entry_mask |= 1 << j;
+                changed++;
+            }
+        }
+
+        if (changed < best_changed) {
+            best_index = i;
+            best_changed = changed;
+            *mask = entry_mask;
+
+            if (changed == 0)
+                break;
+        }
+    }
+
+    return best_index;
+}
+
+static void encode_packet(GByteArray *out,
+                          PackedCoder *coder,
+                          gboolean received,
+                          time_t start_time,
+                          PackedPacket *packet) {
+    PackedDict *dict = &coder->dicts[received];
+    PackedPacket *entry = NULL;
+    guint index;
+    guint8 mask = 0;
+    time_t delta;
+
+    index = packed_dict_find(dict, packet, &mask);
+    if (index != PACKED_PACKET_LITERAL)
+        entry = &dict->entries[index];
+
+    write_byte(out, PACKED_RECORD_PACKET |
+                    (received ? PACKED_PACKET_DIRECTION_RECEIVED : 0) |
+                    index);
+
+    delta = start_time - coder->last_time;
+    write_varint(out, zigzag_encode(delta - coder->last_delta));
+    coder->last_time = start_time;
+    coder->last_delta = delta;
+
+    if (entry) {
+        write_byte(out, mask);
+        for (guint i = 0; i < packet->len; i++) {
+            if (mask & (1 << i))
+                write_byte(out, packet->data[i] ^ entry->data[i]);
+        }
+    } else {
+        write_byte(out, packet->len);
+        g_byte_array_append(out, packet->data, packet->len);
+    }
+
+    for (guint i = 1; i < packet->len; i++) {
+        write_varint(out, zigzag_encode(packet->gaps[i] -
+                                        (entry ? entry->gaps[i] : 0)));
+    }
+
+    packed_dict_use(dict, index, packet);
+}
+
+static void encode_section(GByteArray *out,
+                           PackedCoder *coder,
+                           GList *section) {
+    PackedPacket packet = { 0 };
+    PS2Event *last_event = NULL;
+    gboolean received = FALSE;
+    time_t start_time = 0;
+
+    coder->last_time = 0;
+    coder->last_delta = 0;
+
+    for (GList *l = section; l != NULL; l = l->next) {
+        LogLine *log_line = l->data;
+        PS2Event *event;
+        gboolean event_received;
+
+        if (log_line->type == LINE_TYPE_NOTE) {
+            if (packet.len) {
+                encode_packet(out, coder, received, start_time, &packet);
+                packet.len = 0;
+            }
+
+            write_byte(out, PACKED_RECORD_NOTE);
+            write_string(out, log_line->note);
+            continue;
+        }
+
+        event = log_line->ps2_event;
+        event_received = event->type == PS2_EVENT_TYPE_INTERRUPT;
+
+        if (packet.len &&
+            !ps2_event_continues_packet(last_event, packet.len, event)) {
+            encode_packet(out, coder, received, start_time, &packet);
+            packet.len = 0;
+        }
+
+        if (packet.len == 0) {
+            received = event_received;
+            start_time = event->time;
+            packet.gaps[0] = 0;
+        } else
+            packet.gaps[packet.len] = event->time - last_event->time;
+
+        packet.data[packet.len++] = event->data;
+        last_event = event;
+    }
+
+    if (packet.len)
+        encode_packet(out, coder, received, start_time, &packet);
+}
+
+GByteArray *packed_log_encode(ParsedLog *parsed_log,
+                              int log_version) {
+    GByteArray *out = g_byte_array_new();
+    PackedCoder *coder = g_new0(PackedCoder, 1);
+
+    g_byte_array_append(out, (const guint8*)PACKED_LOG_MAGIC,
+                        PACKED_LOG_MAGIC_LEN);
+    write_byte(out, PACKED_LOG_FORMAT_VERSION);
+    write_byte(out, log_version);
+    write_byte(out, parsed_log->port == PS2_PORT_KBD ? 'K' : 'A');
+    write_string(out, parsed_log->header);
+    write_string(out, parsed_log->device_name);
+
+    /* V0 logs don't have any sections, everything's in the main section */
+    if (log_version >= 1) {
+        write_byte(out, PACKED_RECORD_SECTION);
+        write_byte(out, SECTION_TYPE_INIT);
+        encode_section(out, coder, parsed_log->init_section);
+
+        write_byte(out, PACKED_RECORD_SECTION);
+        write_byte(out, SECTION_TYPE_MAIN);
+    }
+    encode_section(out, coder, parsed_log->main_section);
+
+    write_byte(out, PACKED_RECORD_END);
+
+    g_free(coder);
+
+    return out;
+}
+
+typedef struct {
+    const guint8 *pos;
+    const guint8 *end;
+} PackedReader;
+
+static inline gboolean read_byte(PackedReader *reader,
+                                 guint8 *byte) {
+    if (G_UNLIKELY(reader->pos >= reader->end))
+        return FALSE;
+
+    *byte = *reader->pos++;
+    return TRUE;
+}
+
+static gboolean read_varint(PackedReader *reader,
+                            guint64 *value) {
+    guint shift = 0;
+    guint8 byte;
+
+    *value = 0;
+    do {
+        if (!read_byte(reader, &byte) || shift > 63)
+            return FALSE;
+
+        *value |= (guint64)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return TRUE;
+}
+
+static gboolean read_signed_varint(PackedReader *reader,
+                                   gint64 *value) {
+    guint64 raw;
+
+    if (!read_varint(reader, &raw))
+        return FALSE;
+
+    *value = zigzag_decode(raw);
+    return TRUE;
+}
+
+static gboolean read_string(PackedReader *reader,
+                            gchar **str) {
+    guint64 len;
+
+    if (!read_varint(reader, &len) || len > reader->end - reader->pos)
+        return FALSE;
+
+    *str = len ? g_strndup((const gchar*)reader->pos, len) : NULL;
+    reader->pos += len;
+
+    return TRUE;
+}
+
+static gboolean decode_packet(PackedReader *reader,
+                              PackedCoder *coder,
+                              guint8 tag,
+                              GList **section_dest) {
+    gboolean received = !!(tag & PACKED_PACKET_DIRECTION_RECEIVED);
+    PackedDict *dict = &coder->dicts[received];
+    guint index = tag & PACKED_PACKET_INDEX_MASK;
+    PackedPacket packet;
+    gint64 delta_of_delta,
+           gap;
+    time_t time;
+    guint8 mask;
+
+    if (!read_signed_varint(reader, &delta_of_delta))
+        return FALSE;
+
+    coder->last_delta += delta_of_delta;
+    coder->last_time += coder->last_delta;
+
+    if (index == PACKED_PACKET_LITERAL) {
+        if (!read_byte(reader, &packet.len) ||
+            packet.len == 0 || packet.len > PACKED_MAX_PACKET_LEN ||
+            packet.len > reader->end - reader->pos)
+            return FALSE;
+
+        memcpy(packet.data, reader->pos, packet.len);
+        reader->pos += packet.len;
+        memset(packet.gaps, 0, sizeof(packet.gaps));
+    } else {
+        if (index >= dict->count || !read_byte(reader, &mask))
+            return FALSE;
+
+        packet = dict->entries[index];
+        for (guint i = 0; i < packet.len; i++) {
+            guint8 delta;
+
+            if (!(mask & (1 << i)))
+                continue;
+
+            if (!read_byte(reader, &delta))
+                return FALSE;
+
+            packet.data[i] ^= delta;
+        }
+    }
+
+    time = coder->last_time;
+    for (guint i = 0; i < packet.len; i++) {
+        LogLine *log_line;
+        PS2Event *event;
+
+        if (i > 0) {
+            if (!read_signed_varint(reader, &gap))
+                return FALSE;
+
+            packet.gaps[i] += gap;
+            time += packet.gaps[i];
+        }
+
+        event = g_slice_new(PS2Event);
+        *event = (PS2Event) {
+            .time = time,
+            .type = received ? PS2_EVENT_TYPE_INTERRUPT :
+                               PS2_EVENT_TYPE_PARAMETER,
+            .data = packet.data[i],
+            .original_line = NULL,
+        };
+
+        log_line = g_slice_new(LogLine);
+        *log_line = (LogLine) {
+            .type = LINE_TYPE_EVENT,
+            .ps2_event = event,
+        };
+
+        *section_dest = g_list_prepend(*section_dest, log_line);
+    }
+
+    packed_dict_use(dict, index, &packet);
+
+    return TRUE;
+}
+
+ParsedLog *packed_log_decode(const guint8 *data,
+                             gsize len,
+                             int *log_version,
+                             GError **error) {
+    PackedReader reader = {
+        .pos = data,
+        .end = data + len,
+    };
+    PackedCoder *coder = g_new0(PackedCoder, 1);
+    ParsedLog *parsed_log = g_new0(ParsedLog, 1);
+    GList **section_dest = &parsed_log->main_section;
+    guint8 format_version,
+           version,
+           port,
+           tag,
+           section;
+
+    if (len < PACKED_LOG_MAGIC_LEN ||
+        memcmp(data, PACKED_LOG_MAGIC, PACKED_LOG_MAGIC_LEN) != 0) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Not a packed log");
+        goto error;
+    }
+    reader.pos += PACKED_LOG_MAGIC_LEN;
+
+    if (!read_byte(&reader, &format_version) ||
+        !read_byte(&reader, &version) ||
+        !read_byte(&reader, &port) ||
+        !read_string(&reader, &parsed_log->header) ||
+        !read_string(&reader, &parsed_log->device_name))
+        goto truncated;
+
+    if (format_version > PACKED_LOG_FORMAT_VERSION) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Packed log format is too new (found %d, we only support "
+                    "up to %d)", format_version, PACKED_LOG_FORMAT_VERSION);
+        goto error;
+    }
+
+    /* The version of the log that was packed, which decides what its events
+     * mean */
+    if (version > PS2EMU_LOG_VERSION) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Log version is too new (found %d, we only support up to "
+                    "%d)", version, PS2EMU_LOG_VERSION);
+        goto error;
+    }
+
+    parsed_log->port = port == 'K' ? PS2_PORT_KBD : PS2_PORT_AUX;
+    *log_version = version;
+
+    while (read_byte(&reader, &tag)) {
+        gchar *note;
+        LogLine *log_line;
+
+        if (tag & PACKED_RECORD_PACKET) {
+            if (!decode_packet(&reader, coder, tag, section_dest))
+                goto truncated;
+
+            continue;
+        }
+
+        switch (tag) {
+            case PACKED_RECORD_END:
+                goto done;
+            case PACKED_RECORD_SECTION:
+                if (!read_byte(&reader, &section))
+                    goto truncated;
+
+                if (section == SECTION_TYPE_INIT)
+                    section_dest = &parsed_log->init_section;
+                else
+                    section_dest = &parsed_log->main_section;
+
+                coder->last_time = 0;
+                coder->last_delta = 0;
+                break;
+            case PACKED_RECORD_NOTE:
+                if (!read_string(&reader, &note) || !note)
+                    goto truncated;
+
+                log_line = g_slice_new(LogLine);
+                *log_line = (LogLine) {
+                    .type = LINE_TYPE_NOTE,
+                    .note = note,
+                };
+                *section_dest = g_list_prepend(*section_dest, log_line);
+                break;
+            default:
+                g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Invalid record type 0x%.2hhx in packed log", tag);
+                goto error;
+        }
+    }
+
+truncated:
+    g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                        "Packed log is truncated or corrupt");
+    goto error;
+
+done:
+    parsed_log->init_section = g_list_reverse(parsed_log->init_section);
+    parsed_log->main_section = g_list_reverse(parsed_log->main_section);
+
+    g_free(coder);
+    return parsed_log;
+
+error:
+    g_free(coder);
+    log_free(parsed_log);
+    return NULL;
+}
+
+gboolean packed_log_file_test(const gchar *path) {
+    gchar magic[PACKED_LOG_MAGIC_LEN];
+    gboolean ret;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file)
+        return FALSE;
+
+    ret = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+          memcmp(magic, PACKED_LOG_MAGIC, sizeof(magic)) == 0;
+
+    fclose(file);
+    return ret;
+}
+
+ParsedLog *packed_log_load(const gchar *path,
+                           int *log_version,
+                           GError **error) {
+    GMappedFile *file;
+    ParsedLog *parsed_log;
+
+    file = g_mapped_file_new(path, FALSE, error);
+    if (!file) {
+        g_prefix_error(error, "While opening %s: ", path);
+        return NULL;
+    }
+
+    parsed_log = packed_log_decode(
+        (const guint8*)g_mapped_file_get_contents(file),
+        g_mapped_file_get_length(file), log_version, error);
+
+    g_mapped_file_unref(file);
+
+    return parsed_log;
+}
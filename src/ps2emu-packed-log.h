@@ -0,0 +1,44 @@
+/*
+ * ps2emu-packed-log.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_PACKED_LOG_H__
+#define __PS2EMU_PACKED_LOG_H__
+
+#include <glib.h>
+
+#include "ps2emu-log.h"
+
+#define PACKED_LOG_MAGIC "PS2EMUPK"
+#define PACKED_LOG_MAGIC_LEN (sizeof(PACKED_LOG_MAGIC) - 1)
+#define PACKED_LOG_FORMAT_VERSION 1
+
+gboolean packed_log_file_test(const gchar *path);
+
+GByteArray *packed_log_encode(ParsedLog *parsed_log,
+                              int log_version)
+G_GNUC_WARN_UNUSED_RESULT G_GNUC_MALLOC;
+
+ParsedLog *packed_log_decode(const guint8 *data,
+                             gsize len,
+                             int *log_version,
+                             GError **error)
+G_GNUC_MALLOC;
+
+ParsedLog *packed_log_load(const gchar *path,
+                           int *log_version,
+                           GError **error)
+G_GNUC_MALLOC;
+
+#endif /* !__PS2EMU_PACKED_LOG_H__ */
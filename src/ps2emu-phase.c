@@ -0,0 +1,28 @@
+/*
+ * ps2emu-phase.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu.h"
+#include "ps2emu-lib-private.h"
+
+#include <glib.h>
+
+PS2EmuPhaseFunc lib_phase_func = NULL;
+gpointer lib_phase_data = NULL;
+
+void ps2emu_set_phase_callback(PS2EmuPhaseFunc func,
+                               gpointer user_data) {
+    lib_phase_func = func;
+    lib_phase_data = user_data;
+}
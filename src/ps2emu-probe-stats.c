@@ -0,0 +1,269 @@
+/*
+ * ps2emu-probe-stats.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-probe-stats.h"
+
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+
+/* Two-sided 95% quantiles of Student's t distribution, by degrees of freedom.
+ * Past the end of the table it's close enough to the normal distribution */
+static const gdouble t_95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+#define T_95_NORMAL 1.960
+
+struct _ProbeStats {
+    GArray *timings;
+};
+
+typedef struct {
+    guint n;
+    gdouble mean;
+    gdouble stddev;
+    /* Half the width of the 95% confidence interval of the mean */
+    gdouble ci;
+    gint64 min;
+    gint64 max;
+} Summary;
+
+static void summarize(const gint64 *values,
+                      guint n,
+                      Summary *summary) {
+    gdouble sum = 0,
+            squares = 0;
+
+    *summary = (Summary) { .n = n };
+    if (!n)
+        return;
+
+    summary->min = summary->max = values[0];
+    for (guint i = 0; i < n; i++) {
+        sum += values[i];
+        summary->min = MIN(summary->min, values[i]);
+        summary->max = MAX(summary->max, values[i]);
+    }
+    summary->mean = sum / n;
+
+    if (n < 2)
+        return;
+
+    for (guint i = 0; i < n; i++)
+        squares += (values[i] - summary->mean) * (values[i] - summary->mean);
+
+    summary->stddev = sqrt(squares / (n - 1));
+    summary->ci = (n - 1 <= G_N_ELEMENTS(t_95) ? t_95[n - 2] : T_95_NORMAL) *
+                  summary->stddev / sqrt(n);
+}
+
+static void print_ms(FILE *output,
+                     gdouble usecs) {
+    fprintf(output, "%9.3f", usecs / 1000);
+}
+
+static void print_summary(FILE *output,
+                          const gchar *label,
+                          const gint64 *values,
+                          guint n) {
+    Summary summary;
+
+    summarize(values, n, &summary);
+
+    fprintf(output, "%-24s", label);
+    print_ms(output, summary.mean);
+    fprintf(output, " ±");
+    print_ms(output, summary.ci);
+    fprintf(output, " ms (stddev");
+    print_ms(output, summary.stddev);
+    fprintf(output, ", min");
+    print_ms(output, summary.min);
+    fprintf(output, ", max");
+    print_ms(output, summary.max);
+    fprintf(output, ")\n");
+}
+
+ProbeStats *probe_stats_new(void) {
+    ProbeStats *stats = g_new0(ProbeStats, 1);
+
+    stats->timings = g_array_new(FALSE, FALSE, sizeof(PS2EmuProbeTiming));
+    g_array_set_clear_func(stats->timings,
+                           (GDestroyNotify)ps2emu_probe_timing_clear);
+
+    return stats;
+}
+
+void probe_stats_add(ProbeStats *stats,
+                     PS2EmuProbeTiming *timing) {
+    g_array_append_vals(stats->timings, timing, 1);
+    *timing = (PS2EmuProbeTiming) { 0 };
+}
+
+static gint64 last_command_time(const PS2EmuProbeTiming *timing) {
+    if (!timing->n_commands)
+        return 0;
+
+    return timing->commands[timing->n_commands - 1].time;
+}
+
+static void sum_waits(const PS2EmuProbeTiming *timing,
+                      gint64 *driver,
+                      gint64 *timeout) {
+    *driver = *timeout = 0;
+
+    for (guint i = 0; i < timing->n_commands; i++) {
+        const PS2EmuProbeCommand *command = &timing->commands[i];
+
+        if (command->wait_type == PS2EMU_PROBE_WAIT_TIMEOUT)
+            *timeout += command->wait;
+        else
+            *driver += command->wait;
+    }
+}
+
+void probe_stats_print_run(const PS2EmuProbeTiming *timing,
+                           guint run,
+                           FILE *output) {
+    gint64 driver,
+           timeout;
+
+    sum_waits(timing, &driver, &timeout);
+
+    fprintf(output, "Run %3u: %9.3f ms, %u commands, driver %9.3f ms, "
+            "timeouts %9.3f ms\n",
+            run, timing->total / 1000.0, timing->n_commands,
+            driver / 1000.0, timeout / 1000.0);
+}
+
+static gboolean same_commands(const PS2EmuProbeTiming *a,
+                              const PS2EmuProbeTiming *b) {
+    if (a->n_commands != b->n_commands)
+        return FALSE;
+
+    for (guint i = 0; i < a->n_commands; i++) {
+        if (a->commands[i].data != b->commands[i].data)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void print_commands(ProbeStats *stats,
+                           FILE *output) {
+    const PS2EmuProbeTiming *first =
+        &g_array_index(stats->timings, PS2EmuProbeTiming, 0);
+    GPtrArray *matching = g_ptr_array_new();
+    gint64 *values;
+
+    for (guint i = 0; i < stats->timings->len; i++) {
+        PS2EmuProbeTiming *timing =
+            &g_array_index(stats->timings, PS2EmuProbeTiming, i);
+
+        if (same_commands(first, timing))
+            g_ptr_array_add(matching, timing);
+    }
+
+    fprintf(output, "\nCommands (%u of %u runs sent the same ones):\n",
+            matching->len, stats->timings->len);
+    fprintf(output, "   #  cmd    at (ms)             wait (ms)  "
+            "waiting on\n");
+
+    values = g_new(gint64, matching->len);
+    for (guint i = 0; i < first->n_commands; i++) {
+        guint timeouts = 0;
+        Summary at,
+                wait;
+
+        for (guint run = 0; run < matching->len; run++) {
+            const PS2EmuProbeTiming *timing = matching->pdata[run];
+
+            values[run] = timing->commands[i].time;
+            if (timing->commands[i].wait_type == PS2EMU_PROBE_WAIT_TIMEOUT)
+                timeouts++;
+        }
+        summarize(values, matching->len, &at);
+
+        for (guint run = 0; run < matching->len; run++) {
+            const PS2EmuProbeTiming *timing = matching->pdata[run];
+
+            values[run] = timing->commands[i].wait;
+        }
+        summarize(values, matching->len, &wait);
+
+        fprintf(output, "%4u   %.2hhx  ", i, first->commands[i].data);
+        print_ms(output, at.mean);
+        fprintf(output, "  ");
+        print_ms(output, wait.mean);
+        fprintf(output, " ±");
+        print_ms(output, wait.ci);
+        fprintf(output, "  %s\n",
+                timeouts == 0              ? "driver"  :
+                timeouts == matching->len  ? "timeout" :
+                                             "mixed");
+    }
+
+    g_free(values);
+    g_ptr_array_free(matching, TRUE);
+}
+
+void probe_stats_print(ProbeStats *stats,
+                       FILE *output) {
+    const guint n = stats->timings->len;
+    gint64 *totals,
+           *drivers,
+           *timeouts,
+           *tails;
+
+    if (!n)
+        return;
+
+    totals = g_new(gint64, n);
+    drivers = g_new(gint64, n);
+    timeouts = g_new(gint64, n);
+    tails = g_new(gint64, n);
+
+    for (guint i = 0; i < n; i++) {
+        const PS2EmuProbeTiming *timing =
+            &g_array_index(stats->timings, PS2EmuProbeTiming, i);
+
+        totals[i] = timing->total;
+        sum_waits(timing, &drivers[i], &timeouts[i]);
+
+        /* Drivers can create their input device before they're done sending
+         * commands, in which case this is negative */
+        tails[i] = timing->total - last_command_time(timing);
+    }
+
+    fprintf(output, "\nProbe time over %u runs, with 95%% confidence "
+            "intervals:\n", n);
+    print_summary(output, "Total", totals, n);
+    print_summary(output, "Waiting on the driver", drivers, n);
+    print_summary(output, "Waiting on timeouts", timeouts, n);
+    print_summary(output, "Last command to evdev", tails, n);
+
+    print_commands(stats, output);
+
+    g_free(totals);
+    g_free(drivers);
+    g_free(timeouts);
+    g_free(tails);
+}
+
+void probe_stats_free(ProbeStats *stats) {
+    g_array_free(stats->timings, TRUE);
+    g_free(stats);
+}
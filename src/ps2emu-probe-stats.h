@@ -0,0 +1,46 @@
+/*
+ * ps2emu-probe-stats.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_PROBE_STATS_H__
+#define __PS2EMU_PROBE_STATS_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+#include "ps2emu.h"
+
+/* Collects the probe timings of repeated runs, and summarizes them with 95%
+ * confidence intervals */
+typedef struct _ProbeStats ProbeStats;
+
+ProbeStats *probe_stats_new(void);
+
+/* Takes over the commands of timing, and clears it */
+void probe_stats_add(ProbeStats *stats,
+                     PS2EmuProbeTiming *timing);
+
+void probe_stats_print_run(const PS2EmuProbeTiming *timing,
+                           guint run,
+                           FILE *output);
+
+/* The total probe time, how it splits between the driver and host timeouts,
+ * and how long each command took. Only the runs where the host sent the same
+ * commands as the first one go into the per-command breakdown */
+void probe_stats_print(ProbeStats *stats,
+                       FILE *output);
+
+void probe_stats_free(ProbeStats *stats);
+
+#endif /* !__PS2EMU_PROBE_STATS_H__ */
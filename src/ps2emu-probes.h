@@ -0,0 +1,35 @@
+/*
+ * ps2emu-probes.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_PROBES_H__
+#define __PS2EMU_PROBES_H__
+
+#include "config.h"
+
+/* USDT probes for perf, bpftrace and systemtap, all under the ps2emu provider.
+ * A disabled probe is a single nop, and without --enable-usdt they're compiled
+ * out entirely. The arguments of each probe are documented in the man pages of
+ * ps2emu-replay and ps2emu-record, keep them in sync.
+ *
+ * Arguments have to be integers or pointers */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define PS2EMU_PROBE(name, ...) STAP_PROBEV(ps2emu, name, ##__VA_ARGS__)
+#else
+#define PS2EMU_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* !__PS2EMU_PROBES_H__ */
@@ -0,0 +1,195 @@
+/*
+ * ps2emu-profile.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+/* Enough for every phase of a replay or a recording. The table is static so
+ * that profiling doesn't allocate anything itself */
+#define PROFILE_MAX_PHASES 32
+
+typedef struct {
+    const gchar *name;
+    gint64 time;
+    guint64 allocs;
+    guint64 bytes;
+} ProfilePhase;
+
+static ProfilePhase phases[PROFILE_MAX_PHASES];
+static guint phase_count = 0;
+static ProfilePhase *current_phase = NULL;
+
+static gint64 phase_start_time;
+static guint64 phase_start_allocs;
+static guint64 phase_start_bytes;
+
+/* Counts allocations by interposing the allocator in glibc. Since this is
+ * linked into the main executable, everything it links to (glib and libps2emu
+ * included) ends up calling these. Nothing is counted until profile_start()
+ * is called, so the allocator only pays for a branch when we aren't
+ * profiling. Any thread can allocate, so the counters are added to
+ * atomically */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static gboolean counting = FALSE;
+static guint64 alloc_count = 0;
+static guint64 alloc_bytes = 0;
+
+static inline void count_alloc(size_t size) {
+    if (G_LIKELY(!__atomic_load_n(&counting, __ATOMIC_RELAXED)))
+        return;
+
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb,
+             size_t size) {
+    count_alloc(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr,
+              size_t size) {
+    count_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment,
+               size_t size) {
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment,
+                    size_t size) {
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr,
+                   size_t alignment,
+                   size_t size) {
+    /* __libc_memalign() rounds bad alignments up instead of failing */
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    count_alloc(size);
+
+    *memptr = __libc_memalign(alignment, size);
+
+    return *memptr ? 0 : ENOMEM;
+}
+
+guint64 profile_get_alloc_count(void) {
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+guint64 profile_get_alloc_bytes(void) {
+    return __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+}
+
+void profile_start(void) {
+    __atomic_store_n(&counting, TRUE, __ATOMIC_RELAXED);
+}
+
+static void end_current_phase(void) {
+    if (!current_phase)
+        return;
+
+    current_phase->time += g_get_monotonic_time() - phase_start_time;
+    current_phase->allocs += profile_get_alloc_count() - phase_start_allocs;
+    current_phase->bytes += profile_get_alloc_bytes() - phase_start_bytes;
+}
+
+void profile_phase(const gchar *phase,
+                   gpointer user_data) {
+    ProfilePhase *next_phase = NULL;
+
+    end_current_phase();
+
+    for (guint i = 0; i < phase_count; i++) {
+        if (strcmp(phases[i].name, phase) == 0) {
+            next_phase = &phases[i];
+            break;
+        }
+    }
+
+    if (!next_phase) {
+        /* Keep counting towards the current phase if we run out of room */
+        if (phase_count < PROFILE_MAX_PHASES) {
+            next_phase = &phases[phase_count++];
+            next_phase->name = phase;
+        } else {
+            next_phase = current_phase;
+        }
+    }
+
+    current_phase = next_phase;
+    phase_start_time = g_get_monotonic_time();
+    phase_start_allocs = profile_get_alloc_count();
+    phase_start_bytes = profile_get_alloc_bytes();
+}
+
+static void print_summary(void) {
+    struct rusage usage;
+    gint64 total_time = 0;
+    guint64 total_allocs = 0,
+            total_bytes = 0;
+
+    end_current_phase();
+    current_phase = NULL;
+
+    fprintf(stderr, "\n%-20s %12s %12s %14s\n",
+            "Phase", "Time (ms)", "Allocations", "Bytes");
+
+    for (guint i = 0; i < phase_count; i++) {
+        fprintf(stderr, "%-20s %12.3f %12" G_GUINT64_FORMAT
+                " %14" G_GUINT64_FORMAT "\n",
+                phases[i].name, phases[i].time / 1000.0, phases[i].allocs,
+                phases[i].bytes);
+
+        total_time += phases[i].time;
+        total_allocs += phases[i].allocs;
+        total_bytes += phases[i].bytes;
+    }
+
+    fprintf(stderr, "%-20s %12.3f %12" G_GUINT64_FORMAT
+            " %14" G_GUINT64_FORMAT "\n",
+            "Total", total_time / 1000.0, total_allocs, total_bytes);
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stderr, "Peak RSS: %ld KiB\n", usage.ru_maxrss);
+}
+
+void profile_print_at_exit(void) {
+    atexit(print_summary);
+}
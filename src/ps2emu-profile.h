@@ -0,0 +1,42 @@
+/*
+ * ps2emu-profile.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_PROFILE_H__
+#define __PS2EMU_PROFILE_H__
+
+#include <glib.h>
+
+/* Start counting allocations. Programs linking libps2emu-profile replace the
+ * allocator functions in glibc, but they don't count anything until this is
+ * called */
+void profile_start(void);
+
+/* The number of times anything in the process has allocated memory through
+ * malloc() and friends since profile_start(), and the number of bytes it asked
+ * for. glib's slice allocator has to be told to use malloc
+ * (G_SLICE=always-malloc) for all of its allocations to show up here */
+guint64 profile_get_alloc_count(void);
+guint64 profile_get_alloc_bytes(void);
+
+/* Start timing a new phase, ending the current one. Phases with the same name
+ * are added up. Can be passed to ps2emu_set_phase_callback() */
+void profile_phase(const gchar *phase,
+                   gpointer user_data);
+
+/* Print the time and allocations of each phase to stderr when we exit. Call
+ * profile_start() first */
+void profile_print_at_exit(void);
+
+#endif /* !__PS2EMU_PROFILE_H__ */
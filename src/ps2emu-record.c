@@ -15,804 +15,62 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-#include <errno.h>
-#include <error.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <signal.h>
-#include <linux/limits.h>
 
-#include "ps2emu-log.h"
+#include "ps2emu.h"
 #include "ps2emu-misc.h"
-
-typedef struct {
-    GQuark type;
-
-    time_t dmesg_time;
-
-    union {
-        PS2Event event;
-        gint64 start_time;
-    };
-} LogMsgParseResult;
+#include "ps2emu-profile.h"
+#include "ps2emu-metrics-export.h"
 
 static PS2Port recording_target = PS2_PORT_AUX;
+static PS2EmuRecorder *recorder = NULL;
+static PS2EmuTrace *trace = NULL;
+static gchar *trace_path = NULL;
+static PS2EmuMetrics *metrics = NULL;
+static MetricsExporter *exporter = NULL;
 
-static gint64 start_time = 0;
-static time_t dmesg_start_time = 0;
-
-static GHashTable *ports;
-
-#define I8042_OUTPUT  (g_quark_from_static_string("i8042: "))
-#define PS2EMU_OUTPUT (g_quark_from_static_string("ps2emu: "))
-
-#define I8042_DEV_DIR "/sys/devices/platform/i8042/"
-
-#define PS2EMU_INIT_TIMEOUT_SECS 5
-
-static GIOStatus get_next_module_line(GIOChannel *input_channel,
-                                      GQuark *match,
-                                      gchar **output,
-                                      gchar **start_pos,
-                                      GError **error) {
-    static const gchar *search_strings[] = { "i8042: ", "ps2emu: " };
-    int index;
-    gchar *current_line;
-    GIOStatus rc;
-
-    while ((rc = g_io_channel_read_line(input_channel, &current_line, NULL,
-                                        NULL, error)) == G_IO_STATUS_NORMAL) {
-        for (index = 0; index < G_N_ELEMENTS(search_strings); index++) {
-            *start_pos = strstr(current_line, search_strings[index]);
-            if (*start_pos)
-                break;
-        }
-        if (*start_pos)
-            break;
-
-        g_free(current_line);
-    }
-
-    if (rc != G_IO_STATUS_NORMAL) {
-        return rc;
-    }
-
-    /* Move the start position after the initial 'i8042: ' */
-    *start_pos += strlen(search_strings[index]);
-    *output = current_line;
-
-    *match = g_quark_from_static_string(search_strings[index]);
-
-    return rc;
-}
-
-static gboolean parse_normal_event(const gchar *start_pos,
-                                   PS2Event *event,
-                                   GError **error) {
-    gchar *type_str = NULL;
-    gchar **type_str_args = NULL;
-    int type_str_argc,
-        parsed_count,
-        port;
-
-    errno = 0;
-    parsed_count = sscanf(start_pos,
-                          "[%*d] %hhx %*1[-<]%*1[->] i8042 (%m[^)])\n",
-                          &event->data, &type_str);
-
-    if (errno != 0 || parsed_count != 2)
-        return FALSE;
-
-    type_str_args = g_strsplit(type_str, ",", 0);
-
-    if (strcmp(type_str_args[0], "interrupt") == 0) {
-        event->type = PS2_EVENT_TYPE_INTERRUPT;
-
-        type_str_argc = g_strv_length(type_str_args);
-        if (type_str_argc < 3) {
-            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
-                        "Got interrupt event, but had less arguments then "
-                        "expected");
-            goto error;
-        }
-
-        errno = 0;
-        port = strtol(type_str_args[1], NULL, 10);
-        if (errno != 0) {
-            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
-                        "Failed to parse port number from interrupt event: "
-                        "%s\n",
-                        strerror(errno));
-            goto error;
-        }
-
-        event->origin = port;
-    }
-    else if (strcmp(type_str, "command") == 0)
-        event->type = PS2_EVENT_TYPE_COMMAND;
-    else if (strcmp(type_str, "parameter") == 0)
-        event->type = PS2_EVENT_TYPE_PARAMETER;
-    else if (strcmp(type_str, "return") == 0)
-        event->type = PS2_EVENT_TYPE_RETURN;
-    else if (strcmp(type_str, "kbd-data") == 0)
-        event->type = PS2_EVENT_TYPE_KBD_DATA;
-
-    event->original_line = start_pos;
-
-    g_free(type_str);
-    g_strfreev(type_str_args);
-
-    return TRUE;
-
-error:
-    g_free(type_str);
-    g_strfreev(type_str_args);
-
-    return FALSE;
-}
-
-static gboolean parse_record_start_marker(const gchar *start_pos,
-                                          gint64 *start_time) {
-    gint parsed_count;
-
-    errno = 0;
-    parsed_count = sscanf(start_pos,
-                          "Start recording %ld\n",
-                          start_time);
-
-    if (errno != 0 || parsed_count != 1)
-        return FALSE;
-
-    return TRUE;
-}
-
-static GIOStatus parse_next_message(GIOChannel *input_channel,
-                                    LogMsgParseResult *res,
-                                    GError **error) {
-    gchar *start_pos;
-    gchar *current_line = NULL;
-    gint parsed_count;
-    GIOStatus rc;
-
-    while ((rc = get_next_module_line(input_channel, &res->type, &current_line,
-                                      &start_pos, error)) ==
-            G_IO_STATUS_NORMAL) {
-        if (res->type == I8042_OUTPUT) {
-            if (parse_normal_event(start_pos, &res->event, error))
-                break;
-
-            if (*error)
-                goto fail;
-        }
-        else if (res->type == PS2EMU_OUTPUT) {
-            if (parse_record_start_marker(start_pos, &res->start_time))
-                break;
-        }
-
-        g_free(current_line);
-    }
-
-    if (rc != G_IO_STATUS_NORMAL)
-        return rc;
-
-    /* Parse the time value at the beginning of the message */
-    errno = 0;
-    parsed_count = sscanf(current_line, "%*d,%*d,%ld", &res->dmesg_time);
-    if (parsed_count != 1 || errno != 0) {
-        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
-                    "Invalid/no time value received: %s", strerror(errno));
-
-        rc = G_IO_STATUS_ERROR;
-    }
-
-    res->type = res->type;
-
-fail:
-    g_free(current_line);
-
-    return rc;
-}
-
-static GIOStatus process_event(PS2Event *event,
-                               time_t time,
-                               GError **error) {
-    static gboolean ignoring_events = FALSE;
-
-    /* Any commands that we receive with any of the port numbers are just part
-     * of the i8042 probing, and can't be forwarded over serio in the relay
-     * module. Ignore all data we read starting from commands like this, until
-     * we reach a different command */
-    if (!ignoring_events) {
-        if (event->type == PS2_EVENT_TYPE_COMMAND &&
-            g_hash_table_contains(ports, GUINT_TO_POINTER(event->data))) {
-
-            ignoring_events = TRUE;
-            return G_IO_STATUS_NORMAL;
-        }
-    }
-    else {
-        if (event->type == PS2_EVENT_TYPE_COMMAND &&
-            !g_hash_table_contains(ports, GUINT_TO_POINTER(event->data))) {
-
-            ignoring_events = FALSE;
-        }
-        else
-            return G_IO_STATUS_NORMAL;
-    }
-
-    /* Filter out all commands that have made it to this point. With i8042's
-     * debug output, commands just mark the recepient of the message which we
-     * don't need (with the AUX port anyway), and can't use with serio */
-    if (event->type == PS2_EVENT_TYPE_COMMAND)
-        return G_IO_STATUS_NORMAL;
-
-    /* The logic here is that we can only get two types of events from a
-     * keyboard, kbd-data and interrupt. No other device sends kbd-data, so we
-     * can judge if an event comes from a keyboard or not solely based off that.
-     * With interrupts, we can tell if the interrupt is coming from the keyboard
-     * or not by comparing the port number of the event to that of the KBD
-     * port */
-    if (recording_target == PS2_PORT_AUX) {
-        if (event->type == PS2_EVENT_TYPE_INTERRUPT &&
-            event->origin == PS2_PORT_KBD)
-            return G_IO_STATUS_NORMAL;
-
-        if (event->type == PS2_EVENT_TYPE_KBD_DATA)
-            return G_IO_STATUS_NORMAL;
-    }
-
-    if (recording_target == PS2_PORT_KBD) {
-        if (event->type == PS2_EVENT_TYPE_INTERRUPT) {
-            if (event->origin == PS2_PORT_AUX)
-                return G_IO_STATUS_NORMAL;
-        }
-        else if (event->type != PS2_EVENT_TYPE_KBD_DATA)
-            return G_IO_STATUS_NORMAL;
-    }
-
-    if (!dmesg_start_time)
-        dmesg_start_time = time;
+static void write_trace() {
+    GError *error = NULL;
 
-    printf("%s", ps2_event_to_string(event, time - dmesg_start_time));
+    if (!trace)
+        return;
 
-    return G_IO_STATUS_NORMAL;
-}
-
-static gboolean write_to_char_dev(const gchar *cdev,
-                                  GError **error,
-                                  const gchar *format,
-                                  ...) {
-    GIOChannel *channel = g_io_channel_new_file(cdev, "w", error);
-    GIOStatus rc;
-    gchar *data = NULL;
-    gsize data_len,
-          bytes_written;
-    va_list args;
-
-    if (!channel) {
-        g_prefix_error(error, "While opening %s: ", cdev);
-
-        goto error;
+    if (ps2emu_trace_get_dropped(trace)) {
+        fprintf(stderr, "Warning: the trace ran out of room, %"
+                G_GUINT64_FORMAT " events were dropped\n",
+                ps2emu_trace_get_dropped(trace));
     }
 
-    va_start(args, format);
-    data = g_strdup_vprintf(format, args);
-    va_end(args);
-
-    data_len = strlen(data);
-
-    rc = g_io_channel_write_chars(channel, data, data_len, &bytes_written,
-                                  error);
-    if (rc != G_IO_STATUS_NORMAL) {
-        g_prefix_error(error, "While writing to %s: ", cdev);
-
-        goto error;
+    if (!ps2emu_trace_write(trace, trace_path, &error)) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
     }
-
-    g_io_channel_unref(channel);
-    g_free(data);
-    return TRUE;
-
-error:
-    if (channel)
-        g_io_channel_unref(channel);
-
-    g_free(data);
-
-    return FALSE;
 }
 
-static gboolean get_i8042_io_ports(GError **error) {
-    GIOChannel *io_ports_file = g_io_channel_new_file("/proc/ioports", "r",
-                                                      error);
-    gchar *line;
-    GIOStatus rc;
+static void stop_metrics() {
+    if (!exporter)
+        return;
 
-    ports = g_hash_table_new(g_direct_hash, g_direct_equal);
-
-    if (!io_ports_file)
-        return FALSE;
-
-    for (rc = g_io_channel_read_line(io_ports_file, &line, NULL, NULL, error);
-         rc == G_IO_STATUS_NORMAL;
-         rc = g_io_channel_read_line(io_ports_file, &line, NULL, NULL, error)) {
-        guint min, max;
-        gint parsed_count;
-        gchar *device_name;
-
-        errno = 0;
-        parsed_count = sscanf(line, "%x-%x : %m[^\n]\n",
-                              &min, &max, &device_name);
-        if (parsed_count != 3 || errno != 0 ||
-            strcmp(device_name, "keyboard") != 0)
-            goto next;
-
-        for (int i = min; i <= max; i++) {
-            g_hash_table_insert(ports, GUINT_TO_POINTER(i),
-                                GUINT_TO_POINTER(i));
-        }
-next:
-        g_free(line);
-    }
-
-    g_io_channel_unref(io_ports_file);
-
-    return TRUE;
+    metrics_exporter_free(exporter);
+    exporter = NULL;
 }
 
-static inline void disable_i8042_debugging() {
-    g_warn_if_fail(write_to_char_dev("/sys/module/i8042/parameters/debug",
-                                     NULL, "0\n"));
+/* Quit from the main loop instead of the signal handler, so everything that
+ * was read from the kernel log still gets written out */
+static gboolean quit_on_interrupt(gpointer user_data) {
+    ps2emu_recorder_quit(recorder);
 
-    if (recording_target == PS2_PORT_KBD &&
-        g_file_test("/sys/module/i8042/parameters/unmask_kbd_data",
-                    G_FILE_TEST_EXISTS)) {
-        g_warn_if_fail(write_to_char_dev(
-                "/sys/module/i8042/parameters/unmask_kbd_data",
-                NULL, "0\n"));
-    }
+    return G_SOURCE_CONTINUE;
 }
 
-static void exit_on_interrupt() {
-    disable_i8042_debugging();
-
-    exit(0);
-}
-
-static gboolean enable_i8042_debugging(GError **error) {
-    GDir *devices_dir = NULL;
-    GSList *connected_ports = NULL;
-    struct sigaction sigaction_struct;
-
-    devices_dir = g_dir_open(I8042_DEV_DIR, 0, error);
-    if (!devices_dir) {
-        g_prefix_error(error, "While opening " I8042_DEV_DIR ": ");
-
-        goto error;
-    }
-
-    /* Detach the devices before we do anything, this prevents potential race
-     * conditions */
-    for (gchar const *dir_name = g_dir_read_name(devices_dir);
-         dir_name != NULL && *error == NULL;
-         dir_name = g_dir_read_name(devices_dir)) {
-        gchar *file_name;
-        gchar *input_dev_path;
-
-        if (!g_str_has_prefix(dir_name, "serio"))
-            continue;
-
-        /* Check if the port's connected */
-        input_dev_path = g_build_filename(I8042_DEV_DIR, dir_name, "input",
-                                          NULL);
-        if (!g_file_test(input_dev_path, G_FILE_TEST_EXISTS)) {
-            g_free(input_dev_path);
-            continue;
-        }
-
-        g_free(input_dev_path);
-        connected_ports = g_slist_prepend(connected_ports, strdup(dir_name));
-
-        file_name = g_build_filename(I8042_DEV_DIR, dir_name, "drvctl", NULL);
-        if (!write_to_char_dev(file_name, error, "none")) {
-            g_free(file_name);
-            goto error;
-        }
-
-        g_free(file_name);
-    }
-    if (*error)
-        goto error;
-
-    /* We mark when the recording starts, so that we can separate this recording
-     * from other recordings ran during this session */
-    start_time = g_get_monotonic_time();
-
-    if (!write_to_char_dev("/dev/kmsg", error, "ps2emu: Start recording %ld\n",
-                           start_time))
-        goto error;
-
-    /* Enable the debugging output for i8042 */
-    if (!write_to_char_dev("/sys/module/i8042/parameters/debug", error, "1\n"))
-        goto error;
-
-    /* As of Linux 4.3+, data coming out of the KBD port is masked by default */
-    if (recording_target == PS2_PORT_KBD &&
-        g_file_test("/sys/module/i8042/parameters/unmask_kbd_data",
-                    G_FILE_TEST_EXISTS)) {
-        if (!write_to_char_dev("/sys/module/i8042/parameters/unmask_kbd_data",
-                               error, "1\n"))
-            goto error;
-    }
-
-    /* Reattach the devices */
-    g_dir_rewind(devices_dir);
-    for (gchar const *dir_name = g_dir_read_name(devices_dir);
-         dir_name != NULL && *error == NULL;
-         dir_name = g_dir_read_name(devices_dir)) {
-        gchar *file_name;
-        gboolean was_connected = FALSE;
-
-        /* Check if the directory was a previously connected port */
-        for (GSList *l = connected_ports; l != NULL; l = l->next) {
-            if (strcmp(l->data, dir_name) != 0)
-                continue;
-
-            was_connected = TRUE;
-            break;
-        }
-        if (!was_connected)
-            continue;
-
-        file_name = g_build_filename(I8042_DEV_DIR, dir_name, "drvctl", NULL);
-        if (!write_to_char_dev(file_name, error, "rescan")) {
-            g_free(file_name);
-            goto error;
-        }
-
-        g_free(file_name);
-    }
-    if (*error)
-        goto error;
-
-    g_dir_close(devices_dir);
-    g_slist_free_full(connected_ports, g_free);
-
-    /* Disable debugging when this application quits */
-    memset(&sigaction_struct, 0, sizeof(sigaction_struct));
-    sigaction_struct.sa_handler = exit_on_interrupt;
-
-    g_warn_if_fail(sigaction(SIGINT, &sigaction_struct, NULL) == 0);
-    g_warn_if_fail(sigaction(SIGTERM, &sigaction_struct, NULL) == 0);
-    g_warn_if_fail(sigaction(SIGHUP, &sigaction_struct, NULL) == 0);
-
-    return TRUE;
-
-error:
-    if (devices_dir)
-        g_dir_close(devices_dir);
-
-    if (connected_ports)
-        g_slist_free_full(connected_ports, g_free);
-
-    return FALSE;
-}
-
-typedef struct {
-    time_t last_check_time;
-    time_t *last_event_time;
-} InitTimeoutCheckerArgs;
-
-gboolean init_timeout_checker(void *data) {
-    InitTimeoutCheckerArgs *args = data;
-
-    if ((*args->last_event_time - args->last_check_time) / G_USEC_PER_SEC <
-        PS2EMU_INIT_TIMEOUT_SECS)
-        return G_SOURCE_CONTINUE;
-
-    dmesg_start_time = 0;
-
-    /* We can just rely on the main recording function failing if this
-     * happens to fail */
-    printf("S: Main\n");
-
+static void init_done(PS2EmuRecorder *recorder,
+                      gpointer user_data) {
     fprintf(stderr,
             "# The first stage of the recording has completed, you may now use "
             "# your computer normally.\n");
-
-    return G_SOURCE_REMOVE;
-}
-
-typedef struct {
-    LogMsgParseResult *res;
-    gboolean *ret;
-    GError **error;
-} DmesgEventHandlerArgs;
-
-static gboolean dmesg_event_handler(GIOChannel *source,
-                                    GIOCondition condition,
-                                    void *data) {
-    DmesgEventHandlerArgs *args = data;
-    GIOStatus rc;
-
-    switch (condition) {
-        case G_IO_IN:
-            while ((rc = parse_next_message(source, args->res, args->error)) ==
-                   G_IO_STATUS_NORMAL) {
-                if (args->res->type != I8042_OUTPUT)
-                    continue;
-
-                rc = process_event(&args->res->event, args->res->dmesg_time,
-                                   args->error);
-                if (rc != G_IO_STATUS_NORMAL)
-                    goto error;
-            }
-            if (rc != G_IO_STATUS_AGAIN)
-                goto error;
-
-            break;
-        default:
-            break;
-    }
-
-    return TRUE;
-
-error:
-    *args->ret = FALSE;
-    return FALSE;
-}
-
-static inline gboolean change_directory(const gchar *path,
-                                        GError **error) {
-    int rc;
-
-    rc = chdir(path);
-    if (rc) {
-        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
-                    "When changing directory to %s: %s", path, strerror(errno));
-        return FALSE;
-    }
-
-    return TRUE;
-}
-
-static gboolean write_version_info(GError **error) {
-    gchar *version;
-
-    if (!g_file_get_contents("/proc/version", &version, NULL, error))
-        return FALSE;
-
-    printf("# Kernel Info: %s", version);
-
-    g_free(version);
-
-    return !(*error);
-}
-
-static gboolean write_input_device_info(const gchar *path,
-                                        GError **error) {
-    gchar *last_wd = getcwd(g_malloc(PATH_MAX), PATH_MAX),
-          *input_dev_path,
-          *device_name,
-          *device_port;
-    GDir *input_dir;
-
-    if (!change_directory(path, error))
-        goto out1;
-
-    /* If the subdirectory "input" exists, there's probably an input device
-     * attached to this i8042 port */
-    input_dir = g_dir_open("input", 0, error);
-    if (!input_dir) {
-        if (g_error_matches(*error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
-            g_error_matches(*error, G_FILE_ERROR, G_FILE_ERROR_NOTDIR))
-            g_clear_error(error);
-
-        goto out2;
-    }
-
-    /* Find the directory containing the information on the device */
-    input_dev_path = NULL;
-    for (const gchar *dir_name = g_dir_read_name(input_dir);
-         dir_name != NULL && *error == NULL;
-         dir_name = g_dir_read_name(input_dir)) {
-
-        if (g_str_has_prefix(dir_name, "input")) {
-            input_dev_path = g_build_filename("input", dir_name, NULL);
-            break;
-        }
-    }
-    if (!input_dev_path)
-        goto out3;
-
-    if (!g_file_get_contents("description", &device_port, NULL, error))
-        goto out4;
-
-    if (!change_directory(input_dev_path, error))
-        goto out5;
-
-    if (!g_file_get_contents("name", &device_name, NULL, error))
-        goto out5;
-
-    g_strstrip(device_port);
-    g_strstrip(device_name);
-
-    printf("#    \"%s\" on %s\n", device_name, device_port);
-
-      g_free(device_name);
-out5: g_free(device_port);
-out4: g_free(input_dev_path);
-out3: g_dir_close(input_dir);
-
-out2: change_directory(last_wd, error);
-out1: g_free(last_wd);
-
-    return !(*error);
-}
-
-static gboolean write_device_summary(GError **error) {
-    gchar *device_path,
-          *child_device_path;
-    GDir *devices_dir,
-         *device_dir;
-
-    printf("# Device listing:\n");
-
-    devices_dir = g_dir_open(I8042_DEV_DIR, 0, error);
-    if (!devices_dir) {
-        g_prefix_error(error, "While opening " I8042_DEV_DIR ": ");
-
-        return FALSE;
-    }
-
-    for (const gchar *dir_name = g_dir_read_name(devices_dir);
-         dir_name != NULL && *error == NULL;
-         dir_name = g_dir_read_name(devices_dir)) {
-        if (!g_str_has_prefix(dir_name, "serio"))
-            continue;
-
-        device_path = g_build_filename(I8042_DEV_DIR, dir_name, NULL);
-        if (!write_input_device_info(device_path, error))
-            goto out;
-
-        /* Check for children on the PS/2 device */
-        device_dir = g_dir_open(device_path, 0, error);
-        if (!device_dir)
-            goto out;
-
-        for (const gchar *dir_name = g_dir_read_name(device_dir);
-             dir_name != NULL && *error == NULL;
-             dir_name = g_dir_read_name(device_dir)) {
-            if (!g_str_has_prefix(dir_name, "serio"))
-                continue;
-
-            child_device_path = g_build_filename(device_path, dir_name, NULL);
-            write_input_device_info(child_device_path, error);
-
-            g_free(child_device_path);
-
-            if (*error)
-                goto out;
-        }
-out:
-
-        g_dir_close(device_dir);
-        g_free(device_path);
-    }
-
-    printf("#\n");
-
-    g_dir_close(devices_dir);
-
-    return !(*error);
-}
-
-static gboolean write_machine_summary(GError **error) {
-    gchar *last_wd = getcwd(g_malloc(PATH_MAX), PATH_MAX),
-          *sys_vendor = NULL,
-          *product_name = NULL,
-          *product_version = NULL,
-          *bios_vendor = NULL,
-          *bios_date = NULL,
-          *bios_version = NULL;
-
-    if (!change_directory("/sys/class/dmi/id", error))
-        return FALSE;
-
-    if (!g_file_get_contents("sys_vendor", &sys_vendor, NULL, error) ||
-        !g_file_get_contents("product_name", &product_name, NULL, error) ||
-        !g_file_get_contents("product_version", &product_version, NULL, error) ||
-        !g_file_get_contents("bios_vendor", &bios_vendor, NULL, error) ||
-        !g_file_get_contents("bios_date", &bios_date, NULL, error) ||
-        !g_file_get_contents("bios_version", &bios_version, NULL, error))
-        goto out;
-
-    printf("# Manufacturer: %s"
-           "# Product Name: %s"
-           "# Version: %s"
-           "# BIOS Vendor: %s"
-           "# BIOS Date: %s"
-           "# BIOS Version: %s"
-           "#\n",
-           sys_vendor, product_name, product_version, bios_vendor, bios_date,
-           bios_version);
-
-out:
-    g_free(sys_vendor);
-    g_free(product_name);
-    g_free(product_version);
-    g_free(bios_vendor);
-    g_free(bios_date);
-    g_free(bios_version);
-
-    change_directory(last_wd, error);
-    g_free(last_wd);
-
-    return !(*error);
-}
-
-static gboolean write_info(GError **error) {
-    if (!write_version_info(error) ||
-        !write_machine_summary(error) ||
-        !write_device_summary(error))
-        return FALSE;
-
-    return TRUE;
-}
-
-static gboolean record(GError **error) {
-    GIOChannel *input_channel;
-    LogMsgParseResult res;
-    InitTimeoutCheckerArgs timeout_checker_args;
-    DmesgEventHandlerArgs dmesg_event_handler_args;
-    GIOStatus rc;
-    gboolean ret = TRUE;
-
-    printf("T: %c\n"
-           "S: Init\n",
-           (recording_target == PS2_PORT_KBD) ? 'K' : 'A');
-
-    input_channel = g_io_channel_new_file("/dev/kmsg", "r", error);
-    if (!input_channel)
-        return FALSE;
-
-    while ((rc = parse_next_message(input_channel, &res, error)) ==
-           G_IO_STATUS_NORMAL) {
-        if (res.type == I8042_OUTPUT)
-            continue;
-        else if (res.start_time >= start_time)
-            break;
-    }
-    if (rc != G_IO_STATUS_NORMAL) {
-        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_NO_EVENTS,
-                            "Reached EOF of /dev/kmsg and got no events");
-        return FALSE;
-    }
-
-    rc = g_io_channel_set_flags(input_channel, G_IO_FLAG_NONBLOCK, error);
-    if (rc != G_IO_STATUS_NORMAL)
-        return FALSE;
-
-    dmesg_event_handler_args = (DmesgEventHandlerArgs) {
-        .res = &res,
-        .error = error,
-        .ret = &ret,
-    };
-    g_io_add_watch(input_channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
-                   dmesg_event_handler, &dmesg_event_handler_args);
-
-    timeout_checker_args = (InitTimeoutCheckerArgs) {
-        .last_check_time = g_get_monotonic_time() - start_time,
-        .last_event_time = &res.dmesg_time,
-    };
-    g_timeout_add_seconds_full(G_PRIORITY_HIGH, PS2EMU_INIT_TIMEOUT_SECS,
-                               init_timeout_checker, &timeout_checker_args,
-                               NULL);
-
-    g_main_loop_run(g_main_loop_new(NULL, FALSE));
-
-    return ret;
 }
 
 static gboolean process_target_arg(const gchar *option_name,
@@ -832,8 +90,12 @@ static gboolean process_target_arg(const gchar *option_name,
 int main(int argc, char *argv[]) {
     GOptionContext *main_context =
         g_option_context_new("record PS/2 devices");
-    gboolean rc;
+    gboolean rc,
+             profile = FALSE;
     GError *error = NULL;
+    gchar *root = NULL,
+          *metrics_socket_path = NULL,
+          *metrics_file_path = NULL;
 
     GOptionEntry options[] = {
         { "target", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK,
@@ -842,9 +104,27 @@ int main(int argc, char *argv[]) {
         { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
           print_version,
           "Show the version of the application", NULL },
+        { "root", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &root,
+          "Look for /dev, /proc and /sys in dir instead of /, for testing",
+          "dir" },
+        { "profile", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &profile, "Print the time and allocations of each phase on exit",
+          NULL },
+        { "trace", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &trace_path, "Write a timeline of the recording to file, as Chrome "
+          "trace-event JSON", "file" },
+        { "metrics-socket", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &metrics_socket_path, "Serve OpenMetrics on a UNIX socket at path",
+          "path" },
+        { "metrics-file", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &metrics_file_path, "Keep file updated with OpenMetrics, for "
+          "node_exporter's textfile collector", "file" },
         { 0 }
     };
 
+    profile_phase("options", NULL);
+
     g_option_context_add_main_entries(main_context, options, NULL);
     g_option_context_set_help_enabled(main_context, TRUE);
     g_option_context_set_description(main_context,
@@ -865,13 +145,42 @@ int main(int argc, char *argv[]) {
             "Invalid options: %s", error->message);
     }
 
-    if (!get_i8042_io_ports(&error)) {
-        fprintf(stderr,
-                "Failed to read /proc/ioports: %s\n",
-                error->message);
+    if (profile) {
+        profile_start();
+        ps2emu_set_phase_callback(profile_phase, NULL);
+        profile_print_at_exit();
+    }
+
+    recorder = ps2emu_recorder_new(recording_target, &error);
+    if (!recorder) {
+        fprintf(stderr, "Error: %s\n", error->message);
         exit(1);
     }
 
+    ps2emu_recorder_set_init_done_callback(recorder, init_done, NULL);
+    if (root)
+        ps2emu_recorder_set_root(recorder, root);
+
+    if (trace_path) {
+        trace = ps2emu_trace_new("ps2emu-record",
+                                 PS2EMU_TRACE_DEFAULT_MAX_EVENTS);
+        ps2emu_recorder_set_trace(recorder, trace);
+    }
+
+    if (metrics_socket_path || metrics_file_path) {
+        metrics = ps2emu_metrics_new();
+        ps2emu_recorder_set_metrics(recorder, metrics);
+
+        exporter = metrics_exporter_new(metrics, metrics_socket_path,
+                                        metrics_file_path, &error);
+        if (!exporter) {
+            rc = FALSE;
+            goto out;
+        }
+    }
+
+    profile_phase("prompt", NULL);
+
     fprintf(stderr,
             "====== ATTENTION! ======\n"
             "ps2emu-record will soon start recording your device. During the\n"
@@ -885,29 +194,30 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Recording has started, please don't touch your mouse or "
                     "keyboard...\n");
 
-    /* Write the header for the recording */
-    printf("# ps2emu-record V%d\n", PS2EMU_LOG_VERSION);
-
-    if (!write_info(&error))
+    rc = ps2emu_recorder_start(recorder, &error);
+    if (!rc)
         goto out;
 
-    if (!enable_i8042_debugging(&error)) {
-        fprintf(stderr,
-                "Failed to enable i8042 debugging: %s\n",
-                error->message);
-        exit(1);
-    }
+    /* Disable debugging when this application quits */
+    g_unix_signal_add(SIGINT, quit_on_interrupt, NULL);
+    g_unix_signal_add(SIGTERM, quit_on_interrupt, NULL);
+    g_unix_signal_add(SIGHUP, quit_on_interrupt, NULL);
 
     g_option_context_free(main_context);
 
-    rc = record(&error);
+    rc = ps2emu_recorder_run(recorder, &error);
 
 out:
-    disable_i8042_debugging();
+    ps2emu_recorder_free(recorder);
+    write_trace();
+    stop_metrics();
+    if (metrics)
+        ps2emu_metrics_free(metrics);
+    g_free(root);
     if (error) {
         fprintf(stderr, "Error: %s\n",
                 error->message);
     }
 
-    return rc;
+    return !rc;
 }
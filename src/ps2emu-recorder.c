@@ -0,0 +1,1318 @@
+/*
+ * ps2emu-recorder.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <glib.h>
+#include <linux/limits.h>
+
+#include "ps2emu.h"
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+#include "ps2emu-kmsg.h"
+#include "ps2emu-lib-private.h"
+#include "ps2emu-probes.h"
+#include "ps2emu-spsc-queue.h"
+
+/* Big enough for any record in /dev/kmsg, which returns one per read() */
+#define KMSG_READ_SIZE 8192
+
+struct _PS2EmuRecorder {
+    PS2Port recording_target;
+    FILE *output;
+
+    /* Everything we read and write on the system, relative to the root */
+    gchar *kmsg_path;
+    gchar *ioports_path;
+    gchar *version_path;
+    gchar *dmi_dir;
+    gchar *i8042_params_dir;
+    gchar *i8042_dev_dir;
+
+    gint64 start_time;
+    time_t dmesg_start_time;
+    gboolean ignoring_events;
+    PS2EmuSection section;
+
+    /* The last line we read from /dev/kmsg */
+    gchar *current_line;
+
+    /* What we've handed to the writer thread since we last caught up with the
+     * kernel log */
+    gsize unflushed_bytes;
+
+    PS2EmuTrace *trace;
+    PS2EmuMetrics *metrics;
+    /* The sequence number of the last record from /dev/kmsg, -1 before the
+     * first one. Only touched by the reader thread */
+    gint64 last_kmsg_seq;
+
+    /* While ps2emu_recorder_run() is going, a reader thread moves lines from
+     * /dev/kmsg into kmsg_queue, they're parsed and filtered on the main loop,
+     * and the lines of the recording go through output_queue to a writer
+     * thread. Nothing waits on the output, so a slow one only makes
+     * output_queue grow instead of holding up reading the kernel log */
+    gint kmsg_fd;
+    SpscQueue *kmsg_queue;
+    SpscQueue *output_queue;
+    GThread *reader_thread;
+    GThread *writer_thread;
+    gint reader_stop_fds[2];
+    /* Why the reader thread stopped, set before it closes kmsg_queue */
+    GError *reader_error;
+
+    /* The I/O ports of the i8042 controller */
+    GHashTable *ports;
+
+    gboolean debugging_enabled;
+    GMainLoop *main_loop;
+
+    PS2EmuRecordFunc event_func;
+    gpointer event_data;
+    PS2EmuRecorderFunc init_done_func;
+    gpointer init_done_data;
+};
+
+/* Why process_event() dropped an event, for the record_event_filtered probe */
+typedef enum {
+    FILTER_REASON_PROBING,
+    FILTER_REASON_COMMAND,
+    FILTER_REASON_OTHER_PORT
+} FilterReason;
+
+static void count_kmsg_record(PS2EmuRecorder *recorder,
+                              const gchar *line) {
+    PS2EmuMetrics *metrics = recorder->metrics;
+    guint64 seq;
+
+    metrics_add(&metrics->kmsg_records, 1);
+
+    if (!kmsg_parse_seq(line, &seq))
+        return;
+
+    if (recorder->last_kmsg_seq >= 0 &&
+        seq > (guint64)recorder->last_kmsg_seq + 1) {
+        metrics_add(&metrics->kmsg_lost_records,
+                    seq - recorder->last_kmsg_seq - 1);
+    }
+
+    recorder->last_kmsg_seq = seq;
+}
+
+/* Reading /dev/kmsg is the one thing that can't fall behind, since the kernel
+ * overwrites the records nobody read in time. Try to get ahead of everything
+ * else on the system, it's fine if we aren't allowed to. On Linux this only
+ * changes the calling thread */
+static void raise_reader_priority(void) {
+    struct sched_param param = {
+        .sched_priority = sched_get_priority_min(SCHED_FIFO)
+    };
+
+    sched_setscheduler(0, SCHED_FIFO, &param);
+}
+
+static void queue_kmsg_lines(PS2EmuRecorder *recorder,
+                             GString *partial_line,
+                             const gchar *buf,
+                             gsize len) {
+    const gchar *line = buf,
+                *end = buf + len,
+                *newline;
+    gchar *current_line;
+
+    while ((newline = memchr(line, '\n', end - line))) {
+        g_string_append_len(partial_line, line, newline - line + 1);
+        current_line = g_strndup(partial_line->str, partial_line->len);
+        g_string_truncate(partial_line, 0);
+
+        if (recorder->metrics)
+            count_kmsg_record(recorder, current_line);
+
+        spsc_queue_push(recorder->kmsg_queue, current_line);
+        line = newline + 1;
+    }
+
+    /* A fake kmsg fed through a pipe can split records between reads */
+    g_string_append_len(partial_line, line, end - line);
+}
+
+static gpointer kmsg_reader_thread(gpointer data) {
+    PS2EmuRecorder *recorder = data;
+    PS2EmuMetrics *metrics = recorder->metrics;
+    struct pollfd pollfds[2] = {
+        { .fd = recorder->kmsg_fd, .events = POLLIN },
+        { .fd = recorder->reader_stop_fds[0], .events = POLLIN },
+    };
+    GString *partial_line = g_string_new(NULL);
+    gchar buf[KMSG_READ_SIZE];
+    gssize len;
+    gint read_errno;
+
+    raise_reader_priority();
+
+    while (TRUE) {
+        if (poll(pollfds, G_N_ELEMENTS(pollfds), -1) < 0 && errno != EINTR) {
+            g_set_error(&recorder->reader_error, G_FILE_ERROR,
+                        g_file_error_from_errno(errno),
+                        "While polling %s: %s", recorder->kmsg_path,
+                        strerror(errno));
+            break;
+        }
+
+        if (pollfds[1].revents)
+            break;
+
+        while ((len = read(recorder->kmsg_fd, buf, sizeof(buf))) > 0)
+            queue_kmsg_lines(recorder, partial_line, buf, len);
+        read_errno = errno;
+
+        spsc_queue_flush(recorder->kmsg_queue);
+
+        if (metrics) {
+            guint64 parsed = metrics_get(&metrics->kmsg_records_parsed);
+
+            metrics_max(&metrics->kmsg_queue_max,
+                        metrics->kmsg_records - parsed);
+        }
+
+        /* The end of a fake kmsg fed through a pipe */
+        if (len == 0)
+            break;
+
+        /* EPIPE means the kernel overwrote records before we got to them,
+         * which the gap in the sequence numbers already accounts for */
+        if (read_errno == EAGAIN || read_errno == EINTR || read_errno == EPIPE)
+            continue;
+
+        g_set_error(&recorder->reader_error, G_FILE_ERROR,
+                    g_file_error_from_errno(read_errno),
+                    "While reading %s: %s", recorder->kmsg_path,
+                    strerror(read_errno));
+        break;
+    }
+
+    if (partial_line->len) {
+        spsc_queue_push(recorder->kmsg_queue,
+                        g_string_free(partial_line, FALSE));
+    } else {
+        g_string_free(partial_line, TRUE);
+    }
+
+    spsc_queue_close(recorder->kmsg_queue);
+
+    return NULL;
+}
+
+/* Returns G_IO_STATUS_AGAIN once kmsg_queue is empty, and G_IO_STATUS_EOF
+ * once the reader thread is done and everything it read was parsed */
+static GIOStatus parse_next_message(PS2EmuRecorder *recorder,
+                                    KmsgMessage *res,
+                                    GError **error) {
+    gchar *current_line;
+    gboolean closed;
+
+    while (TRUE) {
+        closed = spsc_queue_is_closed(recorder->kmsg_queue);
+        current_line = spsc_queue_pop(recorder->kmsg_queue);
+
+        if (!current_line) {
+            if (closed)
+                break;
+
+            return G_IO_STATUS_AGAIN;
+        }
+
+        if (recorder->metrics)
+            metrics_add(&recorder->metrics->kmsg_records_parsed, 1);
+
+        if (kmsg_parse_line(current_line, res, error)) {
+            PS2EMU_PROBE(record_kmsg_record, res->dmesg_time,
+                         res->type == I8042_OUTPUT);
+
+            /* The event points into the line, so keep it around until the
+             * next message */
+            g_free(recorder->current_line);
+            recorder->current_line = current_line;
+
+            return G_IO_STATUS_NORMAL;
+        }
+
+        g_free(current_line);
+
+        if (*error)
+            return G_IO_STATUS_ERROR;
+    }
+
+    if (recorder->reader_error) {
+        g_propagate_error(error, recorder->reader_error);
+        recorder->reader_error = NULL;
+
+        return G_IO_STATUS_ERROR;
+    }
+
+    return G_IO_STATUS_EOF;
+}
+
+/* Hands a line of the recording over to the writer thread, which frees it */
+static void queue_output(PS2EmuRecorder *recorder,
+                         gchar *line) {
+    PS2EmuMetrics *metrics = recorder->metrics;
+
+    /* Counted before the writer thread can see it, so it can't have written
+     * more lines than we've counted */
+    if (metrics) {
+        guint64 written = metrics_get(&metrics->output_lines_written);
+
+        metrics_add(&metrics->output_lines, 1);
+        metrics_max(&metrics->output_queue_max,
+                    metrics->output_lines - written);
+    }
+
+    spsc_queue_push(recorder->output_queue, line);
+}
+
+static gpointer writer_thread(gpointer data) {
+    PS2EmuRecorder *recorder = data;
+    PS2EmuMetrics *metrics = recorder->metrics;
+    SpscQueue *queue = recorder->output_queue;
+    gchar *line;
+    gsize unflushed_bytes;
+    gint64 start_time;
+    gboolean closed;
+
+    while (TRUE) {
+        spsc_queue_wait(queue);
+
+        closed = spsc_queue_is_closed(queue);
+        unflushed_bytes = 0;
+        start_time = g_get_monotonic_time();
+
+        while ((line = spsc_queue_pop(queue))) {
+            unflushed_bytes += strlen(line);
+            fputs(line, recorder->output);
+            g_free(line);
+
+            if (metrics)
+                metrics_add(&metrics->output_lines_written, 1);
+        }
+
+        /* We've caught up with the recording, so get what we have out before
+         * waiting for more */
+        if (unflushed_bytes) {
+            PS2EMU_PROBE(record_output_flush, unflushed_bytes);
+            fflush(recorder->output);
+
+            if (metrics) {
+                metrics_observe(&metrics->output_stall,
+                                g_get_monotonic_time() - start_time);
+            }
+        }
+
+        if (closed)
+            break;
+    }
+
+    return NULL;
+}
+
+static inline void count_filtered(PS2EmuRecorder *recorder) {
+    if (recorder->metrics)
+        metrics_add(&recorder->metrics->events_filtered, 1);
+}
+
+static GIOStatus process_event(PS2EmuRecorder *recorder,
+                               PS2Event *event,
+                               time_t time,
+                               GError **error) {
+    GHashTable *ports = recorder->ports;
+    gchar *event_str;
+    gsize event_len;
+    gint64 lag = 0;
+
+    /* Any commands that we receive with any of the port numbers are just part
+     * of the i8042 probing, and can't be forwarded over serio in the relay
+     * module. Ignore all data we read starting from commands like this, until
+     * we reach a different command */
+    if (!recorder->ignoring_events) {
+        if (event->type == PS2_EVENT_TYPE_COMMAND &&
+            g_hash_table_contains(ports, GUINT_TO_POINTER(event->data))) {
+
+            recorder->ignoring_events = TRUE;
+            goto probing;
+        }
+    }
+    else {
+        if (event->type == PS2_EVENT_TYPE_COMMAND &&
+            !g_hash_table_contains(ports, GUINT_TO_POINTER(event->data))) {
+
+            recorder->ignoring_events = FALSE;
+        }
+        else
+            goto probing;
+    }
+
+    /* Filter out all commands that have made it to this point. With i8042's
+     * debug output, commands just mark the recepient of the message which we
+     * don't need (with the AUX port anyway), and can't use with serio */
+    if (event->type == PS2_EVENT_TYPE_COMMAND) {
+        PS2EMU_PROBE(record_event_filtered, event->type, event->data,
+                     event->origin, FILTER_REASON_COMMAND);
+        count_filtered(recorder);
+        return G_IO_STATUS_NORMAL;
+    }
+
+    /* The logic here is that we can only get two types of events from a
+     * keyboard, kbd-data and interrupt. No other device sends kbd-data, so we
+     * can judge if an event comes from a keyboard or not solely based off that.
+     * With interrupts, we can tell if the interrupt is coming from the keyboard
+     * or not by comparing the port number of the event to that of the KBD
+     * port */
+    if (recorder->recording_target == PS2_PORT_AUX) {
+        if (event->type == PS2_EVENT_TYPE_INTERRUPT &&
+            event->origin == PS2_PORT_KBD)
+            goto other_port;
+
+        if (event->type == PS2_EVENT_TYPE_KBD_DATA)
+            goto other_port;
+    }
+
+    if (recorder->recording_target == PS2_PORT_KBD) {
+        if (event->type == PS2_EVENT_TYPE_INTERRUPT) {
+            if (event->origin == PS2_PORT_AUX)
+                goto other_port;
+        }
+        else if (event->type != PS2_EVENT_TYPE_KBD_DATA)
+            goto other_port;
+    }
+
+    if (!recorder->dmesg_start_time)
+        recorder->dmesg_start_time = time;
+
+    event_str = ps2_event_to_string(event, time - recorder->dmesg_start_time);
+    event_len = strlen(event_str);
+    queue_output(recorder, event_str);
+    recorder->unflushed_bytes += event_len;
+
+    PS2EMU_PROBE(record_event_accepted, recorder->section, event->type,
+                 event->data, time - recorder->dmesg_start_time);
+
+    if (recorder->trace || recorder->metrics)
+        lag = g_get_monotonic_time() - time;
+
+    if (recorder->trace) {
+        gboolean from_device = event->type == PS2_EVENT_TYPE_INTERRUPT ||
+                               event->type == PS2_EVENT_TYPE_RETURN;
+
+        trace_add(recorder->trace, &(TraceEvent) {
+            .type = from_device ? TRACE_EVENT_INTERRUPT :
+                                  TRACE_EVENT_HOST_BYTE,
+            .time = time,
+            .value = lag,
+            .section = recorder->section,
+            .data = event->data,
+        });
+    }
+
+    if (recorder->metrics) {
+        metrics_add(&recorder->metrics->events_recorded, 1);
+        metrics_add(&recorder->metrics->output_bytes, event_len);
+        metrics_observe(&recorder->metrics->kmsg_lag, lag);
+    }
+
+    if (recorder->event_func) {
+        PS2Event recorded_event = *event;
+
+        recorded_event.time = time - recorder->dmesg_start_time;
+        recorder->event_func(recorder, recorder->section, &recorded_event,
+                             recorder->event_data);
+    }
+
+    return G_IO_STATUS_NORMAL;
+
+probing:
+    PS2EMU_PROBE(record_event_filtered, event->type, event->data, event->origin,
+                 FILTER_REASON_PROBING);
+    count_filtered(recorder);
+    return G_IO_STATUS_NORMAL;
+
+other_port:
+    PS2EMU_PROBE(record_event_filtered, event->type, event->data, event->origin,
+                 FILTER_REASON_OTHER_PORT);
+    count_filtered(recorder);
+    return G_IO_STATUS_NORMAL;
+}
+
+static void trace_section(PS2EmuRecorder *recorder,
+                          TraceEventType type) {
+    if (G_LIKELY(!recorder->trace))
+        return;
+
+    trace_add(recorder->trace, &(TraceEvent) {
+        .type = type,
+        .time = g_get_monotonic_time(),
+        .section = recorder->section,
+    });
+}
+
+static gboolean write_to_char_dev(const gchar *cdev,
+                                  GError **error,
+                                  const gchar *format,
+                                  ...) {
+    GIOChannel *channel = g_io_channel_new_file(cdev, "w", error);
+    GIOStatus rc;
+    gchar *data = NULL;
+    gsize data_len,
+          bytes_written;
+    va_list args;
+
+    if (!channel) {
+        g_prefix_error(error, "While opening %s: ", cdev);
+
+        goto error;
+    }
+
+    va_start(args, format);
+    data = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    data_len = strlen(data);
+
+    rc = g_io_channel_write_chars(channel, data, data_len, &bytes_written,
+                                  error);
+    if (rc != G_IO_STATUS_NORMAL) {
+        g_prefix_error(error, "While writing to %s: ", cdev);
+
+        goto error;
+    }
+
+    g_io_channel_unref(channel);
+    g_free(data);
+    return TRUE;
+
+error:
+    if (channel)
+        g_io_channel_unref(channel);
+
+    g_free(data);
+
+    return FALSE;
+}
+
+static gboolean get_i8042_io_ports(GHashTable *ports,
+                                   const gchar *ioports_path,
+                                   GError **error) {
+    GIOChannel *io_ports_file = g_io_channel_new_file(ioports_path, "r",
+                                                      error);
+    gchar *line;
+    GIOStatus rc;
+
+    if (!io_ports_file)
+        return FALSE;
+
+    for (rc = g_io_channel_read_line(io_ports_file, &line, NULL, NULL, error);
+         rc == G_IO_STATUS_NORMAL;
+         rc = g_io_channel_read_line(io_ports_file, &line, NULL, NULL, error)) {
+        guint min, max;
+        gint parsed_count;
+        gchar *device_name;
+
+        errno = 0;
+        parsed_count = sscanf(line, "%x-%x : %m[^\n]\n",
+                              &min, &max, &device_name);
+        if (parsed_count != 3 || errno != 0 ||
+            strcmp(device_name, "keyboard") != 0)
+            goto next;
+
+        for (int i = min; i <= max; i++) {
+            g_hash_table_insert(ports, GUINT_TO_POINTER(i),
+                                GUINT_TO_POINTER(i));
+        }
+next:
+        g_free(line);
+    }
+
+    g_io_channel_unref(io_ports_file);
+
+    return TRUE;
+}
+
+void ps2emu_recorder_stop(PS2EmuRecorder *recorder) {
+    gchar *debug_path,
+          *unmask_kbd_data_path;
+
+    if (!recorder->debugging_enabled)
+        return;
+
+    recorder->debugging_enabled = FALSE;
+
+    debug_path = g_build_filename(recorder->i8042_params_dir, "debug", NULL);
+    unmask_kbd_data_path = g_build_filename(recorder->i8042_params_dir,
+                                            "unmask_kbd_data", NULL);
+
+    g_warn_if_fail(write_to_char_dev(debug_path, NULL, "0\n"));
+
+    if (recorder->recording_target == PS2_PORT_KBD &&
+        g_file_test(unmask_kbd_data_path, G_FILE_TEST_EXISTS)) {
+        g_warn_if_fail(write_to_char_dev(unmask_kbd_data_path, NULL, "0\n"));
+    }
+
+    g_free(debug_path);
+    g_free(unmask_kbd_data_path);
+}
+
+static gboolean enable_i8042_debugging(PS2EmuRecorder *recorder,
+                                       GError **error) {
+    const gchar *i8042_dev_dir = recorder->i8042_dev_dir;
+    GDir *devices_dir = NULL;
+    GSList *connected_ports = NULL;
+    gchar *debug_path,
+          *unmask_kbd_data_path;
+
+    debug_path = g_build_filename(recorder->i8042_params_dir, "debug", NULL);
+    unmask_kbd_data_path = g_build_filename(recorder->i8042_params_dir,
+                                            "unmask_kbd_data", NULL);
+
+    lib_phase("detach");
+
+    devices_dir = g_dir_open(i8042_dev_dir, 0, error);
+    if (!devices_dir) {
+        g_prefix_error(error, "While opening %s: ", i8042_dev_dir);
+
+        goto error;
+    }
+
+    /* Detach the devices before we do anything, this prevents potential race
+     * conditions */
+    for (gchar const *dir_name = g_dir_read_name(devices_dir);
+         dir_name != NULL && *error == NULL;
+         dir_name = g_dir_read_name(devices_dir)) {
+        gchar *file_name;
+        gchar *input_dev_path;
+
+        if (!g_str_has_prefix(dir_name, "serio"))
+            continue;
+
+        /* Check if the port's connected */
+        input_dev_path = g_build_filename(i8042_dev_dir, dir_name, "input",
+                                          NULL);
+        if (!g_file_test(input_dev_path, G_FILE_TEST_EXISTS)) {
+            g_free(input_dev_path);
+            continue;
+        }
+
+        g_free(input_dev_path);
+        connected_ports = g_slist_prepend(connected_ports, strdup(dir_name));
+
+        file_name = g_build_filename(i8042_dev_dir, dir_name, "drvctl", NULL);
+        if (!write_to_char_dev(file_name, error, "none")) {
+            g_free(file_name);
+            goto error;
+        }
+
+        g_free(file_name);
+    }
+    if (*error)
+        goto error;
+
+    lib_phase("enable debugging");
+
+    /* We mark when the recording starts, so that we can separate this recording
+     * from other recordings ran during this session */
+    recorder->start_time = g_get_monotonic_time();
+
+    if (!write_to_char_dev(recorder->kmsg_path, error,
+                           "ps2emu: Start recording %ld\n",
+                           recorder->start_time))
+        goto error;
+
+    /* Enable the debugging output for i8042 */
+    if (!write_to_char_dev(debug_path, error, "1\n"))
+        goto error;
+
+    recorder->debugging_enabled = TRUE;
+
+    /* As of Linux 4.3+, data coming out of the KBD port is masked by default */
+    if (recorder->recording_target == PS2_PORT_KBD &&
+        g_file_test(unmask_kbd_data_path, G_FILE_TEST_EXISTS)) {
+        if (!write_to_char_dev(unmask_kbd_data_path, error, "1\n"))
+            goto error;
+    }
+
+    /* Reattach the devices */
+    lib_phase("reprobe");
+    g_dir_rewind(devices_dir);
+    for (gchar const *dir_name = g_dir_read_name(devices_dir);
+         dir_name != NULL && *error == NULL;
+         dir_name = g_dir_read_name(devices_dir)) {
+        gchar *file_name;
+        gboolean was_connected = FALSE;
+
+        /* Check if the directory was a previously connected port */
+        for (GSList *l = connected_ports; l != NULL; l = l->next) {
+            if (strcmp(l->data, dir_name) != 0)
+                continue;
+
+            was_connected = TRUE;
+            break;
+        }
+        if (!was_connected)
+            continue;
+
+        file_name = g_build_filename(i8042_dev_dir, dir_name, "drvctl", NULL);
+        if (!write_to_char_dev(file_name, error, "rescan")) {
+            g_free(file_name);
+            goto error;
+        }
+
+        g_free(file_name);
+    }
+    if (*error)
+        goto error;
+
+    g_dir_close(devices_dir);
+    g_slist_free_full(connected_ports, g_free);
+    g_free(debug_path);
+    g_free(unmask_kbd_data_path);
+
+    return TRUE;
+
+error:
+    if (devices_dir)
+        g_dir_close(devices_dir);
+
+    if (connected_ports)
+        g_slist_free_full(connected_ports, g_free);
+
+    g_free(debug_path);
+    g_free(unmask_kbd_data_path);
+
+    return FALSE;
+}
+
+typedef struct {
+    PS2EmuRecorder *recorder;
+    time_t last_check_time;
+    time_t *last_event_time;
+} InitTimeoutCheckerArgs;
+
+static gboolean init_timeout_checker(void *data) {
+    InitTimeoutCheckerArgs *args = data;
+    PS2EmuRecorder *recorder = args->recorder;
+
+    if ((*args->last_event_time - args->last_check_time) / G_USEC_PER_SEC <
+        PS2EMU_INIT_TIMEOUT_SECS)
+        return G_SOURCE_CONTINUE;
+
+    PS2EMU_PROBE(record_section_end, recorder->section, g_get_monotonic_time());
+    trace_section(recorder, TRACE_EVENT_SECTION_END);
+
+    recorder->dmesg_start_time = 0;
+    recorder->section = PS2EMU_SECTION_MAIN;
+    lib_phase("main");
+
+    PS2EMU_PROBE(record_section_start, recorder->section,
+                 g_get_monotonic_time());
+    trace_section(recorder, TRACE_EVENT_SECTION_START);
+
+    queue_output(recorder, g_strdup("S: Main\n"));
+    spsc_queue_flush(recorder->output_queue);
+
+    if (recorder->init_done_func)
+        recorder->init_done_func(recorder, recorder->init_done_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+typedef struct {
+    PS2EmuRecorder *recorder;
+    KmsgMessage *res;
+    /* Set until we reach the start marker we wrote to the kernel log */
+    gboolean reading_backlog;
+    InitTimeoutCheckerArgs timeout_checker_args;
+    guint timeout_id;
+    gboolean *ret;
+    GError **error;
+} DmesgEventHandlerArgs;
+
+static void start_init_section(DmesgEventHandlerArgs *args) {
+    PS2EmuRecorder *recorder = args->recorder;
+
+    args->reading_backlog = FALSE;
+
+    args->timeout_checker_args = (InitTimeoutCheckerArgs) {
+        .recorder = recorder,
+        .last_check_time = g_get_monotonic_time() - recorder->start_time,
+        .last_event_time = &args->res->dmesg_time,
+    };
+    args->timeout_id = g_timeout_add_seconds_full(G_PRIORITY_HIGH,
+                                                  PS2EMU_INIT_TIMEOUT_SECS,
+                                                  init_timeout_checker,
+                                                  &args->timeout_checker_args,
+                                                  NULL);
+
+    lib_phase("init");
+    PS2EMU_PROBE(record_section_start, recorder->section,
+                 g_get_monotonic_time());
+    trace_section(recorder, TRACE_EVENT_SECTION_START);
+}
+
+static void process_kmsg_queue(DmesgEventHandlerArgs *args) {
+    PS2EmuRecorder *recorder = args->recorder;
+    KmsgMessage *res = args->res;
+    GIOStatus rc;
+
+    spsc_queue_ack(recorder->kmsg_queue);
+
+    while ((rc = parse_next_message(recorder, res, args->error)) ==
+           G_IO_STATUS_NORMAL) {
+        if (G_UNLIKELY(args->reading_backlog)) {
+            if (res->type != I8042_OUTPUT &&
+                res->start_time >= recorder->start_time)
+                start_init_section(args);
+
+            continue;
+        }
+
+        if (res->type != I8042_OUTPUT)
+            continue;
+
+        rc = process_event(recorder, &res->event, res->dmesg_time,
+                           args->error);
+        if (rc != G_IO_STATUS_NORMAL)
+            goto error;
+    }
+
+    /* The writer thread flushes the output whenever it catches up, this just
+     * marks where we caught up with the kernel log */
+    if (recorder->unflushed_bytes) {
+        spsc_queue_flush(recorder->output_queue);
+
+        if (recorder->trace) {
+            trace_add(recorder->trace, &(TraceEvent) {
+                .type = TRACE_EVENT_FLUSH,
+                .time = g_get_monotonic_time(),
+                .value = recorder->unflushed_bytes,
+            });
+        }
+
+        recorder->unflushed_bytes = 0;
+    }
+
+    if (rc == G_IO_STATUS_AGAIN)
+        return;
+
+    if (args->reading_backlog) {
+        g_clear_error(args->error);
+        g_set_error_literal(args->error, PS2EMU_ERROR, PS2EMU_ERROR_NO_EVENTS,
+                            "Reached EOF of the kernel log and got no "
+                            "events");
+        goto error;
+    }
+
+    /* /dev/kmsg never ends, but a fake one fed through a pipe does. That's the
+     * end of the recording, not an error */
+    if (rc == G_IO_STATUS_EOF) {
+        g_main_loop_quit(recorder->main_loop);
+        return;
+    }
+
+error:
+    *args->ret = FALSE;
+    g_main_loop_quit(recorder->main_loop);
+}
+
+/* The watch gets removed by ps2emu_recorder_run() */
+static gboolean dmesg_event_handler(GIOChannel *source,
+                                    GIOCondition condition,
+                                    void *data) {
+    process_kmsg_queue(data);
+
+    return TRUE;
+}
+
+static gboolean start_pipeline(PS2EmuRecorder *recorder,
+                               GError **error) {
+    recorder->kmsg_fd = open(recorder->kmsg_path, O_RDONLY | O_CLOEXEC);
+    if (recorder->kmsg_fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", recorder->kmsg_path,
+                    strerror(errno));
+        return FALSE;
+    }
+
+    /* Opened blocking, so a fake kmsg that's a FIFO waits for its writer */
+    if (fcntl(recorder->kmsg_fd, F_SETFL, O_NONBLOCK) < 0 ||
+        pipe(recorder->reader_stop_fds) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While setting up %s: %s", recorder->kmsg_path,
+                    strerror(errno));
+        return FALSE;
+    }
+
+    recorder->kmsg_queue = spsc_queue_new(error);
+    if (!recorder->kmsg_queue)
+        return FALSE;
+
+    recorder->output_queue = spsc_queue_new(error);
+    if (!recorder->output_queue)
+        return FALSE;
+
+    /* The header went out before the writer thread existed, so it can't get
+     * mixed up with anything the thread writes */
+    fflush(recorder->output);
+
+    recorder->writer_thread = g_thread_new("record-writer", writer_thread,
+                                           recorder);
+    recorder->reader_thread = g_thread_new("record-reader",
+                                           kmsg_reader_thread, recorder);
+
+    return TRUE;
+}
+
+/* Anything the reader thread queued before it stopped is still left to
+ * parse */
+static void stop_reader(PS2EmuRecorder *recorder) {
+    if (!recorder->reader_thread)
+        return;
+
+    g_warn_if_fail(write(recorder->reader_stop_fds[1], "", 1) == 1);
+    g_thread_join(recorder->reader_thread);
+    recorder->reader_thread = NULL;
+}
+
+/* Waits for the writer thread to write out everything that was recorded.
+ * Safe to call on a pipeline that was only partly started */
+static void stop_pipeline(PS2EmuRecorder *recorder) {
+    stop_reader(recorder);
+
+    if (recorder->writer_thread) {
+        spsc_queue_close(recorder->output_queue);
+        g_thread_join(recorder->writer_thread);
+        recorder->writer_thread = NULL;
+    }
+
+    if (recorder->kmsg_queue) {
+        spsc_queue_free(recorder->kmsg_queue, g_free);
+        recorder->kmsg_queue = NULL;
+    }
+    if (recorder->output_queue) {
+        spsc_queue_free(recorder->output_queue, g_free);
+        recorder->output_queue = NULL;
+    }
+
+    if (recorder->reader_stop_fds[0] >= 0) {
+        close(recorder->reader_stop_fds[0]);
+        close(recorder->reader_stop_fds[1]);
+        recorder->reader_stop_fds[0] = recorder->reader_stop_fds[1] = -1;
+    }
+
+    if (recorder->kmsg_fd >= 0) {
+        close(recorder->kmsg_fd);
+        recorder->kmsg_fd = -1;
+    }
+
+    g_clear_error(&recorder->reader_error);
+}
+
+static inline gboolean change_directory(const gchar *path,
+                                        GError **error) {
+    int rc;
+
+    rc = chdir(path);
+    if (rc) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "When changing directory to %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean write_version_info(FILE *output,
+                                   const gchar *version_path,
+                                   GError **error) {
+    gchar *version;
+
+    if (!g_file_get_contents(version_path, &version, NULL, error))
+        return FALSE;
+
+    fprintf(output, "# Kernel Info: %s", version);
+
+    g_free(version);
+
+    return !(*error);
+}
+
+static gboolean write_input_device_info(FILE *output,
+                                        const gchar *path,
+                                        GError **error) {
+    gchar *last_wd = getcwd(g_malloc(PATH_MAX), PATH_MAX),
+          *input_dev_path,
+          *device_name,
+          *device_port;
+    GDir *input_dir;
+
+    if (!change_directory(path, error))
+        goto out1;
+
+    /* If the subdirectory "input" exists, there's probably an input device
+     * attached to this i8042 port */
+    input_dir = g_dir_open("input", 0, error);
+    if (!input_dir) {
+        if (g_error_matches(*error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
+            g_error_matches(*error, G_FILE_ERROR, G_FILE_ERROR_NOTDIR))
+            g_clear_error(error);
+
+        goto out2;
+    }
+
+    /* Find the directory containing the information on the device */
+    input_dev_path = NULL;
+    for (const gchar *dir_name = g_dir_read_name(input_dir);
+         dir_name != NULL && *error == NULL;
+         dir_name = g_dir_read_name(input_dir)) {
+
+        if (g_str_has_prefix(dir_name, "input")) {
+            input_dev_path = g_build_filename("input", dir_name, NULL);
+            break;
+        }
+    }
+    if (!input_dev_path)
+        goto out3;
+
+    if (!g_file_get_contents("description", &device_port, NULL, error))
+        goto out4;
+
+    if (!change_directory(input_dev_path, error))
+        goto out5;
+
+    if (!g_file_get_contents("name", &device_name, NULL, error))
+        goto out5;
+
+    g_strstrip(device_port);
+    g_strstrip(device_name);
+
+    fprintf(output, "#    \"%s\" on %s\n", device_name, device_port);
+
+      g_free(device_name);
+out5: g_free(device_port);
+out4: g_free(input_dev_path);
+out3: g_dir_close(input_dir);
+
+out2: change_directory(last_wd, error);
+out1: g_free(last_wd);
+
+    return !(*error);
+}
+
+static gboolean write_device_summary(FILE *output,
+                                     const gchar *i8042_dev_dir,
+                                     GError **error) {
+    gchar *device_path,
+          *child_device_path;
+    GDir *devices_dir,
+         *device_dir;
+
+    fprintf(output, "# Device listing:\n");
+
+    devices_dir = g_dir_open(i8042_dev_dir, 0, error);
+    if (!devices_dir) {
+        g_prefix_error(error, "While opening %s: ", i8042_dev_dir);
+
+        return FALSE;
+    }
+
+    for (const gchar *dir_name = g_dir_read_name(devices_dir);
+         dir_name != NULL && *error == NULL;
+         dir_name = g_dir_read_name(devices_dir)) {
+        if (!g_str_has_prefix(dir_name, "serio"))
+            continue;
+
+        device_path = g_build_filename(i8042_dev_dir, dir_name, NULL);
+        if (!write_input_device_info(output, device_path, error))
+            goto out;
+
+        /* Check for children on the PS/2 device */
+        device_dir = g_dir_open(device_path, 0, error);
+        if (!device_dir)
+            goto out;
+
+        for (const gchar *dir_name = g_dir_read_name(device_dir);
+             dir_name != NULL && *error == NULL;
+             dir_name = g_dir_read_name(device_dir)) {
+            if (!g_str_has_prefix(dir_name, "serio"))
+                continue;
+
+            child_device_path = g_build_filename(device_path, dir_name, NULL);
+            write_input_device_info(output, child_device_path, error);
+
+            g_free(child_device_path);
+
+            if (*error)
+                goto out;
+        }
+out:
+
+        g_dir_close(device_dir);
+        g_free(device_path);
+    }
+
+    fprintf(output, "#\n");
+
+    g_dir_close(devices_dir);
+
+    return !(*error);
+}
+
+static gboolean write_machine_summary(FILE *output,
+                                      const gchar *dmi_dir,
+                                      GError **error) {
+    gchar *last_wd = getcwd(g_malloc(PATH_MAX), PATH_MAX),
+          *sys_vendor = NULL,
+          *product_name = NULL,
+          *product_version = NULL,
+          *bios_vendor = NULL,
+          *bios_date = NULL,
+          *bios_version = NULL;
+
+    if (!change_directory(dmi_dir, error))
+        return FALSE;
+
+    if (!g_file_get_contents("sys_vendor", &sys_vendor, NULL, error) ||
+        !g_file_get_contents("product_name", &product_name, NULL, error) ||
+        !g_file_get_contents("product_version", &product_version, NULL, error) ||
+        !g_file_get_contents("bios_vendor", &bios_vendor, NULL, error) ||
+        !g_file_get_contents("bios_date", &bios_date, NULL, error) ||
+        !g_file_get_contents("bios_version", &bios_version, NULL, error))
+        goto out;
+
+    fprintf(output,
+            "# Manufacturer: %s"
+            "# Product Name: %s"
+            "# Version: %s"
+            "# BIOS Vendor: %s"
+            "# BIOS Date: %s"
+            "# BIOS Version: %s"
+            "#\n",
+            sys_vendor, product_name, product_version, bios_vendor, bios_date,
+            bios_version);
+
+out:
+    g_free(sys_vendor);
+    g_free(product_name);
+    g_free(product_version);
+    g_free(bios_vendor);
+    g_free(bios_date);
+    g_free(bios_version);
+
+    change_directory(last_wd, error);
+    g_free(last_wd);
+
+    return !(*error);
+}
+
+static gboolean write_info(PS2EmuRecorder *recorder,
+                           GError **error) {
+    FILE *output = recorder->output;
+
+    if (!write_version_info(output, recorder->version_path, error) ||
+        !write_machine_summary(output, recorder->dmi_dir, error) ||
+        !write_device_summary(output, recorder->i8042_dev_dir, error))
+        return FALSE;
+
+    return TRUE;
+}
+
+PS2EmuRecorder *ps2emu_recorder_new(PS2Port target,
+                                    GError **error) {
+    PS2EmuRecorder *recorder = g_new0(PS2EmuRecorder, 1);
+
+    recorder->recording_target = target;
+    recorder->output = stdout;
+    recorder->section = PS2EMU_SECTION_INIT;
+    recorder->ports = g_hash_table_new(g_direct_hash, g_direct_equal);
+    recorder->last_kmsg_seq = -1;
+    recorder->kmsg_fd = -1;
+    recorder->reader_stop_fds[0] = recorder->reader_stop_fds[1] = -1;
+
+    ps2emu_recorder_set_root(recorder, "/");
+
+    return recorder;
+}
+
+void ps2emu_recorder_free(PS2EmuRecorder *recorder) {
+    ps2emu_recorder_stop(recorder);
+
+    if (recorder->main_loop)
+        g_main_loop_unref(recorder->main_loop);
+
+    g_hash_table_destroy(recorder->ports);
+    g_free(recorder->current_line);
+    g_free(recorder->kmsg_path);
+    g_free(recorder->ioports_path);
+    g_free(recorder->version_path);
+    g_free(recorder->dmi_dir);
+    g_free(recorder->i8042_params_dir);
+    g_free(recorder->i8042_dev_dir);
+    g_free(recorder);
+}
+
+void ps2emu_recorder_set_root(PS2EmuRecorder *recorder,
+                              const gchar *root) {
+    g_free(recorder->kmsg_path);
+    g_free(recorder->ioports_path);
+    g_free(recorder->version_path);
+    g_free(recorder->dmi_dir);
+    g_free(recorder->i8042_params_dir);
+    g_free(recorder->i8042_dev_dir);
+
+    recorder->kmsg_path = g_build_filename(root, "dev", "kmsg", NULL);
+    recorder->ioports_path = g_build_filename(root, "proc", "ioports", NULL);
+    recorder->version_path = g_build_filename(root, "proc", "version", NULL);
+    recorder->dmi_dir = g_build_filename(root, "sys", "class", "dmi", "id",
+                                         NULL);
+    recorder->i8042_params_dir = g_build_filename(root, "sys", "module",
+                                                  "i8042", "parameters",
+                                                  NULL);
+    recorder->i8042_dev_dir = g_build_filename(root, "sys", "devices",
+                                               "platform", "i8042", NULL);
+}
+
+void ps2emu_recorder_set_trace(PS2EmuRecorder *recorder,
+                               PS2EmuTrace *trace) {
+    recorder->trace = trace;
+    if (trace)
+        trace->recording = TRUE;
+}
+
+void ps2emu_recorder_set_metrics(PS2EmuRecorder *recorder,
+                                 PS2EmuMetrics *metrics) {
+    recorder->metrics = metrics;
+    if (metrics)
+        metrics->recording = TRUE;
+}
+
+void ps2emu_recorder_set_output(PS2EmuRecorder *recorder,
+                                FILE *output) {
+    recorder->output = output;
+}
+
+void ps2emu_recorder_set_event_callback(PS2EmuRecorder *recorder,
+                                        PS2EmuRecordFunc func,
+                                        gpointer user_data) {
+    recorder->event_func = func;
+    recorder->event_data = user_data;
+}
+
+void ps2emu_recorder_set_init_done_callback(PS2EmuRecorder *recorder,
+                                            PS2EmuRecorderFunc func,
+                                            gpointer user_data) {
+    recorder->init_done_func = func;
+    recorder->init_done_data = user_data;
+}
+
+gboolean ps2emu_recorder_start(PS2EmuRecorder *recorder,
+                               GError **error) {
+    lib_phase("collect info");
+
+    g_hash_table_remove_all(recorder->ports);
+    if (!get_i8042_io_ports(recorder->ports, recorder->ioports_path, error)) {
+        g_prefix_error(error, "While reading %s: ", recorder->ioports_path);
+        return FALSE;
+    }
+
+    /* Write the header for the recording */
+    fprintf(recorder->output, "# ps2emu-record V%d\n", PS2EMU_LOG_VERSION);
+
+    if (!write_info(recorder, error))
+        return FALSE;
+
+    if (!enable_i8042_debugging(recorder, error)) {
+        g_prefix_error(error, "Failed to enable i8042 debugging: ");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean ps2emu_recorder_run(PS2EmuRecorder *recorder,
+                             GError **error) {
+    KmsgMessage res;
+    DmesgEventHandlerArgs dmesg_event_handler_args;
+    GIOChannel *queue_channel;
+    guint watch_id;
+    gboolean ret = TRUE;
+
+    fprintf(recorder->output,
+            "T: %c\n"
+            "S: Init\n",
+            (recorder->recording_target == PS2_PORT_KBD) ? 'K' : 'A');
+
+    lib_phase("kmsg backlog");
+    if (!start_pipeline(recorder, error)) {
+        ret = FALSE;
+        goto out;
+    }
+
+    if (!recorder->main_loop)
+        recorder->main_loop = g_main_loop_new(NULL, FALSE);
+
+    dmesg_event_handler_args = (DmesgEventHandlerArgs) {
+        .recorder = recorder,
+        .res = &res,
+        .reading_backlog = TRUE,
+        .error = error,
+        .ret = &ret,
+    };
+    queue_channel =
+        g_io_channel_unix_new(spsc_queue_get_fd(recorder->kmsg_queue));
+    watch_id = g_io_add_watch(queue_channel, G_IO_IN, dmesg_event_handler,
+                              &dmesg_event_handler_args);
+    g_io_channel_unref(queue_channel);
+
+    g_main_loop_run(recorder->main_loop);
+
+    /* Both sources point to our stack, so make sure they're gone */
+    g_source_remove(watch_id);
+    if (dmesg_event_handler_args.reading_backlog)
+        goto out;
+    if (recorder->section == PS2EMU_SECTION_INIT)
+        g_source_remove(dmesg_event_handler_args.timeout_id);
+
+    /* Record whatever was read before we were asked to quit */
+    stop_reader(recorder);
+    if (ret)
+        process_kmsg_queue(&dmesg_event_handler_args);
+
+    PS2EMU_PROBE(record_section_end, recorder->section, g_get_monotonic_time());
+    trace_section(recorder, TRACE_EVENT_SECTION_END);
+
+out:
+    stop_pipeline(recorder);
+
+    return ret;
+}
+
+void ps2emu_recorder_quit(PS2EmuRecorder *recorder) {
+    if (recorder->main_loop)
+        g_main_loop_quit(recorder->main_loop);
+}
@@ -0,0 +1,1180 @@
+/*
+ * ps2emu-replay-session.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu.h"
+#include "ps2emu-log.h"
+#include "ps2emu-lib-private.h"
+#include "ps2emu-probes.h"
+#include "ps2emu-device-ready.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <linux/serio.h>
+#include <userio.h>
+#include <sys/prctl.h>
+#include <sys/select.h>
+
+#define PS2EMU_USERIO_PATH     "/dev/userio"
+#define PS2EMU_SYSFS_DIR       "/sys"
+#define PS2EMU_MIN_EVENT_DELAY (G_USEC_PER_SEC / 2)
+
+/* Throwaway sleeps to get a first estimate of the send latency from */
+#define LATENCY_CALIBRATION_ROUNDS 8
+#define LATENCY_CALIBRATION_SLEEP  1000
+/* Each new sample moves the estimate by 1/2^shift of the difference */
+#define LATENCY_EWMA_SHIFT         3
+/* Anything slower means we got preempted. Such samples are thrown away rather
+ * than clamped, since even a clamped one would drag the average up for many
+ * events after a single hiccup */
+#define LATENCY_MAX_SAMPLE         5000
+
+/* How far ahead of the replay a byte from the host can be matched with the
+ * line of the log expecting it */
+#define HOST_BYTE_WINDOW     32
+/* Interrupts up to this long after a byte from the host in the log are taken
+ * to answer it, and are timed from when the host actually sent it */
+#define HOST_RESPONSE_WINDOW G_USEC_PER_SEC
+
+typedef struct {
+    gint64 time;
+    guchar data;
+} HostByte;
+
+struct _PS2EmuReplay {
+    PS2EmuLog *log;
+
+    const PS2EmuClock *clock;
+    gpointer clock_data;
+
+    const PS2EmuDevice *device;
+    gpointer device_data;
+    GDestroyNotify device_data_destroy;
+    gboolean device_open;
+    /* Whether we've waited for the device since initializing it */
+    gboolean device_ready;
+
+    PS2EmuEventFunc event_func;
+    gpointer event_data;
+    PS2EmuMismatchFunc mismatch_func;
+    gpointer mismatch_data;
+    PS2EmuNoteFunc note_func;
+    gpointer note_data;
+
+    gint64 max_wait;
+    gint64 tolerance;
+    gboolean compensate;
+    gboolean latency_calibrated;
+    /* Moving average of how long from the time we meant to wake up for an
+     * interrupt until it was sent */
+    gint64 latency;
+    gint64 event_delay;
+    gint64 note_delay;
+
+    gboolean wait_for_ready;
+    gchar *sysfs_dir;
+
+    guint mismatch_count;
+    PS2EmuSchedulingStats scheduling;
+
+    /* Bytes the host sent that no line of the log was matched with yet. These
+     * carry over into the next section */
+    GArray *host_bytes;
+
+    /* Set while measuring the probe: interrupts are sent as soon as the host
+     * is done, and every byte either way is timestamped */
+    gboolean response_driven;
+    GArray *probe_commands;
+    gint64 probe_last_time;
+    gboolean probe_last_from_host;
+
+    PS2EmuTrace *trace;
+    PS2EmuMetrics *metrics;
+
+    PS2EmuCheckpointFunc checkpoint_func;
+    gpointer checkpoint_data;
+    gint64 checkpoint_interval;
+    /* Where the next run of the main section starts from */
+    PS2EmuCheckpoint *resume;
+};
+
+static gint64 monotonic_get_time(gpointer user_data) {
+    return g_get_monotonic_time();
+}
+
+static void monotonic_sleep(gint64 duration,
+                            gpointer user_data) {
+    g_usleep(duration);
+}
+
+const PS2EmuClock ps2emu_clock_monotonic = {
+    .get_time = monotonic_get_time,
+    .sleep = monotonic_sleep,
+};
+
+/* The default device backend, the userio character device from the ps2emu
+ * kernel module */
+typedef struct {
+    gchar *path;
+    gchar *sysfs_dir;
+    GIOChannel *channel;
+
+    /* Set from registering the port until we've waited for it to be ready */
+    DeviceReady *ready;
+} UserioDevice;
+
+static GIOStatus send_userio_cmd(GIOChannel *userio_channel,
+                                 guint8 type,
+                                 guint8 data,
+                                 GError **error) {
+    GIOStatus rc;
+    struct userio_cmd cmd = {
+        .type = type,
+        .data = data,
+    };
+
+    rc = g_io_channel_write_chars(userio_channel, (gchar*)&cmd, sizeof(cmd),
+                                  NULL, error);
+    return rc;
+}
+
+static gboolean userio_open(PS2Port port,
+                            gpointer user_data,
+                            GError **error) {
+    UserioDevice *userio = user_data;
+    GIOStatus rc;
+    __u8 port_type;
+
+    userio->channel = g_io_channel_new_file(userio->path, "r+", error);
+    if (!userio->channel) {
+        g_prefix_error(error, "While opening %s: ", userio->path);
+        return FALSE;
+    }
+
+    rc = g_io_channel_set_encoding(userio->channel, NULL, error);
+    if (rc != G_IO_STATUS_NORMAL) {
+        g_prefix_error(error, "While opening %s: ", userio->path);
+        return FALSE;
+    }
+    g_io_channel_set_buffered(userio->channel, FALSE);
+
+    lib_phase("set port type");
+    port_type = (port == PS2_PORT_KBD) ? SERIO_8042_XL : SERIO_8042;
+    rc = send_userio_cmd(userio->channel, USERIO_CMD_SET_PORT_TYPE, port_type,
+                         error);
+    if (rc != G_IO_STATUS_NORMAL) {
+        g_prefix_error(error, "While setting port type on %s: ",
+                       userio->path);
+        return FALSE;
+    }
+
+    lib_phase("register device");
+    userio->ready = device_ready_new(userio->sysfs_dir);
+    rc = send_userio_cmd(userio->channel, USERIO_CMD_REGISTER, 0, error);
+    if (rc != G_IO_STATUS_NORMAL) {
+        g_prefix_error(error, "While starting device on %s: ", userio->path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean userio_send(guchar data,
+                            gpointer user_data,
+                            GError **error) {
+    UserioDevice *userio = user_data;
+
+    return send_userio_cmd(userio->channel, USERIO_CMD_SEND_INTERRUPT, data,
+                           error) == G_IO_STATUS_NORMAL;
+}
+
+static gboolean userio_receive(guchar *data,
+                               gpointer user_data,
+                               GError **error) {
+    UserioDevice *userio = user_data;
+    gsize count;
+
+    return g_io_channel_read_chars(userio->channel, (gchar*)data,
+                                   sizeof(*data), &count, error) ==
+        G_IO_STATUS_NORMAL;
+}
+
+static gboolean userio_wait(gint64 timeout,
+                            gpointer user_data) {
+    UserioDevice *userio = user_data;
+    const int fd = g_io_channel_unix_get_fd(userio->channel);
+    const struct timespec ts = {
+        .tv_sec = timeout / G_USEC_PER_SEC,
+        .tv_nsec = (timeout % G_USEC_PER_SEC) * 1000,
+    };
+    fd_set fds;
+    int rc;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+
+    /* pselect() rather than poll(), so we don't wake up late by up to a
+     * millisecond */
+    rc = pselect(fd + 1, &fds, NULL, NULL, &ts, NULL);
+    if (rc < 0 && errno == EINTR)
+        return FALSE;
+
+    /* Anything else goes wrong, receive() gets to report it */
+    return rc != 0;
+}
+
+static void userio_close(gpointer user_data) {
+    UserioDevice *userio = user_data;
+
+    g_clear_pointer(&userio->ready, device_ready_free);
+    g_clear_pointer(&userio->channel, g_io_channel_unref);
+}
+
+static void userio_device_free(UserioDevice *userio) {
+    if (userio->ready)
+        device_ready_free(userio->ready);
+    if (userio->channel)
+        g_io_channel_unref(userio->channel);
+
+    g_free(userio->path);
+    g_free(userio->sysfs_dir);
+    g_free(userio);
+}
+
+static const PS2EmuDevice userio_device = {
+    .open = userio_open,
+    .send = userio_send,
+    .receive = userio_receive,
+    .close = userio_close,
+    .wait = userio_wait,
+};
+
+PS2EmuReplay *ps2emu_replay_new(PS2EmuLog *log) {
+    PS2EmuReplay *replay = g_new0(PS2EmuReplay, 1);
+
+    replay->log = ps2emu_log_ref(log);
+    replay->clock = &ps2emu_clock_monotonic;
+    replay->wait_for_ready = TRUE;
+    replay->compensate = TRUE;
+    replay->sysfs_dir = g_strdup(PS2EMU_SYSFS_DIR);
+    replay->host_bytes = g_array_new(FALSE, FALSE, sizeof(HostByte));
+
+    ps2emu_replay_set_userio_path(replay, PS2EMU_USERIO_PATH);
+
+    return replay;
+}
+
+static void replay_close_device(PS2EmuReplay *replay) {
+    if (replay->device_open && replay->device->close)
+        replay->device->close(replay->device_data);
+
+    replay->device_open = FALSE;
+    g_array_set_size(replay->host_bytes, 0);
+}
+
+void ps2emu_replay_free(PS2EmuReplay *replay) {
+    replay_close_device(replay);
+
+    if (replay->device_data_destroy)
+        replay->device_data_destroy(replay->device_data);
+
+    ps2emu_log_unref(replay->log);
+    g_free(replay->sysfs_dir);
+    g_free(replay->resume);
+    g_array_free(replay->host_bytes, TRUE);
+    g_free(replay);
+}
+
+void ps2emu_replay_set_clock(PS2EmuReplay *replay,
+                             const PS2EmuClock *clock,
+                             gpointer user_data) {
+    replay->clock = clock;
+    replay->clock_data = user_data;
+}
+
+void ps2emu_replay_set_device(PS2EmuReplay *replay,
+                              const PS2EmuDevice *device,
+                              gpointer user_data,
+                              GDestroyNotify destroy) {
+    replay_close_device(replay);
+
+    if (replay->device_data_destroy)
+        replay->device_data_destroy(replay->device_data);
+
+    replay->device = device;
+    replay->device_data = user_data;
+    replay->device_data_destroy = destroy;
+}
+
+void ps2emu_replay_set_userio_path(PS2EmuReplay *replay,
+                                   const gchar *path) {
+    UserioDevice *userio = g_new0(UserioDevice, 1);
+
+    userio->path = g_strdup(path);
+    userio->sysfs_dir = g_strdup(replay->sysfs_dir);
+
+    ps2emu_replay_set_device(replay, &userio_device, userio,
+                             (GDestroyNotify)userio_device_free);
+}
+
+void ps2emu_replay_set_event_callback(PS2EmuReplay *replay,
+                                      PS2EmuEventFunc func,
+                                      gpointer user_data) {
+    replay->event_func = func;
+    replay->event_data = user_data;
+}
+
+void ps2emu_replay_set_mismatch_callback(PS2EmuReplay *replay,
+                                         PS2EmuMismatchFunc func,
+                                         gpointer user_data) {
+    replay->mismatch_func = func;
+    replay->mismatch_data = user_data;
+}
+
+void ps2emu_replay_set_note_callback(PS2EmuReplay *replay,
+                                     PS2EmuNoteFunc func,
+                                     gpointer user_data) {
+    replay->note_func = func;
+    replay->note_data = user_data;
+}
+
+void ps2emu_replay_set_max_wait(PS2EmuReplay *replay,
+                                gint64 max_wait) {
+    replay->max_wait = max_wait;
+}
+
+void ps2emu_replay_set_timing_tolerance(PS2EmuReplay *replay,
+                                        gint64 tolerance) {
+    replay->tolerance = tolerance;
+}
+
+void ps2emu_replay_set_latency_compensation(PS2EmuReplay *replay,
+                                            gboolean compensate) {
+    replay->compensate = compensate;
+}
+
+void ps2emu_replay_set_event_delay(PS2EmuReplay *replay,
+                                   gint64 event_delay) {
+    replay->event_delay = event_delay;
+}
+
+void ps2emu_replay_set_wait_for_ready(PS2EmuReplay *replay,
+                                      gboolean wait_for_ready) {
+    replay->wait_for_ready = wait_for_ready;
+}
+
+void ps2emu_replay_set_sysfs_dir(PS2EmuReplay *replay,
+                                 const gchar *sysfs_dir) {
+    g_free(replay->sysfs_dir);
+    replay->sysfs_dir = g_strdup(sysfs_dir);
+
+    if (replay->device == &userio_device) {
+        UserioDevice *userio = replay->device_data;
+
+        g_free(userio->sysfs_dir);
+        userio->sysfs_dir = g_strdup(sysfs_dir);
+    }
+}
+
+void ps2emu_replay_set_note_delay(PS2EmuReplay *replay,
+                                  gint64 note_delay) {
+    replay->note_delay = note_delay;
+}
+
+void ps2emu_replay_set_trace(PS2EmuReplay *replay,
+                             PS2EmuTrace *trace) {
+    replay->trace = trace;
+}
+
+void ps2emu_replay_set_metrics(PS2EmuReplay *replay,
+                               PS2EmuMetrics *metrics) {
+    replay->metrics = metrics;
+    if (metrics)
+        metrics->replaying = TRUE;
+}
+
+/* How many lines (events and notes) there are in the main section */
+static guint64 count_main_lines(PS2EmuLog *log) {
+    const PS2Event *event;
+    const gchar *note;
+    LogCursor cursor;
+    guint64 count = 0;
+
+    log_handle_cursor_init(log, PS2EMU_SECTION_MAIN, &cursor);
+    while (log_cursor_next(&cursor, &event, &note))
+        count++;
+
+    return count;
+}
+
+void ps2emu_replay_set_checkpoint_callback(PS2EmuReplay *replay,
+                                           gint64 interval,
+                                           PS2EmuCheckpointFunc func,
+                                           gpointer user_data) {
+    replay->checkpoint_interval = interval;
+    replay->checkpoint_func = func;
+    replay->checkpoint_data = user_data;
+}
+
+gboolean ps2emu_replay_set_resume(PS2EmuReplay *replay,
+                                  const PS2EmuCheckpoint *checkpoint,
+                                  GError **error) {
+    PS2EmuLog *log = replay->log;
+
+    if (ps2emu_log_get_version(log) == 0) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "V0 logs can't be resumed");
+        return FALSE;
+    }
+
+    if (checkpoint->port != ps2emu_log_get_port(log) ||
+        checkpoint->main_lines != count_main_lines(log) ||
+        checkpoint->position > checkpoint->main_lines) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "The checkpoint was made while replaying a "
+                            "different log");
+        return FALSE;
+    }
+
+    g_free(replay->resume);
+    replay->resume = g_new(PS2EmuCheckpoint, 1);
+    *replay->resume = *checkpoint;
+
+    return TRUE;
+}
+
+gboolean ps2emu_replay_set_log(PS2EmuReplay *replay,
+                               PS2EmuLog *log) {
+    gboolean same_init = ps2emu_log_init_equal(replay->log, log);
+
+    ps2emu_log_ref(log);
+    ps2emu_log_unref(replay->log);
+    replay->log = log;
+
+    replay->mismatch_count = 0;
+    g_clear_pointer(&replay->resume, g_free);
+
+    if (!same_init)
+        replay_close_device(replay);
+
+    return replay->device_open;
+}
+
+guint ps2emu_replay_get_mismatch_count(PS2EmuReplay *replay) {
+    return replay->mismatch_count;
+}
+
+void ps2emu_replay_get_scheduling_stats(PS2EmuReplay *replay,
+                                        PS2EmuSchedulingStats *stats) {
+    *stats = replay->scheduling;
+    stats->compensation = replay->compensate ? replay->latency : 0;
+}
+
+static inline gint64 replay_get_time(PS2EmuReplay *replay) {
+    return replay->clock->get_time(replay->clock_data);
+}
+
+static void replay_sleep(PS2EmuReplay *replay,
+                         gint64 duration) {
+    gint64 start_time;
+
+    if (G_LIKELY(!replay->trace)) {
+        replay->clock->sleep(duration, replay->clock_data);
+        return;
+    }
+
+    start_time = replay_get_time(replay);
+    replay->clock->sleep(duration, replay->clock_data);
+
+    trace_add(replay->trace, &(TraceEvent) {
+        .type = TRACE_EVENT_SLEEP,
+        .time = start_time,
+        .value = replay_get_time(replay) - start_time,
+    });
+}
+
+static void latency_add_sample(PS2EmuReplay *replay,
+                               gint64 sample) {
+    if (sample < 0 || sample > LATENCY_MAX_SAMPLE)
+        return;
+
+    if (!replay->latency_calibrated) {
+        replay->latency = sample;
+        replay->latency_calibrated = TRUE;
+        return;
+    }
+
+    replay->latency += (sample - replay->latency) >> LATENCY_EWMA_SHIFT;
+}
+
+/* Writing to the device can't be part of this: whatever we send goes straight
+ * to the driver. Waking up late usually makes up most of the latency anyway,
+ * and the writes get measured once the replay starts */
+static void replay_calibrate_latency(PS2EmuReplay *replay) {
+    if (replay->latency_calibrated || !replay->compensate)
+        return;
+
+    lib_phase("calibrate latency");
+    for (guint i = 0; i < LATENCY_CALIBRATION_ROUNDS; i++) {
+        const gint64 start_time = replay_get_time(replay);
+
+        replay->clock->sleep(LATENCY_CALIBRATION_SLEEP, replay->clock_data);
+        latency_add_sample(replay, replay_get_time(replay) - start_time -
+                                   LATENCY_CALIBRATION_SLEEP);
+    }
+}
+
+static void replay_trace_section(PS2EmuReplay *replay,
+                                 PS2EmuSection section,
+                                 TraceEventType type,
+                                 gint64 time) {
+    if (G_LIKELY(!replay->trace))
+        return;
+
+    trace_add(replay->trace, &(TraceEvent) {
+        .type = type,
+        .time = time,
+        .section = section,
+    });
+}
+
+/* Reading from the host while the replay goes on. Whatever the host sends is
+ * read as soon as it arrives, and matched in order with the lines of the log
+ * expecting it, as long as those are within HOST_BYTE_WINDOW lines of the
+ * replay. A host that's ahead of the replay doesn't hold up the interrupts
+ * before those lines, and the answers to it are timed from when it actually
+ * sent something */
+typedef struct {
+    PS2EmuSection section;
+
+    /* The next line that could be expecting a byte from the host */
+    LogCursor cursor;
+    guint64 position;
+    guint64 window_end;
+
+    /* Bytes that were matched with lines the replay hasn't gotten to yet */
+    GArray *matched;
+
+    /* How much later than its schedule the host sent the last byte the replay
+     * got to, and when the log has it */
+    gint64 anchor_shift;
+    gint64 anchor_event_time;
+} HostReader;
+
+static void probe_add_command(PS2EmuReplay *replay,
+                              guchar data) {
+    UserioDevice *userio = replay->device_data;
+    const gint64 now = g_get_monotonic_time();
+    PS2EmuProbeCommand command = {
+        .data = data,
+        .time = now - device_ready_get_register_time(userio->ready),
+        .wait = now - replay->probe_last_time,
+        .wait_type = replay->probe_last_from_host ? PS2EMU_PROBE_WAIT_TIMEOUT :
+                                                    PS2EMU_PROBE_WAIT_DRIVER,
+    };
+
+    g_array_append_val(replay->probe_commands, command);
+
+    replay->probe_last_time = now;
+    replay->probe_last_from_host = TRUE;
+}
+
+static void host_byte_matched(PS2EmuReplay *replay,
+                              PS2EmuSection section,
+                              const PS2Event *event,
+                              const HostByte *byte) {
+    if (replay->trace) {
+        trace_add(replay->trace, &(TraceEvent) {
+            .type = event->data == byte->data ? TRACE_EVENT_HOST_BYTE :
+                                                TRACE_EVENT_MISMATCH,
+            .time = byte->time,
+            .section = section,
+            .data = byte->data,
+            .expected = event->data,
+        });
+    }
+
+    if (event->data == byte->data) {
+        PS2EMU_PROBE(replay_byte_received, section, event->data);
+
+        if (replay->metrics)
+            metrics_add(&replay->metrics->bytes_received, 1);
+
+        if (replay->event_func)
+            replay->event_func(replay, section, event, replay->event_data);
+    } else {
+        replay->mismatch_count++;
+        PS2EMU_PROBE(replay_byte_mismatch, section, event->data, byte->data,
+                     replay->mismatch_count);
+
+        if (replay->metrics)
+            metrics_add(&replay->metrics->mismatches, 1);
+
+        if (replay->mismatch_func)
+            replay->mismatch_func(replay, event, byte->data,
+                                  replay->mismatch_data);
+    }
+}
+
+static void host_match(PS2EmuReplay *replay,
+                       HostReader *host) {
+    const PS2Event *event;
+    const gchar *note;
+
+    while (replay->host_bytes->len && host->position < host->window_end &&
+           log_cursor_next(&host->cursor, &event, &note)) {
+        HostByte *byte = &g_array_index(replay->host_bytes, HostByte, 0);
+
+        host->position++;
+        if (note || event->type == PS2_EVENT_TYPE_INTERRUPT)
+            continue;
+
+        host_byte_matched(replay, host->section, event, byte);
+
+        g_array_append_vals(host->matched, byte, 1);
+        g_array_remove_index(replay->host_bytes, 0);
+    }
+}
+
+/* Read a byte from the host, waiting for one if there's none yet */
+static gboolean host_receive(PS2EmuReplay *replay,
+                             HostReader *host,
+                             GError **error) {
+    HostByte byte = { 0 };
+
+    if (!replay->device->receive(&byte.data, replay->device_data, error))
+        return FALSE;
+
+    byte.time = replay_get_time(replay);
+
+    if (replay->probe_commands)
+        probe_add_command(replay, byte.data);
+
+    g_array_append_val(replay->host_bytes, byte);
+    host_match(replay, host);
+
+    return TRUE;
+}
+
+/* Sleep for duration, reading everything the host sends in the meantime */
+static gboolean replay_wait(PS2EmuReplay *replay,
+                            HostReader *host,
+                            gint64 duration,
+                            GError **error) {
+    const PS2EmuDevice *device = replay->device;
+    const gint64 start_time = replay_get_time(replay),
+                 end_time = start_time + duration;
+    gint64 current_time = start_time;
+
+    if (!device->wait) {
+        replay_sleep(replay, duration);
+        return TRUE;
+    }
+
+    /* Other clocks can't wait on the device at the same time, so the host
+     * only gets read from once they're done sleeping */
+    if (replay->clock != &ps2emu_clock_monotonic) {
+        replay_sleep(replay, duration);
+
+        while (device->wait(0, replay->device_data)) {
+            if (!host_receive(replay, host, error))
+                return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    do {
+        if (device->wait(end_time - current_time, replay->device_data) &&
+            !host_receive(replay, host, error))
+            return FALSE;
+
+        current_time = replay_get_time(replay);
+    } while (current_time < end_time);
+
+    if (replay->trace) {
+        trace_add(replay->trace, &(TraceEvent) {
+            .type = TRACE_EVENT_SLEEP,
+            .time = start_time,
+            .value = current_time - start_time,
+        });
+    }
+
+    return TRUE;
+}
+
+static gboolean simulate_interrupt(PS2EmuReplay *replay,
+                                   HostReader *host,
+                                   gint64 start_time,
+                                   gint64 offset,
+                                   const PS2Event *event,
+                                   GError **error) {
+    const PS2EmuSection section = host->section;
+    /* The initialization sequence is short, and the driver's probe might
+     * depend on its timing */
+    const gint64 tolerance = section == PS2EMU_SECTION_MAIN ?
+                             replay->tolerance : 0;
+    gint64 deadline = start_time - offset + event->time,
+           wake_time;
+    gboolean slept = FALSE;
+    gint64 current_time;
+
+    /* However early or late the host was, the device answers it as quickly
+     * as it did in the log */
+    if (host->anchor_event_time >= 0 &&
+        event->time - host->anchor_event_time <= HOST_RESPONSE_WINDOW)
+        deadline += host->anchor_shift;
+
+    wake_time = replay->compensate ? deadline - replay->latency : deadline;
+
+    current_time = replay_get_time(replay);
+    PS2EMU_PROBE(replay_interrupt_scheduled, section, event->data, deadline,
+                 current_time);
+
+    /* Anything due within the tolerance goes out with this wakeup */
+    if (wake_time - current_time > tolerance && !replay->response_driven) {
+        if (!replay_wait(replay, host, wake_time - current_time, error))
+            return FALSE;
+        slept = TRUE;
+
+        if (section == PS2EMU_SECTION_MAIN) {
+            replay->scheduling.wakeups++;
+
+            if (replay->metrics)
+                metrics_add(&replay->metrics->wakeups, 1);
+        }
+    }
+
+    if (!replay->device->send(event->data, replay->device_data, error))
+        return FALSE;
+
+    if (replay->probe_commands) {
+        replay->probe_last_time = g_get_monotonic_time();
+        replay->probe_last_from_host = FALSE;
+    }
+
+    if (replay->trace || replay->metrics || slept ||
+        section == PS2EMU_SECTION_MAIN)
+        current_time = replay_get_time(replay);
+
+    /* Otherwise we sent it right after the last time we read the clock, and
+     * we don't read it again just for a probe nobody might be watching */
+    PS2EMU_PROBE(replay_interrupt_sent, section, event->data, deadline,
+                 current_time);
+
+    /* Only an interrupt we slept for tells us how late we wake up. With a
+     * tolerance, the kernel makes us late on purpose */
+    if (slept && replay->compensate && !tolerance)
+        latency_add_sample(replay, current_time - wake_time);
+
+    if (section == PS2EMU_SECTION_MAIN) {
+        const gint64 lateness = current_time - deadline;
+
+        replay->scheduling.interrupts++;
+        replay->scheduling.lateness_sum += lateness;
+        replay->scheduling.error_sum += ABS(lateness);
+        replay->scheduling.error_max = MAX(replay->scheduling.error_max,
+                                           ABS(lateness));
+    }
+
+    if (replay->trace) {
+        trace_add(replay->trace, &(TraceEvent) {
+            .type = TRACE_EVENT_INTERRUPT,
+            .time = current_time,
+            .value = current_time - deadline,
+            .section = section,
+            .data = event->data,
+        });
+    }
+
+    if (replay->metrics) {
+        metrics_add(&replay->metrics->interrupts_sent, 1);
+        metrics_observe(&replay->metrics->interrupt_lateness,
+                        current_time - deadline);
+    }
+
+    if (replay->event_func)
+        replay->event_func(replay, section, event, replay->event_data);
+
+    return TRUE;
+}
+
+static gboolean simulate_receive(PS2EmuReplay *replay,
+                                 HostReader *host,
+                                 gint64 start_time,
+                                 gint64 offset,
+                                 const PS2Event *event,
+                                 GError **error) {
+    HostByte *byte;
+
+    /* Lines are only matched in order, so the first byte in there is the one
+     * for this line */
+    while (!host->matched->len) {
+        if (!host_receive(replay, host, error))
+            return FALSE;
+    }
+
+    byte = &g_array_index(host->matched, HostByte, 0);
+    host->anchor_shift = byte->time - (start_time - offset + event->time);
+    host->anchor_event_time = event->time;
+    g_array_remove_index(host->matched, 0);
+
+    return TRUE;
+}
+
+static void replay_wait_for_device(PS2EmuReplay *replay) {
+    UserioDevice *userio = replay->device_data;
+    DeviceReadyResult result = DEVICE_READY_UNKNOWN;
+    const gint64 start_time = replay_get_time(replay);
+    gint64 waited;
+
+    /* Other backends don't have a serio port we could watch. If we've already
+     * read something from the host that's meant for the main section, the
+     * device won't show up as busy anymore */
+    if (replay->host_bytes->len) {
+        result = DEVICE_READY_HOST_BUSY;
+    } else if (replay->wait_for_ready && replay->device == &userio_device &&
+               userio->ready) {
+        result = device_ready_wait(userio->ready,
+                                   g_io_channel_unix_get_fd(userio->channel),
+                                   PS2EMU_MIN_EVENT_DELAY);
+    }
+
+    if (replay->device == &userio_device)
+        g_clear_pointer(&userio->ready, device_ready_free);
+
+    waited = replay_get_time(replay) - start_time;
+    if (replay->trace && waited > 0) {
+        trace_add(replay->trace, &(TraceEvent) {
+            .type = TRACE_EVENT_SLEEP,
+            .time = start_time,
+            .value = waited,
+        });
+    }
+
+    /* If we can't tell, always wait at least a little so we don't throw the
+     * driver out of sync */
+    if (result == DEVICE_READY_UNKNOWN && waited < PS2EMU_MIN_EVENT_DELAY)
+        replay_sleep(replay, PS2EMU_MIN_EVENT_DELAY - waited);
+
+    PS2EMU_PROBE(replay_device_ready, result,
+                 replay_get_time(replay) - start_time);
+}
+
+static gboolean replay_section(PS2EmuReplay *replay,
+                               PS2EmuSection section,
+                               gint64 max_wait,
+                               gint64 note_delay,
+                               const PS2EmuCheckpoint *resume,
+                               GError **error) {
+    const gboolean checkpoints = replay->checkpoint_func &&
+                                 section == PS2EMU_SECTION_MAIN &&
+                                 ps2emu_log_get_version(replay->log) != 0;
+    const gboolean low_power = replay->tolerance &&
+                               section == PS2EMU_SECTION_MAIN;
+    const gint64 section_start = replay_get_time(replay);
+    gint64 start_time = section_start,
+           next_checkpoint = start_time + replay->checkpoint_interval,
+           section_end = -1;
+    int timer_slack = -1;
+    gboolean ret = FALSE;
+    const PS2Event *event;
+    const gchar *note;
+    LogCursor cursor;
+    /* The last event replayed, and how far into its packet it was */
+    PS2Event last_event = { 0 };
+    guint packet_len = 0;
+    PS2EmuCheckpoint progress = {
+        .last_event_time = -1,
+        .port = ps2emu_log_get_port(replay->log),
+    };
+    HostReader host = {
+        .section = section,
+        .anchor_event_time = -1,
+    };
+
+    PS2EMU_PROBE(replay_section_start, section, start_time);
+    replay_trace_section(replay, section, TRACE_EVENT_SECTION_START,
+                         start_time);
+
+    log_handle_cursor_init(replay->log, section, &cursor);
+
+    /* Skip everything that was already replayed, and pick the schedule up
+     * where it was */
+    if (resume) {
+        while (progress.position < resume->position &&
+               log_cursor_next(&cursor, &event, &note))
+            progress.position++;
+
+        progress.elapsed = resume->elapsed;
+        progress.offset = resume->offset;
+        progress.last_event_time = resume->last_event_time;
+        progress.notes = resume->notes;
+        progress.note_delay_total = resume->note_delay_total;
+        replay->mismatch_count = resume->mismatch_count;
+
+        start_time -= resume->elapsed;
+    }
+
+    if (checkpoints)
+        progress.main_lines = count_main_lines(replay->log);
+
+    host.cursor = cursor;
+    host.position = progress.position;
+    host.matched = g_array_new(FALSE, FALSE, sizeof(HostByte));
+
+    /* Let the kernel put off our wakeups by up to the tolerance, so they can
+     * share an interrupt with other timers on the host. This doesn't apply to
+     * timerfds, only to sleeps */
+    if (low_power) {
+        timer_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+        prctl(PR_SET_TIMERSLACK, (unsigned long)replay->tolerance * 1000,
+              0, 0, 0);
+    }
+
+    while (log_cursor_next(&cursor, &event, &note)) {
+        /* A replay resumed in the middle of a packet would leave the driver
+         * out of sync with the device, so checkpoints only go right before a
+         * line from the host, or an interrupt that starts a new packet */
+        const gboolean packet_start =
+            !note &&
+            (event->type != PS2_EVENT_TYPE_INTERRUPT || !packet_len ||
+             !ps2_event_continues_packet(&last_event, packet_len, event));
+
+        if (G_UNLIKELY(checkpoints) && packet_start) {
+            const gint64 current_time = replay_get_time(replay);
+
+            if (current_time >= next_checkpoint) {
+                progress.elapsed = current_time - start_time;
+                progress.mismatch_count = replay->mismatch_count;
+                replay->checkpoint_func(replay, &progress,
+                                        replay->checkpoint_data);
+
+                next_checkpoint = current_time + replay->checkpoint_interval;
+            }
+        }
+        progress.position++;
+
+        /* Whatever the host sent early might be expected now */
+        host.window_end = progress.position - 1 + HOST_BYTE_WINDOW;
+        host_match(replay, &host);
+
+        if (note) {
+            PS2EMU_PROBE(replay_note, section, note);
+
+            if (replay->trace) {
+                trace_add(replay->trace, &(TraceEvent) {
+                    .type = TRACE_EVENT_NOTE,
+                    .time = replay_get_time(replay),
+                    .section = section,
+                    .note = g_string_chunk_insert_const(replay->trace->notes,
+                                                        note),
+                });
+            }
+
+            if (replay->metrics)
+                metrics_add(&replay->metrics->notes, 1);
+
+            if (replay->note_func)
+                replay->note_func(replay, note, replay->note_data);
+
+            if (!replay_wait(replay, &host, note_delay, error))
+                goto out;
+            progress.offset -= note_delay;
+            progress.note_delay_total += note_delay;
+            progress.notes++;
+
+            continue;
+        }
+
+        if (max_wait && progress.last_event_time >= 0) {
+            gint64 wait_time = event->time - progress.last_event_time;
+
+            /* If necessary, time-travel to the future */
+            if (wait_time > max_wait)
+                progress.offset += wait_time - max_wait;
+        }
+        progress.last_event_time = event->time;
+
+        packet_len = packet_start ? 1 : packet_len + 1;
+        last_event = *event;
+
+        if (event->type == PS2_EVENT_TYPE_INTERRUPT) {
+            if (!simulate_interrupt(replay, &host, start_time,
+                                    progress.offset, event, error))
+                goto out;
+        } else {
+            if (!simulate_receive(replay, &host, start_time,
+                                  progress.offset, event, error))
+                goto out;
+        }
+    }
+
+    /* Shared by the probe, the trace and the main section's duration, so the
+     * probe doesn't read the clock on its own */
+    section_end = replay_get_time(replay);
+    PS2EMU_PROBE(replay_section_end, section, section_end);
+    replay_trace_section(replay, section, TRACE_EVENT_SECTION_END,
+                         section_end);
+
+    ret = TRUE;
+
+out:
+    g_array_free(host.matched, TRUE);
+
+    if (timer_slack > 0)
+        prctl(PR_SET_TIMERSLACK, (unsigned long)timer_slack, 0, 0, 0);
+
+    if (section == PS2EMU_SECTION_MAIN) {
+        if (!ret)
+            section_end = replay_get_time(replay);
+
+        replay->scheduling.duration += section_end - section_start;
+    }
+
+    return ret;
+}
+
+gboolean ps2emu_replay_init(PS2EmuReplay *replay,
+                            GError **error) {
+    PS2EmuLog *log = replay->log;
+    gboolean ret;
+
+    replay_calibrate_latency(replay);
+
+    lib_phase("open device");
+    if (!replay->device->open(ps2emu_log_get_port(log), replay->device_data,
+                              error))
+        return FALSE;
+
+    replay->device_open = TRUE;
+    replay->device_ready = FALSE;
+
+    lib_phase("init replay");
+    if (ps2emu_log_get_version(log) == 0) {
+        return replay_section(replay, PS2EMU_SECTION_MAIN, 0, 0, NULL, error);
+    }
+
+    /* When resuming, the host decides how fast the device gets set up again,
+     * there's no reason to wait as long as the log did */
+    replay->response_driven = replay->resume != NULL;
+    ret = replay_section(replay, PS2EMU_SECTION_INIT, 0, 0, NULL, error);
+    replay->response_driven = FALSE;
+
+    return ret;
+}
+
+gboolean ps2emu_replay_run(PS2EmuReplay *replay,
+                           GError **error) {
+    PS2EmuLog *log = replay->log;
+    gboolean ret;
+
+    if (!replay->device_open) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                            "The device hasn't been initialized yet");
+        return FALSE;
+    }
+
+    /* V0 logs were already replayed completely during initialization */
+    if (ps2emu_log_get_version(log) == 0)
+        return TRUE;
+
+    if (!replay->device_ready) {
+        lib_phase("wait for device");
+        replay_wait_for_device(replay);
+
+        lib_phase("event delay");
+        if (replay->event_delay)
+            replay_sleep(replay, replay->event_delay);
+
+        replay->device_ready = TRUE;
+    }
+
+    lib_phase("main replay");
+    ret = replay_section(replay, PS2EMU_SECTION_MAIN, replay->max_wait,
+                         replay->note_delay, replay->resume, error);
+
+    /* Only the first run picks up from the checkpoint */
+    g_clear_pointer(&replay->resume, g_free);
+
+    return ret;
+}
+
+void ps2emu_probe_timing_clear(PS2EmuProbeTiming *timing) {
+    g_clear_pointer(&timing->commands, g_free);
+    timing->n_commands = 0;
+    timing->total = 0;
+}
+
+gboolean ps2emu_replay_measure_probe(PS2EmuReplay *replay,
+                                     gint64 timeout,
+                                     PS2EmuProbeTiming *timing,
+                                     GError **error) {
+    PS2EmuLog *log = replay->log;
+    UserioDevice *userio = replay->device_data;
+    gint64 evdev_time;
+    gboolean ret = FALSE;
+
+    *timing = (PS2EmuProbeTiming) { 0 };
+
+    if (replay->device != &userio_device) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                            "The probe can only be measured on userio");
+        return FALSE;
+    }
+
+    if (ps2emu_log_get_version(log) == 0) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                            "V0 logs don't have an initialization sequence "
+                            "to measure");
+        return FALSE;
+    }
+
+    lib_phase("open device");
+    if (!replay->device->open(ps2emu_log_get_port(log), replay->device_data,
+                              error))
+        return FALSE;
+
+    replay->device_open = TRUE;
+
+    lib_phase("measure probe");
+    replay->response_driven = TRUE;
+    replay->probe_commands = g_array_new(FALSE, FALSE,
+                                         sizeof(PS2EmuProbeCommand));
+    replay->probe_last_time = device_ready_get_register_time(userio->ready);
+    replay->probe_last_from_host = FALSE;
+
+    if (!replay_section(replay, PS2EMU_SECTION_INIT, 0, 0, NULL, error))
+        goto out;
+
+    if (!device_ready_wait_for_evdev(userio->ready, timeout, &evdev_time,
+                                     error))
+        goto out;
+
+    timing->total = evdev_time - device_ready_get_register_time(userio->ready);
+    timing->n_commands = replay->probe_commands->len;
+    timing->commands = (PS2EmuProbeCommand*)
+        g_array_free(replay->probe_commands, FALSE);
+    replay->probe_commands = NULL;
+
+    ret = TRUE;
+
+out:
+    if (replay->probe_commands)
+        g_array_free(replay->probe_commands, TRUE);
+    replay->probe_commands = NULL;
+    replay->response_driven = FALSE;
+
+    return ret;
+}
@@ -13,155 +13,278 @@
  * details.
  */
 
-#include "ps2emu-log.h"
+#include "ps2emu.h"
 #include "ps2emu-misc.h"
+#include "ps2emu-async-log.h"
+#include "ps2emu-metrics-export.h"
+#include "ps2emu-probe-stats.h"
+#include "ps2emu-profile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <string.h>
+#include <sys/resource.h>
 #include <glib.h>
-#include <errno.h>
-#include <linux/serio.h>
-#include <userio.h>
-
-#define PS2EMU_MIN_EVENT_DELAY (0.5 * G_USEC_PER_SEC)
-
-static GIOStatus send_userio_cmd(GIOChannel *userio_channel,
-                                 guint8 type,
-                                 guint8 data,
-                                 GError **error) {
-    GIOStatus rc;
-    struct userio_cmd cmd = {
-        .type = type,
-        .data = data,
-    };
 
-    rc = g_io_channel_write_chars(userio_channel, (gchar*)&cmd, sizeof(cmd),
-                                  NULL, error);
-    return rc;
+static void print_event(PS2EmuReplay *replay,
+                        PS2EmuSection section,
+                        const PS2Event *event,
+                        gpointer user_data) {
+    AsyncLog *output = user_data;
+
+    if (event->type == PS2_EVENT_TYPE_INTERRUPT)
+        async_log_printf(output, stdout, "Send\t-> %.2hhx\n", event->data);
+    else
+        async_log_printf(output, stdout, "Receive\t<- %.2hhx\n", event->data);
 }
 
-static gboolean simulate_interrupt(GIOChannel *userio_channel,
-                                   time_t start_time,
-                                   time_t offset,
-                                   PS2Event *event,
-                                   gboolean verbose,
-                                   GError **error) {
-    time_t current_time;
-    GIOStatus rc;
+static void print_mismatch(PS2EmuReplay *replay,
+                           const PS2Event *expected,
+                           guchar received,
+                           gpointer user_data) {
+    AsyncLog *output = user_data;
 
-    current_time = g_get_monotonic_time() - start_time + offset;
-    if (current_time < event->time)
-        g_usleep(event->time - current_time);
+    async_log_printf(output, stderr, "Expected %.2hhx, received %.2hhx\n",
+                     expected->data, received);
 
-    if (verbose)
-        printf("Send\t-> %.2hhx\n", event->data);
+    if (ps2emu_replay_get_mismatch_count(replay) == 1) {
+        async_log_printf(output, stderr,
+                         "The device has gone out of sync with the recording, "
+                         "playback from this point forward will probably "
+                         "fail.\n");
+    }
+}
 
-    rc = send_userio_cmd(userio_channel, USERIO_CMD_SEND_INTERRUPT,
-                         event->data, error);
-    if (rc != G_IO_STATUS_NORMAL)
-        return FALSE;
+static void print_note(PS2EmuReplay *replay,
+                       const gchar *note,
+                       gpointer user_data) {
+    AsyncLog *output = user_data;
 
-    return TRUE;
+    async_log_printf(output, stdout, "User note: %s\n", note);
 }
 
-static gboolean simulate_receive(GIOChannel *userio_channel,
-                                 PS2Event *event,
-                                 gboolean verbose,
-                                 GError **error) {
-    guchar data;
-    gsize count;
-    static gboolean sync_warning_printed = FALSE;
-    GIOStatus rc;
-
-    rc = g_io_channel_read_chars(userio_channel, (gchar*)&data,
-                                 sizeof(event->data), &count, error);
-
-    if (rc != G_IO_STATUS_NORMAL)
-        return FALSE;
-
-    if (verbose && event->data == data)
-        printf("Receive\t<- %.2hhx\n", data);
-    else if (event->data != data) {
-        fprintf(stderr, "Expected %.2hhx, received %.2hhx\n",
-                event->data, data);
-
-        if (!sync_warning_printed) {
-            fprintf(stderr,
-                    "The device has gone out of sync with the recording, "
-                    "playback from this point forward will probably fail.\n");
-            sync_warning_printed = TRUE;
-        }
+#define CHECKPOINT_DEFAULT_INTERVAL_SECS 60
+
+typedef struct {
+    const gchar *path;
+    AsyncLog *output;
+} CheckpointWriter;
+
+static void write_checkpoint(PS2EmuReplay *replay,
+                             const PS2EmuCheckpoint *checkpoint,
+                             gpointer user_data) {
+    CheckpointWriter *writer = user_data;
+    GError *error = NULL;
+
+    /* Not worth stopping the replay over, the last checkpoint is still
+     * there */
+    if (!ps2emu_checkpoint_save(checkpoint, writer->path, &error)) {
+        async_log_printf(writer->output, stderr, "Warning: %s\n",
+                         error->message);
+        g_error_free(error);
     }
+}
+
+#define LOW_POWER_DEFAULT_TOLERANCE_MS 10
+
+/* Every time any of our threads went to sleep on its own, which is about how
+ * often the process as a whole woke up */
+static glong get_voluntary_switches(void) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+    return usage.ru_nvcsw;
+}
 
-    return TRUE;
+/* The replay loop only counts its own sleeps while replaying the events, the
+ * process-wide count covers every thread and the whole playlist */
+static void print_scheduling_stats(PS2EmuReplay *replay,
+                                   AsyncLog *output,
+                                   glong start_switches,
+                                   gint64 start_time) {
+    PS2EmuSchedulingStats stats;
+    gdouble seconds, process_seconds;
+    glong switches;
+
+    ps2emu_replay_get_scheduling_stats(replay, &stats);
+    if (!stats.interrupts)
+        return;
+
+    switches = get_voluntary_switches() - start_switches;
+
+    seconds = MAX((gdouble)stats.duration / G_USEC_PER_SEC, 1e-6);
+    process_seconds = MAX((gdouble)(g_get_monotonic_time() - start_time) /
+                          G_USEC_PER_SEC, 1e-6);
+    async_log_printf(output, stdout,
+                     "Scheduling: %" G_GUINT64_FORMAT " replay loop wakeups "
+                     "for %" G_GUINT64_FORMAT " bytes in %.1fs (%.2f "
+                     "wakeups/s), %ld process-wide in %.1fs (%.2f "
+                     "wakeups/s)\n"
+                     "Timing: %+.3fms late on average, %.3fms off either way "
+                     "on average and %.3fms at most, waking up %.3fms "
+                     "early\n",
+                     stats.wakeups, stats.interrupts, seconds,
+                     stats.wakeups / seconds,
+                     switches, process_seconds, switches / process_seconds,
+                     (gdouble)stats.lateness_sum / stats.interrupts / 1000,
+                     (gdouble)stats.error_sum / stats.interrupts / 1000,
+                     (gdouble)stats.error_max / 1000,
+                     (gdouble)stats.compensation / 1000);
 }
 
-static gboolean replay_line_list(GIOChannel *userio_channel,
-                                 GList *event_list,
-                                 time_t max_wait,
-                                 time_t note_delay,
-                                 gboolean verbose,
-                                 GError **error) {
-    LogLine *log_line;
-    const time_t start_time = g_get_monotonic_time();
-    long offset = 0;
+/* How a log in a playlist went */
+typedef struct {
+    const gchar *path;
+    gboolean replayed;
+    /* Whether the device had to be initialized for it, or was kept from the
+     * log before */
+    gboolean initialized;
+    guint mismatches;
+    gint64 duration;
+} PlaylistResult;
+
+/* Replays the log that replay is on. If the device is still set up from the
+ * log before, it goes straight on to the events */
+static gboolean replay_log(PS2EmuReplay *replay,
+                           PS2EmuLog *log,
+                           gboolean initialized,
+                           gboolean no_events,
+                           AsyncLog *output,
+                           GError **error) {
+    if (ps2emu_log_get_version(log) == 0)
+        return ps2emu_replay_init(replay, error);
+
+    if (initialized) {
+        async_log_printf(output, stdout,
+                         "Device already initialized with the same "
+                         "sequence\n");
+    } else {
+        async_log_printf(output, stdout,
+                         "Replaying initialization sequence...\n");
+        if (!ps2emu_replay_init(replay, error))
+            return FALSE;
+
+        async_log_printf(output, stdout, "Device initialized\n");
+    }
+
+    if (no_events)
+        return TRUE;
 
-    for (GList *l = event_list; l != NULL; l = l->next) {
-        log_line = l->data;
+    async_log_printf(output, stdout, "Replaying event sequence...\n");
+    return ps2emu_replay_run(replay, error);
+}
 
-        if (log_line->type == LINE_TYPE_NOTE) {
-            printf("User note: %s\n",
-                   log_line->note);
+static void print_playlist_results(const PlaylistResult *results,
+                                   guint count) {
+    printf("\n%-40s %-12s %-10s %10s %12s\n",
+           "Log", "Result", "Device", "Mismatches", "Time (s)");
 
-            g_usleep(note_delay);
-            offset -= note_delay;
+    for (guint i = 0; i < count; i++) {
+        const PlaylistResult *result = &results[i];
 
+        if (!result->replayed) {
+            printf("%-40s %s\n", result->path,
+                   i == 0 || results[i - 1].replayed ? "failed" :
+                                                       "not replayed");
             continue;
         }
 
-        if (max_wait && l->prev) {
-            LogLine *last_line = l->prev->data;
-            time_t wait_time =
-                log_line->ps2_event->time - last_line->ps2_event->time;
+        printf("%-40s %-12s %-10s %10u %12.3f\n", result->path,
+               result->mismatches ? "out of sync" : "ok",
+               result->initialized ? "init" : "reused", result->mismatches,
+               (gdouble)result->duration / G_USEC_PER_SEC);
+    }
+}
 
-            /* If necessary, time-travel to the future */
-            if (wait_time > max_wait)
-                offset += wait_time - max_wait;
+/* How long to let the kernel settle after removing the device, before the
+ * next run */
+#define PROBE_RUN_INTERVAL (G_USEC_PER_SEC / 10)
+
+#define PROBE_DEFAULT_RUNS 10
+
+/* Give up on a run if the evdev node doesn't show up by then */
+#define PROBE_EVDEV_TIMEOUT (PS2EMU_INIT_TIMEOUT_SECS * G_USEC_PER_SEC)
+
+static gboolean measure_probe(PS2EmuLog *log,
+                              guint runs,
+                              GError **error) {
+    ProbeStats *stats = probe_stats_new();
+    gboolean ret = FALSE;
+
+    for (guint run = 1; run <= runs; run++) {
+        PS2EmuReplay *replay = ps2emu_replay_new(log);
+        PS2EmuProbeTiming timing;
+        gboolean measured;
+
+        measured = ps2emu_replay_measure_probe(replay, PROBE_EVDEV_TIMEOUT,
+                                               &timing, error);
+        if (measured && ps2emu_replay_get_mismatch_count(replay)) {
+            printf("Run %3u: the host went out of sync with the log, "
+                   "skipping it\n", run);
+            ps2emu_probe_timing_clear(&timing);
+        } else if (measured) {
+            probe_stats_print_run(&timing, run, stdout);
+            probe_stats_add(stats, &timing);
         }
 
-        if (log_line->ps2_event->type == PS2_EVENT_TYPE_INTERRUPT) {
-            if (!simulate_interrupt(userio_channel, start_time, offset,
-                                    log_line->ps2_event, verbose, error))
-                return FALSE;
-        } else {
-            if (!simulate_receive(userio_channel, log_line->ps2_event, verbose,
-                                  error))
-                return FALSE;
+        /* Unregisters the device */
+        ps2emu_replay_free(replay);
+
+        if (!measured) {
+            g_prefix_error(error, "Run %u: ", run);
+            goto out;
         }
+
+        g_usleep(PROBE_RUN_INTERVAL);
     }
 
-    return TRUE;
+    probe_stats_print(stats, stdout);
+    ret = TRUE;
+
+out:
+    probe_stats_free(stats);
+
+    return ret;
 }
 
 gint main(gint argc,
           gchar *argv[]) {
     GOptionContext *main_context =
-        g_option_context_new("<event_log> - replay PS/2 devices");
-    GIOChannel *input_channel,
-               *userio_channel;
-    GIOStatus rc;
-    int log_version;
+        g_option_context_new("<event_log>... - replay PS/2 devices");
     time_t max_wait = 0,
            event_delay = 0,
            note_delay = 0;
+    gint probe_runs = PROBE_DEFAULT_RUNS,
+         checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL_SECS,
+         tolerance = LOW_POWER_DEFAULT_TOLERANCE_MS;
     GError *error = NULL;
     gboolean no_events = FALSE,
              keep_running = FALSE,
-             verbose = FALSE;
-    ParsedLog *log;
-    __u8 port_type;
+             verbose = FALSE,
+             fixed_delay = FALSE,
+             probe = FALSE,
+             profile = FALSE,
+             low_power = FALSE,
+             no_compensation = FALSE;
+    gchar *trace_path = NULL,
+          *metrics_socket_path = NULL,
+          *metrics_file_path = NULL,
+          *checkpoint_path = NULL,
+          *resume_path = NULL;
+    CheckpointWriter checkpoint_writer;
+    PS2EmuLog *log;
+    PS2EmuReplay *replay = NULL;
+    PlaylistResult *results = NULL;
+    gint log_count;
+    glong playlist_switches;
+    gint64 playlist_start;
+    PS2EmuTrace *trace = NULL;
+    PS2EmuMetrics *metrics = NULL;
+    MetricsExporter *exporter = NULL;
+    AsyncLog *output = NULL;
+    gint ret = 1;
 
     GOptionEntry options[] = {
         { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
@@ -178,16 +301,58 @@ gint main(gint argc,
         { "event-delay", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &event_delay, "Wait n seconds after init before playing events",
           "n" },
+        { "fixed-delay", 'F', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &fixed_delay, "Always wait half a second after init, instead of "
+          "waiting for the device to be ready", NULL },
+        { "low-power", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &low_power, "Send events that are due close together in one "
+          "wakeup, for long replays", NULL },
+        { "timing-tolerance", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &tolerance, "How far off an event's time --low-power may send it, "
+          "in ms (default 10)", "ms" },
+        { "no-compensation", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &no_compensation, "Don't wake up early to make up for the time it "
+          "takes to send an event", NULL },
         { "note-delay", 'D', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &note_delay, "Wait n seconds after printing a user note",
           "n" },
+        { "measure-probe", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &probe, "Time how long the kernel takes to probe the device, "
+          "instead of replaying it", NULL },
+        { "probe-runs", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &probe_runs, "Measure the probe n times (default 10)", "n" },
+        { "profile", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &profile, "Print the time and allocations of each phase on exit",
+          NULL },
+        { "trace", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &trace_path, "Write a timeline of the replay to file, as Chrome "
+          "trace-event JSON", "file" },
+        { "metrics-socket", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &metrics_socket_path, "Serve OpenMetrics on a UNIX socket at path",
+          "path" },
+        { "metrics-file", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &metrics_file_path, "Keep file updated with OpenMetrics, for "
+          "node_exporter's textfile collector", "file" },
+        { "checkpoint", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &checkpoint_path, "Save the progress of the replay to file every so "
+          "often", "file" },
+        { "checkpoint-interval", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &checkpoint_interval, "Save a checkpoint every n seconds (default "
+          "60)", "n" },
+        { "resume", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &resume_path, "Carry on from the checkpoint in file", "file" },
         { 0 }
     };
 
+    profile_phase("options", NULL);
+
     g_option_context_add_main_entries(main_context, options, NULL);
     g_option_context_set_help_enabled(main_context, TRUE);
     g_option_context_set_description(main_context,
-        "Replays a PS/2 device using any log created with ps2emu-record\n");
+        "Replays a PS/2 device using any log created with ps2emu-record.\n"
+        "Given more than one log, they're replayed one after the other on the\n"
+        "same device, which is only initialized again when the next log sets\n"
+        "it up differently.\n");
 
     if (!g_option_context_parse(main_context, &argc, &argv, &error))
         exit_on_bad_argument(main_context, TRUE, error->message);
@@ -197,87 +362,195 @@ gint main(gint argc,
                              "No filename specified! Use --help for more "
                              "information");
 
-    max_wait *= G_USEC_PER_SEC;
-    event_delay = event_delay * G_USEC_PER_SEC + PS2EMU_MIN_EVENT_DELAY;
-    note_delay *= G_USEC_PER_SEC;
+    log_count = argc - 1;
+    if (log_count > 1 && (no_events || probe))
+        exit_on_bad_argument(main_context, FALSE,
+                             "--no-events and --measure-probe only take one "
+                             "log");
 
-    input_channel = g_io_channel_new_file(argv[1], "r", &error);
-    if (!input_channel) {
-        g_prefix_error(&error, "While opening %s: ", argv[1]);
-        goto error;
-    }
+    if (log_count > 1 && (checkpoint_path || resume_path))
+        exit_on_bad_argument(main_context, FALSE,
+                             "--checkpoint and --resume only take one log");
 
-    log_version = log_parse_version(input_channel, &error);
-    if (log_version > PS2EMU_LOG_VERSION) {
-        g_set_error(&error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
-                    "Log version is too new (found %d, we only support up to "
-                    "%d)", log_version, PS2EMU_LOG_VERSION);
-        goto error;
+    if (checkpoint_interval < 1)
+        exit_on_bad_argument(main_context, FALSE,
+                             "--checkpoint-interval needs to be at least 1");
+
+    if (tolerance < 1)
+        exit_on_bad_argument(main_context, FALSE,
+                             "--timing-tolerance needs to be at least 1");
+
+    if (probe_runs < 1)
+        exit_on_bad_argument(main_context, FALSE,
+                             "--probe-runs needs to be at least 1");
+
+    if (profile) {
+        profile_start();
+        ps2emu_set_phase_callback(profile_phase, NULL);
+        profile_print_at_exit();
     }
 
-    log = log_parse(input_channel, log_version, &error);
+    log = ps2emu_log_load(argv[1], &error);
     if (!log)
-        goto error;
+        goto out;
+
+    if (probe) {
+        if (measure_probe(log, probe_runs, &error))
+            ret = 0;
+
+        ps2emu_log_unref(log);
+        goto out;
+    }
 
-    g_io_channel_unref(input_channel);
+    replay = ps2emu_replay_new(log);
+    ps2emu_log_unref(log);
+
+    /* Nothing we print while replaying should be able to slow it down */
+    output = async_log_new(ASYNC_LOG_DEFAULT_SLOTS, &error);
+    if (!output)
+        goto out;
+
+    ps2emu_replay_set_max_wait(replay, max_wait * G_USEC_PER_SEC);
+    if (low_power)
+        ps2emu_replay_set_timing_tolerance(replay, (gint64)tolerance * 1000);
+    ps2emu_replay_set_latency_compensation(replay, !no_compensation);
+    ps2emu_replay_set_event_delay(replay, event_delay * G_USEC_PER_SEC);
+    ps2emu_replay_set_wait_for_ready(replay, !fixed_delay);
+    ps2emu_replay_set_note_delay(replay, note_delay * G_USEC_PER_SEC);
+    ps2emu_replay_set_mismatch_callback(replay, print_mismatch, output);
+    ps2emu_replay_set_note_callback(replay, print_note, output);
+    if (verbose)
+        ps2emu_replay_set_event_callback(replay, print_event, output);
 
-    userio_channel = g_io_channel_new_file("/dev/userio", "r+", &error);
-    if (!userio_channel) {
-        g_prefix_error(&error, "While opening /dev/userio: ");
-        goto error;
+    if (trace_path) {
+        trace = ps2emu_trace_new("ps2emu-replay",
+                                 PS2EMU_TRACE_DEFAULT_MAX_EVENTS);
+        ps2emu_replay_set_trace(replay, trace);
     }
 
-    rc = g_io_channel_set_encoding(userio_channel, NULL, &error);
-    if (rc != G_IO_STATUS_NORMAL) {
-        g_prefix_error(&error, "While opening /dev/userio: ");
-        goto error;
+    if (metrics_socket_path || metrics_file_path) {
+        metrics = ps2emu_metrics_new();
+        ps2emu_replay_set_metrics(replay, metrics);
+
+        exporter = metrics_exporter_new(metrics, metrics_socket_path,
+                                        metrics_file_path, &error);
+        if (!exporter)
+            goto out;
     }
-    g_io_channel_set_buffered(userio_channel, FALSE);
-
-    port_type = (log->port == PS2_PORT_KBD) ? SERIO_8042_XL : SERIO_8042;
-    rc = send_userio_cmd(userio_channel, USERIO_CMD_SET_PORT_TYPE, port_type,
-                         &error);
-    if (rc != G_IO_STATUS_NORMAL) {
-        g_prefix_error(&error, "While setting port type on /dev/userio: ");
-        goto error;
+
+    if (resume_path) {
+        PS2EmuCheckpoint checkpoint;
+
+        if (!ps2emu_checkpoint_load(&checkpoint, resume_path, &error) ||
+            !ps2emu_replay_set_resume(replay, &checkpoint, &error))
+            goto out;
+
+        async_log_printf(output, stdout, "Resuming from line %"
+                         G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+                         " in the event sequence\n",
+                         checkpoint.position, checkpoint.main_lines);
+
+        /* Keep the checkpoint going for the next time we get killed */
+        if (!checkpoint_path)
+            checkpoint_path = resume_path;
     }
 
-    rc = send_userio_cmd(userio_channel, USERIO_CMD_REGISTER, 0, &error);
-    if (rc != G_IO_STATUS_NORMAL) {
-        g_prefix_error(&error, "While starting device on /dev/userio: ");
-        goto error;
+    if (checkpoint_path) {
+        checkpoint_writer = (CheckpointWriter) {
+            .path = checkpoint_path,
+            .output = output,
+        };
+        ps2emu_replay_set_checkpoint_callback(
+            replay, checkpoint_interval * G_USEC_PER_SEC, write_checkpoint,
+            &checkpoint_writer);
     }
 
-    if (log_version == 0) {
-        if (!replay_line_list(userio_channel, log->main_section, 0, 0, verbose,
-                              &error))
-            goto error;
-    } else {
-        printf("Replaying initialization sequence...\n");
-        if (!replay_line_list(userio_channel, log->init_section, 0, 0, verbose,
-                              &error))
-            goto error;
+    results = g_new0(PlaylistResult, log_count);
+    for (gint i = 0; i < log_count; i++)
+        results[i].path = argv[i + 1];
+
+    playlist_switches = get_voluntary_switches();
+    playlist_start = g_get_monotonic_time();
 
-        printf("Device initialized\n");
+    for (gint i = 0; i < log_count; i++) {
+        PlaylistResult *result = &results[i];
+        gboolean initialized = FALSE;
+        gint64 start_time;
 
-        if (!no_events) {
-            /* Sleep for half a second so we don't throw the driver out of sync */
-            g_usleep(event_delay);
+        if (i > 0) {
+            log = ps2emu_log_load(result->path, &error);
+            if (!log)
+                goto out;
 
-            printf("Replaying event sequence...\n");
-            if (!replay_line_list(userio_channel, log->main_section, max_wait,
-                                  note_delay, verbose, &error))
-                goto error;
+            initialized = ps2emu_replay_set_log(replay, log);
+            ps2emu_log_unref(log);
         }
 
-        if (keep_running)
-            pause();
+        if (log_count > 1) {
+            async_log_printf(output, stdout, "=== [%d/%d] %s ===\n",
+                             i + 1, log_count, result->path);
+        }
+
+        start_time = g_get_monotonic_time();
+        if (!replay_log(replay, log, initialized, no_events, output, &error))
+            goto out;
+
+        result->replayed = TRUE;
+        result->initialized = !initialized;
+        result->mismatches = ps2emu_replay_get_mismatch_count(replay);
+        result->duration = g_get_monotonic_time() - start_time;
     }
 
-    return 0;
+    if (!no_events)
+        print_scheduling_stats(replay, output, playlist_switches,
+                               playlist_start);
+
+    /* There's nothing left to resume */
+    if (checkpoint_path && !no_events)
+        unlink(checkpoint_path);
+
+    /* The replay holds on to the last log */
+    if (keep_running && ps2emu_log_get_version(log) != 0)
+        pause();
+
+    ret = 0;
+
+out:
+    if (exporter)
+        metrics_exporter_free(exporter);
+    if (output)
+        async_log_free(output);
+
+    /* Printed once everything from the replay has been written out */
+    if (results && log_count > 1)
+        print_playlist_results(results, log_count);
+    g_free(results);
+
+    if (error) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_clear_error(&error);
+    }
+
+    /* Even a replay that failed is worth looking at */
+    if (trace) {
+        if (ps2emu_trace_get_dropped(trace)) {
+            fprintf(stderr, "Warning: the trace ran out of room, %"
+                    G_GUINT64_FORMAT " events were dropped\n",
+                    ps2emu_trace_get_dropped(trace));
+        }
+
+        if (!ps2emu_trace_write(trace, trace_path, &error)) {
+            fprintf(stderr, "Error: %s\n", error->message);
+            ret = 1;
+        }
+    }
 
-error:
-    fprintf(stderr, "Error: %s\n", error->message);
+    if (replay)
+        ps2emu_replay_free(replay);
+    if (trace)
+        ps2emu_trace_free(trace);
+    if (metrics)
+        ps2emu_metrics_free(metrics);
 
-    return 1;
+    return ret;
 }
@@ -0,0 +1,319 @@
+/*
+ * ps2emu-split.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+typedef struct {
+    time_t start;
+    time_t end;
+
+    FILE *file;
+    gchar *path;
+    time_t base_time;
+    gboolean has_base_time;
+} SplitPiece;
+
+static gchar *output_prefix = NULL;
+static guint piece_count = 0;
+
+static gboolean piece_open(SplitPiece *piece,
+                           LogPrelude *prelude,
+                           GError **error) {
+    piece->path = g_strdup_printf("%s-%03u.log", output_prefix,
+                                  ++piece_count);
+    piece->file = fopen(piece->path, "w");
+    if (!piece->file) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", piece->path, strerror(errno));
+        return FALSE;
+    }
+
+    piece->has_base_time = FALSE;
+    log_prelude_write(piece->file, prelude);
+
+    return TRUE;
+}
+
+static gboolean piece_close(SplitPiece *piece,
+                            GError **error) {
+    gboolean ret = TRUE;
+
+    if (!piece->file)
+        return TRUE;
+
+    if (fclose(piece->file) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s", piece->path, strerror(errno));
+        ret = FALSE;
+    } else
+        printf("Wrote %s\n", piece->path);
+
+    piece->file = NULL;
+    g_clear_pointer(&piece->path, g_free);
+
+    return ret;
+}
+
+static void piece_write_event(SplitPiece *piece,
+                              time_t time,
+                              const gchar *rest) {
+    if (!piece->has_base_time) {
+        piece->base_time = time;
+        piece->has_base_time = TRUE;
+    }
+
+    fprintf(piece->file, "E: %-10ld %s", time - piece->base_time, rest);
+}
+
+static gboolean parse_range(const gchar *str,
+                            SplitPiece *piece) {
+    gchar *end;
+    gdouble start,
+            stop;
+
+    start = g_ascii_strtod(str, &end);
+    if (end == str || *end != ':')
+        return FALSE;
+
+    str = end + 1;
+    stop = g_ascii_strtod(str, &end);
+    if (end == str || *end != '\0' || stop <= start)
+        return FALSE;
+
+    piece->start = start * G_USEC_PER_SEC;
+    piece->end = stop * G_USEC_PER_SEC;
+
+    return TRUE;
+}
+
+static gboolean split(GIOChannel *input_channel,
+                      gboolean at_notes,
+                      SplitPiece *ranges,
+                      guint range_count,
+                      GError **error) {
+    LogPrelude prelude;
+    SplitPiece note_piece = { 0 };
+    gchar *line = NULL,
+          *msg_start;
+    GIOStatus rc;
+    gboolean ret = FALSE;
+
+    if (!log_read_prelude(input_channel, &prelude, error))
+        return FALSE;
+
+    if (!prelude.has_main_section) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_NO_EVENTS,
+                            "Log has no main section");
+        goto out;
+    }
+
+    while ((rc = g_io_channel_read_line(input_channel, &line, NULL, NULL,
+                                        error)) == G_IO_STATUS_NORMAL) {
+        const gchar *rest;
+        time_t time;
+
+        g_strchug(line);
+        if (line[0] == '#' || line[0] == '\0')
+            goto next;
+
+        switch (log_get_line_type(line, &msg_start, error)) {
+            case LINE_TYPE_NOTE:
+                if (at_notes) {
+                    if (!piece_close(&note_piece, error) ||
+                        !piece_open(&note_piece, &prelude, error))
+                        goto out;
+                }
+
+                if (note_piece.file)
+                    fputs(line, note_piece.file);
+
+                /* Notes go into any ranges that have already started */
+                for (guint i = 0; i < range_count; i++) {
+                    if (ranges[i].file)
+                        fputs(line, ranges[i].file);
+                }
+                break;
+            case LINE_TYPE_EVENT:
+                if (!log_event_line_split_time(msg_start, &time, &rest)) {
+                    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                "Invalid event line '%s'", line);
+                    goto out;
+                }
+
+                if (at_notes) {
+                    /* Events before the first note get a piece of their own */
+                    if (!note_piece.file &&
+                        !piece_open(&note_piece, &prelude, error))
+                        goto out;
+
+                    piece_write_event(&note_piece, time, rest);
+                }
+
+                for (guint i = 0; i < range_count; i++) {
+                    SplitPiece *range = &ranges[i];
+
+                    if (time >= range->end) {
+                        if (!piece_close(range, error))
+                            goto out;
+
+                        continue;
+                    }
+
+                    if (time < range->start)
+                        continue;
+
+                    if (!range->file && !piece_open(range, &prelude, error))
+                        goto out;
+
+                    piece_write_event(range, time, rest);
+                }
+                break;
+            case LINE_TYPE_INVALID:
+                goto out;
+            default:
+                g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "Unexpected line in main section '%s'", line);
+                goto out;
+        }
+
+next:
+        g_clear_pointer(&line, g_free);
+    }
+    if (rc != G_IO_STATUS_EOF)
+        goto out;
+
+    ret = piece_close(&note_piece, error);
+    for (guint i = 0; i < range_count && ret; i++)
+        ret = piece_close(&ranges[i], error);
+
+out:
+    g_free(line);
+    if (!ret) {
+        if (note_piece.file)
+            fclose(note_piece.file);
+        g_free(note_piece.path);
+
+        for (guint i = 0; i < range_count; i++) {
+            if (ranges[i].file)
+                fclose(ranges[i].file);
+            g_free(ranges[i].path);
+        }
+    }
+
+    log_prelude_clear(&prelude);
+
+    return ret;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("<event_log> - split PS/2 logs");
+    GIOChannel *input_channel;
+    GError *error = NULL;
+    gchar **range_strs = NULL;
+    SplitPiece *ranges = NULL;
+    guint range_count = 0;
+    gboolean at_notes = FALSE;
+    int log_version;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "notes", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &at_notes, "Start a new log at every user note", NULL },
+        { "range", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY,
+          &range_strs, "Write the events between start and end seconds into "
+          "their own log, may be given more than once", "start:end" },
+        { "output", 'o', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &output_prefix, "Name the new logs prefix-001.log, "
+          "prefix-002.log...", "prefix" },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Splits the main section of a log into several logs, each with a copy\n"
+        "of the original header and initialization sequence.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (argc < 2)
+        exit_on_bad_argument(main_context, FALSE,
+                             "No filename specified! Use --help for more "
+                             "information");
+
+    if (at_notes == (range_strs != NULL))
+        exit_on_bad_argument(main_context, TRUE,
+                             "Exactly one of --notes or --range is required");
+
+    if (range_strs) {
+        range_count = g_strv_length(range_strs);
+        ranges = g_new0(SplitPiece, range_count);
+
+        for (guint i = 0; i < range_count; i++) {
+            if (!parse_range(range_strs[i], &ranges[i]))
+                exit_on_bad_argument(main_context, FALSE,
+                                     "Invalid range '%s'", range_strs[i]);
+        }
+    }
+
+    if (!output_prefix) {
+        gchar *basename = g_path_get_basename(argv[1]);
+
+        if (g_str_has_suffix(basename, ".log"))
+            basename[strlen(basename) - strlen(".log")] = '\0';
+
+        output_prefix = basename;
+    }
+
+    input_channel = g_io_channel_new_file(argv[1], "r", &error);
+    if (!input_channel) {
+        g_prefix_error(&error, "While opening %s: ", argv[1]);
+        goto error;
+    }
+
+    log_version = log_parse_version(input_channel, &error);
+    if (log_version < 0)
+        goto error;
+
+    if (log_version != PS2EMU_LOG_VERSION) {
+        g_set_error(&error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Only V%d logs can be split (found V%d)",
+                    PS2EMU_LOG_VERSION, log_version);
+        goto error;
+    }
+
+    if (!split(input_channel, at_notes, ranges, range_count, &error))
+        goto error;
+
+    g_io_channel_unref(input_channel);
+
+    return 0;
+
+error:
+    fprintf(stderr, "Error: %s\n", error->message);
+
+    return 1;
+}
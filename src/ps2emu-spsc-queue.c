@@ -0,0 +1,173 @@
+/*
+ * ps2emu-spsc-queue.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu-spsc-queue.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <glib.h>
+
+/* A page worth of pointers on 64 bit machines */
+#define SPSC_QUEUE_SEGMENT_SLOTS 512
+
+typedef struct _SpscSegment SpscSegment;
+
+struct _SpscSegment {
+    /* Set by the producer before anything is pushed into the next segment */
+    SpscSegment *next;
+    gpointer slots[SPSC_QUEUE_SEGMENT_SLOTS];
+};
+
+struct _SpscQueue {
+    /* Only touched by the producer */
+    SpscSegment *head_segment;
+    guint head_slot;
+
+    /* Only touched by the consumer */
+    SpscSegment *tail_segment;
+    guint tail_slot;
+    guint popped;
+
+    /* Only ever counts up, it's published after the item is in its slot, so
+     * the consumer can pop anything up to it */
+    guint pushed;
+    gint closed;
+
+    /* Set by spsc_queue_flush() when it writes to wake_fds[1], cleared by
+     * spsc_queue_ack() */
+    gint notified;
+    gint wake_fds[2];
+};
+
+SpscQueue *spsc_queue_new(GError **error) {
+    SpscQueue *queue = g_new0(SpscQueue, 1);
+
+    if (pipe(queue->wake_fds) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While creating a pipe: %s", strerror(errno));
+        g_free(queue);
+        return NULL;
+    }
+
+    /* Acks read until the pipe is empty */
+    fcntl(queue->wake_fds[0], F_SETFL, O_NONBLOCK);
+
+    queue->head_segment = g_new0(SpscSegment, 1);
+    queue->tail_segment = queue->head_segment;
+
+    return queue;
+}
+
+void spsc_queue_push(SpscQueue *queue,
+                     gpointer item) {
+    if (queue->head_slot == SPSC_QUEUE_SEGMENT_SLOTS) {
+        SpscSegment *segment = g_new(SpscSegment, 1);
+
+        segment->next = NULL;
+        queue->head_segment->next = segment;
+        queue->head_segment = segment;
+        queue->head_slot = 0;
+    }
+
+    queue->head_segment->slots[queue->head_slot++] = item;
+    g_atomic_int_set(&queue->pushed, queue->pushed + 1);
+}
+
+void spsc_queue_flush(SpscQueue *queue) {
+    if (g_atomic_int_get(&queue->notified))
+        return;
+
+    g_atomic_int_set(&queue->notified, TRUE);
+    g_warn_if_fail(write(queue->wake_fds[1], "", 1) == 1);
+}
+
+void spsc_queue_close(SpscQueue *queue) {
+    g_atomic_int_set(&queue->closed, TRUE);
+    spsc_queue_flush(queue);
+}
+
+gpointer spsc_queue_pop(SpscQueue *queue) {
+    if (queue->popped == g_atomic_int_get(&queue->pushed))
+        return NULL;
+
+    /* The producer moved on to the next segment before pushing what we're
+     * about to pop, so it's done with this one */
+    if (queue->tail_slot == SPSC_QUEUE_SEGMENT_SLOTS) {
+        SpscSegment *next = queue->tail_segment->next;
+
+        g_free(queue->tail_segment);
+        queue->tail_segment = next;
+        queue->tail_slot = 0;
+    }
+
+    queue->popped++;
+
+    return queue->tail_segment->slots[queue->tail_slot++];
+}
+
+gboolean spsc_queue_is_closed(SpscQueue *queue) {
+    return g_atomic_int_get(&queue->closed);
+}
+
+gint spsc_queue_get_fd(SpscQueue *queue) {
+    return queue->wake_fds[0];
+}
+
+void spsc_queue_ack(SpscQueue *queue) {
+    gchar buf[16];
+
+    /* Empty the pipe before clearing notified, so a wakeup for something
+     * pushed after this can't get read along with the old ones */
+    while (read(queue->wake_fds[0], buf, sizeof(buf)) > 0);
+
+    g_atomic_int_set(&queue->notified, FALSE);
+}
+
+void spsc_queue_wait(SpscQueue *queue) {
+    struct pollfd pollfd = { .fd = queue->wake_fds[0], .events = POLLIN };
+
+    while (TRUE) {
+        spsc_queue_ack(queue);
+
+        if (queue->popped != g_atomic_int_get(&queue->pushed) ||
+            g_atomic_int_get(&queue->closed))
+            return;
+
+        poll(&pollfd, 1, -1);
+    }
+}
+
+void spsc_queue_free(SpscQueue *queue,
+                     GDestroyNotify free_func) {
+    SpscSegment *next;
+    gpointer item;
+
+    while ((item = spsc_queue_pop(queue))) {
+        if (free_func)
+            free_func(item);
+    }
+
+    for (; queue->tail_segment; queue->tail_segment = next) {
+        next = queue->tail_segment->next;
+        g_free(queue->tail_segment);
+    }
+
+    close(queue->wake_fds[0]);
+    close(queue->wake_fds[1]);
+    g_free(queue);
+}
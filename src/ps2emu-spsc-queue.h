@@ -0,0 +1,63 @@
+/*
+ * ps2emu-spsc-queue.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_SPSC_QUEUE_H__
+#define __PS2EMU_SPSC_QUEUE_H__
+
+#include <glib.h>
+
+/* A queue of pointers from one thread to another that never fills up, so
+ * pushing never blocks and never drops anything. Items are kept in a list of
+ * fixed size rings, and a new one is only allocated when the last one is
+ * full. Only one thread may push to a queue, and only one may pop from it.
+ *
+ * The consumer can sleep in poll() on spsc_queue_get_fd() instead of polling
+ * the queue. It becomes readable when the producer calls spsc_queue_flush()
+ * after a batch of pushes, at most once per spsc_queue_ack(), so the producer
+ * only makes a syscall when the consumer might be asleep, and the consumer
+ * doesn't get woken up for every item. A consumer that isn't using
+ * spsc_queue_wait() should ack before popping, and check
+ * spsc_queue_is_closed() before the pop that finds the queue empty; if it was
+ * closed by then, nothing else is coming */
+typedef struct _SpscQueue SpscQueue;
+
+SpscQueue *spsc_queue_new(GError **error);
+
+void spsc_queue_push(SpscQueue *queue,
+                     gpointer item);
+
+/* Wakes up the consumer for everything pushed so far */
+void spsc_queue_flush(SpscQueue *queue);
+
+/* Called by the producer once it's done pushing, flushes the queue */
+void spsc_queue_close(SpscQueue *queue);
+
+/* Returns NULL if the queue is empty */
+gpointer spsc_queue_pop(SpscQueue *queue);
+
+gboolean spsc_queue_is_closed(SpscQueue *queue);
+
+gint spsc_queue_get_fd(SpscQueue *queue);
+
+void spsc_queue_ack(SpscQueue *queue);
+
+/* Blocks until there's something to pop, or the queue is closed */
+void spsc_queue_wait(SpscQueue *queue);
+
+/* free_func is called on anything still in the queue */
+void spsc_queue_free(SpscQueue *queue,
+                     GDestroyNotify free_func);
+
+#endif /* !__PS2EMU_SPSC_QUEUE_H__ */
@@ -0,0 +1,1400 @@
+/*
+ * ps2emu-synth.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* For ppoll() and accept4() */
+#define _GNU_SOURCE
+
+#include "ps2emu.h"
+#include "ps2emu-log.h"
+#include "ps2emu-misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <linux/serio.h>
+#include <userio.h>
+
+#define SYNTH_USERIO_PATH "/dev/userio"
+
+/* Keyboards don't have a report rate, but a byte takes about a millisecond to
+ * clock out */
+#define SYNTH_KEY_BYTE_TIME 1000
+
+#define SYNTH_DEFAULT_RATE       100
+#define SYNTH_DEFAULT_RESOLUTION 2
+
+#define SYNTH_MAX_SOURCES 16
+
+/* The longest answer to a single byte from the host: an ACK and a packet */
+#define SYNTH_MAX_REPLY 8
+
+/* Internal button bits, the first three are where a PS/2 packet has them */
+#define SYNTH_BUTTON_LEFT   0x01
+#define SYNTH_BUTTON_RIGHT  0x02
+#define SYNTH_BUTTON_MIDDLE 0x04
+#define SYNTH_BUTTON_SIDE   0x08
+#define SYNTH_BUTTON_EXTRA  0x10
+
+typedef enum {
+    /* Three buttons, no wheel */
+    SYNTH_DEVICE_MOUSE,
+    /* IntelliMouse: a wheel, once the host knocks with rates 200, 100, 80 */
+    SYNTH_DEVICE_WHEEL,
+    /* IntelliMouse Explorer: two more buttons, after a second knock with
+     * rates 200, 200, 80 */
+    SYNTH_DEVICE_EXPLORER,
+    SYNTH_DEVICE_KEYBOARD
+} SynthDeviceType;
+
+/* The state the host has put the device into */
+typedef struct {
+    SynthDeviceType type;
+
+    guchar id;
+    guint rate;
+    guchar resolution;
+    gboolean scaling;
+    gboolean enabled;
+    gboolean remote;
+    gboolean wrap;
+
+    /* The command whose parameter comes next, or -1 */
+    gint pending_command;
+    /* The last three sample rates, for the knocks */
+    guchar rates[3];
+
+    /* While the init section of a log answers the host, the model only
+     * follows along, and takes the mouse's ID from the log */
+    gboolean following;
+    gint id_bytes_due;
+    /* What the model would have answered the host's last byte with, which the
+     * log has to match for the model to be able to take over from it */
+    guchar host_byte;
+    guchar expected[SYNTH_MAX_REPLY];
+    guint expected_len;
+    guint expected_pos;
+} SynthModel;
+
+/* Something we read commands from */
+typedef struct {
+    int fd;
+    GString *buffer;
+    guint line_number;
+    gboolean eof;
+    /* Whether the last ppoll() found something to read, it's read with a
+     * blocking read(), since the fd might be shared with other processes */
+    gboolean readable;
+    /* Don't run any more commands from it until then */
+    gint64 sleep_until;
+} SynthSource;
+
+typedef struct {
+    SynthModel model;
+    int userio_fd;
+
+    /* Input that hasn't been sent yet. Motion is in PS/2's orientation, with
+     * y going up */
+    gint dx;
+    gint dy;
+    gint dz;
+    guint buttons;
+    /* Button states that have to show up in a packet of their own, so that a
+     * click isn't lost between two packets */
+    GArray *button_states;
+    GByteArray *keys;
+
+    gint64 next_send_time;
+
+    SynthSource sources[SYNTH_MAX_SOURCES];
+    guint source_count;
+    int listen_fd;
+
+    /* Without --live, where the packets go instead */
+    FILE *log_output;
+} Synth;
+
+static const struct {
+    const gchar *name;
+    SynthDeviceType type;
+} device_types[] = {
+    { "mouse",    SYNTH_DEVICE_MOUSE },
+    { "wheel",    SYNTH_DEVICE_WHEEL },
+    { "explorer", SYNTH_DEVICE_EXPLORER },
+    { "keyboard", SYNTH_DEVICE_KEYBOARD },
+};
+
+static const struct {
+    const gchar *name;
+    guint button;
+} button_names[] = {
+    { "left",   SYNTH_BUTTON_LEFT },
+    { "right",  SYNTH_BUTTON_RIGHT },
+    { "middle", SYNTH_BUTTON_MIDDLE },
+    { "side",   SYNTH_BUTTON_SIDE },
+    { "extra",  SYNTH_BUTTON_EXTRA },
+};
+
+/* Scancode set 1, which is what the host gets from a keyboard behind a
+ * translating i8042. Rows of a US layout, starting at code, with and without
+ * shift */
+static const struct {
+    guchar code;
+    const gchar *plain;
+    const gchar *shifted;
+} key_rows[] = {
+    { 0x02, "1234567890-=", "!@#$%^&*()_+" },
+    { 0x10, "qwertyuiop[]", "QWERTYUIOP{}" },
+    { 0x1e, "asdfghjkl;'`", "ASDFGHJKL:\"~" },
+    { 0x2b, "\\",           "|" },
+    { 0x2c, "zxcvbnm,./",   "ZXCVBNM<>?" },
+    { 0x39, " ",            " " },
+};
+
+#define KEY_EXTENDED 0x100
+#define KEY_SHIFT    0x2a
+
+static const struct {
+    const gchar *name;
+    guint code;
+} key_names[] = {
+    { "esc",       0x01 },
+    { "backspace", 0x0e },
+    { "tab",       0x0f },
+    { "enter",     0x1c },
+    { "ctrl",      0x1d },
+    { "shift",     0x2a },
+    { "rightshift", 0x36 },
+    { "alt",       0x38 },
+    { "space",     0x39 },
+    { "capslock",  0x3a },
+    { "f1",        0x3b },
+    { "f2",        0x3c },
+    { "f3",        0x3d },
+    { "f4",        0x3e },
+    { "f5",        0x3f },
+    { "f6",        0x40 },
+    { "f7",        0x41 },
+    { "f8",        0x42 },
+    { "f9",        0x43 },
+    { "f10",       0x44 },
+    { "f11",       0x57 },
+    { "f12",       0x58 },
+    { "rightctrl", KEY_EXTENDED | 0x1d },
+    { "rightalt",  KEY_EXTENDED | 0x38 },
+    { "home",      KEY_EXTENDED | 0x47 },
+    { "up",        KEY_EXTENDED | 0x48 },
+    { "pageup",    KEY_EXTENDED | 0x49 },
+    { "left",      KEY_EXTENDED | 0x4b },
+    { "right",     KEY_EXTENDED | 0x4d },
+    { "end",       KEY_EXTENDED | 0x4f },
+    { "down",      KEY_EXTENDED | 0x50 },
+    { "pagedown",  KEY_EXTENDED | 0x51 },
+    { "insert",    KEY_EXTENDED | 0x52 },
+    { "delete",    KEY_EXTENDED | 0x53 },
+    { "meta",      KEY_EXTENDED | 0x5b },
+};
+
+static SynthDeviceType device_type = SYNTH_DEVICE_EXPLORER;
+static volatile sig_atomic_t interrupted = FALSE;
+
+static void stop_on_interrupt() {
+    interrupted = TRUE;
+}
+
+static gboolean process_device_arg(const gchar *option_name,
+                                   const gchar *value,
+                                   gpointer data,
+                                   GError **error) {
+    for (guint i = 0; i < G_N_ELEMENTS(device_types); i++) {
+        if (strcasecmp(value, device_types[i].name) == 0) {
+            device_type = device_types[i].type;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * The device model
+ */
+static inline gboolean model_is_keyboard(const SynthModel *model) {
+    return model->type == SYNTH_DEVICE_KEYBOARD;
+}
+
+static void model_reset(SynthModel *model) {
+    model->id = 0;
+    model->rate = SYNTH_DEFAULT_RATE;
+    model->resolution = SYNTH_DEFAULT_RESOLUTION;
+    model->scaling = FALSE;
+    /* Unlike mice, keyboards start scanning on their own */
+    model->enabled = model_is_keyboard(model);
+    model->remote = FALSE;
+    model->wrap = FALSE;
+    model->pending_command = -1;
+    memset(model->rates, 0, sizeof(model->rates));
+}
+
+static void model_init(SynthModel *model,
+                       SynthDeviceType type) {
+    model->type = type;
+    model->following = FALSE;
+    model->id_bytes_due = 0;
+    model->expected_len = 0;
+    model->expected_pos = 0;
+    model_reset(model);
+}
+
+static gboolean model_knocked(const SynthModel *model,
+                              guchar first,
+                              guchar second,
+                              guchar third) {
+    return model->rates[0] == first && model->rates[1] == second &&
+           model->rates[2] == third;
+}
+
+static void model_set_rate(SynthModel *model,
+                           guchar rate) {
+    model->rate = MAX(rate, 10);
+
+    model->rates[0] = model->rates[1];
+    model->rates[1] = model->rates[2];
+    model->rates[2] = rate;
+
+    if (model->following)
+        return;
+
+    if (model->type >= SYNTH_DEVICE_WHEEL && model->id == 0 &&
+        model_knocked(model, 200, 100, 80))
+        model->id = 3;
+    else if (model->type == SYNTH_DEVICE_EXPLORER && model->id == 3 &&
+             model_knocked(model, 200, 200, 80))
+        model->id = 4;
+}
+
+static void model_status(const SynthModel *model,
+                         guint buttons,
+                         GByteArray *replies) {
+    guchar status[3] = {
+        (model->remote ? 0x40 : 0) | (model->enabled ? 0x20 : 0) |
+        (model->scaling ? 0x10 : 0) |
+        (buttons & SYNTH_BUTTON_LEFT ? 0x04 : 0) |
+        (buttons & SYNTH_BUTTON_MIDDLE ? 0x02 : 0) |
+        (buttons & SYNTH_BUTTON_RIGHT ? 0x01 : 0),
+        model->resolution,
+        model->rate,
+    };
+
+    g_byte_array_append(replies, status, sizeof(status));
+}
+
+static void synth_build_packet(Synth *synth,
+                               GByteArray *packet);
+
+/* Works out what the device answers to a byte from the host */
+static void model_host_byte(Synth *synth,
+                            guchar data,
+                            GByteArray *replies) {
+    SynthModel *model = &synth->model;
+    const guchar ack = PS2_RET_ACK,
+                 resend = 0xfe;
+
+    if (model->wrap && data != 0xec && data != 0xff) {
+        g_byte_array_append(replies, &data, 1);
+        return;
+    }
+
+    if (model->pending_command >= 0) {
+        const guchar command = model->pending_command;
+
+        model->pending_command = -1;
+        g_byte_array_append(replies, &ack, 1);
+
+        if (model_is_keyboard(model)) {
+            /* Asking for the scancode set, the host gets what it'd get
+             * through translation */
+            if (command == 0xf0 && data == 0) {
+                const guchar set = 0x41;
+
+                g_byte_array_append(replies, &set, 1);
+            }
+        } else if (command == 0xf3) {
+            model_set_rate(model, data);
+        } else if (command == 0xe8) {
+            model->resolution = data;
+        }
+
+        return;
+    }
+
+    switch (data) {
+        case 0xff:
+            model_reset(model);
+            g_byte_array_append(replies, (const guchar[]) { ack, 0xaa }, 2);
+            if (!model_is_keyboard(model))
+                g_byte_array_append(replies, &model->id, 1);
+            return;
+        case 0xf6:
+            model->rate = SYNTH_DEFAULT_RATE;
+            model->resolution = SYNTH_DEFAULT_RESOLUTION;
+            model->scaling = FALSE;
+            model->enabled = model_is_keyboard(model);
+            break;
+        case 0xf5:
+            model->enabled = FALSE;
+            break;
+        case 0xf4:
+            model->enabled = TRUE;
+            break;
+        case 0xf2:
+            g_byte_array_append(replies, &ack, 1);
+            if (model_is_keyboard(model)) {
+                g_byte_array_append(replies, (const guchar[]) { 0xab, 0x41 },
+                                    2);
+            } else {
+                g_byte_array_append(replies, &model->id, 1);
+                model->id_bytes_due = 2;
+            }
+            return;
+        case 0xf3:
+            model->pending_command = data;
+            break;
+        default:
+            if (model_is_keyboard(model)) {
+                if (data == 0xee) {
+                    g_byte_array_append(replies, &data, 1);
+                    return;
+                } else if (data == 0xed || data == 0xf0) {
+                    model->pending_command = data;
+                } else if (data < 0xf7 || data > 0xfd) {
+                    g_byte_array_append(replies, &resend, 1);
+                    return;
+                }
+
+                break;
+            }
+
+            switch (data) {
+                case 0xe8:
+                    model->pending_command = data;
+                    break;
+                case 0xe6:
+                case 0xe7:
+                    model->scaling = data == 0xe7;
+                    break;
+                case 0xe9:
+                    g_byte_array_append(replies, &ack, 1);
+                    model_status(model, synth->buttons, replies);
+                    return;
+                case 0xea:
+                    model->remote = FALSE;
+                    break;
+                case 0xf0:
+                    model->remote = TRUE;
+                    break;
+                case 0xeb:
+                    g_byte_array_append(replies, &ack, 1);
+                    synth_build_packet(synth, replies);
+                    return;
+                case 0xee:
+                    model->wrap = TRUE;
+                    break;
+                case 0xec:
+                    model->wrap = FALSE;
+                    break;
+                default:
+                    g_byte_array_append(replies, &resend, 1);
+                    return;
+            }
+            break;
+    }
+
+    g_byte_array_append(replies, &ack, 1);
+}
+
+/* While following a log, the ID the host switched the mouse to is whatever
+ * the log answered with. Anything else has to be what the model would have
+ * answered, otherwise the device in the log is one we can't emulate, like a
+ * touchpad switched to its own protocol, and the host would misframe every
+ * packet we send once we take over */
+static gboolean model_device_byte(SynthModel *model,
+                                  guchar data,
+                                  GError **error) {
+    const gboolean id_byte = model->id_bytes_due == 1;
+    guchar expected;
+
+    if (model->id_bytes_due && --model->id_bytes_due == 0)
+        model->id = data;
+
+    /* Sent without the host asking for anything */
+    if (model->expected_pos == model->expected_len)
+        return TRUE;
+
+    expected = model->expected[model->expected_pos++];
+    if (id_byte || data == expected)
+        return TRUE;
+
+    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                "The device in the log answered %.2hhx to %.2hhx where "
+                "ps2emu-synth would answer %.2hhx, it probably switched to a "
+                "protocol ps2emu-synth can't emulate", data, model->host_byte,
+                expected);
+    return FALSE;
+}
+
+/*
+ * Turning input into packets
+ */
+static inline gboolean synth_has_pending(const Synth *synth) {
+    if (model_is_keyboard(&synth->model))
+        return synth->keys->len > 0;
+
+    return synth->dx || synth->dy || synth->dz || synth->button_states->len;
+}
+
+static inline gint take_motion(gint *pending,
+                               gint min,
+                               gint max) {
+    const gint value = CLAMP(*pending, min, max);
+
+    *pending -= value;
+    return value;
+}
+
+/* Everything that fits into one packet, in the format the host switched the
+ * mouse to, and the rest is left for the next one */
+static void synth_build_packet(Synth *synth,
+                               GByteArray *packet) {
+    const SynthModel *model = &synth->model;
+    guint buttons = synth->buttons;
+    gint x, y;
+    guchar bytes[4];
+    guint len = 3;
+
+    if (synth->button_states->len) {
+        buttons = g_array_index(synth->button_states, guint, 0);
+        g_array_remove_index(synth->button_states, 0);
+    }
+
+    x = take_motion(&synth->dx, -255, 255);
+    y = take_motion(&synth->dy, -255, 255);
+
+    bytes[0] = 0x08 | (buttons & 0x07) | (x < 0 ? 0x10 : 0) |
+               (y < 0 ? 0x20 : 0);
+    bytes[1] = x & 0xff;
+    bytes[2] = y & 0xff;
+
+    if (model->id == 3) {
+        bytes[3] = take_motion(&synth->dz, -8, 7) & 0xff;
+        len = 4;
+    } else if (model->id == 4) {
+        bytes[3] = (take_motion(&synth->dz, -8, 7) & 0x0f) |
+                   (buttons & SYNTH_BUTTON_SIDE ? 0x10 : 0) |
+                   (buttons & SYNTH_BUTTON_EXTRA ? 0x20 : 0);
+        len = 4;
+    } else {
+        /* Nowhere to put it */
+        synth->dz = 0;
+    }
+
+    g_byte_array_append(packet, bytes, len);
+}
+
+/* The next packet, or the next byte from the keyboard */
+static void synth_next_chunk(Synth *synth,
+                             GByteArray *chunk) {
+    if (model_is_keyboard(&synth->model)) {
+        g_byte_array_append(chunk, synth->keys->data, 1);
+        g_byte_array_remove_index(synth->keys, 0);
+    } else {
+        synth_build_packet(synth, chunk);
+    }
+}
+
+static inline gint64 synth_period(const Synth *synth) {
+    if (model_is_keyboard(&synth->model))
+        return SYNTH_KEY_BYTE_TIME;
+
+    return G_USEC_PER_SEC / synth->model.rate;
+}
+
+/* Whether the device would send anything on its own right now */
+static inline gboolean synth_streaming(const Synth *synth) {
+    return synth->model.enabled && !synth->model.remote &&
+           !synth->model.wrap && synth_has_pending(synth);
+}
+
+/*
+ * Commands
+ */
+static void synth_set_buttons(Synth *synth,
+                              guint buttons) {
+    if (buttons == synth->buttons)
+        return;
+
+    synth->buttons = buttons;
+    g_array_append_val(synth->button_states, buttons);
+}
+
+static void synth_add_key(Synth *synth,
+                          guint code,
+                          gboolean down) {
+    const guchar extended = 0xe0,
+                 scancode = (code & 0x7f) | (down ? 0 : 0x80);
+
+    if (code & KEY_EXTENDED)
+        g_byte_array_append(synth->keys, &extended, 1);
+
+    g_byte_array_append(synth->keys, &scancode, 1);
+}
+
+static gboolean lookup_char(gchar c,
+                            guint *code,
+                            gboolean *shift) {
+    for (guint i = 0; i < G_N_ELEMENTS(key_rows); i++) {
+        const gchar *pos;
+
+        if ((pos = strchr(key_rows[i].plain, c))) {
+            *code = key_rows[i].code + (pos - key_rows[i].plain);
+            *shift = FALSE;
+            return TRUE;
+        }
+
+        if ((pos = strchr(key_rows[i].shifted, c))) {
+            *code = key_rows[i].code + (pos - key_rows[i].shifted);
+            *shift = TRUE;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean lookup_key(const gchar *name,
+                           guint *code,
+                           GError **error) {
+    gboolean shift;
+
+    for (guint i = 0; i < G_N_ELEMENTS(key_names); i++) {
+        if (strcasecmp(name, key_names[i].name) == 0) {
+            *code = key_names[i].code;
+            return TRUE;
+        }
+    }
+
+    if (name[0] && !name[1] && lookup_char(g_ascii_tolower(name[0]), code,
+                                           &shift))
+        return TRUE;
+
+    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                "Unknown key '%s'", name);
+    return FALSE;
+}
+
+static gboolean lookup_button(const gchar *name,
+                              guint *button,
+                              GError **error) {
+    for (guint i = 0; i < G_N_ELEMENTS(button_names); i++) {
+        if (strcasecmp(name, button_names[i].name) == 0) {
+            *button = button_names[i].button;
+            return TRUE;
+        }
+    }
+
+    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                "Unknown button '%s'", name);
+    return FALSE;
+}
+
+static gboolean parse_int(const gchar *str,
+                          gint *value,
+                          GError **error) {
+    gchar *end;
+    glong parsed;
+
+    errno = 0;
+    parsed = strtol(str ? str : "", &end, 10);
+    if (!str || end == str || *end || errno || parsed < G_MININT ||
+        parsed > G_MAXINT) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Expected a number, got '%s'", str ? str : "");
+        return FALSE;
+    }
+
+    *value = parsed;
+    return TRUE;
+}
+
+/* Runs one line of input. sleep is set to how long to wait before the next
+ * line */
+static gboolean synth_run_command(Synth *synth,
+                                  gchar *line,
+                                  gint64 *sleep,
+                                  GError **error) {
+    const gboolean keyboard = model_is_keyboard(&synth->model);
+    gchar *command,
+          *rest,
+          **args = NULL;
+    gboolean ret = FALSE;
+    guint code,
+          button;
+    gint value;
+
+    *sleep = 0;
+
+    line = g_strstrip(line);
+    if (line[0] == '\0' || line[0] == '#')
+        return TRUE;
+
+    /* Everything after the command, for "type" */
+    command = line;
+    rest = line + strcspn(line, " \t");
+    if (*rest) {
+        *rest++ = '\0';
+        rest += strspn(rest, " \t");
+    }
+
+    args = g_strsplit_set(rest, " \t", -1);
+
+    if (strcmp(command, "sleep") == 0) {
+        if (!parse_int(args[0], &value, error))
+            goto out;
+
+        *sleep = (gint64)MAX(value, 0) * 1000;
+    } else if (strcmp(command, "type") == 0 ||
+               strcmp(command, "key") == 0 ||
+               strcmp(command, "keydown") == 0 ||
+               strcmp(command, "keyup") == 0) {
+        if (!keyboard) {
+            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                        "'%s' needs a keyboard", command);
+            goto out;
+        }
+
+        if (strcmp(command, "type") == 0) {
+            gboolean shift;
+
+            for (const gchar *c = rest; *c; c++) {
+                if (!lookup_char(*c, &code, &shift)) {
+                    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                "Can't type '%c'", *c);
+                    goto out;
+                }
+
+                if (shift)
+                    synth_add_key(synth, KEY_SHIFT, TRUE);
+                synth_add_key(synth, code, TRUE);
+                synth_add_key(synth, code, FALSE);
+                if (shift)
+                    synth_add_key(synth, KEY_SHIFT, FALSE);
+            }
+        } else {
+            if (!args[0] || !lookup_key(args[0], &code, error)) {
+                if (!args[0])
+                    g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                                "'%s' needs a key", command);
+                goto out;
+            }
+
+            if (strcmp(command, "keyup") != 0)
+                synth_add_key(synth, code, TRUE);
+            if (strcmp(command, "keydown") != 0)
+                synth_add_key(synth, code, FALSE);
+        }
+    } else if (keyboard) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Unknown command '%s' for a keyboard", command);
+        goto out;
+    } else if (strcmp(command, "move") == 0) {
+        gint dx, dy;
+
+        if (!parse_int(args[0], &dx, error) ||
+            !parse_int(args[0] ? args[1] : NULL, &dy, error))
+            goto out;
+
+        /* Down the screen is down for the mouse */
+        synth->dx += dx;
+        synth->dy -= dy;
+    } else if (strcmp(command, "scroll") == 0) {
+        if (!parse_int(args[0], &value, error))
+            goto out;
+
+        synth->dz += value;
+    } else if (strcmp(command, "press") == 0 ||
+               strcmp(command, "release") == 0 ||
+               strcmp(command, "click") == 0) {
+        if (!args[0]) {
+            g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                        "'%s' needs a button", command);
+            goto out;
+        }
+
+        if (!lookup_button(args[0], &button, error))
+            goto out;
+
+        if (strcmp(command, "release") != 0)
+            synth_set_buttons(synth, synth->buttons | button);
+        if (strcmp(command, "press") != 0)
+            synth_set_buttons(synth, synth->buttons & ~button);
+    } else {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Unknown command '%s'", command);
+        goto out;
+    }
+
+    ret = TRUE;
+
+out:
+    g_strfreev(args);
+
+    return ret;
+}
+
+/*
+ * The userio device
+ */
+static gboolean synth_userio_cmd(Synth *synth,
+                                 guint8 type,
+                                 guint8 data,
+                                 GError **error) {
+    struct userio_cmd cmd = {
+        .type = type,
+        .data = data,
+    };
+
+    if (write(synth->userio_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing to %s: %s", SYNTH_USERIO_PATH,
+                    strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean synth_send(Synth *synth,
+                           const guchar *data,
+                           guint len,
+                           GError **error) {
+    for (guint i = 0; i < len; i++) {
+        if (!synth_userio_cmd(synth, USERIO_CMD_SEND_INTERRUPT, data[i],
+                              error))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean synth_device_open(PS2Port port,
+                                  gpointer user_data,
+                                  GError **error) {
+    Synth *synth = user_data;
+
+    synth->userio_fd = open(SYNTH_USERIO_PATH, O_RDWR | O_CLOEXEC);
+    if (synth->userio_fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", SYNTH_USERIO_PATH,
+                    strerror(errno));
+        return FALSE;
+    }
+
+    return synth_userio_cmd(synth, USERIO_CMD_SET_PORT_TYPE,
+                            port == PS2_PORT_KBD ? SERIO_8042_XL : SERIO_8042,
+                            error) &&
+           synth_userio_cmd(synth, USERIO_CMD_REGISTER, 0, error);
+}
+
+/* Only used while the init section of a log is answering the host, the model
+ * keeps track of what it does */
+static gboolean synth_device_send(guchar data,
+                                  gpointer user_data,
+                                  GError **error) {
+    Synth *synth = user_data;
+
+    if (!model_device_byte(&synth->model, data, error))
+        return FALSE;
+
+    return synth_send(synth, &data, 1, error);
+}
+
+static gboolean synth_device_receive(guchar *data,
+                                     gpointer user_data,
+                                     GError **error) {
+    Synth *synth = user_data;
+    SynthModel *model = &synth->model;
+    GByteArray *replies = g_byte_array_new();
+    ssize_t count;
+
+    do {
+        count = read(synth->userio_fd, data, 1);
+    } while (count < 0 && errno == EINTR);
+
+    if (count != 1) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While reading from %s: %s", SYNTH_USERIO_PATH,
+                    count < 0 ? strerror(errno) : "Unexpected EOF");
+        g_byte_array_unref(replies);
+        return FALSE;
+    }
+
+    /* The log answers instead, but it has to answer the same */
+    model_host_byte(synth, *data, replies);
+
+    model->host_byte = *data;
+    model->expected_len = MIN(replies->len, SYNTH_MAX_REPLY);
+    model->expected_pos = 0;
+    memcpy(model->expected, replies->data, model->expected_len);
+    g_byte_array_unref(replies);
+
+    return TRUE;
+}
+
+/* The userio device outlives the replay of the init section */
+static void synth_device_close(gpointer user_data) {
+}
+
+static const PS2EmuDevice synth_device = {
+    .open = synth_device_open,
+    .send = synth_device_send,
+    .receive = synth_device_receive,
+    .close = synth_device_close,
+};
+
+static void print_mismatch(PS2EmuReplay *replay,
+                           const PS2Event *expected,
+                           guchar received,
+                           gpointer user_data) {
+    fprintf(stderr, "Expected %.2hhx, received %.2hhx\n", expected->data,
+            received);
+}
+
+/* Lets the init section of log answer the host, then hands the device over
+ * to the model as the log left it */
+static gboolean synth_init_from_log(Synth *synth,
+                                    PS2EmuLog *log,
+                                    GError **error) {
+    PS2EmuReplay *replay;
+    gboolean ret;
+
+    if (ps2emu_log_get_version(log) == 0) {
+        g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                            "V0 logs don't have an initialization sequence "
+                            "to take the device from");
+        return FALSE;
+    }
+
+    model_init(&synth->model, ps2emu_log_get_port(log) == PS2_PORT_KBD ?
+                              SYNTH_DEVICE_KEYBOARD : SYNTH_DEVICE_MOUSE);
+    synth->model.following = TRUE;
+
+    replay = ps2emu_replay_new(log);
+    ps2emu_replay_set_device(replay, &synth_device, synth, NULL);
+    ps2emu_replay_set_mismatch_callback(replay, print_mismatch, NULL);
+
+    ret = ps2emu_replay_init(replay, error);
+    if (ret && ps2emu_replay_get_mismatch_count(replay)) {
+        fprintf(stderr, "Warning: the host went out of sync with the "
+                "initialization sequence of the log\n");
+    }
+
+    ps2emu_replay_free(replay);
+
+    /* If the host ever probes the device again, answer the way the log
+     * did */
+    synth->model.following = FALSE;
+    if (synth->model.id == 4)
+        synth->model.type = SYNTH_DEVICE_EXPLORER;
+    else if (synth->model.id == 3)
+        synth->model.type = SYNTH_DEVICE_WHEEL;
+
+    return ret;
+}
+
+/*
+ * Reading commands
+ */
+static void synth_add_source(Synth *synth,
+                             int fd) {
+    if (synth->source_count == SYNTH_MAX_SOURCES) {
+        fprintf(stderr, "Warning: too many clients, dropping one\n");
+        close(fd);
+        return;
+    }
+
+    synth->sources[synth->source_count++] = (SynthSource) {
+        .fd = fd,
+        .buffer = g_string_new(NULL),
+    };
+}
+
+static void synth_remove_source(Synth *synth,
+                                guint index) {
+    SynthSource *source = &synth->sources[index];
+
+    if (source->fd != STDIN_FILENO)
+        close(source->fd);
+    g_string_free(source->buffer, TRUE);
+
+    synth->sources[index] = synth->sources[--synth->source_count];
+}
+
+/* Runs whatever complete lines source has, until one of them sleeps */
+static void synth_run_source(Synth *synth,
+                             SynthSource *source,
+                             gint64 now) {
+    gchar *newline;
+
+    while (now >= source->sleep_until &&
+           (newline = memchr(source->buffer->str, '\n',
+                             source->buffer->len))) {
+        const gsize len = newline - source->buffer->str + 1;
+        GError *error = NULL;
+        gint64 sleep;
+
+        *newline = '\0';
+        source->line_number++;
+
+        if (!synth_run_command(synth, source->buffer->str, &sleep, &error)) {
+            fprintf(stderr, "Line %u: %s\n", source->line_number,
+                    error->message);
+            g_error_free(error);
+        }
+        g_string_erase(source->buffer, 0, len);
+
+        source->sleep_until = now + sleep;
+    }
+}
+
+/* Reads once, so it only blocks if nothing's ready yet */
+static gboolean synth_read_source(SynthSource *source) {
+    gchar buffer[4096];
+    ssize_t count;
+
+    count = read(source->fd, buffer, sizeof(buffer));
+    if (count > 0)
+        g_string_append_len(source->buffer, buffer, count);
+
+    if (count == 0) {
+        /* A last line without a newline still counts */
+        if (source->buffer->len)
+            g_string_append_c(source->buffer, '\n');
+
+        source->eof = TRUE;
+    }
+
+    return count >= 0 || errno == EINTR;
+}
+
+static gboolean synth_listen(Synth *synth,
+                             const gchar *path,
+                             GError **error) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_set_error(error, PS2EMU_ERROR, PS2EMU_ERROR_INPUT,
+                    "Socket path %s is too long", path);
+        return FALSE;
+    }
+    strcpy(addr.sun_path, path);
+
+    synth->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (synth->listen_fd < 0 ||
+        bind(synth->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(synth->listen_fd, SYNTH_MAX_SOURCES) < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While listening on %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Running the device
+ */
+static gboolean synth_answer_host(Synth *synth,
+                                  GError **error) {
+    GByteArray *replies = g_byte_array_new();
+    guchar data[64];
+    ssize_t count;
+    gboolean ret = FALSE;
+
+    count = read(synth->userio_fd, data, sizeof(data));
+    if (count <= 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While reading from %s: %s", SYNTH_USERIO_PATH,
+                    count < 0 ? strerror(errno) : "Unexpected EOF");
+        goto out;
+    }
+
+    for (ssize_t i = 0; i < count; i++)
+        model_host_byte(synth, data[i], replies);
+
+    ret = synth_send(synth, replies->data, replies->len, error);
+
+out:
+    g_byte_array_unref(replies);
+
+    return ret;
+}
+
+static gboolean synth_run_live(Synth *synth,
+                               gboolean keep_running,
+                               GError **error) {
+    GByteArray *chunk = g_byte_array_new();
+    sigset_t interrupts,
+             poll_mask;
+    gboolean ret = FALSE;
+
+    /* Interrupts only get through while we're waiting, so we can't miss one
+     * right before going to sleep */
+    sigemptyset(&interrupts);
+    sigaddset(&interrupts, SIGINT);
+    sigaddset(&interrupts, SIGTERM);
+    sigaddset(&interrupts, SIGHUP);
+    sigprocmask(SIG_BLOCK, &interrupts, &poll_mask);
+
+    while (!interrupted) {
+        struct pollfd fds[SYNTH_MAX_SOURCES + 2];
+        nfds_t nfds = 0;
+        gint64 now = g_get_monotonic_time(),
+               wake_time = G_MAXINT64;
+        gboolean more_input = keep_running || synth->listen_fd >= 0;
+
+        for (guint i = 0; i < synth->source_count; i++) {
+            SynthSource *source = &synth->sources[i];
+
+            synth_run_source(synth, source, now);
+
+            if (now < source->sleep_until)
+                wake_time = MIN(wake_time, source->sleep_until);
+            if (!source->eof || source->buffer->len)
+                more_input = TRUE;
+        }
+
+        if (synth_streaming(synth)) {
+            if (now >= synth->next_send_time) {
+                g_byte_array_set_size(chunk, 0);
+                synth_next_chunk(synth, chunk);
+                if (!synth_send(synth, chunk->data, chunk->len, error))
+                    goto out;
+
+                synth->next_send_time = now + synth_period(synth);
+                continue;
+            }
+
+            wake_time = MIN(wake_time, synth->next_send_time);
+        } else if (!more_input && !synth_has_pending(synth)) {
+            break;
+        }
+
+        fds[nfds++] = (struct pollfd) {
+            .fd = synth->userio_fd,
+            .events = POLLIN,
+        };
+        if (synth->listen_fd >= 0) {
+            fds[nfds++] = (struct pollfd) {
+                .fd = synth->listen_fd,
+                .events = POLLIN,
+            };
+        }
+        for (guint i = 0; i < synth->source_count; i++) {
+            fds[nfds++] = (struct pollfd) {
+                .fd = synth->sources[i].eof ? -1 : synth->sources[i].fd,
+                .events = POLLIN,
+            };
+        }
+
+        if (wake_time == G_MAXINT64) {
+            if (ppoll(fds, nfds, NULL, &poll_mask) < 0 && errno != EINTR)
+                goto poll_error;
+        } else {
+            const gint64 timeout = MAX(wake_time - now, 0);
+            const struct timespec ts = {
+                .tv_sec = timeout / G_USEC_PER_SEC,
+                .tv_nsec = (timeout % G_USEC_PER_SEC) * 1000,
+            };
+
+            if (ppoll(fds, nfds, &ts, &poll_mask) < 0 && errno != EINTR)
+                goto poll_error;
+        }
+
+        if (interrupted)
+            break;
+
+        /* Before any new client gets added after them */
+        for (guint i = 0; i < synth->source_count; i++)
+            synth->sources[i].readable = fds[nfds - synth->source_count +
+                                             i].revents != 0;
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            if (!synth_answer_host(synth, error))
+                goto out;
+        }
+
+        if (synth->listen_fd >= 0 && fds[1].revents & POLLIN) {
+            int client_fd = accept4(synth->listen_fd, NULL, NULL,
+                                    SOCK_CLOEXEC);
+
+            if (client_fd >= 0)
+                synth_add_source(synth, client_fd);
+        }
+
+        for (guint i = 0; i < synth->source_count; i++) {
+            SynthSource *source = &synth->sources[i];
+
+            if (!source->eof && !source->readable)
+                continue;
+
+            if (source->eof || !synth_read_source(source)) {
+                if (source->fd == STDIN_FILENO || source->buffer->len)
+                    continue;
+
+                /* Clients are done once they hang up */
+                synth_remove_source(synth, i--);
+            }
+        }
+    }
+
+    ret = TRUE;
+    goto out;
+
+poll_error:
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "While waiting for input: %s", strerror(errno));
+
+out:
+    sigprocmask(SIG_SETMASK, &poll_mask, NULL);
+    g_byte_array_unref(chunk);
+
+    return ret;
+}
+
+/* Without a device, the host is assumed to have enabled everything the model
+ * has, and the packets are written out as a log with the time they'd be sent
+ * at */
+static void synth_write_chunks(Synth *synth,
+                               gint64 *now,
+                               gint64 until) {
+    GByteArray *chunk = g_byte_array_new();
+
+    while (synth_streaming(synth)) {
+        const gint64 time = MAX(synth->next_send_time, *now);
+
+        if (time > until)
+            break;
+
+        g_byte_array_set_size(chunk, 0);
+        synth_next_chunk(synth, chunk);
+
+        for (guint i = 0; i < chunk->len; i++) {
+            fprintf(synth->log_output, "E: %-10" G_GINT64_FORMAT " R %.2hhx\n",
+                    time, chunk->data[i]);
+        }
+
+        *now = time;
+        synth->next_send_time = time + synth_period(synth);
+    }
+
+    *now = MAX(*now, until == G_MAXINT64 ? *now : until);
+    g_byte_array_unref(chunk);
+}
+
+static gboolean synth_run_offline(Synth *synth,
+                                  GError **error) {
+    SynthModel *model = &synth->model;
+    SynthSource *source = &synth->sources[0];
+    gint64 now = 0;
+
+    model->enabled = TRUE;
+    if (model->type == SYNTH_DEVICE_EXPLORER)
+        model->id = 4;
+    else if (model->type == SYNTH_DEVICE_WHEEL)
+        model->id = 3;
+
+    fprintf(synth->log_output,
+            "# ps2emu-record V%d\n"
+            "# Synthesized by ps2emu-synth\n"
+            "#\n"
+            "T: %c\n"
+            "S: Init\n"
+            "S: Main\n",
+            PS2EMU_LOG_VERSION, model_is_keyboard(model) ? 'K' : 'A');
+
+    while (!source->eof || source->buffer->len) {
+        if (!memchr(source->buffer->str, '\n', source->buffer->len)) {
+            if (!synth_read_source(source)) {
+                g_set_error(error, G_FILE_ERROR,
+                            g_file_error_from_errno(errno),
+                            "While reading commands: %s", strerror(errno));
+                return FALSE;
+            }
+
+            continue;
+        }
+
+        synth_run_source(synth, source, now);
+        if (source->sleep_until > now)
+            synth_write_chunks(synth, &now, source->sleep_until);
+    }
+
+    synth_write_chunks(synth, &now, G_MAXINT64);
+
+    return TRUE;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    GOptionContext *main_context =
+        g_option_context_new("- emulate a PS/2 device driven by commands");
+    GError *error = NULL;
+    gboolean live = FALSE,
+             keep_running = FALSE;
+    gchar *log_path = NULL,
+          *socket_path = NULL;
+    PS2EmuLog *log = NULL;
+    struct sigaction sigaction_struct;
+    Synth synth = {
+        .userio_fd = -1,
+        .listen_fd = -1,
+        .button_states = g_array_new(FALSE, FALSE, sizeof(guint)),
+        .keys = g_byte_array_new(),
+    };
+    gint ret = 1;
+
+    GOptionEntry options[] = {
+        { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
+          print_version, "Show the version of the application", NULL },
+        { "live", 'l', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &live, "Create the device with userio, instead of writing a log",
+          NULL },
+        { "device", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK,
+          process_device_arg, "The device to emulate (default explorer)",
+          "<mouse|wheel|explorer|keyboard>" },
+        { "log", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &log_path, "Initialize the device with the initialization "
+          "sequence of log", "log" },
+        { "socket", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &socket_path, "Read commands from clients of a UNIX socket at path "
+          "instead of stdin", "path" },
+        { "keep-running", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &keep_running, "Keep the device around once stdin is closed",
+          NULL },
+        { 0 }
+    };
+
+    g_option_context_add_main_entries(main_context, options, NULL);
+    g_option_context_set_help_enabled(main_context, TRUE);
+    g_option_context_set_description(main_context,
+        "Reads commands, one per line: move <dx> <dy>, scroll <n>,\n"
+        "press|release|click <left|right|middle|side|extra>, type <text>,\n"
+        "key|keydown|keyup <key> and sleep <ms>.\n");
+
+    if (!g_option_context_parse(main_context, &argc, &argv, &error))
+        exit_on_bad_argument(main_context, TRUE, error->message);
+
+    if (argc > 1)
+        exit_on_bad_argument(main_context, TRUE, "Unexpected argument '%s'",
+                             argv[1]);
+
+    if (!live && (log_path || socket_path || keep_running))
+        exit_on_bad_argument(main_context, FALSE,
+                             "--log, --socket and --keep-running need "
+                             "--live");
+
+    if (log_path) {
+        log = ps2emu_log_load(log_path, &error);
+        if (!log)
+            goto out;
+    }
+
+    model_init(&synth.model, device_type);
+
+    if (!live) {
+        synth.log_output = stdout;
+        synth_add_source(&synth, STDIN_FILENO);
+
+        if (!synth_run_offline(&synth, &error))
+            goto out;
+
+        ret = 0;
+        goto out;
+    }
+
+    if (socket_path) {
+        if (!synth_listen(&synth, socket_path, &error))
+            goto out;
+    } else {
+        synth_add_source(&synth, STDIN_FILENO);
+    }
+
+    if (log) {
+        if (!synth_init_from_log(&synth, log, &error))
+            goto out;
+    } else if (!synth_device_open(model_is_keyboard(&synth.model) ?
+                                  PS2_PORT_KBD : PS2_PORT_AUX,
+                                  &synth, &error)) {
+        goto out;
+    }
+
+    /* Remove the device and the socket when we're told to quit */
+    memset(&sigaction_struct, 0, sizeof(sigaction_struct));
+    sigaction_struct.sa_handler = stop_on_interrupt;
+
+    g_warn_if_fail(sigaction(SIGINT, &sigaction_struct, NULL) == 0);
+    g_warn_if_fail(sigaction(SIGTERM, &sigaction_struct, NULL) == 0);
+    g_warn_if_fail(sigaction(SIGHUP, &sigaction_struct, NULL) == 0);
+
+    if (!synth_run_live(&synth, keep_running, &error))
+        goto out;
+
+    ret = 0;
+
+out:
+    if (error) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    while (synth.source_count)
+        synth_remove_source(&synth, 0);
+
+    if (synth.listen_fd >= 0) {
+        close(synth.listen_fd);
+        unlink(socket_path);
+    }
+
+    /* Unregisters the device */
+    if (synth.userio_fd >= 0)
+        close(synth.userio_fd);
+
+    if (log)
+        ps2emu_log_unref(log);
+
+    g_array_free(synth.button_states, TRUE);
+    g_byte_array_unref(synth.keys);
+
+    return ret;
+}
@@ -0,0 +1,193 @@
+/*
+ * ps2emu-trace.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include "ps2emu.h"
+#include "ps2emu-lib-private.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+/* Each kind of event gets its own track in the viewer */
+typedef enum {
+    TRACK_DEVICE_TO_HOST = 1,
+    TRACK_HOST_TO_DEVICE,
+    TRACK_MISMATCHES,
+    TRACK_NOTES,
+    TRACK_SECTIONS,
+    TRACK_SCHEDULER
+} TraceTrack;
+
+static const gchar *track_names[] = {
+    [TRACK_DEVICE_TO_HOST] = "Device to host",
+    [TRACK_HOST_TO_DEVICE] = "Host to device",
+    [TRACK_MISMATCHES]     = "Mismatches",
+    [TRACK_NOTES]          = "Notes",
+    [TRACK_SECTIONS]       = "Sections",
+    [TRACK_SCHEDULER]      = "Scheduler",
+};
+
+PS2EmuTrace *ps2emu_trace_new(const gchar *process_name,
+                              gsize max_events) {
+    PS2EmuTrace *trace = g_new0(PS2EmuTrace, 1);
+
+    trace->process_name = g_strdup(process_name);
+    trace->max_events = max_events;
+    trace->notes = g_string_chunk_new(256);
+
+    /* Touch all of the buffer now, so we don't take page faults for it while
+     * we're tracing */
+    trace->events = g_new(TraceEvent, max_events);
+    memset(trace->events, 0, max_events * sizeof(TraceEvent));
+
+    return trace;
+}
+
+void ps2emu_trace_free(PS2EmuTrace *trace) {
+    g_free(trace->process_name);
+    g_free(trace->events);
+    g_string_chunk_free(trace->notes);
+    g_free(trace);
+}
+
+guint64 ps2emu_trace_get_dropped(PS2EmuTrace *trace) {
+    return trace->dropped;
+}
+
+static void write_json_string(FILE *output,
+                              const gchar *str) {
+    fputc('"', output);
+
+    for (const guchar *c = (const guchar *)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(output, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(output, "\\u%.4x", *c);
+        else
+            fputc(*c, output);
+    }
+
+    fputc('"', output);
+}
+
+static inline const gchar *section_name(PS2EmuSection section) {
+    return section == PS2EMU_SECTION_INIT ? "Init" : "Main";
+}
+
+static void write_event(FILE *output,
+                        const PS2EmuTrace *trace,
+                        const TraceEvent *event) {
+    /* In a replay, how late we sent an interrupt. In a recording, how long it
+     * took us to read an event after the kernel logged it */
+    const gchar *delay_name = trace->recording ? "lag_us" : "late_us";
+
+    switch (event->type) {
+    case TRACE_EVENT_INTERRUPT:
+    case TRACE_EVENT_HOST_BYTE:
+        fprintf(output,
+                "{\"name\":\"%.2hhx\",\"ph\":\"i\",\"s\":\"t\","
+                "\"ts\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"section\":\"%s\",\"%s\":%" G_GINT64_FORMAT "}}",
+                event->data, event->time,
+                event->type == TRACE_EVENT_INTERRUPT ? TRACK_DEVICE_TO_HOST :
+                                                       TRACK_HOST_TO_DEVICE,
+                section_name(event->section), delay_name, event->value);
+        break;
+    case TRACE_EVENT_MISMATCH:
+        fprintf(output,
+                "{\"name\":\"Expected %.2hhx, received %.2hhx\",\"ph\":\"i\","
+                "\"s\":\"g\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"section\":\"%s\"}}",
+                event->expected, event->data, event->time, TRACK_MISMATCHES,
+                section_name(event->section));
+        break;
+    case TRACE_EVENT_NOTE:
+        fprintf(output, "{\"name\":");
+        write_json_string(output, event->note);
+        fprintf(output,
+                ",\"ph\":\"i\",\"s\":\"g\",\"ts\":%" G_GINT64_FORMAT
+                ",\"pid\":1,\"tid\":%d}",
+                event->time, TRACK_NOTES);
+        break;
+    case TRACE_EVENT_SECTION_START:
+    case TRACE_EVENT_SECTION_END:
+        fprintf(output,
+                "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT
+                ",\"pid\":1,\"tid\":%d}",
+                section_name(event->section),
+                event->type == TRACE_EVENT_SECTION_START ? 'B' : 'E',
+                event->time, TRACK_SECTIONS);
+        break;
+    case TRACE_EVENT_SLEEP:
+        fprintf(output,
+                "{\"name\":\"Sleep\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+                ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":%d}",
+                event->time, event->value, TRACK_SCHEDULER);
+        break;
+    case TRACE_EVENT_FLUSH:
+        fprintf(output,
+                "{\"name\":\"Flush\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%"
+                G_GINT64_FORMAT ",\"pid\":1,\"tid\":%d,\"args\":{\"bytes\":%"
+                G_GINT64_FORMAT "}}",
+                event->time, TRACK_SCHEDULER, event->value);
+        break;
+    }
+}
+
+gboolean ps2emu_trace_write(PS2EmuTrace *trace,
+                            const gchar *path,
+                            GError **error) {
+    FILE *output = fopen(path, "w");
+
+    if (!output) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While opening %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    fprintf(output, "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":");
+    write_json_string(output, trace->process_name);
+    fprintf(output, "}}");
+
+    for (gint i = TRACK_DEVICE_TO_HOST; i <= TRACK_SCHEDULER; i++) {
+        fprintf(output,
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}"
+                ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+                i, track_names[i], i, i);
+    }
+
+    for (gsize i = 0; i < trace->len; i++) {
+        fprintf(output, ",\n");
+        write_event(output, trace, &trace->events[i]);
+    }
+
+    fprintf(output,
+            "\n],\n\"displayTimeUnit\":\"ms\",\n"
+            "\"otherData\":{\"dropped_events\":%" G_GUINT64_FORMAT "}}\n",
+            trace->dropped);
+
+    if (fclose(output) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "While writing %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
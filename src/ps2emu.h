@@ -0,0 +1,520 @@
+/*
+ * ps2emu.h
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#ifndef __PS2EMU_H__
+#define __PS2EMU_H__
+
+#include <stdio.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define PS2EMU_ERROR (g_quark_from_static_string("ps2emu-error"))
+
+typedef enum {
+    PS2EMU_ERROR_INPUT,
+    PS2EMU_ERROR_NO_EVENTS,
+    PS2EMU_ERROR_MISC
+} PS2Error;
+
+typedef enum {
+    PS2_EVENT_TYPE_COMMAND,
+    PS2_EVENT_TYPE_PARAMETER,
+    PS2_EVENT_TYPE_RETURN,
+    PS2_EVENT_TYPE_KBD_DATA,
+    PS2_EVENT_TYPE_INTERRUPT
+} PS2EventType;
+
+typedef enum {
+    PS2_PORT_KBD,
+    PS2_PORT_AUX
+} PS2Port;
+
+/* A single byte going to (anything but PS2_EVENT_TYPE_INTERRUPT) or coming
+ * from (PS2_EVENT_TYPE_INTERRUPT) the device. time is in microseconds from the
+ * start of the section the event is in */
+typedef struct {
+    time_t        time;
+    PS2EventType  type;
+    guchar        data;
+    PS2Port       origin;
+    const gchar  *original_line;
+} PS2Event;
+
+typedef enum {
+    PS2EMU_SECTION_INIT,
+    PS2EMU_SECTION_MAIN
+} PS2EmuSection;
+
+/*
+ * Profiling
+ *
+ * The phase callback is called as loading a log, a replay or a recording moves
+ * on to its next phase, with a short static name for the phase. It's global
+ * since logs are loaded before there's anything else to attach it to.
+ */
+typedef void (*PS2EmuPhaseFunc)(const gchar *phase,
+                                gpointer user_data);
+
+void ps2emu_set_phase_callback(PS2EmuPhaseFunc func,
+                               gpointer user_data);
+
+/*
+ * Logs
+ *
+ * A parsed log, either text (any version) or packed. Logs are reference
+ * counted, replay sessions hold a reference on the log they're replaying.
+ */
+typedef struct _PS2EmuLog PS2EmuLog;
+
+typedef void (*PS2EmuLogForeachFunc)(PS2EmuSection section,
+                                     const PS2Event *event,
+                                     const gchar *note,
+                                     gpointer user_data);
+
+PS2EmuLog *ps2emu_log_load(const gchar *path,
+                           GError **error);
+
+PS2EmuLog *ps2emu_log_load_from_channel(GIOChannel *input_channel,
+                                        GError **error);
+
+PS2EmuLog *ps2emu_log_ref(PS2EmuLog *log);
+
+void ps2emu_log_unref(PS2EmuLog *log);
+
+gint ps2emu_log_get_version(PS2EmuLog *log);
+
+PS2Port ps2emu_log_get_port(PS2EmuLog *log);
+
+/* NULL if the log's header doesn't list a device on the recorded port */
+const gchar *ps2emu_log_get_device_name(PS2EmuLog *log);
+
+const gchar *ps2emu_log_get_header(PS2EmuLog *log);
+
+guint ps2emu_log_get_event_count(PS2EmuLog *log,
+                                 PS2EmuSection section);
+
+/* Calls func for every event and note in the log, in order. For notes, event
+ * is NULL */
+void ps2emu_log_foreach(PS2EmuLog *log,
+                        PS2EmuLogForeachFunc func,
+                        gpointer user_data);
+
+/* Whether a and b would set up the device the same way: they're for the same
+ * port and device, and the bytes in their initialization sequences are the
+ * same. Timing and notes aren't compared. V0 logs don't have an
+ * initialization sequence of their own, so they never match */
+gboolean ps2emu_log_init_equal(PS2EmuLog *a,
+                               PS2EmuLog *b);
+
+/*
+ * Backends
+ *
+ * The clock decides how long a replay waits between events, and the device is
+ * where the events of a replay go to and come from. By default, replays use
+ * the monotonic clock and /dev/userio. All times are in microseconds.
+ */
+typedef struct {
+    gint64 (*get_time)(gpointer user_data);
+    void (*sleep)(gint64 duration,
+                  gpointer user_data);
+} PS2EmuClock;
+
+typedef struct {
+    /* Create the emulated port, and attach a device of the given type */
+    gboolean (*open)(PS2Port port,
+                     gpointer user_data,
+                     GError **error);
+    /* Send a byte from the device to the host */
+    gboolean (*send)(guchar data,
+                     gpointer user_data,
+                     GError **error);
+    /* Wait for the host to send a byte to the device */
+    gboolean (*receive)(guchar *data,
+                        gpointer user_data,
+                        GError **error);
+    void (*close)(gpointer user_data);
+    /* Optional: wait up to timeout for the host to send a byte, without
+     * reading it, and return whether there's one to receive. Without it,
+     * the replay only reads from the device when the log expects the host to
+     * send something, instead of as soon as the host does */
+    gboolean (*wait)(gint64 timeout,
+                     gpointer user_data);
+} PS2EmuDevice;
+
+extern const PS2EmuClock ps2emu_clock_monotonic;
+
+/*
+ * Tracing
+ *
+ * A trace records the timeline of a replay or a recording: bytes from the
+ * device and from the host, mismatches, notes, sections and the time spent
+ * sleeping. Everything goes into a buffer allocated up front, and is only
+ * formatted when the trace is written out as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto can open. Events past the end of the buffer
+ * are dropped and counted.
+ */
+typedef struct _PS2EmuTrace PS2EmuTrace;
+
+#define PS2EMU_TRACE_DEFAULT_MAX_EVENTS (1 << 20)
+
+PS2EmuTrace *ps2emu_trace_new(const gchar *process_name,
+                              gsize max_events);
+
+void ps2emu_trace_free(PS2EmuTrace *trace);
+
+guint64 ps2emu_trace_get_dropped(PS2EmuTrace *trace);
+
+gboolean ps2emu_trace_write(PS2EmuTrace *trace,
+                            const gchar *path,
+                            GError **error);
+
+/*
+ * Metrics
+ *
+ * Counters and histograms of a long running replay or recording, which can be
+ * read from any thread while it runs. Each counter has exactly one thread
+ * writing to it, though not every counter has the same one (a recording reads
+ * the kernel log and writes the log out on threads of their own), so updates
+ * are plain relaxed atomic stores.
+ */
+typedef struct _PS2EmuMetrics PS2EmuMetrics;
+
+PS2EmuMetrics *ps2emu_metrics_new(void);
+
+void ps2emu_metrics_free(PS2EmuMetrics *metrics);
+
+/* The current values in the OpenMetrics text format, along with the resident
+ * memory of the process. Safe to call from any thread */
+gchar *ps2emu_metrics_to_string(PS2EmuMetrics *metrics);
+
+/*
+ * Checkpoints
+ *
+ * How far a replay got through the main section of its log, so that it can be
+ * picked up from there by a new replay of the same log.
+ */
+typedef struct {
+    /* Lines of the main section already replayed, notes included */
+    guint64 position;
+    /* How far into the schedule of the main section the replay was */
+    gint64 elapsed;
+    /* Added to the time of each event in the log: minus the time spent in
+     * note delays, plus the time skipped because of max_wait */
+    gint64 offset;
+    /* Time in the log of the last event replayed, or -1 */
+    gint64 last_event_time;
+    guint notes;
+    gint64 note_delay_total;
+    guint mismatch_count;
+
+    /* To make sure the checkpoint is resumed with the same log */
+    PS2Port port;
+    guint64 main_lines;
+} PS2EmuCheckpoint;
+
+/* Written atomically, so a replay killed while writing its checkpoint leaves
+ * the last one behind */
+gboolean ps2emu_checkpoint_save(const PS2EmuCheckpoint *checkpoint,
+                                const gchar *path,
+                                GError **error);
+
+gboolean ps2emu_checkpoint_load(PS2EmuCheckpoint *checkpoint,
+                                const gchar *path,
+                                GError **error);
+
+/*
+ * Replay sessions
+ */
+typedef struct _PS2EmuReplay PS2EmuReplay;
+
+/* Called for every byte right after the device sent it, and for every byte the
+ * host sent that matched the log, as soon as it arrived */
+typedef void (*PS2EmuEventFunc)(PS2EmuReplay *replay,
+                                PS2EmuSection section,
+                                const PS2Event *event,
+                                gpointer user_data);
+
+/* Called when the host sends something other than what the log expected */
+typedef void (*PS2EmuMismatchFunc)(PS2EmuReplay *replay,
+                                   const PS2Event *expected,
+                                   guchar received,
+                                   gpointer user_data);
+
+/* Called when the replay reaches a user note in the log */
+typedef void (*PS2EmuNoteFunc)(PS2EmuReplay *replay,
+                               const gchar *note,
+                               gpointer user_data);
+
+/* Called between two lines of the main section */
+typedef void (*PS2EmuCheckpointFunc)(PS2EmuReplay *replay,
+                                     const PS2EmuCheckpoint *checkpoint,
+                                     gpointer user_data);
+
+/* How the main section was scheduled, over every run of the session */
+typedef struct {
+    /* Sleeps to wait for an interrupt to be due */
+    guint64 wakeups;
+    guint64 interrupts;
+    /* Time spent replaying the main section */
+    gint64 duration;
+    /* How late each interrupt was sent, negative if it was early */
+    gint64 lateness_sum;
+    /* How far from its time in the log each interrupt was sent, either way */
+    gint64 error_sum;
+    gint64 error_max;
+    /* How much earlier than each interrupt's time the replay currently wakes
+     * up, to make up for the time it takes to wake up and send it */
+    gint64 compensation;
+} PS2EmuSchedulingStats;
+
+PS2EmuReplay *ps2emu_replay_new(PS2EmuLog *log);
+
+void ps2emu_replay_free(PS2EmuReplay *replay);
+
+void ps2emu_replay_set_clock(PS2EmuReplay *replay,
+                             const PS2EmuClock *clock,
+                             gpointer user_data);
+
+/* Use device instead of /dev/userio. destroy is called on user_data once the
+ * session is freed */
+void ps2emu_replay_set_device(PS2EmuReplay *replay,
+                              const PS2EmuDevice *device,
+                              gpointer user_data,
+                              GDestroyNotify destroy);
+
+/* Use a different userio character device than /dev/userio */
+void ps2emu_replay_set_userio_path(PS2EmuReplay *replay,
+                                   const gchar *path);
+
+void ps2emu_replay_set_event_callback(PS2EmuReplay *replay,
+                                      PS2EmuEventFunc func,
+                                      gpointer user_data);
+
+void ps2emu_replay_set_mismatch_callback(PS2EmuReplay *replay,
+                                         PS2EmuMismatchFunc func,
+                                         gpointer user_data);
+
+void ps2emu_replay_set_note_callback(PS2EmuReplay *replay,
+                                     PS2EmuNoteFunc func,
+                                     gpointer user_data);
+
+/* Don't wait for longer than max_wait between events in the main section, 0
+ * to always wait as long as the log did */
+void ps2emu_replay_set_max_wait(PS2EmuReplay *replay,
+                                gint64 max_wait);
+
+/* Trade timing precision for fewer wakeups in the main section, for long
+ * replays on busy hosts. Every interrupt due within tolerance of when the
+ * replay woke up is sent right away rather than slept for, and the kernel may
+ * put off each wakeup by up to tolerance to line it up with other timers. 0,
+ * the default, sleeps until each interrupt is due */
+void ps2emu_replay_set_timing_tolerance(PS2EmuReplay *replay,
+                                        gint64 tolerance);
+
+/* By default the replay measures how long it takes from when it means to
+ * wake up for an interrupt until the device has sent it, starting with a few
+ * throwaway sleeps before the device is opened and then keeping a moving
+ * average of every interrupt it slept for, and wakes up that much earlier.
+ * Unset to always wake up right when each interrupt is due */
+void ps2emu_replay_set_latency_compensation(PS2EmuReplay *replay,
+                                            gboolean compensate);
+
+/* How long to wait after initialization before replaying the main section,
+ * on top of waiting for the device to be ready */
+void ps2emu_replay_set_event_delay(PS2EmuReplay *replay,
+                                   gint64 event_delay);
+
+/* After initialization, the kernel still has to bind a driver to the device
+ * and finish setting it up before events can be replayed. By default, replays
+ * on userio find their serio port in sysfs and wait until its input device
+ * shows up and the driver stops sending commands. With wait_for_ready unset,
+ * other backends, or if the port can't be found, the replay waits half a
+ * second instead */
+void ps2emu_replay_set_wait_for_ready(PS2EmuReplay *replay,
+                                      gboolean wait_for_ready);
+
+/* Look for the serio port of the userio device under sysfs_dir instead of
+ * /sys */
+void ps2emu_replay_set_sysfs_dir(PS2EmuReplay *replay,
+                                 const gchar *sysfs_dir);
+
+/* How long to wait after reaching a user note */
+void ps2emu_replay_set_note_delay(PS2EmuReplay *replay,
+                                  gint64 note_delay);
+
+/* Record the replay into trace, which must outlive the replay. Times are from
+ * the replay's clock */
+void ps2emu_replay_set_trace(PS2EmuReplay *replay,
+                             PS2EmuTrace *trace);
+
+/* Count what the replay does in metrics, which must outlive the replay */
+void ps2emu_replay_set_metrics(PS2EmuReplay *replay,
+                               PS2EmuMetrics *metrics);
+
+/* Call func with the progress of the replay about every interval while
+ * replaying the main section of a V1 log. It's only called between two
+ * packets, so a replay resumed from it doesn't start in the middle of one. It
+ * runs on the replay's thread, so anything it does delays the next event */
+void ps2emu_replay_set_checkpoint_callback(PS2EmuReplay *replay,
+                                           gint64 interval,
+                                           PS2EmuCheckpointFunc func,
+                                           gpointer user_data);
+
+/* Pick up from checkpoint, which must have been made while replaying the same
+ * log. ps2emu_replay_init() then replays the initialization sequence as fast
+ * as the host drives it, and ps2emu_replay_run() carries on with the main
+ * section where the checkpoint left off, without sending anything from before
+ * it again */
+gboolean ps2emu_replay_set_resume(PS2EmuReplay *replay,
+                                  const PS2EmuCheckpoint *checkpoint,
+                                  GError **error);
+
+/* Attach the device and replay the initialization sequence. V0 logs don't
+ * have one, so the whole log gets replayed here */
+gboolean ps2emu_replay_init(PS2EmuReplay *replay,
+                            GError **error);
+
+/* Replay the main section of the log, after ps2emu_replay_init(). Can be
+ * called more than once, only the first run after initializing the device
+ * waits for it to be ready and for the event delay */
+gboolean ps2emu_replay_run(PS2EmuReplay *replay,
+                           GError **error);
+
+/* Replay log from now on, and reset the mismatch count. If the device is
+ * initialized and log sets it up the same way (see ps2emu_log_init_equal()),
+ * it's kept and ps2emu_replay_run() can go straight on to the main section of
+ * log. Otherwise the device is removed, and this returns FALSE to say that
+ * ps2emu_replay_init() needs to be called again */
+gboolean ps2emu_replay_set_log(PS2EmuReplay *replay,
+                               PS2EmuLog *log);
+
+guint ps2emu_replay_get_mismatch_count(PS2EmuReplay *replay);
+
+void ps2emu_replay_get_scheduling_stats(PS2EmuReplay *replay,
+                                        PS2EmuSchedulingStats *stats);
+
+/*
+ * Probe timing
+ *
+ * Measures how long the kernel takes to probe the device: the initialization
+ * sequence is replayed as fast as the host drives it, each byte from the host
+ * is timestamped, and the probe is over once the evdev node of the device
+ * shows up. The time the host spent on each command is put down either to the
+ * driver, if the device had just answered it, or to a timeout in the host if
+ * the device hadn't sent anything since the host's last command.
+ */
+typedef enum {
+    PS2EMU_PROBE_WAIT_DRIVER,
+    PS2EMU_PROBE_WAIT_TIMEOUT
+} PS2EmuProbeWait;
+
+typedef struct {
+    guchar data;
+    /* When the host sent it, since the port was registered */
+    gint64 time;
+    /* Since the last byte either way, or since the port was registered */
+    gint64 wait;
+    PS2EmuProbeWait wait_type;
+} PS2EmuProbeCommand;
+
+typedef struct {
+    /* From registering the port until the evdev node was created */
+    gint64 total;
+    PS2EmuProbeCommand *commands;
+    guint n_commands;
+} PS2EmuProbeTiming;
+
+void ps2emu_probe_timing_clear(PS2EmuProbeTiming *timing);
+
+/* Used instead of ps2emu_replay_init(), only on userio and with V1 logs. Waits
+ * for up to timeout for the evdev node after the initialization sequence.
+ * timing must be cleared with ps2emu_probe_timing_clear() afterwards */
+gboolean ps2emu_replay_measure_probe(PS2EmuReplay *replay,
+                                     gint64 timeout,
+                                     PS2EmuProbeTiming *timing,
+                                     GError **error);
+
+/*
+ * Recording
+ *
+ * Records a PS/2 port through i8042's debugging output in the kernel log. This
+ * needs root, and temporarily detaches the devices on the i8042 controller.
+ */
+typedef struct _PS2EmuRecorder PS2EmuRecorder;
+
+/* Called for every event written to the recording */
+typedef void (*PS2EmuRecordFunc)(PS2EmuRecorder *recorder,
+                                 PS2EmuSection section,
+                                 const PS2Event *event,
+                                 gpointer user_data);
+
+typedef void (*PS2EmuRecorderFunc)(PS2EmuRecorder *recorder,
+                                   gpointer user_data);
+
+PS2EmuRecorder *ps2emu_recorder_new(PS2Port target,
+                                    GError **error);
+
+/* Disables i8042 debugging if it's still enabled */
+void ps2emu_recorder_free(PS2EmuRecorder *recorder);
+
+/* Look up /dev/kmsg, /proc and /sys under root instead of /, so a recording
+ * can be made against a fake tree and a fake kmsg. Must be called before
+ * ps2emu_recorder_start() */
+void ps2emu_recorder_set_root(PS2EmuRecorder *recorder,
+                              const gchar *root);
+
+/* Record the recording into trace, which must outlive the recorder. Events are
+ * placed at their time in the kernel log */
+void ps2emu_recorder_set_trace(PS2EmuRecorder *recorder,
+                               PS2EmuTrace *trace);
+
+/* Count what the recorder does in metrics, which must outlive the recorder */
+void ps2emu_recorder_set_metrics(PS2EmuRecorder *recorder,
+                                 PS2EmuMetrics *metrics);
+
+/* Write the log to output instead of stdout */
+void ps2emu_recorder_set_output(PS2EmuRecorder *recorder,
+                                FILE *output);
+
+void ps2emu_recorder_set_event_callback(PS2EmuRecorder *recorder,
+                                        PS2EmuRecordFunc func,
+                                        gpointer user_data);
+
+/* Called once the initialization sequence of the device is over */
+void ps2emu_recorder_set_init_done_callback(PS2EmuRecorder *recorder,
+                                            PS2EmuRecorderFunc func,
+                                            gpointer user_data);
+
+/* Write the header of the log, and reattach the devices with i8042 debugging
+ * enabled */
+gboolean ps2emu_recorder_start(PS2EmuRecorder *recorder,
+                               GError **error);
+
+/* Record until ps2emu_recorder_quit() is called, the kernel log ends or an
+ * error occurs. Runs the default GMainContext, which the callbacks are called
+ * from. The kernel log is read and the output is written by threads of their
+ * own, and everything that was read is written out before this returns */
+gboolean ps2emu_recorder_run(PS2EmuRecorder *recorder,
+                             GError **error);
+
+void ps2emu_recorder_quit(PS2EmuRecorder *recorder);
+
+/* Turn off i8042 debugging again, safe to call more than once */
+void ps2emu_recorder_stop(PS2EmuRecorder *recorder);
+
+G_END_DECLS
+
+#endif /* !__PS2EMU_H__ */
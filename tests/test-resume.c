@@ -0,0 +1,232 @@
+/*
+ * test-resume.c
+ * Copyright (C) 2015 Red Hat
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/* Replays a log of mouse packets against a mock device and clock, saving
+ * checkpoints far more often than packets go out, then resumes from each of
+ * them and checks the first byte sent is the start of a packet */
+
+#include "ps2emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#define PACKETS 50
+#define PACKET_LEN 3
+/* Bytes of a packet are 1ms apart, packets 10ms */
+#define BYTE_INTERVAL 1000
+#define PACKET_INTERVAL 10000
+#define CHECKPOINT_INTERVAL 700
+
+/* Only the first byte of each packet has this bit set */
+#define PACKET_START 0x08
+
+typedef struct {
+    gint64 now;
+    GArray *checkpoints;
+    /* The first byte of the main section sent after resuming, or -1 */
+    gint first_byte;
+} MockBackend;
+
+static gint64 mock_get_time(gpointer user_data) {
+    MockBackend *mock = user_data;
+
+    return mock->now;
+}
+
+static void mock_sleep(gint64 duration,
+                       gpointer user_data) {
+    MockBackend *mock = user_data;
+
+    mock->now += duration;
+}
+
+static gboolean mock_open(PS2Port port,
+                          gpointer user_data,
+                          GError **error) {
+    return TRUE;
+}
+
+static gboolean mock_send(guchar data,
+                          gpointer user_data,
+                          GError **error) {
+    return TRUE;
+}
+
+static gboolean mock_receive(guchar *data,
+                             gpointer user_data,
+                             GError **error) {
+    g_set_error_literal(error, PS2EMU_ERROR, PS2EMU_ERROR_MISC,
+                        "The log doesn't have anything from the host");
+    return FALSE;
+}
+
+static const PS2EmuClock mock_clock = {
+    .get_time = mock_get_time,
+    .sleep = mock_sleep,
+};
+
+static const PS2EmuDevice mock_device = {
+    .open = mock_open,
+    .send = mock_send,
+    .receive = mock_receive,
+};
+
+static void save_checkpoint(PS2EmuReplay *replay,
+                            const PS2EmuCheckpoint *checkpoint,
+                            gpointer user_data) {
+    MockBackend *mock = user_data;
+
+    g_array_append_vals(mock->checkpoints, checkpoint, 1);
+}
+
+static void note_first_byte(PS2EmuReplay *replay,
+                            PS2EmuSection section,
+                            const PS2Event *event,
+                            gpointer user_data) {
+    MockBackend *mock = user_data;
+
+    if (section == PS2EMU_SECTION_MAIN && mock->first_byte < 0)
+        mock->first_byte = event->data;
+}
+
+static PS2EmuLog *write_log(GError **error) {
+    GString *contents = g_string_new(NULL);
+    PS2EmuLog *log = NULL;
+    gchar *path = NULL;
+    gint fd;
+
+    g_string_append(contents,
+                    "# ps2emu-record V1\n"
+                    "T: A\n"
+                    "S: Init\n"
+                    "E: 0 R aa\n"
+                    "E: 1000 R 00\n"
+                    "S: Main\n");
+
+    for (gint i = 0; i < PACKETS; i++) {
+        for (gint j = 0; j < PACKET_LEN; j++) {
+            g_string_append_printf(contents, "E: %d R %.2x\n",
+                                   i * PACKET_INTERVAL + j * BYTE_INTERVAL,
+                                   j == 0 ? PACKET_START : j);
+        }
+    }
+
+    fd = g_file_open_tmp("ps2emu-test-resume-XXXXXX", &path, error);
+    if (fd < 0)
+        goto out;
+    close(fd);
+
+    if (g_file_set_contents(path, contents->str, contents->len, error))
+        log = ps2emu_log_load(path, error);
+
+    unlink(path);
+
+out:
+    g_free(path);
+    g_string_free(contents, TRUE);
+
+    return log;
+}
+
+static gboolean replay_log(PS2EmuLog *log,
+                           MockBackend *mock,
+                           const PS2EmuCheckpoint *resume,
+                           GError **error) {
+    PS2EmuReplay *replay = ps2emu_replay_new(log);
+    gboolean ret = FALSE;
+
+    ps2emu_replay_set_clock(replay, &mock_clock, mock);
+    ps2emu_replay_set_device(replay, &mock_device, mock, NULL);
+    ps2emu_replay_set_latency_compensation(replay, FALSE);
+    ps2emu_replay_set_wait_for_ready(replay, FALSE);
+    ps2emu_replay_set_event_callback(replay, note_first_byte, mock);
+
+    if (resume) {
+        if (!ps2emu_replay_set_resume(replay, resume, error))
+            goto out;
+    } else {
+        ps2emu_replay_set_checkpoint_callback(replay, CHECKPOINT_INTERVAL,
+                                              save_checkpoint, mock);
+    }
+
+    ret = ps2emu_replay_init(replay, error) &&
+          ps2emu_replay_run(replay, error);
+
+out:
+    ps2emu_replay_free(replay);
+
+    return ret;
+}
+
+gint main(gint argc,
+          gchar *argv[]) {
+    MockBackend mock = { 0 };
+    PS2EmuLog *log;
+    GError *error = NULL;
+    gint ret = 1;
+
+    mock.checkpoints = g_array_new(FALSE, FALSE, sizeof(PS2EmuCheckpoint));
+    mock.first_byte = -1;
+
+    log = write_log(&error);
+    if (!log)
+        goto out;
+
+    if (!replay_log(log, &mock, NULL, &error))
+        goto out;
+
+    if (!mock.checkpoints->len) {
+        fprintf(stderr, "No checkpoints were saved\n");
+        goto out;
+    }
+
+    for (guint i = 0; i < mock.checkpoints->len; i++) {
+        const PS2EmuCheckpoint *checkpoint =
+            &g_array_index(mock.checkpoints, PS2EmuCheckpoint, i);
+
+        /* There's nothing left to send after the last line */
+        if (checkpoint->position == checkpoint->main_lines)
+            continue;
+
+        mock.first_byte = -1;
+        if (!replay_log(log, &mock, checkpoint, &error))
+            goto out;
+
+        if (mock.first_byte < 0 || !(mock.first_byte & PACKET_START)) {
+            fprintf(stderr,
+                    "Resuming from line %" G_GUINT64_FORMAT " started with "
+                    "%.2x, in the middle of a packet\n",
+                    checkpoint->position, mock.first_byte);
+            goto out;
+        }
+    }
+
+    printf("Resumed from %u checkpoints\n", mock.checkpoints->len);
+    ret = 0;
+
+out:
+    if (error) {
+        fprintf(stderr, "Error: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    if (log)
+        ps2emu_log_unref(log);
+    g_array_free(mock.checkpoints, TRUE);
+
+    return ret;
+}